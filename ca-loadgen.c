@@ -0,0 +1,974 @@
+/*! \file ca-loadgen.c
+ *  \brief Synthetic channel access load for e
+ *  \date 2026
+ *  \copyright All Rights Reserved
+ *
+ * Thousands of clients speaking the same protocol e does, built from
+ * e.c's own header encoders and decoders.  The mix (-m) says how often
+ * each client does what:
+ *
+ *   search  UDP search storms: -b searches per datagram from -u sockets
+ *   open    screen opens: -k create_chan at once, each cleared as it is answered
+ *   read    read_notify on a channel of the client's working set
+ *   put     write_notify of a double to one of them
+ *
+ * and -s monitors per client measures update fan-out.  Every client first
+ * connects and creates its working set (-w channels); then we run for -t
+ * seconds and report throughput and latency percentiles.
+ *
+ * Without -r the load is closed loop: each client keeps -d requests
+ * going.  -r makes it open loop: requests go out on a fixed schedule
+ * whether or not the earlier ones have been answered, and each latency
+ * counts from when its request was due, so a server that falls behind
+ * shows it in the percentiles instead of slowing the load down.
+ *
+ * Puts change real kvs: point it at a test database.
+ */
+
+#define E_NO_MAIN
+#include "e.c"
+
+#define LG_OP_CONNECT 0		// connect and create the working set
+#define LG_OP_SEARCH  1
+#define LG_OP_OPEN    2
+#define LG_OP_READ    3
+#define LG_OP_PUT     4
+#define LG_OP_N       5
+
+#define LG_PENDING    (1 << 18)	// requests we can keep track of (power of 2)
+#define LG_SAMPLES    (1 << 20)	// latencies kept per operation (reservoir sampled after that)
+#define LG_BUFSIZE    65536	// receive buffer per client
+#define LG_MINOR      13	// the protocol minor version we claim
+
+#define LG_CONNECTING 0		// waiting for connect to finish
+#define LG_SETUP      1		// creating the working set
+#define LG_RUNNING    2		// doing the mix
+#define LG_DEAD       3		// the server hung up on us
+
+// A TCP client or one of our UDP search sockets
+//
+typedef struct lg_client_struct {
+  int sock;
+  int udp;		// 1 for a search socket
+  int state;		// LG_CONNECTING ...
+  int inflight;		// requests waiting for an answer
+  e_socks_buffer_t in;	// what we have received (e.c's decoders read from this)
+  char *out;		// what we have yet to send
+  int olen;		// bytes in out
+  int osize;		// size of out
+  uint32_t *sids;	// our working set: the server's channel id (0 until created)
+  uint16_t *dtypes;	// native type
+  uint16_t *counts;	// native count
+  int nchans;		// size of the working set
+  int ready;		// channels in it that were created
+} lg_client_t;
+
+// A request waiting for an answer, found by its id (cid or ioid)
+//
+typedef struct lg_req_struct {
+  uint32_t id;		// the request's id
+  uint32_t owner;	// screen opens: the id of the first create (which holds the count)
+  int live;		// 1 until answered or timed out
+  int op;		// LG_OP_CONNECT ...
+  int client;		// who asked
+  int left;		// the owner of a batch: answers still to come
+  int chan;		// working set creates: which channel
+  uint64_t t0;		// when we asked (ns)
+} lg_req_t;
+
+// What happened to each operation
+//
+typedef struct lg_stat_struct {
+  unsigned long n;		// completed
+  unsigned long errors;		// answered with a failure
+  unsigned long timeouts;	// not answered in time
+  unsigned long seen;		// latencies offered to the reservoir
+  int nsamples;			// latencies in it
+  uint32_t *samples;		// microseconds
+} lg_stat_t;
+
+static char *lg_op_names[LG_OP_N] = { "connect", "search", "open", "read", "put"};
+
+static struct sockaddr_in lg_addr;	//!< the server
+static int lg_nclients = 100;		//!< TCP clients (-c)
+static int lg_nudp = 4;			//!< UDP search sockets (-u)
+static int lg_secs = 10;		//!< how long to run the mix (-t)
+static int lg_depth = 1;		//!< requests each client keeps outstanding (-d)
+static double lg_rate = 0;		//!< total requests per second, open loop (-r, 0 for closed loop: as fast as answers come)
+static int lg_wset = 10;		//!< working set channels per client (-w)
+static int lg_screen = 50;		//!< creates per screen open (-k)
+static int lg_burst = 10;		//!< searches per datagram (-b)
+static int lg_subs = 0;			//!< monitors per client (-s)
+static int lg_tmo_ms = 2000;		//!< how long we wait for an answer (-T)
+static int lg_weights[LG_OP_N];		//!< the mix (-m)
+static char **lg_names = NULL;		//!< channel names we use
+static int lg_nnames = 0;		//!< number of them
+
+static lg_client_t *lg_clients;		//!< TCP clients then UDP sockets
+static struct pollfd *lg_pfds;		//!< and their poll entries
+static int lg_n;			//!< number of them
+static lg_req_t lg_reqs[LG_PENDING];	//!< requests waiting for answers
+static uint32_t lg_next_id = 1;		//!< next request id
+static lg_stat_t lg_stats[LG_OP_N];	//!< per operation results
+static unsigned long lg_issued = 0;	//!< requests sent while running the mix
+static uint64_t lg_due = 0;		//!< open loop: when the request being made was due (0 to time it from now)
+static unsigned long lg_updates = 0;	//!< monitor updates received
+static unsigned long lg_found = 0;	//!< searches answered with "here"
+static unsigned long lg_not_found = 0;	//!< and with "not here"
+static unsigned long lg_bytes_in = 0;	//!< bytes received
+static unsigned long lg_bytes_out = 0;	//!< bytes sent
+
+/** Monotonic nanoseconds
+ */
+uint64_t lg_now() {
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Keep a latency
+ *  Reservoir sampled so a long run still gives fair percentiles.
+ *
+ * \param op The operation
+ * \param ns How long it took
+ */
+void lg_sample( int op, uint64_t ns) {
+  lg_stat_t *st;
+  unsigned long j;
+
+  st = lg_stats + op;
+  st->n++;
+  st->seen++;
+  if( st->samples == NULL) {
+    st->samples = malloc( LG_SAMPLES * sizeof( *st->samples));
+    if( st->samples == NULL) {
+      fprintf( stderr, "Out of memory for latencies (lg_sample)\n");
+      return;
+    }
+  }
+  if( st->nsamples < LG_SAMPLES) {
+    st->samples[st->nsamples++] = ns / 1000;
+    return;
+  }
+  j = random() % st->seen;
+  if( j < LG_SAMPLES)
+    st->samples[j] = ns / 1000;
+}
+
+/** Start keeping track of a request
+ *  Returns its id.  A request still waiting in the slot we need has
+ *  waited far too long: it becomes a timeout.
+ *
+ * \param op     The operation
+ * \param client Who is asking
+ * \param owner  The id of the batch this is part of (0 for the first or only one)
+ * \param left   The first of a batch: how many answers make it complete
+ */
+uint32_t lg_req_new( int op, int client, uint32_t owner, int left) {
+  lg_req_t *rq;
+  uint32_t id;
+
+  id = lg_next_id++;
+  if( lg_next_id == 0)
+    lg_next_id = 1;
+
+  rq = lg_reqs + (id & (LG_PENDING - 1));
+  if( rq->live && rq->owner == rq->id) {
+    lg_stats[rq->op].timeouts++;
+    lg_clients[rq->client].inflight--;
+  }
+  rq->id     = id;
+  rq->owner  = owner == 0 ? id : owner;
+  rq->live   = 1;
+  rq->op     = op;
+  rq->client = client;
+  rq->left   = left;
+  rq->chan   = -1;
+  rq->t0     = lg_due != 0 ? lg_due : lg_now();
+  return id;
+}
+
+/** An answer to a request
+ *  Returns the request the answer completes (the owner of its batch
+ *  when that was the last one due) or NULL when there is nothing more
+ *  to do: unknown, timed out or more of the batch to come.  *part gets
+ *  the request the answer itself was for.
+ *
+ * \param id   The request's id
+ * \param part Returns the request answered (NULL when we do not know it)
+ */
+lg_req_t *lg_req_done( uint32_t id, lg_req_t **part) {
+  lg_req_t *rq;
+  lg_req_t *owner;
+
+  *part = NULL;
+  rq = lg_reqs + (id & (LG_PENDING - 1));
+  if( !rq->live || rq->id != id)
+    return NULL;
+  rq->live = 0;
+  *part = rq;
+
+  owner = lg_reqs + (rq->owner & (LG_PENDING - 1));
+  if( owner->id != rq->owner || (owner != rq && !owner->live))
+    return NULL;
+  if( --owner->left > 0) {
+    if( owner == rq)
+      rq->live = 1;	// the owner waits for the rest of its batch
+    return NULL;
+  }
+  owner->live = 0;
+  return owner;
+}
+
+/** Add a message to a client's output
+ *  Payloads are padded to 8 bytes as the protocol wants.
+ *
+ * \param c       The client
+ * \param cmd     The command
+ * \param dtype   Data type
+ * \param dcount  Data count
+ * \param p1      Parameter 1
+ * \param p2      Parameter 2
+ * \param payload The payload (NULL for none)
+ * \param plen    Its length
+ */
+void lg_msg( lg_client_t *c, uint16_t cmd, uint16_t dtype, uint16_t dcount, uint32_t p1, uint32_t p2, void *payload, int plen) {
+  int padded;
+  char *nb;
+
+  padded = (plen + 7) & ~7;
+  if( c->olen + sizeof( e_message_header_t) + padded > c->osize) {
+    nb = realloc( c->out, 2*c->osize + sizeof( e_message_header_t) + padded);
+    if( nb == NULL) {
+      fprintf( stderr, "Out of memory for client output (lg_msg)\n");
+      return;
+    }
+    c->out   = nb;
+    c->osize = 2*c->osize + sizeof( e_message_header_t) + padded;
+  }
+
+  create_message_header( (e_message_header_t *)(c->out + c->olen), cmd, padded, dtype, dcount, p1, p2);
+  c->olen += sizeof( e_message_header_t);
+  memset( c->out + c->olen, 0, padded);
+  if( plen > 0)
+    memcpy( c->out + c->olen, payload, plen);
+  c->olen += padded;
+}
+
+/** Send what a client has waiting
+ *  Datagrams go all at once; TCP sends what the socket will take.
+ *
+ * \param c The client
+ */
+void lg_flush( lg_client_t *c) {
+  int n;
+
+  if( c->olen == 0)
+    return;
+
+  if( c->udp) {
+    n = sendto( c->sock, c->out, c->olen, 0, (struct sockaddr *)&lg_addr, sizeof( lg_addr));
+    if( n > 0)
+      lg_bytes_out += n;
+    c->olen = 0;	// a datagram we could not send is lost like any other
+    return;
+  }
+
+  n = send( c->sock, c->out, c->olen, MSG_NOSIGNAL);
+  if( n == -1) {
+    if( errno != EAGAIN && errno != EWOULDBLOCK)
+      c->state = LG_DEAD;
+    return;
+  }
+  lg_bytes_out += n;
+  memmove( c->out, c->out + n, c->olen - n);
+  c->olen -= n;
+}
+
+/** Ask to create a channel
+ *
+ * \param c    The client
+ * \param cid  Our id for it
+ * \param name Its name
+ */
+void lg_create( lg_client_t *c, uint32_t cid, char *name) {
+  lg_msg( c, 18, 0, 0, cid, LG_MINOR, name, strlen( name) + 1);
+}
+
+/** A client's connection is up: say hello and create the working set
+ *
+ * \param k The client
+ */
+void lg_hello( int k) {
+  lg_client_t *c;
+  char host[256];
+  uint32_t owner;
+  uint32_t cid;
+  int i;
+
+  c = lg_clients + k;
+  lg_msg( c,  0, 0, LG_MINOR, 0, 0, NULL, 0);			// version: priority 0
+  lg_msg( c, 20, 0, 0, 0, 0, "loadgen", 8);			// client name
+  if( gethostname( host, sizeof( host)) == -1)
+    strcpy( host, "localhost");
+  host[sizeof( host) - 1] = 0;
+  lg_msg( c, 21, 0, 0, 0, 0, host, strlen( host) + 1);		// host name
+
+  if( c->nchans == 0) {
+    c->state = LG_RUNNING;
+    return;
+  }
+
+  c->state = LG_SETUP;
+  c->inflight++;
+  owner = 0;
+  for( i=0; i<c->nchans; i++) {
+    cid = lg_req_new( LG_OP_CONNECT, k, owner, c->nchans);
+    if( owner == 0)
+      owner = cid;
+    lg_reqs[cid & (LG_PENDING - 1)].chan = i;
+    lg_create( c, cid, lg_names[(k * c->nchans + i) % lg_nnames]);
+  }
+}
+
+/** The working set is ready: subscribe to the first -s channels of it
+ *
+ * \param c The client
+ */
+void lg_subscribe( lg_client_t *c) {
+  char pl[16];
+  uint16_t mask;
+  int i;
+  int n;
+
+  memset( pl, 0, sizeof( pl));
+  mask = htons( 5);	// DBE_VALUE | DBE_ALARM
+  memcpy( pl + 12, &mask, sizeof( mask));
+
+  n = 0;
+  for( i=0; i<c->nchans && n<lg_subs; i++) {
+    if( c->sids[i] == 0)
+      continue;
+    lg_msg( c, 1, c->dtypes[i], c->counts[i], c->sids[i], i, pl, sizeof( pl));
+    n++;
+  }
+}
+
+/** Pick one of the client's channels at random
+ *  Returns its index or -1 when none were created.
+ *
+ * \param c The client
+ */
+int lg_pick_chan( lg_client_t *c) {
+  int i;
+  int j;
+
+  if( c->ready == 0)
+    return -1;
+  j = random() % c->nchans;
+  for( i=0; i<c->nchans; i++) {
+    if( c->sids[(i + j) % c->nchans] != 0)
+      return (i + j) % c->nchans;
+  }
+  return -1;
+}
+
+/** Send a client its next request
+ *  Returns 1 when one went out.
+ *
+ * \param k The client
+ */
+int lg_issue( int k) {
+  lg_client_t *c;
+  uint32_t id;
+  uint32_t owner;
+  unsigned long long v;
+  int total;
+  int op;
+  int r;
+  int i;
+  int j;
+
+  c = lg_clients + k;
+
+  if( c->udp) {
+    if( lg_weights[LG_OP_SEARCH] == 0)
+      return 0;
+    //
+    // A search storm datagram: version then the searches, each with its own cid
+    // (DO_REPLY so names that are not there are answered too)
+    //
+    lg_msg( c, 0, 0, LG_MINOR, 0, 0, NULL, 0);
+    for( i=0; i<lg_burst; i++) {
+      id = lg_req_new( LG_OP_SEARCH, k, 0, 1);
+      j  = random() % lg_nnames;
+      lg_msg( c, 6, 10, LG_MINOR, id, id, lg_names[j], strlen( lg_names[j]) + 1);
+    }
+    c->inflight += lg_burst;
+    lg_flush( c);
+    return 1;
+  }
+
+  total = lg_weights[LG_OP_OPEN] + lg_weights[LG_OP_READ] + lg_weights[LG_OP_PUT];
+  if( total == 0)
+    return 0;
+  r = random() % total;
+  if( r < lg_weights[LG_OP_OPEN])
+    op = LG_OP_OPEN;
+  else if( r < lg_weights[LG_OP_OPEN] + lg_weights[LG_OP_READ])
+    op = LG_OP_READ;
+  else
+    op = LG_OP_PUT;
+
+  if( op == LG_OP_OPEN) {
+    owner = 0;
+    for( i=0; i<lg_screen; i++) {
+      id = lg_req_new( LG_OP_OPEN, k, owner, lg_screen);
+      if( owner == 0)
+	owner = id;
+      lg_create( c, id, lg_names[random() % lg_nnames]);
+    }
+    c->inflight++;
+    return 1;
+  }
+
+  j = lg_pick_chan( c);
+  if( j == -1)
+    return 0;
+
+  id = lg_req_new( op, k, 0, 1);
+  if( op == LG_OP_READ) {
+    lg_msg( c, 15, c->dtypes[j], c->counts[j], c->sids[j], id, NULL, 0);
+  } else {
+    v = swapd( (double)id);
+    lg_msg( c, 19, 6, 1, c->sids[j], id, &v, sizeof( v));
+  }
+  c->inflight++;
+  return 1;
+}
+
+/** Take in one message from the server
+ *
+ * \param k   The client
+ * \param emh Its header
+ */
+void lg_message( int k, e_extended_message_header_t *emh) {
+  lg_client_t *c;
+  lg_req_t *rq;
+  lg_req_t *part;
+  uint32_t id;
+  int failed;
+
+  c = lg_clients + k;
+  failed = 0;
+  switch( emh->cmd) {
+  case 1:		// monitor update
+    lg_updates++;
+    return;
+
+  case 6:		// search: found it (CID in p2)
+  case 14:		// search: not here (CID in p1 and p2)
+    if( emh->cmd == 6)
+      lg_found++;
+    else
+      lg_not_found++;
+    id = emh->p2;
+    break;
+
+  case 15:		// read_notify: status in p1, IOID in p2
+  case 19:		// write_notify
+    failed = emh->p1 != 1;
+    id = emh->p2;
+    break;
+
+  case 18:		// create_chan: CID in p1, SID in p2
+  case 26:		// create_chan failed: CID in p1
+    failed = emh->cmd == 26;
+    id = emh->p1;
+    break;
+
+  case 23:		// the server wants to know we are still here
+    lg_msg( c, 23, 0, 0, 0, 0, NULL, 0);
+    return;
+
+  default:
+    return;
+  }
+
+  rq = lg_req_done( id, &part);
+  if( part == NULL)
+    return;
+
+  if( emh->cmd == 18) {
+    if( part->op == LG_OP_CONNECT && part->chan >= 0 && c->sids[part->chan] == 0) {
+      c->sids[part->chan]   = emh->p2;
+      c->dtypes[part->chan] = emh->dtype;
+      c->counts[part->chan] = emh->dcount;
+      c->ready++;
+    } else if( part->op == LG_OP_OPEN) {
+      //
+      // Screen channels go away as soon as they are made
+      //
+      lg_msg( c, 12, 0, 0, emh->p2, emh->p1, NULL, 0);
+    }
+  }
+  if( failed)
+    lg_stats[part->op].errors++;
+
+  if( rq == NULL)
+    return;
+
+  c->inflight--;
+  lg_sample( rq->op, lg_now() - rq->t0);
+  if( rq->op == LG_OP_CONNECT) {
+    c->state = LG_RUNNING;
+    lg_subscribe( c);
+  }
+}
+
+/** Read what the server sent a client and act on it
+ *
+ * \param k The client
+ */
+void lg_input( int k) {
+  lg_client_t *c;
+  e_extended_message_header_t emh;
+  uint32_t size;
+  int n;
+
+  c = lg_clients + k;
+  n = recv( c->sock, c->in.wbp, (char *)c->in.buf + c->in.bufsize - c->in.wbp, 0);
+  if( n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    if( !c->udp)
+      c->state = LG_DEAD;
+    return;
+  }
+  if( n == -1)
+    return;
+  lg_bytes_in += n;
+  c->in.wbp += n;
+
+  while( 1) {
+    size = e_msg_size( c->in.rbp, c->in.wbp);
+    if( size == 0 || c->in.rbp + size > c->in.wbp)
+      break;
+    read_extended_message_header( &c->in, &emh);
+    c->in.rbp += emh.plsize;
+    lg_message( k, &emh);
+  }
+
+  //
+  // Datagrams do not continue: whatever is left is junk
+  //
+  if( c->udp || c->in.rbp == c->in.wbp) {
+    c->in.rbp = c->in.buf;
+    c->in.wbp = c->in.buf;
+  } else if( c->in.rbp != c->in.buf) {
+    memmove( c->in.buf, c->in.rbp, c->in.wbp - c->in.rbp);
+    c->in.wbp -= c->in.rbp - (char *)c->in.buf;
+    c->in.rbp  = c->in.buf;
+  }
+  if( !c->udp && (char *)c->in.buf + c->in.bufsize == c->in.wbp && size > c->in.bufsize) {
+    fprintf( stderr, "Message of %u bytes is too big for us, dropping client %d (lg_input)\n", size, k);
+    c->state = LG_DEAD;
+  }
+}
+
+/** Give up on requests nobody answered
+ *
+ * \param now The time
+ */
+void lg_timeouts( uint64_t now) {
+  lg_req_t *rq;
+  int i;
+
+  for( i=0; i<LG_PENDING; i++) {
+    rq = lg_reqs + i;
+    if( !rq->live || now - rq->t0 < lg_tmo_ms * 1000000ULL)
+      continue;
+    rq->live = 0;
+    if( rq->owner != rq->id)
+      continue;
+    lg_stats[rq->op].timeouts++;
+    lg_clients[rq->client].inflight--;
+    if( rq->op == LG_OP_CONNECT && lg_clients[rq->client].state == LG_SETUP) {
+      //
+      // Run with what we have
+      //
+      lg_clients[rq->client].state = LG_RUNNING;
+      lg_subscribe( lg_clients + rq->client);
+    }
+  }
+}
+
+/** One time around the poll loop
+ *  Returns the number of clients still connecting or setting up.
+ *
+ * \param wait_ms How long poll may wait
+ */
+int lg_poll( int wait_ms) {
+  lg_client_t *c;
+  socklen_t len;
+  int err;
+  int starting;
+  int k;
+
+  starting = 0;
+  for( k=0; k<lg_n; k++) {
+    c = lg_clients + k;
+    lg_pfds[k].fd      = c->state == LG_DEAD ? -1 : c->sock;
+    lg_pfds[k].events  = POLLIN;
+    lg_pfds[k].revents = 0;
+    if( c->state == LG_CONNECTING || c->olen > 0)
+      lg_pfds[k].events |= POLLOUT;
+    if( c->state == LG_CONNECTING || c->state == LG_SETUP)
+      starting++;
+  }
+
+  if( poll( lg_pfds, lg_n, wait_ms) <= 0)
+    return starting;
+
+  for( k=0; k<lg_n; k++) {
+    c = lg_clients + k;
+    if( lg_pfds[k].revents == 0)
+      continue;
+
+    if( c->state == LG_CONNECTING) {
+      err = 0;
+      len = sizeof( err);
+      getsockopt( c->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+      if( err != 0) {
+	fprintf( stderr, "client %d could not connect: %s\n", k, strerror( err));
+	c->state = LG_DEAD;
+	continue;
+      }
+      lg_hello( k);
+    }
+    if( lg_pfds[k].revents & POLLIN)
+      lg_input( k);
+    if( lg_pfds[k].revents & (POLLERR | POLLHUP))
+      c->state = c->udp ? c->state : LG_DEAD;
+    if( c->state != LG_DEAD)
+      lg_flush( c);
+  }
+  return starting;
+}
+
+/** Compare latencies for qsort
+ */
+int lg_cmp( const void *a, const void *b) {
+  uint32_t x, y;
+
+  x = *(const uint32_t *)a;
+  y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/** A percentile of an operation's latencies in microseconds
+ *  (the samples must be sorted)
+ *
+ * \param st The operation
+ * \param p  Which percentile
+ */
+uint32_t lg_pct( lg_stat_t *st, double p) {
+  int i;
+
+  if( st->nsamples == 0)
+    return 0;
+  i = p / 100.0 * st->nsamples;
+  if( i >= st->nsamples)
+    i = st->nsamples - 1;
+  return st->samples[i];
+}
+
+/** Tell them how it went
+ *
+ * \param secs How long the mix ran
+ */
+void lg_report( double secs) {
+  lg_stat_t *st;
+  int op;
+
+  printf( "%-8s %10s %10s %8s %8s %9s %9s %9s %9s %9s\n",
+	  "op", "count", "per sec", "errors", "timeouts", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+  for( op=0; op<LG_OP_N; op++) {
+    st = lg_stats + op;
+    if( st->n == 0 && st->errors == 0 && st->timeouts == 0)
+      continue;
+    qsort( st->samples, st->nsamples, sizeof( *st->samples), lg_cmp);
+    printf( "%-8s %10lu %10.0f %8lu %8lu %9u %9u %9u %9u %9u\n",
+	    lg_op_names[op], st->n, op == LG_OP_CONNECT ? 0.0 : st->n / secs, st->errors, st->timeouts,
+	    lg_pct( st, 50), lg_pct( st, 90), lg_pct( st, 99), lg_pct( st, 99.9), lg_pct( st, 100));
+  }
+  printf( "searches: %lu found, %lu not found\n", lg_found, lg_not_found);
+  printf( "monitor updates: %lu (%.0f per sec)\n", lg_updates, lg_updates / secs);
+  printf( "bytes: %lu in (%.1f MB/s), %lu out (%.1f MB/s) over %.1f seconds\n",
+	  lg_bytes_in, lg_bytes_in / secs / 1e6, lg_bytes_out, lg_bytes_out / secs / 1e6, secs);
+}
+
+/** Parse the mix: op:weight,op:weight,...
+ *  Returns -1 if we do not understand it.
+ *
+ * \param spec The mix
+ */
+int lg_mix( char *spec) {
+  char *s, *tok, *save, *colon;
+  int op;
+
+  s = strdup( spec);
+  if( s == NULL)
+    return -1;
+  memset( lg_weights, 0, sizeof( lg_weights));
+  for( tok = strtok_r( s, ",", &save); tok != NULL; tok = strtok_r( NULL, ",", &save)) {
+    colon = strchr( tok, ':');
+    if( colon != NULL)
+      *colon++ = 0;
+    for( op=LG_OP_SEARCH; op<LG_OP_N; op++) {
+      if( strcmp( tok, lg_op_names[op]) == 0)
+	break;
+    }
+    if( op == LG_OP_N) {
+      free( s);
+      return -1;
+    }
+    lg_weights[op] = colon == NULL ? 1 : atoi( colon);
+  }
+  free( s);
+  return 0;
+}
+
+/** The channel names: one per line from a file or made from a pattern
+ *  Returns -1 when we end up with none.
+ *
+ * \param file    File of names or NULL
+ * \param pattern printf pattern with one %d or NULL
+ * \param count   How many names to make from it
+ */
+int lg_load_names( char *file, char *pattern, int count) {
+  FILE *f;
+  char line[E_NAME_MAX];
+  int i;
+
+  lg_names = malloc( (count > 0 ? count : 1) * sizeof( *lg_names));
+  if( file != NULL) {
+    f = fopen( file, "r");
+    if( f == NULL) {
+      perror( file);
+      return -1;
+    }
+    while( fgets( line, sizeof( line), f) != NULL) {
+      line[strcspn( line, "\r\n")] = 0;
+      if( line[0] == 0)
+	continue;
+      lg_names = realloc( lg_names, (lg_nnames + 1) * sizeof( *lg_names));
+      lg_names[lg_nnames++] = strdup( line);
+    }
+    fclose( f);
+  } else if( pattern != NULL) {
+    for( i=0; i<count; i++) {
+      snprintf( line, sizeof( line), pattern, i);
+      lg_names[lg_nnames++] = strdup( line);
+    }
+  }
+  return lg_nnames > 0 ? 0 : -1;
+}
+
+/** Make our clients and start them connecting
+ */
+void lg_start() {
+  lg_client_t *c;
+  int flags;
+  int k;
+
+  lg_n       = lg_nclients + lg_nudp;
+  lg_clients = calloc( lg_n, sizeof( *lg_clients));
+  lg_pfds    = calloc( lg_n, sizeof( *lg_pfds));
+  if( lg_clients == NULL || lg_pfds == NULL) {
+    fprintf( stderr, "Out of memory for %d clients (lg_start)\n", lg_n);
+    exit( -1);
+  }
+
+  for( k=0; k<lg_n; k++) {
+    c = lg_clients + k;
+    c->udp   = k >= lg_nclients;
+    c->sock  = socket( PF_INET, c->udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+    c->osize = 4096;
+    c->out   = malloc( c->osize);
+    c->in.bufsize = LG_BUFSIZE;
+    c->in.buf     = malloc( LG_BUFSIZE);
+    c->in.rbp     = c->in.buf;
+    c->in.wbp     = c->in.buf;
+    if( c->sock == -1 || c->out == NULL || c->in.buf == NULL) {
+      fprintf( stderr, "Could not make client %d: %s (lg_start)\n", k, strerror( errno));
+      exit( -1);
+    }
+    flags = fcntl( c->sock, F_GETFL, 0);
+    fcntl( c->sock, F_SETFL, flags | O_NONBLOCK);
+
+    if( c->udp) {
+      c->state = LG_RUNNING;
+      continue;
+    }
+
+    c->nchans = lg_wset;
+    c->sids   = calloc( lg_wset + 1, sizeof( *c->sids));
+    c->dtypes = calloc( lg_wset + 1, sizeof( *c->dtypes));
+    c->counts = calloc( lg_wset + 1, sizeof( *c->counts));
+    c->state  = LG_CONNECTING;
+    if( connect( c->sock, (struct sockaddr *)&lg_addr, sizeof( lg_addr)) == -1 && errno != EINPROGRESS) {
+      fprintf( stderr, "client %d could not connect: %s\n", k, strerror( errno));
+      c->state = LG_DEAD;
+    }
+  }
+}
+
+int main( int argc, char **argv) {
+  char *host = "127.0.0.1";	// the server
+  int port = 5064;		// and its port
+  char *file = NULL;		// channel names, one per line (-f)
+  char *pattern = NULL;		// or a pattern to make them from (-n)
+  int count = 1000;		// and how many (-N)
+  char *mix = "read";		// what the clients do (-m)
+  uint64_t t0, now, last_tmo, last_report, end;
+  unsigned long last_n[LG_OP_N];
+  unsigned long allowed;	// requests the rate lets us have sent by now
+  int next;		// open loop: the client to make the next request
+  int who;		// and the one asked just now
+  int starting;
+  int c;
+  int k;
+  int op;
+
+  while( (c = getopt( argc, argv, "h:P:c:u:t:d:r:w:k:b:s:T:m:f:n:N:")) != -1) {
+    switch( c) {
+    case 'h': host        = optarg;		break;
+    case 'P': port        = atoi( optarg);	break;
+    case 'c': lg_nclients = atoi( optarg);	break;
+    case 'u': lg_nudp     = atoi( optarg);	break;
+    case 't': lg_secs     = atoi( optarg);	break;
+    case 'd': lg_depth    = atoi( optarg);	break;
+    case 'r': lg_rate     = atof( optarg);	break;
+    case 'w': lg_wset     = atoi( optarg);	break;
+    case 'k': lg_screen   = atoi( optarg);	break;
+    case 'b': lg_burst    = atoi( optarg);	break;
+    case 's': lg_subs     = atoi( optarg);	break;
+    case 'T': lg_tmo_ms   = atoi( optarg);	break;
+    case 'm': mix         = optarg;		break;
+    case 'f': file        = optarg;		break;
+    case 'n': pattern     = optarg;		break;
+    case 'N': count       = atoi( optarg);	break;
+    default:
+      fprintf( stderr, "Usage: %s [-h host] [-P port] [-c tcp_clients] [-u udp_sockets] [-t secs] [-d depth] [-r requests_per_sec]"
+	       " [-w working_set] [-k screen_size] [-b searches_per_datagram] [-s monitors_per_client] [-T timeout_ms]"
+	       " [-m search:w,open:w,read:w,put:w] (-f names_file | -n name_pattern_%%d [-N count])\n", argv[0]);
+      exit( -1);
+    }
+  }
+
+  if( lg_mix( mix) == -1) {
+    fprintf( stderr, "Bad mix '%s': use op:weight,... with ops search, open, read and put\n", mix);
+    exit( -1);
+  }
+  if( lg_load_names( file, pattern, count) == -1) {
+    fprintf( stderr, "Give us some channel names with -f file or -n pattern\n");
+    exit( -1);
+  }
+  if( lg_weights[LG_OP_SEARCH] == 0)
+    lg_nudp = 0;
+  if( lg_depth < 1 || lg_screen < 1 || lg_burst < 1 || lg_wset < 0 || lg_screen > LG_PENDING / 4) {
+    fprintf( stderr, "Depth, screen size and burst need to be at least 1\n");
+    exit( -1);
+  }
+
+  memset( &lg_addr, 0, sizeof( lg_addr));
+  lg_addr.sin_family = AF_INET;
+  lg_addr.sin_port   = htons( port);
+  if( inet_aton( host, &lg_addr.sin_addr) == 0) {
+    fprintf( stderr, "Bad server address %s\n", host);
+    exit( -1);
+  }
+
+  //
+  // Connect everyone and create their working sets
+  //
+  lg_start();
+  t0 = lg_now();
+  last_tmo = t0;
+  do {
+    starting = lg_poll( 100);
+    now = lg_now();
+    if( now - last_tmo > 100000000ULL) {
+      lg_timeouts( now);
+      last_tmo = now;
+    }
+  } while( starting > 0 && now - t0 < 60000000000ULL);
+  fprintf( stderr, "%d clients set up in %.2f seconds\n", lg_nclients, (lg_now() - t0) / 1e9);
+
+  //
+  // Run the mix
+  //
+  memset( last_n, 0, sizeof( last_n));
+  for( op=LG_OP_SEARCH; op<LG_OP_N; op++)
+    memset( lg_stats + op, 0, offsetof( lg_stat_t, nsamples));
+  lg_updates = lg_found = lg_not_found = 0;
+  lg_bytes_in = lg_bytes_out = 0;
+
+  t0 = lg_now();
+  end = t0 + lg_secs * 1000000000ULL;
+  last_report = t0;
+  next = 0;
+  for( now = t0; now < end; now = lg_now()) {
+    if( lg_rate > 0) {
+      //
+      // Open loop: every request due by now goes out, taking turns
+      // between the clients, however many are still unanswered
+      //
+      allowed = (now - t0) / 1e9 * lg_rate;
+      while( lg_issued < allowed) {
+	lg_due = t0 + (uint64_t)(lg_issued * 1e9 / lg_rate);
+	for( k=0; k<lg_n; k++) {
+	  who  = next;
+	  next = (next + 1) % lg_n;
+	  if( lg_clients[who].state == LG_RUNNING && lg_issue( who))
+	    break;
+	}
+	if( k == lg_n)
+	  break;		// nobody can ask for anything just now
+	lg_issued++;
+      }
+      lg_due = 0;
+    } else {
+      //
+      // Closed loop: everyone keeps -d requests going
+      //
+      for( k=0; k<lg_n; k++) {
+	if( lg_clients[k].state == LG_RUNNING && lg_clients[k].inflight < (lg_clients[k].udp ? lg_depth * lg_burst : lg_depth)) {
+	  if( lg_issue( k))
+	    lg_issued++;
+	}
+      }
+    }
+
+    lg_poll( lg_rate > 0 ? 1 : 10);
+
+    now = lg_now();
+    if( now - last_tmo > 100000000ULL) {
+      lg_timeouts( now);
+      last_tmo = now;
+    }
+    if( now - last_report >= 1000000000ULL) {
+      fprintf( stderr, "%.0fs:", (now - t0) / 1e9);
+      for( op=LG_OP_SEARCH; op<LG_OP_N; op++) {
+	if( lg_weights[op] > 0)
+	  fprintf( stderr, " %s %lu/s", lg_op_names[op], lg_stats[op].n - last_n[op]);
+	last_n[op] = lg_stats[op].n;
+      }
+      fprintf( stderr, " updates %lu\n", lg_updates);
+      last_report = now;
+    }
+  }
+
+  lg_report( (lg_now() - t0) / 1e9);
+  return 0;
+}
@@ -0,0 +1,1131 @@
+/*! \file ca-replay.c
+ *  \brief Play a traffic capture (e -C) back against a server
+ *  \date 2026
+ *  \copyright All Rights Reserved
+ *
+ * Every circuit in the capture gets its own connection and is sent what
+ * its client sent, when it sent it: in real time (-s 1), N times faster
+ * (-s N) or as fast as we can (-s 0).  Datagrams go out from a pool of
+ * sockets, one per recorded peer as far as the pool goes.  NOTIFYs are
+ * raised again with pg_notify when we are given a database (-D).
+ *
+ * Sids are the server's to pick (e.create_channel picks them at random)
+ * so the ones in the capture mean nothing to the server we play it to.
+ * The capture also has each channel's cid and recorded sid; we hold a
+ * circuit's messages that name a sid until the create_chan for it has
+ * been answered, as its client did, and send them with the new sid.
+ *
+ * We time each request that gets an answer (create_chan, read_notify,
+ * write_notify, the first update of event_add, searches and echo) and
+ * report throughput and latency percentiles per command.  -o saves the
+ * numbers and -B compares a run with numbers saved from another build.
+ *
+ * Like ca-loadgen we include e.c for its header encoders and decoders.
+ */
+
+#define E_NO_MAIN
+#include "e.c"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RP_REQ_BUCKETS (1 << 16)	// request hash buckets (power of 2)
+#define RP_SAMPLES     (1 << 20)	// latencies kept per command (reservoir sampled after that)
+#define RP_BUFSIZE     65536		// receive buffer per connection
+#define RP_UDP         0x80000000	// request "circuit" numbers for our datagram sockets
+#define RP_CHAN_BUCKETS (1 << 16)	// channel hash buckets (power of 2)
+
+#define RP_CHAN_WAITING 0	// create_chan not answered yet
+#define RP_CHAN_LIVE    1	// created: we have its new sid
+#define RP_CHAN_FAILED  2	// refused or not answered: send the recorded sid
+
+#define RP_UNUSED     0		// not in the capture yet
+#define RP_CONNECTING 1		// waiting for connect to finish
+#define RP_OPEN       2		// sending what the capture says
+#define RP_CLOSING    3		// closed in the capture: close when the answers are in
+#define RP_DEAD       4		// closed
+
+// A recorded circuit or one of our datagram sockets
+//
+typedef struct rp_conn_struct {
+  int sock;
+  int udp;		// 1 for a datagram socket
+  int state;		// RP_UNUSED ...
+  int waiting;		// requests waiting for an answer
+  uint64_t closing;	// when the capture closed us
+  char *out;		// to send
+  int olen;		// bytes in it
+  int osize;		// its size
+  char *pend;		// recorded stream not yet split into messages
+  int plen;		// bytes in it
+  int psize;		// its size
+  char *hold;		// whole messages waiting for a channel to be created
+  int hlen;		// bytes in it
+  int hsize;		// its size
+  e_socks_buffer_t in;	// answers (read with e.c's decoders)
+} rp_conn_t;
+
+// A request waiting for its answer
+//
+typedef struct rp_req_struct {
+  struct rp_req_struct *next;
+  uint32_t conn;	// circuit number or RP_UDP | datagram socket
+  uint32_t id;		// cid, ioid or subscription id
+  uint16_t cmd;		// the request's command
+  uint16_t dtype;	// searches: 10 when the server must answer even when it does not have the name
+  uint64_t t0;		// when we sent it
+} rp_req_t;
+
+// A channel a recorded circuit created
+//
+typedef struct rp_chan_struct {
+  struct rp_chan_struct *next_cid;	// next in its bucket by circuit and cid
+  struct rp_chan_struct *next_sid;	// next in its bucket by circuit and recorded sid
+  uint32_t conn;	// the circuit
+  uint32_t cid;		// the client's id for it
+  uint32_t rec_sid;	// the sid in the capture (0 until the capture tells us)
+  uint32_t sid;		// the sid we were given
+  int state;		// RP_CHAN_WAITING ...
+} rp_chan_t;
+
+// What happened to each command
+//
+typedef struct rp_stat_struct {
+  unsigned long n;		// answered
+  unsigned long errors;		// answered with a failure
+  unsigned long timeouts;	// not answered in time
+  unsigned long sent;		// sent
+  unsigned long seen;		// latencies offered to the reservoir
+  int nsamples;			// latencies in it
+  uint32_t *samples;		// microseconds
+} rp_stat_t;
+
+static struct sockaddr_in rp_addr;	//!< the server
+static double rp_speed = 1.0;		//!< 1 for real time, N for N times faster, 0 for as fast as we can (-s)
+static int rp_tmo_ms = 2000;		//!< how long we wait for an answer (-T)
+static int rp_nudp = 64;		//!< datagram sockets (-u)
+static PGconn *rp_pg = NULL;		//!< raises the NOTIFYs (-D)
+
+static rp_conn_t *rp_conns;		//!< circuits by number then our datagram sockets
+static struct pollfd *rp_pfds;		//!< their poll entries
+static int rp_nconns;			//!< circuit numbers go up to this
+static rp_req_t *rp_reqs[RP_REQ_BUCKETS];	//!< requests waiting for answers
+static rp_req_t *rp_req_free = NULL;	//!< recycled ones
+static rp_stat_t rp_stats[E_CMDS];	//!< per command results
+static rp_chan_t *rp_chans_cid[RP_CHAN_BUCKETS];	//!< channels by circuit and cid
+static rp_chan_t *rp_chans_sid[RP_CHAN_BUCKETS];	//!< and by circuit and recorded sid
+static unsigned long rp_remapped = 0;	//!< messages sent with the new sid
+static unsigned long rp_unmapped = 0;	//!< and with the recorded one (created before the capture or refused)
+static unsigned long rp_updates = 0;	//!< monitor updates received
+static unsigned long rp_found = 0;	//!< searches answered with "here"
+static unsigned long rp_not_found = 0;	//!< and with "not here"
+static unsigned long rp_unanswered = 0;	//!< searches for names nobody has (no answer wanted)
+static unsigned long rp_notifies = 0;	//!< NOTIFYs raised
+static unsigned long rp_notifies_skipped = 0;	//!< and not (no -D)
+static unsigned long rp_refused = 0;	//!< circuits that could not connect
+static unsigned long rp_bytes_out = 0;	//!< bytes sent
+static unsigned long rp_bytes_in = 0;	//!< bytes received
+
+/** Monotonic nanoseconds
+ */
+uint64_t rp_now() {
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Keep a latency
+ *  Reservoir sampled so a long capture still gives fair percentiles.
+ *
+ * \param cmd The request's command
+ * \param ns  How long the answer took
+ */
+void rp_sample( int cmd, uint64_t ns) {
+  rp_stat_t *st;
+  unsigned long j;
+
+  st = rp_stats + cmd;
+  st->n++;
+  st->seen++;
+  if( st->samples == NULL) {
+    st->samples = malloc( RP_SAMPLES * sizeof( *st->samples));
+    if( st->samples == NULL) {
+      fprintf( stderr, "Out of memory for latencies (rp_sample)\n");
+      return;
+    }
+  }
+  if( st->nsamples < RP_SAMPLES) {
+    st->samples[st->nsamples++] = ns / 1000;
+    return;
+  }
+  j = random() % st->seen;
+  if( j < RP_SAMPLES)
+    st->samples[j] = ns / 1000;
+}
+
+/** Which hash bucket a request goes in
+ *
+ * \param conn Circuit
+ * \param cmd  Command
+ * \param id   Its id
+ */
+uint32_t rp_bucket( uint32_t conn, uint16_t cmd, uint32_t id) {
+  return ((conn * 0x9e3779b1) ^ (id * 0x85ebca6b) ^ cmd) & (RP_REQ_BUCKETS - 1);
+}
+
+/** The connection a request came from
+ *
+ * \param conn Circuit number or RP_UDP | datagram socket
+ */
+rp_conn_t *rp_conn_of( uint32_t conn) {
+  return conn & RP_UDP ? rp_conns + rp_nconns + (conn & ~RP_UDP) : rp_conns + conn;
+}
+
+/** Remember a request we sent
+ *
+ * \param conn  Circuit number or RP_UDP | datagram socket
+ * \param cmd   The command
+ * \param id    Its id
+ * \param dtype Its data type
+ */
+void rp_req_add( uint32_t conn, uint16_t cmd, uint32_t id, uint16_t dtype) {
+  rp_req_t *rq;
+  uint32_t b;
+
+  rq = rp_req_free;
+  if( rq != NULL) {
+    rp_req_free = rq->next;
+  } else {
+    rq = malloc( sizeof( *rq));
+    if( rq == NULL) {
+      fprintf( stderr, "Out of memory for requests (rp_req_add)\n");
+      return;
+    }
+  }
+  rq->conn  = conn;
+  rq->cmd   = cmd;
+  rq->id    = id;
+  rq->dtype = dtype;
+  rq->t0    = rp_now();
+
+  b = rp_bucket( conn, cmd, id);
+  rq->next = rp_reqs[b];
+  rp_reqs[b] = rq;
+  rp_stats[cmd].sent++;
+  rp_conn_of( conn)->waiting++;
+}
+
+/** An answer: find its request and time it
+ *
+ * \param conn   Who got it
+ * \param cmd    The command of the request it answers
+ * \param id     Its id
+ * \param failed 1 when the server said no
+ */
+void rp_req_done( uint32_t conn, uint16_t cmd, uint32_t id, int failed) {
+  rp_req_t **pp, *rq;
+
+  for( pp = rp_reqs + rp_bucket( conn, cmd, id); *pp != NULL; pp = &(*pp)->next) {
+    rq = *pp;
+    if( rq->conn == conn && rq->cmd == cmd && rq->id == id) {
+      *pp = rq->next;
+      rp_sample( cmd, rp_now() - rq->t0);
+      if( failed)
+	rp_stats[cmd].errors++;
+      rp_conn_of( conn)->waiting--;
+      rq->next = rp_req_free;
+      rp_req_free = rq;
+      return;
+    }
+  }
+}
+
+/** Which channel hash bucket
+ *
+ * \param conn Circuit
+ * \param id   cid or recorded sid
+ */
+uint32_t rp_chan_bucket( uint32_t conn, uint32_t id) {
+  return ((conn * 0x9e3779b1) ^ (id * 0x85ebca6b)) & (RP_CHAN_BUCKETS - 1);
+}
+
+/** A recorded circuit asks for a channel
+ *  Newest first: a cid used again makes a new channel.
+ *
+ * \param conn The circuit
+ * \param cid  The client's id for it
+ */
+void rp_chan_new( uint32_t conn, uint32_t cid) {
+  rp_chan_t *ch;
+  uint32_t b;
+
+  ch = calloc( 1, sizeof( *ch));
+  if( ch == NULL) {
+    fprintf( stderr, "Out of memory for channels (rp_chan_new)\n");
+    return;
+  }
+  ch->conn  = conn;
+  ch->cid   = cid;
+  ch->state = RP_CHAN_WAITING;
+  b = rp_chan_bucket( conn, cid);
+  ch->next_cid = rp_chans_cid[b];
+  rp_chans_cid[b] = ch;
+}
+
+/** The capture says which sid the recorded server gave a channel
+ *
+ * \param conn    The circuit
+ * \param cid     The client's id for it
+ * \param rec_sid The recorded sid
+ */
+void rp_chan_recorded( uint32_t conn, uint32_t cid, uint32_t rec_sid) {
+  rp_chan_t *ch;
+  uint32_t b;
+
+  for( ch = rp_chans_cid[rp_chan_bucket( conn, cid)]; ch != NULL; ch = ch->next_cid) {
+    if( ch->conn == conn && ch->cid == cid)
+      break;
+  }
+  if( ch == NULL || ch->rec_sid != 0)
+    return;
+  ch->rec_sid = rec_sid;
+  b = rp_chan_bucket( conn, rec_sid);
+  ch->next_sid = rp_chans_sid[b];
+  rp_chans_sid[b] = ch;
+}
+
+/** The server answered a create_chan
+ *  The oldest channel still waiting with that cid is the one answered.
+ *
+ * \param conn   The circuit
+ * \param cid    The client's id for it
+ * \param sid    Our new sid for it
+ * \param failed 1 when it was refused or never answered
+ */
+void rp_chan_answer( uint32_t conn, uint32_t cid, uint32_t sid, int failed) {
+  rp_chan_t *ch, *oldest;
+
+  oldest = NULL;
+  for( ch = rp_chans_cid[rp_chan_bucket( conn, cid)]; ch != NULL; ch = ch->next_cid) {
+    if( ch->conn == conn && ch->cid == cid && ch->state == RP_CHAN_WAITING)
+      oldest = ch;
+  }
+  if( oldest == NULL)
+    return;
+  oldest->sid   = sid;
+  oldest->state = failed ? RP_CHAN_FAILED : RP_CHAN_LIVE;
+}
+
+/** Find a channel by the sid it had in the capture
+ *  Returns NULL when the capture does not know it.
+ *
+ * \param conn    The circuit
+ * \param rec_sid The recorded sid
+ */
+rp_chan_t *rp_chan_by_sid( uint32_t conn, uint32_t rec_sid) {
+  rp_chan_t *ch;
+
+  for( ch = rp_chans_sid[rp_chan_bucket( conn, rec_sid)]; ch != NULL; ch = ch->next_sid) {
+    if( ch->conn == conn && ch->rec_sid == rec_sid)
+      return ch;
+  }
+  return NULL;
+}
+
+/** Make room in a buffer
+ *  Returns -1 when we are out of memory.
+ *
+ * \param buf  The buffer
+ * \param size Its size
+ * \param need How much we need it to hold
+ */
+int rp_grow( char **buf, int *size, int need) {
+  char *nb;
+  int ns;
+
+  if( need <= *size)
+    return 0;
+  ns = *size == 0 ? 4096 : *size;
+  while( ns < need)
+    ns *= 2;
+  nb = realloc( *buf, ns);
+  if( nb == NULL) {
+    fprintf( stderr, "Out of memory for %d bytes (rp_grow)\n", ns);
+    return -1;
+  }
+  *buf  = nb;
+  *size = ns;
+  return 0;
+}
+
+/** Note the requests in some messages we are about to send
+ *
+ * \param conn Circuit number or RP_UDP | datagram socket
+ * \param p    The messages
+ * \param len  Their length
+ *  Returns how many bytes made up whole messages.
+ */
+int rp_track( uint32_t conn, char *p, int len) {
+  e_socks_buffer_t b;
+  e_extended_message_header_t emh;
+  uint32_t size;
+
+  b.rbp = p;
+  b.wbp = p + len;
+  while( 1) {
+    size = e_msg_size( b.rbp, b.wbp);
+    if( size == 0 || b.rbp + size > b.wbp)
+      break;
+    read_extended_message_header( &b, &emh);
+    b.rbp += emh.plsize;
+    switch( emh.cmd) {
+    case 1:		// event_add: the first update answers it
+    case 15:		// read_notify
+    case 19:		// write_notify
+      rp_req_add( conn, emh.cmd, emh.p2, emh.dtype);
+      break;
+    case 6:		// search
+    case 18:		// create_chan
+      rp_req_add( conn, emh.cmd, emh.p1, emh.dtype);
+      break;
+    case 23:		// echo
+      rp_req_add( conn, emh.cmd, 0, 0);
+      break;
+    }
+  }
+  return b.rbp - p;
+}
+
+/** Send what a connection has waiting
+ *
+ * \param c The connection
+ */
+void rp_flush( rp_conn_t *c) {
+  int n;
+
+  if( c->olen == 0 || c->state == RP_CONNECTING || c->state == RP_DEAD)
+    return;
+
+  n = send( c->sock, c->out, c->olen, MSG_NOSIGNAL);
+  if( n == -1) {
+    if( errno != EAGAIN && errno != EWOULDBLOCK) {
+      close( c->sock);
+      c->state = RP_DEAD;
+    }
+    return;
+  }
+  rp_bytes_out += n;
+  memmove( c->out, c->out + n, c->olen - n);
+  c->olen -= n;
+}
+
+/** A recorded circuit opens
+ *
+ * \param conn Its number
+ */
+void rp_open( uint32_t conn) {
+  rp_conn_t *c;
+  int flags;
+
+  c = rp_conns + conn;
+  c->sock = socket( PF_INET, SOCK_STREAM, 0);
+  if( c->sock == -1) {
+    fprintf( stderr, "No socket for circuit %u: %s (rp_open)\n", conn, strerror( errno));
+    c->state = RP_DEAD;
+    return;
+  }
+  flags = fcntl( c->sock, F_GETFL, 0);
+  fcntl( c->sock, F_SETFL, flags | O_NONBLOCK);
+  c->state = RP_CONNECTING;
+  if( connect( c->sock, (struct sockaddr *)&rp_addr, sizeof( rp_addr)) == -1 && errno != EINPROGRESS) {
+    close( c->sock);
+    c->state = RP_DEAD;
+    rp_refused++;
+  }
+}
+
+/** Send what a circuit can of its hold queue
+ *  Messages naming a sid go out with the sid we were given for the
+ *  channel; the queue stops at one whose create_chan is still waiting.
+ *
+ * \param conn The circuit
+ */
+void rp_release( uint32_t conn) {
+  rp_conn_t *c;
+  rp_chan_t *ch;
+  e_socks_buffer_t b;
+  e_extended_message_header_t emh;
+  uint32_t nsid;
+  char *msg;
+
+  c = rp_conns + conn;
+  if( c->hlen == 0 || c->state == RP_DEAD)
+    return;
+
+  b.rbp = c->hold;
+  b.wbp = c->hold + c->hlen;
+  while( b.rbp < b.wbp) {
+    msg = b.rbp;
+    read_extended_message_header( &b, &emh);
+    switch( emh.cmd) {
+    case 1:		// event_add
+    case 2:		// event_cancel
+    case 4:		// write
+    case 12:		// clear_channel
+    case 15:		// read_notify
+    case 19:		// write_notify
+      ch = rp_chan_by_sid( conn, emh.p1);
+      if( ch != NULL && ch->state == RP_CHAN_WAITING) {
+	b.rbp = msg;
+	goto blocked;
+      }
+      if( ch != NULL && ch->state == RP_CHAN_LIVE) {
+	//
+	// p1 is at the same place in both kinds of header
+	//
+	nsid = htonl( ch->sid);
+	memcpy( msg + 8, &nsid, sizeof( nsid));
+	rp_remapped++;
+      } else {
+	rp_unmapped++;
+      }
+      break;
+    }
+    b.rbp += emh.plsize;
+    if( rp_grow( &c->out, &c->osize, c->olen + (b.rbp - msg)) == -1)
+      return;
+    rp_track( conn, msg, b.rbp - msg);
+    memcpy( c->out + c->olen, msg, b.rbp - msg);
+    c->olen += b.rbp - msg;
+  }
+
+ blocked:
+  memmove( c->hold, b.rbp, b.wbp - b.rbp);
+  c->hlen = b.wbp - b.rbp;
+  rp_flush( c);
+}
+
+/** Give up on requests nobody answered
+ *
+ * \param now The time
+ */
+void rp_timeouts( uint64_t now) {
+  rp_req_t **pp, *rq;
+  int b;
+  int k;
+
+  for( b=0; b<RP_REQ_BUCKETS; b++) {
+    pp = rp_reqs + b;
+    while( *pp != NULL) {
+      rq = *pp;
+      if( now - rq->t0 < rp_tmo_ms * 1000000ULL) {
+	pp = &rq->next;
+	continue;
+      }
+      *pp = rq->next;
+      if( rq->cmd == 6 && rq->dtype != 10)
+	rp_unanswered++;		// DONT_REPLY: nobody has the name
+      else
+	rp_stats[rq->cmd].timeouts++;
+      if( rq->cmd == 18)
+	rp_chan_answer( rq->conn, rq->id, 0, 1);
+      rp_conn_of( rq->conn)->waiting--;
+      rq->next = rp_req_free;
+      rp_req_free = rq;
+    }
+  }
+
+  //
+  // Channels given up on no longer hold their circuits up
+  //
+  for( k=0; k<rp_nconns; k++) {
+    if( rp_conns[k].hlen > 0)
+      rp_release( k);
+  }
+}
+
+/** Bytes a recorded circuit sent
+ *
+ * \param conn Its number
+ * \param data The bytes
+ * \param len  How many
+ */
+void rp_tcp( uint32_t conn, char *data, int len) {
+  rp_conn_t *c;
+  e_socks_buffer_t b;
+  e_extended_message_header_t emh;
+  uint32_t size;
+  int n;
+
+  c = rp_conns + conn;
+  if( c->state == RP_UNUSED)
+    rp_open( conn);		// the capture started after it did
+  if( c->state == RP_DEAD)
+    return;
+
+  //
+  // Messages span reads: keep the tail until the rest comes
+  //
+  if( rp_grow( &c->pend, &c->psize, c->plen + len) == -1)
+    return;
+  memcpy( c->pend + c->plen, data, len);
+  c->plen += len;
+
+  //
+  // Whole messages join the hold queue, each create_chan making a
+  // channel for the capture's sid record that follows it
+  //
+  b.rbp = c->pend;
+  b.wbp = c->pend + c->plen;
+  while( 1) {
+    size = e_msg_size( b.rbp, b.wbp);
+    if( size == 0 || b.rbp + size > b.wbp)
+      break;
+    read_extended_message_header( &b, &emh);
+    b.rbp += emh.plsize;
+    if( emh.cmd == 18)
+      rp_chan_new( conn, emh.p1);
+  }
+  n = b.rbp - c->pend;
+  if( rp_grow( &c->hold, &c->hsize, c->hlen + n) == -1)
+    return;
+  memcpy( c->hold + c->hlen, c->pend, n);
+  c->hlen += n;
+  memmove( c->pend, c->pend + n, c->plen - n);
+  c->plen -= n;
+
+  rp_release( conn);
+}
+
+/** A recorded datagram
+ *
+ * \param addr Who sent it
+ * \param port From where
+ * \param data The datagram
+ * \param len  Its length
+ */
+void rp_udp( uint32_t addr, uint16_t port, char *data, int len) {
+  rp_conn_t *c;
+  uint32_t k;
+  int n;
+
+  k = ((addr * 0x9e3779b1) ^ port) % rp_nudp;
+  c = rp_conns + rp_nconns + k;
+  rp_track( RP_UDP | k, data, len);
+  n = sendto( c->sock, data, len, 0, (struct sockaddr *)&rp_addr, sizeof( rp_addr));
+  if( n > 0)
+    rp_bytes_out += n;
+}
+
+/** A recorded NOTIFY: raise it again
+ *
+ * \param data Channel name then payload
+ * \param len  Their length
+ */
+void rp_notify( char *data, int len) {
+  const char *params[2];
+  PGresult *pgr;
+
+  if( rp_pg == NULL || len < 2 || data[len-1] != 0) {
+    rp_notifies_skipped++;
+    return;
+  }
+  params[0] = data;
+  params[1] = data + strlen( data) + 1;
+  pgr = PQexecParams( rp_pg, "SELECT pg_notify( $1, $2)", 2, NULL, params, NULL, NULL, 0);
+  if( PQresultStatus( pgr) != PGRES_TUPLES_OK)
+    fprintf( stderr, "pg_notify failed: %s", PQerrorMessage( rp_pg));
+  else
+    rp_notifies++;
+  PQclear( pgr);
+}
+
+/** One answer from the server
+ *
+ * \param conn Who got it
+ * \param emh  Its header
+ */
+void rp_message( uint32_t conn, e_extended_message_header_t *emh) {
+  switch( emh->cmd) {
+  case 1:		// monitor update (the first answers the event_add)
+    rp_updates++;
+    rp_req_done( conn, 1, emh->p2, emh->p1 != 1);
+    break;
+  case 6:		// search: found it
+    rp_found++;
+    rp_req_done( conn, 6, emh->p2, 0);
+    break;
+  case 14:		// search: not here
+    rp_not_found++;
+    rp_req_done( conn, 6, emh->p2, 0);
+    break;
+  case 15:		// read_notify
+  case 19:		// write_notify
+    rp_req_done( conn, emh->cmd, emh->p2, emh->p1 != 1);
+    break;
+  case 18:		// create_chan: what was waiting for it can go now
+    rp_req_done( conn, 18, emh->p1, 0);
+    rp_chan_answer( conn, emh->p1, emh->p2, 0);
+    rp_release( conn);
+    break;
+  case 26:		// create_chan failed
+    rp_req_done( conn, 18, emh->p1, 1);
+    rp_chan_answer( conn, emh->p1, 0, 1);
+    rp_release( conn);
+    break;
+  case 23:		// echo
+    rp_req_done( conn, 23, 0, 0);
+    break;
+  }
+}
+
+/** Read what the server sent a connection
+ *
+ * \param k The connection
+ */
+void rp_input( int k) {
+  rp_conn_t *c;
+  e_extended_message_header_t emh;
+  uint32_t conn;
+  uint32_t size;
+  int n;
+
+  c = rp_conns + k;
+  conn = k < rp_nconns ? k : RP_UDP | (k - rp_nconns);
+  n = recv( c->sock, c->in.wbp, (char *)c->in.buf + c->in.bufsize - c->in.wbp, 0);
+  if( n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    if( !c->udp) {
+      close( c->sock);
+      c->state = RP_DEAD;
+    }
+    return;
+  }
+  if( n == -1)
+    return;
+  rp_bytes_in += n;
+  c->in.wbp += n;
+
+  size = 0;
+  while( 1) {
+    size = e_msg_size( c->in.rbp, c->in.wbp);
+    if( size == 0 || c->in.rbp + size > c->in.wbp)
+      break;
+    read_extended_message_header( &c->in, &emh);
+    c->in.rbp += emh.plsize;
+    rp_message( conn, &emh);
+  }
+
+  if( c->udp || c->in.rbp == c->in.wbp) {
+    c->in.rbp = c->in.buf;
+    c->in.wbp = c->in.buf;
+  } else if( c->in.rbp != c->in.buf) {
+    memmove( c->in.buf, c->in.rbp, c->in.wbp - c->in.rbp);
+    c->in.wbp -= c->in.rbp - (char *)c->in.buf;
+    c->in.rbp  = c->in.buf;
+  }
+  if( !c->udp && (char *)c->in.buf + c->in.bufsize == c->in.wbp && size > c->in.bufsize) {
+    //
+    // A big array: make room for it
+    //
+    n = c->in.wbp - (char *)c->in.buf;
+    if( rp_grow( (char **)&c->in.buf, &c->in.bufsize, size) == -1) {
+      close( c->sock);
+      c->state = RP_DEAD;
+      return;
+    }
+    c->in.rbp = c->in.buf;
+    c->in.wbp = (char *)c->in.buf + n;
+  }
+}
+
+/** One time around the poll loop
+ *  Returns the number of connections still open.
+ *
+ * \param wait_ms How long poll may wait
+ */
+int rp_poll( int wait_ms) {
+  rp_conn_t *c;
+  socklen_t len;
+  uint64_t now;
+  int open;
+  int err;
+  int k;
+
+  open = 0;
+  now  = rp_now();
+  for( k=0; k<rp_nconns + rp_nudp; k++) {
+    c = rp_conns + k;
+    if( c->state == RP_CLOSING && c->olen == 0 && c->hlen == 0 && (c->waiting == 0 || now - c->closing > rp_tmo_ms * 1000000ULL)) {
+      close( c->sock);
+      c->state = RP_DEAD;
+    }
+    rp_pfds[k].fd      = c->state == RP_UNUSED || c->state == RP_DEAD ? -1 : c->sock;
+    rp_pfds[k].events  = POLLIN;
+    rp_pfds[k].revents = 0;
+    if( c->state == RP_CONNECTING || c->olen > 0)
+      rp_pfds[k].events |= POLLOUT;
+    if( rp_pfds[k].fd != -1 && !c->udp)
+      open++;
+  }
+
+  if( poll( rp_pfds, rp_nconns + rp_nudp, wait_ms) <= 0)
+    return open;
+
+  for( k=0; k<rp_nconns + rp_nudp; k++) {
+    c = rp_conns + k;
+    if( rp_pfds[k].revents == 0)
+      continue;
+
+    if( c->state == RP_CONNECTING) {
+      err = 0;
+      len = sizeof( err);
+      getsockopt( c->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+      if( err != 0) {
+	close( c->sock);
+	c->state = RP_DEAD;
+	rp_refused++;
+	continue;
+      }
+      c->state = c->closing ? RP_CLOSING : RP_OPEN;
+    }
+    if( rp_pfds[k].revents & POLLIN)
+      rp_input( k);
+    if( c->state != RP_DEAD && !c->udp && (rp_pfds[k].revents & (POLLERR | POLLHUP))) {
+      close( c->sock);
+      c->state = RP_DEAD;
+    }
+    rp_flush( c);
+  }
+  return open;
+}
+
+/** Compare latencies for qsort
+ */
+int rp_cmp( const void *a, const void *b) {
+  uint32_t x, y;
+
+  x = *(const uint32_t *)a;
+  y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/** A percentile of a command's latencies in microseconds
+ *  (the samples must be sorted)
+ *
+ * \param st The command
+ * \param p  Which percentile
+ */
+uint32_t rp_pct( rp_stat_t *st, double p) {
+  int i;
+
+  if( st->nsamples == 0)
+    return 0;
+  i = p / 100.0 * st->nsamples;
+  if( i >= st->nsamples)
+    i = st->nsamples - 1;
+  return st->samples[i];
+}
+
+/** Write the results, as a table or for -B to read back
+ *
+ * \param f    Where
+ * \param secs How long the replay took
+ */
+void rp_print( FILE *f, double secs) {
+  rp_stat_t *st;
+  int cmd;
+
+  for( cmd=0; cmd<E_CMDS; cmd++) {
+    st = rp_stats + cmd;
+    if( st->sent == 0)
+      continue;
+    fprintf( f, "%-14s %10lu %10lu %10.0f %8lu %8lu %9u %9u %9u %9u %9u\n",
+	     e_cmd_names[cmd], st->sent, st->n, st->n / secs, st->errors, st->timeouts,
+	     rp_pct( st, 50), rp_pct( st, 90), rp_pct( st, 99), rp_pct( st, 99.9), rp_pct( st, 100));
+  }
+}
+
+/** Compare with the results of another run
+ *
+ * \param path Saved with -o
+ * \param secs How long this replay took
+ */
+void rp_compare( char *path, double secs) {
+  FILE *f;
+  rp_stat_t *st;
+  char name[64];
+  unsigned long sent, n, errors, timeouts;
+  double rate;
+  unsigned int p50, p90, p99, p999, max;
+  int cmd;
+
+  f = fopen( path, "r");
+  if( f == NULL) {
+    fprintf( stderr, "Could not read %s: %s\n", path, strerror( errno));
+    return;
+  }
+  printf( "\ncompared with %s (change in per sec and latency; + is slower for latency)\n", path);
+  printf( "%-14s %10s %10s %8s %9s %9s %9s %9s\n", "command", "per sec", "was", "change", "p50 us", "change", "p99 us", "change");
+  while( fscanf( f, "%63s %lu %lu %lf %lu %lu %u %u %u %u %u", name, &sent, &n, &rate, &errors, &timeouts, &p50, &p90, &p99, &p999, &max) == 11) {
+    for( cmd=0; cmd<E_CMDS; cmd++) {
+      if( strcmp( name, e_cmd_names[cmd]) == 0)
+	break;
+    }
+    if( cmd == E_CMDS)
+      continue;
+    st = rp_stats + cmd;
+    printf( "%-14s %10.0f %10.0f %7.1f%% %9u %8.1f%% %9u %8.1f%%\n", name,
+	    st->n / secs, rate, rate > 0 ? 100.0 * (st->n / secs - rate) / rate : 0.0,
+	    rp_pct( st, 50), p50 > 0 ? 100.0 * ((double)rp_pct( st, 50) - p50) / p50 : 0.0,
+	    rp_pct( st, 99), p99 > 0 ? 100.0 * ((double)rp_pct( st, 99) - p99) / p99 : 0.0);
+  }
+  fclose( f);
+}
+
+/** Tell them how it went
+ *
+ * \param secs How long the replay took
+ * \param span How long the capture took
+ * \param out  Save the numbers here for -B (NULL for not)
+ * \param base Compare with numbers saved before (NULL for not)
+ */
+void rp_report( double secs, double span, char *out, char *base) {
+  FILE *f;
+  int cmd;
+
+  for( cmd=0; cmd<E_CMDS; cmd++) {
+    if( rp_stats[cmd].nsamples > 0)
+      qsort( rp_stats[cmd].samples, rp_stats[cmd].nsamples, sizeof( *rp_stats[cmd].samples), rp_cmp);
+  }
+
+  printf( "%-14s %10s %10s %10s %8s %8s %9s %9s %9s %9s %9s\n",
+	  "command", "sent", "answered", "per sec", "errors", "timeouts", "p50 us", "p90 us", "p99 us", "p99.9 us", "max us");
+  rp_print( stdout, secs);
+  printf( "captured over %.2f seconds, replayed in %.2f (%.2f times as fast)\n", span, secs, secs > 0 ? span / secs : 0.0);
+  printf( "searches: %lu found, %lu not found, %lu for names nobody has\n", rp_found, rp_not_found, rp_unanswered);
+  printf( "monitor updates: %lu (%.0f per sec)\n", rp_updates, rp_updates / secs);
+  printf( "notifies: %lu raised, %lu skipped\n", rp_notifies, rp_notifies_skipped);
+  printf( "circuits refused: %lu\n", rp_refused);
+  printf( "sids: %lu messages sent with the new sid, %lu with the recorded one\n", rp_remapped, rp_unmapped);
+  printf( "bytes: %lu out (%.1f MB/s), %lu in (%.1f MB/s)\n", rp_bytes_out, rp_bytes_out / secs / 1e6, rp_bytes_in, rp_bytes_in / secs / 1e6);
+
+  if( out != NULL) {
+    f = fopen( out, "w");
+    if( f == NULL) {
+      fprintf( stderr, "Could not write %s: %s\n", out, strerror( errno));
+    } else {
+      rp_print( f, secs);
+      fclose( f);
+    }
+  }
+  if( base != NULL)
+    rp_compare( base, secs);
+}
+
+/** Make the connection table and the datagram sockets
+ *  Circuit numbers are dense from 1 so they index the table.
+ *
+ * \param nconns Highest circuit number plus one
+ */
+void rp_start( int nconns) {
+  rp_conn_t *c;
+  int flags;
+  int k;
+
+  rp_nconns = nconns;
+  rp_conns = calloc( rp_nconns + rp_nudp, sizeof( *rp_conns));
+  rp_pfds  = calloc( rp_nconns + rp_nudp, sizeof( *rp_pfds));
+  if( rp_conns == NULL || rp_pfds == NULL) {
+    fprintf( stderr, "Out of memory for %d connections (rp_start)\n", rp_nconns + rp_nudp);
+    exit( -1);
+  }
+
+  for( k=0; k<rp_nconns + rp_nudp; k++) {
+    c = rp_conns + k;
+    c->sock = -1;
+    c->in.bufsize = RP_BUFSIZE;
+    c->in.buf     = malloc( RP_BUFSIZE);
+    c->in.rbp     = c->in.buf;
+    c->in.wbp     = c->in.buf;
+    if( c->in.buf == NULL) {
+      fprintf( stderr, "Out of memory for connection %d (rp_start)\n", k);
+      exit( -1);
+    }
+    if( k < rp_nconns)
+      continue;
+
+    c->udp   = 1;
+    c->state = RP_OPEN;
+    c->sock  = socket( PF_INET, SOCK_DGRAM, 0);
+    if( c->sock == -1) {
+      fprintf( stderr, "Could not make datagram socket: %s (rp_start)\n", strerror( errno));
+      exit( -1);
+    }
+    flags = fcntl( c->sock, F_GETFL, 0);
+    fcntl( c->sock, F_SETFL, flags | O_NONBLOCK);
+  }
+}
+
+int main( int argc, char **argv) {
+  char *host = "127.0.0.1";	// the server
+  int port = 5064;		// and its port
+  char *out = NULL;		// save our numbers here (-o)
+  char *base = NULL;		// and compare with these (-B)
+  char *conninfo = NULL;	// database to raise NOTIFYs on (-D)
+  struct stat sb;
+  e_cap_file_t *hdr;
+  e_cap_rec_t *rec;
+  char *cap, *p, *end;
+  uint64_t t0, now, due, last_tmo, span;
+  uint32_t ids[2];		// E_CAP_SID: cid and recorded sid
+  uint32_t maxconn;
+  unsigned long nrecs;
+  int fd;
+  int c;
+
+  while( (c = getopt( argc, argv, "h:P:s:T:u:o:B:D:")) != -1) {
+    switch( c) {
+    case 'h': host      = optarg;		break;
+    case 'P': port      = atoi( optarg);	break;
+    case 's': rp_speed  = atof( optarg);	break;
+    case 'T': rp_tmo_ms = atoi( optarg);	break;
+    case 'u': rp_nudp   = atoi( optarg);	break;
+    case 'o': out       = optarg;		break;
+    case 'B': base      = optarg;		break;
+    case 'D': conninfo  = optarg;		break;
+    default:
+      fprintf( stderr, "Usage: %s [-h host] [-P port] [-s speed (0 for flat out)] [-T timeout_ms] [-u udp_sockets] [-o save_results] [-B compare_with] [-D conninfo] capture_file\n", argv[0]);
+      exit( -1);
+    }
+  }
+  if( optind >= argc || rp_nudp < 1 || rp_speed < 0) {
+    fprintf( stderr, "Usage: %s [-h host] [-P port] [-s speed (0 for flat out)] [-T timeout_ms] [-u udp_sockets] [-o save_results] [-B compare_with] [-D conninfo] capture_file\n", argv[0]);
+    exit( -1);
+  }
+
+  memset( &rp_addr, 0, sizeof( rp_addr));
+  rp_addr.sin_family = AF_INET;
+  rp_addr.sin_port   = htons( port);
+  if( inet_aton( host, &rp_addr.sin_addr) == 0) {
+    fprintf( stderr, "Bad server address %s\n", host);
+    exit( -1);
+  }
+
+  if( conninfo != NULL) {
+    rp_pg = PQconnectdb( conninfo);
+    if( PQstatus( rp_pg) != CONNECTION_OK) {
+      fprintf( stderr, "Could not connect to the database: %s", PQerrorMessage( rp_pg));
+      exit( -1);
+    }
+  }
+
+  //
+  // Map the capture and look it over
+  //
+  fd = open( argv[optind], O_RDONLY);
+  if( fd == -1 || fstat( fd, &sb) == -1) {
+    perror( argv[optind]);
+    exit( -1);
+  }
+  if( sb.st_size < sizeof( e_cap_file_t)) {
+    fprintf( stderr, "%s is not a capture\n", argv[optind]);
+    exit( -1);
+  }
+  cap = mmap( NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if( cap == MAP_FAILED) {
+    perror( "mmap");
+    exit( -1);
+  }
+  hdr = (e_cap_file_t *)cap;
+  if( hdr->magic != E_CAP_MAGIC || hdr->version != E_CAP_VERSION) {
+    fprintf( stderr, "%s is not a version %d capture from a machine like this one\n", argv[optind], E_CAP_VERSION);
+    exit( -1);
+  }
+
+  end = cap + sb.st_size;
+  maxconn = 0;
+  nrecs = 0;
+  span = 0;
+  for( p = cap + sizeof( *hdr); p + sizeof( *rec) <= end; p += sizeof( *rec) + rec->len) {
+    rec = (e_cap_rec_t *)p;
+    if( p + sizeof( *rec) + rec->len > end)
+      break;		// cut short while it was being written
+    if( rec->conn > maxconn)
+      maxconn = rec->conn;
+    span = rec->t;
+    nrecs++;
+  }
+  end = p;
+  fprintf( stderr, "%lu records, %u circuits over %.2f seconds\n", nrecs, maxconn, span / 1e9);
+
+  //
+  // Play it
+  //
+  rp_start( maxconn + 1);
+  t0 = rp_now();
+  last_tmo = t0;
+  for( p = cap + sizeof( *hdr); p < end; p += sizeof( *rec) + rec->len) {
+    rec = (e_cap_rec_t *)p;
+
+    due = rp_speed > 0 ? t0 + rec->t / rp_speed : 0;
+    for( now = rp_now(); now < due; now = rp_now()) {
+      rp_poll( (due - now) / 1000000 > 10 ? 10 : (due - now) / 1000000);
+    }
+    if( rp_speed == 0)
+      rp_poll( 0);
+    if( now - last_tmo > 100000000ULL) {
+      rp_timeouts( now);
+      last_tmo = now;
+    }
+
+    switch( rec->kind) {
+    case E_CAP_OPEN:
+      rp_open( rec->conn);
+      break;
+    case E_CAP_TCP:
+      rp_tcp( rec->conn, p + sizeof( *rec), rec->len);
+      break;
+    case E_CAP_CLOSE:
+      if( rp_conns[rec->conn].state == RP_OPEN || rp_conns[rec->conn].state == RP_CONNECTING) {
+	rp_conns[rec->conn].closing = rp_now();
+	if( rp_conns[rec->conn].state == RP_OPEN)
+	  rp_conns[rec->conn].state = RP_CLOSING;
+      }
+      break;
+    case E_CAP_UDP:
+      rp_udp( rec->addr, rec->port, p + sizeof( *rec), rec->len);
+      break;
+    case E_CAP_NOTIFY:
+      rp_notify( p + sizeof( *rec), rec->len);
+      break;
+    case E_CAP_SID:
+      if( rec->len == 2 * sizeof( uint32_t)) {
+	memcpy( ids, p + sizeof( *rec), sizeof( ids));
+	rp_chan_recorded( rec->conn, ids[0], ids[1]);
+      }
+      break;
+    }
+  }
+
+  //
+  // Wait for the last answers
+  //
+  now = rp_now();
+  due = now + rp_tmo_ms * 1000000ULL;
+  while( now < due) {
+    rp_poll( 10);
+    now = rp_now();
+    if( now - last_tmo > 100000000ULL) {
+      rp_timeouts( now);
+      last_tmo = now;
+    }
+    for( c=0; c<rp_nconns + rp_nudp && rp_conns[c].waiting == 0 && rp_conns[c].hlen == 0; c++);
+    if( c == rp_nconns + rp_nudp)
+      break;
+  }
+  rp_timeouts( rp_now() + rp_tmo_ms * 1000000ULL);
+
+  rp_report( (now - t0) / 1e9, span / 1e9, out, base);
+  return 0;
+}
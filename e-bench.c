@@ -0,0 +1,394 @@
+/*! \file e-bench.c
+ *  \brief Microbenchmarks for e's protocol encoders and decoders
+ *  \date 2026
+ *  \copyright All Rights Reserved
+ *
+ * The per message hot path, one function at a time: create_message,
+ * mk_dbr_struct, pack_dbr_data, read_extended_message_header, swapd,
+ * the bulk swap kernels and format_dbr.  The dbr functions run over all
+ * 35 dbr types; format_dbr gets results shaped like get_values' (a text
+ * value, binary time stamp and a binary float8[] for waveforms of 1 up
+ * to 1M elements) built with libpq's PQmakeEmptyPGresult and PQsetvalue
+ * so no database is needed.
+ *
+ * Each benchmark runs once to warm up (arena and scratch growth happen
+ * there) and then doubles its iterations until it has run for -t ms.  We
+ * report ns/op, allocations/op (we count malloc, calloc and realloc by
+ * standing in for them) and, where it means something, GB/s.
+ *
+ * Like ca-loadgen and ca-replay we include e.c for the real thing.
+ */
+
+#define E_NO_MAIN
+#include "e.c"
+
+extern void *__libc_malloc( size_t size);
+extern void *__libc_calloc( size_t n, size_t size);
+extern void *__libc_realloc( void *p, size_t size);
+
+static unsigned long bm_allocs = 0;		//!< allocations so far
+static uint64_t bm_target_ns = 100000000;	//!< how long each benchmark runs (-t)
+static char *bm_filter = NULL;			//!< only benchmarks whose name has this in it (-f)
+static int bm_max_n = 1 << 20;			//!< biggest waveform and swap (-n)
+
+static e_socks_buffer_t bm_out;		//!< the output arena our messages go into
+static e_response_t bm_r;		//!< and the response that points to it
+static e_dbr_meta_t bm_meta;		//!< limits and precision for the dbr structures
+static char *bm_buf = NULL;		//!< somewhere to encode into
+static int bm_dtype;			//!< the dbr type being run
+static int bm_n;			//!< the payload size or element count being run
+static PGresult *bm_pgr;		//!< the result format_dbr formats
+static double bm_bytes;			//!< bytes each op moves (set in the warm up, 0 for no GB/s)
+static volatile unsigned long long bm_sink;	//!< keeps the compiler from throwing away what we compute
+static void (*bm_kernel)( void *dst, const void *src, int n);	//!< the swap kernel being run
+
+//
+// Count allocations by standing in for the allocator
+//
+void *malloc( size_t size) {
+  bm_allocs++;
+  return __libc_malloc( size);
+}
+
+void *calloc( size_t n, size_t size) {
+  bm_allocs++;
+  return __libc_calloc( n, size);
+}
+
+void *realloc( void *p, size_t size) {
+  bm_allocs++;
+  return __libc_realloc( p, size);
+}
+
+/** Monotonic nanoseconds
+ */
+uint64_t bm_now() {
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Run a benchmark and print what it did
+ *
+ * \param name  The benchmark
+ * \param type  What it ran on (a dbr type or kernel)
+ * \param size  Payload size or element count (-1 for none)
+ * \param fn    Runs the benchmark so many times
+ */
+void bm_run( char *name, char *type, int size, void (*fn)( long)) {
+  uint64_t t0, t;
+  unsigned long a0;
+  long iters;
+  char full[128];
+
+  snprintf( full, sizeof( full), "%s/%s", name, type);
+  if( bm_filter != NULL && strstr( full, bm_filter) == NULL)
+    return;
+
+  bm_bytes = 0;
+  fn( 1);
+
+  for( iters = 1; ; iters *= 2) {
+    a0 = bm_allocs;
+    t0 = bm_now();
+    fn( iters);
+    t  = bm_now() - t0;
+    if( t >= bm_target_ns || iters >= (1L << 40))
+      break;
+  }
+
+  printf( "%-28s %-22s %8d %12.1f %10.2f", name, type, size, (double)t / iters, (double)(bm_allocs - a0) / iters);
+  if( bm_bytes > 0)
+    printf( " %8.2f", bm_bytes * iters / t);
+  printf( "\n");
+  fflush( stdout);
+}
+
+/** create_message into an emptied arena
+ *
+ * \param iters How many times
+ */
+void bm_create_message( long iters) {
+  long i;
+
+  for( i=0; i<iters; i++) {
+    bm_out.ohead = 0;
+    bm_out.otail = 0;
+    create_message( &bm_r, 15, bm_n, 6, 1, 1, 2);
+  }
+  bm_bytes = bm_r.bufsize;
+}
+
+/** mk_dbr_struct for one dbr type
+ *
+ * \param iters How many times
+ */
+void bm_mk_dbr_struct( long iters) {
+  long i;
+
+  for( i=0; i<iters; i++)
+    mk_dbr_struct( bm_buf, bm_dtype, &bm_meta);
+}
+
+/** pack_dbr_data for one dbr type
+ *
+ * \param iters How many times
+ */
+void bm_pack_dbr_data( long iters) {
+  long i;
+
+  for( i=0; i<iters; i++)
+    pack_dbr_data( bm_buf, bm_dtype, "12.5");
+}
+
+/** read_extended_message_header over a buffer of headers
+ *  bm_n is 0 for plain headers, 1 for extended ones.
+ *
+ * \param iters How many times
+ */
+void bm_read_header( long iters) {
+  e_socks_buffer_t b;
+  e_extended_message_header_t emh;
+  int hsize;
+  long i;
+
+  hsize = bm_n ? sizeof( e_extended_message_header_t) : sizeof( e_message_header_t);
+  b.rbp = bm_buf;
+  for( i=0; i<iters; i++) {
+    if( b.rbp >= bm_buf + 64 * hsize)
+      b.rbp = bm_buf;
+    read_extended_message_header( &b, &emh);
+    bm_sink += emh.p2;
+  }
+}
+
+/** swapd
+ *
+ * \param iters How many times
+ */
+void bm_swapd( long iters) {
+  long i;
+
+  for( i=0; i<iters; i++)
+    bm_sink += swapd( (double)i);
+}
+
+/** A bulk swap kernel over bm_n elements of bm_dtype bytes
+ *
+ * \param iters How many times
+ */
+void bm_swap( long iters) {
+  long i;
+
+  for( i=0; i<iters; i++)
+    bm_kernel( bm_buf, bm_buf, bm_n);
+  bm_bytes = (double)bm_n * bm_dtype;
+}
+
+/** format_dbr on bm_pgr into an emptied arena
+ *
+ * \param iters How many times
+ */
+void bm_format_dbr( long iters) {
+  long i;
+
+  for( i=0; i<iters; i++) {
+    bm_out.ohead = 0;
+    bm_out.otail = 0;
+    format_dbr( bm_pgr, &bm_meta, &bm_r, 15, bm_dtype, bm_n < 0 ? 1 : 0, 1, 2);
+  }
+  bm_bytes = bm_r.bufsize;
+}
+
+/** A result like get_values gives us
+ *  A text value, binary eepoch and ensec and, for waveforms, the
+ *  elements as a binary float8[].
+ *
+ * \param n Number of waveform elements (-1 for a scalar)
+ */
+PGresult *bm_result( int n) {
+  static PGresAttDesc attrs[4] = {
+    { "value",  0, 0, 0,   25, -1, -1},
+    { "eepoch", 0, 0, 1,   23,  4, -1},
+    { "ensec",  0, 0, 1,   23,  4, -1},
+    { "vals",   0, 0, 1, 1022, -1, -1}
+  };
+  PGresult *pgr;
+  uint32_t u;
+  int32_t hdr[5];
+  int32_t len;
+  char *vals;
+  char *p;
+  unsigned long long bits;
+  int i;
+
+  pgr = PQmakeEmptyPGresult( NULL, PGRES_TUPLES_OK);
+  if( pgr == NULL || !PQsetResultAttrs( pgr, 4, attrs)) {
+    fprintf( stderr, "Could not make a result (bm_result)\n");
+    exit( -1);
+  }
+  PQsetvalue( pgr, 0, 0, "12.5", 4);
+  u = htonl( 1700000000);
+  PQsetvalue( pgr, 0, 1, (char *)&u, sizeof( u));
+  u = htonl( 500000000);
+  PQsetvalue( pgr, 0, 2, (char *)&u, sizeof( u));
+
+  if( n < 0) {
+    PQsetvalue( pgr, 0, 3, NULL, -1);
+    return pgr;
+  }
+
+  //
+  // ndim, has nulls, element type, then size and lower bound, then the elements
+  //
+  vals = malloc( sizeof( hdr) + (size_t)n * (sizeof( len) + sizeof( double)));
+  if( vals == NULL) {
+    fprintf( stderr, "Out of memory for a %d element waveform (bm_result)\n", n);
+    exit( -1);
+  }
+  hdr[0] = htonl( 1);
+  hdr[1] = htonl( 0);
+  hdr[2] = htonl( 701);
+  hdr[3] = htonl( n);
+  hdr[4] = htonl( 1);
+  memcpy( vals, hdr, sizeof( hdr));
+  p = vals + sizeof( hdr);
+  len = htonl( sizeof( double));
+  for( i=0; i<n; i++) {
+    memcpy( p, &len, sizeof( len));
+    bits = swapd( i * 0.5);
+    memcpy( p + sizeof( len), &bits, sizeof( bits));
+    p += sizeof( len) + sizeof( double);
+  }
+  PQsetvalue( pgr, 0, 3, vals, p - vals);
+  free( vals);
+  return pgr;
+}
+
+int main( int argc, char **argv) {
+  static int msg_sizes[] = { 0, 8, 40, 1024, 0x4000, 0x4008, 1 << 20};
+  static int wave_sizes[] = { 1, 1024, 16384, 1 << 20};
+  struct {
+    char *name;
+    void (*k16)( void *dst, const void *src, int n);
+    void (*k32)( void *dst, const void *src, int n);
+    void (*k64)( void *dst, const void *src, int n);
+  } kernels[3];
+  char type[32];
+  int nkernels;
+  int i, k, s;
+  int c;
+
+  while( (c = getopt( argc, argv, "t:f:n:")) != -1) {
+    switch( c) {
+    case 't':
+      bm_target_ns = atoi( optarg) * 1000000ULL;
+      break;
+    case 'f':
+      bm_filter = optarg;
+      break;
+    case 'n':
+      bm_max_n = atoi( optarg);
+      break;
+    default:
+      fprintf( stderr, "Usage: %s [-t ms_per_benchmark] [-f name_filter] [-n max_elements]\n", argv[0]);
+      exit( -1);
+    }
+  }
+
+  e_swap_init();
+
+  bm_out.obufsize = 4096;
+  bm_out.obuf     = malloc( bm_out.obufsize);
+  bm_r.out        = &bm_out;
+  bm_buf          = malloc( (size_t)bm_max_n * sizeof( double) + 4096);
+  if( bm_out.obuf == NULL || bm_buf == NULL) {
+    fprintf( stderr, "Out of memory\n");
+    exit( -1);
+  }
+  memset( bm_buf, 0, (size_t)bm_max_n * sizeof( double) + 4096);
+  e_dbr_meta( &bm_meta, 1700000000, 500000000, "100.5", "-7.25", 0, 0, 3);
+
+  printf( "swap kernels: %s\n", e_swap_kernels);
+  printf( "%-28s %-22s %8s %12s %10s %8s\n", "benchmark", "type", "size", "ns/op", "allocs/op", "GB/s");
+
+  for( s=0; s<sizeof( msg_sizes)/sizeof( msg_sizes[0]); s++) {
+    bm_n = msg_sizes[s];
+    bm_run( "create_message", bm_n > 0x4000 ? "extended" : "plain", bm_n, bm_create_message);
+  }
+
+  for( bm_dtype=0; bm_dtype<E_DBR_N; bm_dtype++)
+    bm_run( "mk_dbr_struct", e_dbrs[bm_dtype].dbr_name, e_dbrs[bm_dtype].dbr_struct_size, bm_mk_dbr_struct);
+
+  for( bm_dtype=0; bm_dtype<E_DBR_N; bm_dtype++)
+    bm_run( "pack_dbr_data", e_dbrs[bm_dtype].dbr_name, e_dbrs[bm_dtype].dbr_type_size, bm_pack_dbr_data);
+
+  //
+  // 64 headers to cycle through so we are not just reading one from L1
+  //
+  for( bm_n=0; bm_n<2; bm_n++) {
+    for( i=0; i<64; i++) {
+      if( bm_n)
+	create_extended_message_header( (e_extended_message_header_t *)bm_buf + i, 15, 0x10000, 6, 0x10000, i, i);
+      else
+	create_message_header( (e_message_header_t *)bm_buf + i, 15, 8, 6, 1, i, i);
+    }
+    bm_run( "read_extended_message_header", bm_n ? "extended" : "plain", -1, bm_read_header);
+  }
+
+  bm_run( "swapd", "double", -1, bm_swapd);
+
+  //
+  // Every swap kernel this machine can run
+  //
+  nkernels = 0;
+  kernels[nkernels].name = "scalar";
+  kernels[nkernels].k16 = e_swap16_scalar;
+  kernels[nkernels].k32 = e_swap32_scalar;
+  kernels[nkernels].k64 = e_swap64_scalar;
+  nkernels++;
+#if defined(__x86_64__)
+  if( __builtin_cpu_supports( "sse2")) {
+    kernels[nkernels].name = "sse2";
+    kernels[nkernels].k16 = e_swap16_sse2;
+    kernels[nkernels].k32 = e_swap32_sse2;
+    kernels[nkernels].k64 = e_swap64_sse2;
+    nkernels++;
+  }
+  if( __builtin_cpu_supports( "avx2")) {
+    kernels[nkernels].name = "avx2";
+    kernels[nkernels].k16 = e_swap16_avx2;
+    kernels[nkernels].k32 = e_swap32_avx2;
+    kernels[nkernels].k64 = e_swap64_avx2;
+    nkernels++;
+  }
+#endif
+  for( k=0; k<nkernels; k++) {
+    for( bm_n=1024; bm_n<=bm_max_n; bm_n *= 8) {
+      for( bm_dtype=2; bm_dtype<=8; bm_dtype *= 2) {
+	bm_kernel = bm_dtype == 2 ? kernels[k].k16 : (bm_dtype == 4 ? kernels[k].k32 : kernels[k].k64);
+	snprintf( type, sizeof( type), "%s/%d", kernels[k].name, 8*bm_dtype);
+	bm_run( "swap", type, bm_n, bm_swap);
+      }
+    }
+  }
+
+  //
+  // format_dbr: scalars then waveforms
+  //
+  bm_n = -1;
+  bm_pgr = bm_result( bm_n);
+  for( bm_dtype=0; bm_dtype<E_DBR_N; bm_dtype++)
+    bm_run( "format_dbr", e_dbrs[bm_dtype].dbr_name, bm_n, bm_format_dbr);
+  PQclear( bm_pgr);
+
+  for( s=0; s<sizeof( wave_sizes)/sizeof( wave_sizes[0]) && wave_sizes[s] <= bm_max_n; s++) {
+    bm_n = wave_sizes[s];
+    bm_pgr = bm_result( bm_n);
+    for( bm_dtype=0; bm_dtype<E_DBR_N; bm_dtype++)
+      bm_run( "format_dbr", e_dbrs[bm_dtype].dbr_name, bm_n, bm_format_dbr);
+    PQclear( bm_pgr);
+  }
+  return 0;
+}
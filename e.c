@@ -8,18 +8,121 @@
 
 #include "e.h"
 
-struct pollfd e_socks[1024];					//!< array of active sockets
-e_socks_buffer_t e_sock_bufs[1024];				//!< read buffer to support these sockets
-int n_e_socks = 0;						//!< current number of sockets
+//
+// Each circuit shard thread has its own socket array, database connection and timer wheel
+//
+__thread struct pollfd e_socks[1024];				//!< array of active sockets
+__thread e_socks_buffer_t e_sock_bufs[1024];			//!< read buffer to support these sockets
+__thread int n_e_socks = 0;					//!< current number of sockets
 int n_e_socks_max = sizeof( e_socks)/sizeof( e_socks[0]);	//!< maximum number of sockets
 
 static int beacons;						//!< our beacon socket
 static struct sockaddr_in broadcastaddr, ouraddr;		//!< addresses for broadcasts and listening
 static int beacon_index;					//!< the index of the beacon socket in the socket array
-
-static int maybe_check_monitors = 0;	//!< a set value might have changed a monitor (TODO: have set return a parameter that says for sure if we need to check monitors)
-
-static PGconn *q = NULL;					//!< Our connection to the postgresql server
+static int beacon_interval_ms = 200;				//!< current beacon interval (backs off to 8 seconds)
+
+static __thread int maybe_check_monitors = 0;	//!< a set value might have changed a monitor (TODO: have set return a parameter that says for sure if we need to check monitors)
+
+static __thread PGconn *q = NULL;				//!< Our connection to the postgresql server
+
+static int e_shards_n = 0;			//!< number of circuit shard threads (-c, 0 = the main loop serves circuits itself)
+static e_shard_t e_shards[E_SHARDS_MAX];	//!< the shards
+static __thread e_shard_t *e_shard = NULL;	//!< the shard this thread runs (NULL for the main loop)
+static unsigned char e_fd_shard[E_FD_MAX];	//!< which shard owns a circuit socket (shard id, 0 = the main loop; atomic: shards clear it as they close)
+static int e_monitor_efd = -1;			//!< shards ask the main loop to check monitors through this
+
+#ifndef E_NO_MAIN
+static int e_listen_backlog = E_LISTEN_BACKLOG;	//!< virtual circuit listen backlog (-b)
+#endif
+static double e_max_rate = 0;			//!< default most updates per second per subscription (-m, 0 = no limit): channels may set their own with a .MAXRATE kv
+unsigned long e_updates_held = 0;		//!< monitor updates held back and then replaced by a newer value
+unsigned long e_enc_shared = 0;			//!< monitor updates that were a copy of an encoding made for someone else
+static __thread int e_run_q[E_PRIO_CLASSES][1024];	//!< circuits (by socket) with work left over waiting for another turn, by priority class
+static __thread int e_run_qhead[E_PRIO_CLASSES];	//!< next circuit in each class to get a turn
+static __thread int e_run_qlen[E_PRIO_CLASSES];	//!< number of circuits waiting in each class
+static __thread int e_run_waiting = 0;	//!< number of circuits waiting in all classes
+unsigned long e_accepts = 0;			//!< circuits accepted
+unsigned long e_accept_bursts_max = 0;		//!< most circuits accepted in one listener wakeup
+unsigned long e_run_deferrals = 0;		//!< times a circuit used up its budget and was sent to the back of the run queue
+static e_update_t *e_update_free = NULL;	//!< main loop only: recycled monitor updates
+
+unsigned long e_out_allocs = 0;		//!< allocations made on the reply path (arena growth and reply queue entries); flat in steady state
+
+static int e_use_uring = 0;			//!< 1 to do socket I/O through io_uring instead of poll (-u)
+static e_uring_t ur;				//!< our io_uring, when we use one
+static uint32_t e_uring_gen = 0;		//!< source of generation tags for io_uring operations
+unsigned long e_io_syscalls = 0;		//!< system calls made to move CA traffic (including the ones used to wait for it)
+unsigned long e_io_updates  = 0;		//!< monitor updates queued to clients
+//
+// The datagram counters are shared with the search workers: update them atomically
+//
+unsigned long e_udp_rx_dgrams = 0;		//!< datagrams received
+unsigned long e_udp_rx_calls  = 0;		//!< recvmmsg calls that returned datagrams
+unsigned long e_udp_tx_dgrams = 0;		//!< datagrams sent
+unsigned long e_udp_tx_calls  = 0;		//!< sendmmsg calls
+int e_udp_qmax = 0;				//!< deepest a datagram reply queue has been
+static int e_udp_rcvbuf = 0;			//!< SO_RCVBUF for the search and beacon sockets (-r, 0 = kernel default)
+
+static e_name_t *e_names[E_NAME_BUCKETS];	//!< channel name index: what the database said about each name searched for
+static pthread_rwlock_t e_names_lock = PTHREAD_RWLOCK_INITIALIZER;	//!< many searching readers, one writer (the main loop)
+static int e_search_workers = 0;		//!< number of search worker threads (-s)
+static int e_search_efd = -1;			//!< workers kick the main loop with this when they need the database
+static int search_index;			//!< the index of our own udp search socket in the socket array
+static pthread_mutex_t e_search_lock = PTHREAD_MUTEX_INITIALIZER;	//!< protects the search request queue
+static e_search_req_t *e_search_q = NULL;	//!< searches waiting for the database
+static e_search_req_t *e_search_qtail = NULL;	//!< last of them
+static e_search_req_t *e_search_free = NULL;	//!< recycled search requests
+static int e_search_qlen = 0;			//!< number of searches waiting
+unsigned long e_search_hits = 0;		//!< searches answered from the name index
+unsigned long e_search_misses = 0;		//!< searches that had to go to the database
+unsigned long e_search_overflows = 0;		//!< searches dropped because too many were already waiting
+unsigned long e_search_rejects = 0;		//!< searches from clients the filter turned away
+unsigned long e_create_rejects = 0;		//!< create_chan requests from clients the filter turned away
+static e_cidr_t e_cidrs[E_CIDR_MAX];		//!< client filter rules in the order given (-a and -d)
+static int e_cidrs_n = 0;			//!< number of rules
+static int e_cidrs_allows = 0;			//!< how many of them are allow rules
+
+static __thread e_timer_t *e_wheel[E_WHEEL_LEVELS][E_WHEEL_SLOTS];	//!< hierarchical timer wheel: level 0 slots are one tick wide, level n slots 64^n ticks
+static __thread uint64_t e_wheel_tick = 0;	//!< the tick the wheel has been run up to
+static __thread uint64_t e_wheel_armed = 0;	//!< the tick our timerfd is set to go off at (0 = disarmed)
+static __thread struct timespec e_wheel_t0;	//!< monotonic time of tick 0
+static __thread int e_timerfd = -1;		//!< drives the wheel from inside the poll loop
+#ifndef E_NO_MAIN
+static e_timer_t beacon_timer;			//!< sends our beacons
+static e_timer_t put_timer;			//!< looks for finished write_notify commands
+#endif
+static int e_put_tmo = E_PUT_TMO_S;		//!< seconds a queued write_notify waits before we give up (-w)
+static int e_puts_waiting = 0;			//!< queued write_notify commands (atomic: circuits add, the main loop takes away)
+
+static char *e_metric_prefix = NULL;		//!< our metric channels are this followed by the metric name (-p, NULL for none)
+#ifndef E_NO_MAIN
+static char *e_metric_path = NULL;		//!< unix socket the metrics text dump is served on (-x, NULL for none)
+#endif
+static int e_metric_fd = -1;			//!< listening on it
+static e_metric_t e_metrics[E_METRIC_MAX];	//!< everything we publish, in dump order (set up at start up)
+static int e_metrics_n = 0;			//!< number of them
+static int e_ticks_tsc = 0;			//!< 1 when e_ticks reads the time stamp counter, 0 for CLOCK_MONOTONIC nanoseconds
+static uint64_t e_tick_mult = 1ULL << 32;	//!< nanoseconds per e_ticks tick in 32.32 fixed point
+static __thread e_timer_t *e_metric_timer = NULL;	//!< sends this thread's metric channel subscribers their updates
+static e_stats_t *e_stats[E_STATS_THREADS];	//!< every thread's statistics (e_stats_mine)
+static int e_stats_n = 0;			//!< number of them
+static __thread e_stats_t *e_stats_own = NULL;	//!< this thread's
+static FILE *e_cap_file = NULL;			//!< traffic capture (-C, NULL when not capturing)
+static pthread_mutex_t e_cap_lock = PTHREAD_MUTEX_INITIALIZER;	//!< circuits on every shard write to it
+static uint64_t e_cap_t0 = 0;			//!< monotonic nanoseconds when the capture started
+static uint32_t e_cap_conns = 0;		//!< circuits numbered so far (atomic)
+static unsigned long e_cap_records = 0;		//!< records captured
+static unsigned long e_cap_bytes = 0;		//!< and their size
+#ifndef E_NO_MAIN
+static e_timer_t cap_timer;			//!< flushes the capture
+#endif
+static char *e_cmd_names[] = {		//!< cmds[] as named in the metrics
+  "version", "event_add", "event_cancel", "read", "write", "snapshot", "search", "build",
+  "events_off", "events_on", "read_sync", "error", "clear_channel", "rsrv_is_up", "not_found", "read_notify",
+  "read_build", "repeater_confirm", "create_chan", "write_notify", "client_name", "host_name", "access_rights", "echo",
+  "repeater_register", "signal", "create_ch_fail", "server_disconn"
+};
+_Static_assert( sizeof( e_cmd_names)/sizeof( e_cmd_names[0]) == E_CMDS, "e_cmd_names[] must name every command in cmds[]");
 
 /** List of statements we'll be calling
  *  saved as prepared statements on the server to cut execution time
@@ -27,58 +130,18 @@ static PGconn *q = NULL;					//!< Our connection to the postgresql server
 char* prepared_statements[] = {
   "prepare beacon_update (inet, int) as select e.beacon_update($1,$2)",
   "prepare channel_search (inet,int,text) as select e.channel_search($1,$2,$3)",
-  "prepare create_channel (inet,text,text,int,int,text) as select * from e.create_channel( $1,$2,$3,$4,$5,$6)",
-  "prepare get_values (int) as select * from e.get_values($1)",
+  "prepare create_channels (inet,text,text,int[],int[],text[]) as select * from e.create_channels( $1,$2,$3,$4,$5,$6)",
+  "prepare get_values (int,int) as select * from e.get_values($1,$2)",
   "prepare clear_channel (inet,int,int) as select e.clear_channel($1,$2,$3)",
   "prepare set_str_value (int,text) as select e.set_str_value($1,$2) as rtn",
   "prepare create_monitor (int,int,int,int,int,int) as select e.create_monitor($1,$2,$3,$4,$5,$6)",
   "prepare cancel_monitor (int,int) as select e.cancel_monitor( $1, $2)",
-  "prepare check_monitors as select sid, subid, val, sock, dtype, cnt, eepoch, ensec from e.check_monitors()",
-  "prepare remove_monitor (int) as select e.remove_monitor( $1)"
-};
-
-/** List of sizes for the various dbr types.
- *  dbr name, structure size, type size
- */
-e_dbr_size_t dbr_sizes[] = {
-  //
-  // Keep in order!!
-  //
-  { "string", 0, 0},
-  { "short", 0, 2},
-  { "float", 0, 4},
-  { "enum", 0, 2},
-  { "char", 0, 1},
-  { "long", 0, 4},
-  { "double", 0, 8},
-  { "sts_string", 4, 0},
-  { "sts_short", 4, 2},
-  { "sts_float", 4, 4},
-  { "sts_enum", 4, 2},
-  { "sts_char", 5, 1},
-  { "sts_long", 4, 4},
-  { "sts_double", 8, 8},
-  { "time_string", 12, 0},
-  { "time_short", 14, 2},
-  { "time_float", 12, 4},
-  { "time_enum", 14, 2},
-  { "time_char", 15, 1},
-  { "time_long", 12, 4},
-  { "time_double", 16, 8},
-  { "gr_string", 0, 0},
-  { "gr_short", 24, 2},
-  { "gr_float", 40, 4},
-  { "gr_enum", 422, 2},
-  { "gr_char", 19, 1},
-  { "gr_long", 36, 4},
-  { "gr_double", 64, 8},
-  { "crtl_string", 0, 0},
-  { "crtl_short", 28, 2},
-  { "crtl_float", 48, 4},
-  { "crtl_enum", 422, 2},
-  { "crtl_char", 21, 1},
-  { "crtl_long", 44, 4},
-  { "crtl_double", 80, 8}
+  "prepare check_monitors as select sid, subid, val, sock, dtype, cnt, eepoch, ensec, vals, kv, kvseq, alarm from e.check_monitors()",
+  "prepare remove_monitor (int) as select e.remove_monitor( $1)",
+  "prepare get_dbrs as select dtype, dname, dplsize, ddsize from e.dbrs order by dtype",
+  "prepare put_notify (int,text,int,int,int,int,int) as select e.put_notify($1,$2,$3,$4,$5,$6,$7) as rtn",
+  "prepare check_puts as select sock, ioid, dtype, cnt, status from e.check_puts()",
+  "prepare remove_puts (int) as select e.remove_puts( $1)"
 };
 
 /** Debugging packet helper
@@ -102,10 +165,464 @@ void hex_dump( int n, char *s) {
 }
 
 
+/** Current monotonic time in wheel ticks
+ */
+uint64_t e_wheel_now() {
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts);
+  return ((ts.tv_sec - e_wheel_t0.tv_sec) * 1000 + (ts.tv_nsec - e_wheel_t0.tv_nsec) / 1000000) / E_WHEEL_TICK_MS;
+}
+
+/** Put a timer in the slot its expiration calls for
+ *  Relative to where the wheel is now.
+ *
+ * \param t The timer
+ */
+void e_wheel_insert( e_timer_t *t) {
+  uint64_t diff;
+  int level, slot;
+
+  diff = t->expires > e_wheel_tick ? t->expires - e_wheel_tick : 0;
+
+  for( level=0; level<E_WHEEL_LEVELS-1; level++) {
+    if( diff < (1ULL << (E_WHEEL_BITS * (level+1))))
+      break;
+  }
+  if( diff >= (1ULL << (E_WHEEL_BITS * E_WHEEL_LEVELS))) {
+    // Further out than we can see.  Come back when we can.
+    t->expires = e_wheel_tick + (1ULL << (E_WHEEL_BITS * E_WHEEL_LEVELS)) - 1;
+  }
+  if( diff == 0) {
+    // Overdue: goes in the slot about to be run
+    t->expires = e_wheel_tick;
+  }
+
+  slot = (t->expires >> (E_WHEEL_BITS * level)) & (E_WHEEL_SLOTS - 1);
+
+  t->prev = NULL;
+  t->next = e_wheel[level][slot];
+  if( t->next != NULL)
+    t->next->prev = t;
+  e_wheel[level][slot] = t;
+  t->pending = 1;
+}
+
+/** Take a timer out of the wheel
+ *
+ * \param t The timer
+ */
+void e_timer_cancel( e_timer_t *t) {
+  int level, slot;
+
+  if( t == NULL || !t->pending)
+    return;
+
+  if( t->prev != NULL) {
+    t->prev->next = t->next;
+  } else {
+    //
+    // We are at the head of our slot: find it
+    //
+    for( level=0; level<E_WHEEL_LEVELS; level++) {
+      slot = (t->expires >> (E_WHEEL_BITS * level)) & (E_WHEEL_SLOTS - 1);
+      if( e_wheel[level][slot] == t) {
+	e_wheel[level][slot] = t->next;
+	break;
+      }
+    }
+  }
+  if( t->next != NULL)
+    t->next->prev = t->prev;
+  t->next = NULL;
+  t->prev = NULL;
+  t->pending = 0;
+}
+
+/** Start (or restart) a timer
+ *
+ * \param t  The timer
+ * \param ms Milliseconds from now
+ */
+void e_timer_add( e_timer_t *t, int ms) {
+  e_timer_cancel( t);
+  t->expires = e_wheel_now() + (ms + E_WHEEL_TICK_MS - 1) / E_WHEEL_TICK_MS;
+  if( t->expires <= e_wheel_tick)
+    t->expires = e_wheel_tick + 1;
+  e_wheel_insert( t);
+}
+
+/** Make a new timer for a virtual circuit
+ *
+ * \param cb  What to call when it fires
+ * \param arg Passed along to the callback
+ */
+e_timer_t *e_timer_new( void (*cb)( e_timer_t *), int arg) {
+  e_timer_t *t;
+
+  t = calloc( sizeof( *t), 1);
+  if( t == NULL) {
+    fprintf( stderr, "Out of memory for timer (e_timer_new)\n");
+    return NULL;
+  }
+  t->cb  = cb;
+  t->arg = arg;
+  return t;
+}
+
+/** Run the wheel up to the present, firing whatever is due
+ */
+void e_wheel_run() {
+  uint64_t now;
+  e_timer_t *t, *due;
+  int level, slot;
+
+  now = e_wheel_now();
+  while( e_wheel_tick < now) {
+    e_wheel_tick++;
+
+    //
+    // Cascade: when a lower level wraps, the next slot up comes due
+    // and its timers get spread out over the levels below
+    //
+    for( level=1; level<E_WHEEL_LEVELS; level++) {
+      if( e_wheel_tick & ((1ULL << (E_WHEEL_BITS * level)) - 1))
+	break;
+      slot = (e_wheel_tick >> (E_WHEEL_BITS * level)) & (E_WHEEL_SLOTS - 1);
+      t = e_wheel[level][slot];
+      e_wheel[level][slot] = NULL;
+      while( t != NULL) {
+	due = t;
+	t = t->next;
+	e_wheel_insert( due);
+      }
+    }
+
+    slot = e_wheel_tick & (E_WHEEL_SLOTS - 1);
+    while( (due = e_wheel[0][slot]) != NULL) {
+      e_timer_cancel( due);
+      due->cb( due);
+    }
+  }
+}
+
+/** When does the wheel next need attention?
+ *  Returns the earliest tick at which a timer fires or a slot cascades, 0 if the wheel is empty.
+ */
+uint64_t e_wheel_next() {
+  uint64_t base, rtn, candidate;
+  int level, k;
+
+  rtn = 0;
+  for( level=0; level<E_WHEEL_LEVELS; level++) {
+    base = e_wheel_tick >> (E_WHEEL_BITS * level);
+    for( k=1; k<=E_WHEEL_SLOTS; k++) {
+      if( e_wheel[level][(base + k) & (E_WHEEL_SLOTS - 1)] != NULL) {
+	candidate = (base + k) << (E_WHEEL_BITS * level);
+	if( rtn == 0 || candidate < rtn)
+	  rtn = candidate;
+	break;
+      }
+    }
+  }
+  return rtn;
+}
+
+/** Set our timerfd to go off when the wheel next needs us
+ *  Only touches the timerfd when that time has changed.
+ */
+void e_wheel_arm() {
+  struct itimerspec its;
+  uint64_t next;
+  uint64_t ms;
+
+  next = e_wheel_next();
+  if( next == e_wheel_armed)
+    return;
+
+  memset( &its, 0, sizeof( its));
+  if( next != 0) {
+    ms = next * E_WHEEL_TICK_MS;
+    its.it_value.tv_sec  = e_wheel_t0.tv_sec  + ms / 1000;
+    its.it_value.tv_nsec = e_wheel_t0.tv_nsec + (ms % 1000) * 1000000;
+    if( its.it_value.tv_nsec >= 1000000000) {
+      its.it_value.tv_sec++;
+      its.it_value.tv_nsec -= 1000000000;
+    }
+  }
+  if( timerfd_settime( e_timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+    perror( "timerfd_settime (e_wheel_arm)");
+    return;
+  }
+  e_wheel_armed = next;
+}
+
+/** Our timerfd went off
+ */
+void e_wheel_service() {
+  uint64_t expirations;
+
+  if( read( e_timerfd, &expirations, sizeof( expirations)) == -1 && errno != EAGAIN) {
+    perror( "timerfd read (e_wheel_service)");
+  }
+  e_wheel_armed = 0;
+  e_wheel_run();
+}
+
+/** Set up the timer wheel
+ *  Returns the timerfd to poll.
+ */
+int e_wheel_init() {
+  clock_gettime( CLOCK_MONOTONIC, &e_wheel_t0);
+  e_wheel_tick = 0;
+  e_timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if( e_timerfd == -1) {
+    perror( "timerfd_create (e_wheel_init)");
+    exit( -1);
+  }
+  return e_timerfd;
+}
+
+/** Another user of an encoding
+ *
+ * \param enc The encoding
+ */
+e_enc_t *e_enc_ref( e_enc_t *enc) {
+  __atomic_add_fetch( &enc->refs, 1, __ATOMIC_RELAXED);
+  return enc;
+}
+
+/** Done with an encoding: the last user frees it
+ *  Shards and the main loop share encodings.
+ *
+ * \param enc The encoding (NULL is OK)
+ */
+void e_enc_unref( e_enc_t *enc) {
+  if( enc != NULL && __atomic_sub_fetch( &enc->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free( enc->meta);
+    free( enc);
+  }
+}
+
+/** Forget all of a circuit's subscriptions
+ *
+ * \param b The socket buffer
+ */
+void e_subs_free( e_socks_buffer_t *b) {
+  e_sub_t *sub;
+  int i;
+
+  if( b->subs == NULL)
+    return;
+
+  for( i=0; i<E_SUB_BUCKETS; i++) {
+    while( b->subs[i] != NULL) {
+      sub = b->subs[i];
+      b->subs[i] = sub->next;
+      e_timer_cancel( &sub->timer);
+      e_enc_unref( sub->held);
+      free( sub->tmpl);
+      free( sub);
+    }
+  }
+  free( b->subs);
+  b->subs = NULL;
+}
+
+/** Find one of a circuit's subscriptions
+ *
+ * \param b     The circuit
+ * \param subid The subscription id
+ */
+e_sub_t *e_sub_find( e_socks_buffer_t *b, uint32_t subid) {
+  e_sub_t *sub;
+
+  if( b->subs == NULL)
+    return NULL;
+
+  for( sub = b->subs[subid & (E_SUB_BUCKETS-1)]; sub != NULL; sub = sub->next) {
+    if( sub->subid == subid)
+      return sub;
+  }
+  return NULL;
+}
+
+/** Set how often a subscription may be sent an update
+ *
+ * \param sub      The subscription
+ * \param max_rate Most updates per second (0 for no limit)
+ */
+void e_sub_rate( e_sub_t *sub, double max_rate) {
+  sub->min_ticks = 0;
+  if( max_rate > 0)
+    sub->min_ticks = (uint64_t)(1000.0 / max_rate + E_WHEEL_TICK_MS - 1) / E_WHEEL_TICK_MS;
+}
+
+/** Start keeping track of a new subscription
+ *
+ * \param b        The circuit
+ * \param subid    The client's subscription id
+ * \param max_rate Most updates per second (0 for no limit)
+ */
+e_sub_t *e_sub_add( e_socks_buffer_t *b, uint32_t subid, double max_rate) {
+  e_sub_t *sub;
+
+  if( b->subs == NULL) {
+    b->subs = calloc( E_SUB_BUCKETS, sizeof( *b->subs));
+    if( b->subs == NULL) {
+      fprintf( stderr, "Out of memory for subscriptions on sock %d (e_sub_add)\n", b->sock);
+      return NULL;
+    }
+  }
+
+  sub = e_sub_find( b, subid);
+  if( sub == NULL) {
+    sub = calloc( 1, sizeof( *sub));
+    if( sub == NULL) {
+      fprintf( stderr, "Out of memory for subscription on sock %d (e_sub_add)\n", b->sock);
+      return NULL;
+    }
+    sub->timer.arg = b->sock;	// e_monitor_send sets the callback when it first holds an update
+    sub->b         = b;
+    sub->subid     = subid;
+    sub->next      = b->subs[subid & (E_SUB_BUCKETS-1)];
+    b->subs[subid & (E_SUB_BUCKETS-1)] = sub;
+  }
+
+  e_sub_rate( sub, max_rate);
+  sub->last_sent = e_wheel_now();
+  e_enc_unref( sub->held);
+  sub->held       = NULL;
+  sub->metric_sid = 0;
+  return sub;
+}
+
+/** Stop keeping track of a subscription
+ *
+ * \param b     The circuit
+ * \param subid The subscription id
+ */
+void e_sub_remove( e_socks_buffer_t *b, uint32_t subid) {
+  e_sub_t **spp;
+  e_sub_t *sub;
+
+  if( b->subs == NULL)
+    return;
+
+  for( spp = &b->subs[subid & (E_SUB_BUCKETS-1)]; *spp != NULL; spp = &(*spp)->next) {
+    if( (*spp)->subid == subid) {
+      sub = *spp;
+      *spp = sub->next;
+      e_timer_cancel( &sub->timer);
+      e_enc_unref( sub->held);
+      free( sub->tmpl);
+      free( sub);
+      return;
+    }
+  }
+}
+
+/** Forget the metadata of all of a circuit's channels
+ *
+ * \param b The socket buffer
+ */
+void e_chans_free( e_socks_buffer_t *b) {
+  e_chan_t *chan;
+  int i;
+
+  if( b->chans == NULL)
+    return;
+
+  for( i=0; i<E_CHAN_BUCKETS; i++) {
+    while( b->chans[i] != NULL) {
+      chan = b->chans[i];
+      b->chans[i] = chan->next;
+      free( chan);
+    }
+  }
+  free( b->chans);
+  b->chans = NULL;
+}
+
+/** Find the cached metadata of one of a circuit's channels
+ *
+ * \param b   The circuit
+ * \param sid Our channel identifier
+ */
+e_chan_t *e_chan_find( e_socks_buffer_t *b, uint32_t sid) {
+  e_chan_t *chan;
+
+  if( b->chans == NULL)
+    return NULL;
+
+  for( chan = b->chans[sid & (E_CHAN_BUCKETS-1)]; chan != NULL; chan = chan->next) {
+    if( chan->sid == sid)
+      return chan;
+  }
+  return NULL;
+}
+
+/** Start caching a new channel's metadata
+ *  The metadata starts out unknown (metaseq -1).
+ *
+ * \param b   The circuit
+ * \param sid Our channel identifier
+ */
+e_chan_t *e_chan_add( e_socks_buffer_t *b, uint32_t sid) {
+  e_chan_t *chan;
+
+  if( b->chans == NULL) {
+    b->chans = calloc( E_CHAN_BUCKETS, sizeof( *b->chans));
+    if( b->chans == NULL) {
+      fprintf( stderr, "Out of memory for channels on sock %d (e_chan_add)\n", b->sock);
+      return NULL;
+    }
+  }
+
+  chan = e_chan_find( b, sid);
+  if( chan == NULL) {
+    chan = calloc( 1, sizeof( *chan));
+    if( chan == NULL) {
+      fprintf( stderr, "Out of memory for channel on sock %d (e_chan_add)\n", b->sock);
+      return NULL;
+    }
+    chan->sid  = sid;
+    chan->next = b->chans[sid & (E_CHAN_BUCKETS-1)];
+    b->chans[sid & (E_CHAN_BUCKETS-1)] = chan;
+  }
+  chan->metaseq = -1;
+  return chan;
+}
+
+/** Stop caching a channel's metadata
+ *
+ * \param b   The circuit
+ * \param sid Our channel identifier
+ */
+void e_chan_remove( e_socks_buffer_t *b, uint32_t sid) {
+  e_chan_t **cpp;
+  e_chan_t *chan;
+
+  if( b->chans == NULL)
+    return;
+
+  for( cpp = &b->chans[sid & (E_CHAN_BUCKETS-1)]; *cpp != NULL; cpp = &(*cpp)->next) {
+    if( (*cpp)->sid == sid) {
+      chan = *cpp;
+      *cpp = chan->next;
+      free( chan);
+      return;
+    }
+  }
+}
+
 /** Initialize the socket buffer for the given socket
  */
 int e_socks_buf_init( int sock) {
   int i;
+  int so_type;
+  socklen_t so_type_len;
+  e_reply_queue_t *rq;
 
   for( i=0; i<n_e_socks; i++) {
     if( e_socks[i].fd == sock) {
@@ -114,6 +631,26 @@ int e_socks_buf_init( int sock) {
 	e_sock_bufs[i].buf = NULL;
 	e_sock_bufs[i].bufsize = 0;
       }
+      if( e_sock_bufs[i].obuf != NULL) {
+	free( e_sock_bufs[i].obuf);
+	e_sock_bufs[i].obuf = NULL;
+	e_sock_bufs[i].obufsize = 0;
+      }
+      while( e_sock_bufs[i].reply_q != NULL) {
+	rq = e_sock_bufs[i].reply_q;
+	e_sock_bufs[i].reply_q = rq->next;
+	free( rq);
+      }
+      e_sock_bufs[i].reply_qtail = NULL;
+      while( e_sock_bufs[i].reply_free != NULL) {
+	rq = e_sock_bufs[i].reply_free;
+	e_sock_bufs[i].reply_free = rq->next;
+	free( rq);
+      }
+      e_timer_cancel( e_sock_bufs[i].idle_timer);
+      free( e_sock_bufs[i].idle_timer);
+      e_subs_free( e_sock_bufs + i);
+      e_chans_free( e_sock_bufs + i);
       break;
     }
   }
@@ -121,13 +658,19 @@ int e_socks_buf_init( int sock) {
     n_e_socks++;
   }
 
+  so_type = SOCK_STREAM;
+  so_type_len = sizeof( so_type);
+  getsockopt( sock, SOL_SOCKET, SO_TYPE, &so_type, &so_type_len);
+
   e_socks[i].fd            = sock;
   e_socks[i].events        = POLLIN;
   e_sock_bufs[i].sock	   = sock;
+  memset( &e_sock_bufs[i].peer, 0, sizeof( e_sock_bufs[i].peer));
   e_sock_bufs[i].host_name = NULL;
   e_sock_bufs[i].user_name = NULL;
   e_sock_bufs[i].active    = -1;
   e_sock_bufs[i].events_on = 1;
+  e_sock_bufs[i].udp       = so_type == SOCK_DGRAM;
   e_sock_bufs[i].bufsize   = 4096;
   e_sock_bufs[i].buf       = calloc( e_sock_bufs[i].bufsize, 1);
   if( e_sock_bufs[i].buf == NULL) {
@@ -135,11 +678,282 @@ int e_socks_buf_init( int sock) {
   }
   e_sock_bufs[i].rbp       = e_sock_bufs[i].buf;
   e_sock_bufs[i].wbp       = e_sock_bufs[i].buf;
+  e_sock_bufs[i].obufsize  = 4096;
+  e_sock_bufs[i].obuf      = malloc( e_sock_bufs[i].obufsize);
+  if( e_sock_bufs[i].obuf == NULL) {
+    fprintf( stderr, "out of memory for output arena of sock %d (e_socks_buf_init)\n", sock);
+    e_sock_bufs[i].obufsize = 0;
+  }
+  e_sock_bufs[i].ohead     = 0;
+  e_sock_bufs[i].otail     = 0;
+  e_sock_bufs[i].ostart    = -1;
   e_sock_bufs[i].reply_q   = NULL;
+  e_sock_bufs[i].reply_qtail = NULL;
+  e_sock_bufs[i].reply_qlen = 0;
+  e_sock_bufs[i].reply_free = NULL;
+  e_sock_bufs[i].rx_drops  = 0;
+  e_sock_bufs[i].uring     = 0;
+  e_sock_bufs[i].ugen      = 0;
+  e_sock_bufs[i].uops      = 0;
+  e_sock_bufs[i].urecv     = E_URECV_OFF;
+  e_sock_bufs[i].oinflight = 0;
+  e_sock_bufs[i].ostale    = NULL;
+  e_sock_bufs[i].last_rx   = e_wheel_tick;
+  e_sock_bufs[i].echo_pending = 0;
+  e_sock_bufs[i].idle_timer = NULL;
+  e_sock_bufs[i].msgs      = 0;
+  e_sock_bufs[i].run_wait  = 0;
+  e_sock_bufs[i].turns     = 0;
+  e_sock_bufs[i].turns_deferred = 0;
+  e_sock_bufs[i].inq_max   = 0;
+  e_sock_bufs[i].outq_max  = 0;
+  e_sock_bufs[i].priority  = 0;
+  e_sock_bufs[i].prio_class = E_PRIO_CLASSES - 1;	// our own sockets first, circuits get theirs in e_circuit_adopt
+  e_sock_bufs[i].subs      = NULL;
+  e_sock_bufs[i].chans     = NULL;
+  e_sock_bufs[i].cap_id    = 0;
+  e_socks[i].revents       = 0;
 
   return i;
 }
 
+/** Release everything a socket buffer owns
+ *  Called when the socket is closed for good.
+ *
+ * \param b The socket buffer to empty
+ */
+void e_socks_buf_free( e_socks_buffer_t *b) {
+  e_reply_queue_t *rq;
+
+  free( b->buf);
+  b->buf = NULL;
+  free( b->obuf);
+  b->obuf = NULL;
+  free( b->ostale);
+  b->ostale = NULL;
+  b->obufsize = 0;
+  b->ohead = 0;
+  b->otail = 0;
+  free( b->host_name);
+  b->host_name = NULL;
+  free( b->user_name);
+  b->user_name = NULL;
+  e_timer_cancel( b->idle_timer);
+  free( b->idle_timer);
+  b->idle_timer = NULL;
+  e_subs_free( b);
+  e_chans_free( b);
+  while( b->reply_q != NULL) {
+    rq = b->reply_q;
+    b->reply_q = rq->next;
+    free( rq);
+  }
+  b->reply_qtail = NULL;
+  b->reply_qlen  = 0;
+  while( b->reply_free != NULL) {
+    rq = b->reply_free;
+    b->reply_free = rq->next;
+    free( rq);
+  }
+}
+
+/** Reserve space at the end of a socket's output arena
+ *  Messages are serialized directly into the returned space.
+ *  The arena only grows (by doubling) until it reaches the circuit's
+ *  high water mark so there is nothing to allocate in steady state.
+ *
+ *  While io_uring has a send in flight the bytes already in the arena
+ *  must stay put: we neither compact nor realloc, we copy to a new arena
+ *  and keep the old one until the send completes.
+ *
+ * Returns a pointer to n zeroed bytes that remains valid until the next reservation.
+ *
+ * \param b The socket buffer that owns the arena
+ * \param n Number of bytes needed
+ */
+void *e_out_reserve( e_socks_buffer_t *b, int n) {
+  char *nb;
+  int nsize;
+  void *rtn;
+  e_reply_queue_t *rq;
+
+  if( b->ohead == b->otail) {
+    //
+    // Everything has been sent: start over at the front
+    // (a reply being built has nothing in it yet)
+    //
+    if( b->ostart >= 0)
+      b->ostart = 0;
+    b->ohead = 0;
+    b->otail = 0;
+  }
+
+  if( b->otail + n > b->obufsize && b->ohead > 0 && !b->oinflight) {
+    //
+    // Reclaim what we've already sent before considering growing.
+    // Queued replies and the one being built move down with it.
+    //
+    memmove( b->obuf, b->obuf + b->ohead, b->otail - b->ohead);
+    b->otail -= b->ohead;
+    for( rq = b->reply_q; rq != NULL; rq = rq->next) {
+      rq->reply_offset -= b->ohead;
+    }
+    if( b->ostart >= 0)
+      b->ostart -= b->ohead;
+    b->ohead = 0;
+  }
+
+  if( b->otail + n > b->obufsize) {
+    nsize = b->obufsize > 0 ? b->obufsize : 4096;
+    while( b->otail + n > nsize)
+      nsize *= 2;
+    if( b->oinflight && b->ostale == NULL) {
+      nb = malloc( nsize);
+      if( nb != NULL) {
+	memcpy( nb, b->obuf, b->otail);
+	b->ostale = b->obuf;
+      }
+    } else {
+      nb = realloc( b->obuf, nsize);
+    }
+    if( nb == NULL) {
+      fprintf( stderr, "Out of memory for output arena of sock %d (e_out_reserve)\n", b->sock);
+      return NULL;
+    }
+    __atomic_add_fetch( &e_out_allocs, 1, __ATOMIC_RELAXED);
+    b->obuf     = nb;
+    b->obufsize = nsize;
+  }
+
+  rtn = b->obuf + b->otail;
+  memset( rtn, 0, n);
+  b->otail += n;
+  return rtn;
+}
+
+/** Are there bytes waiting to go out on this socket?
+ *
+ * \param b The socket buffer to check
+ */
+int e_out_pending( e_socks_buffer_t *b) {
+  return b->reply_q != NULL || (!b->udp && b->ohead < b->otail);
+}
+
+/** Time stamp counter
+ *  Cheap enough to read around every command and statement.  Only the
+ *  difference between two readings means anything (e_hist_time).
+ */
+uint64_t e_ticks() {
+  struct timespec ts;
+
+#if defined(__x86_64__)
+  if( e_ticks_tsc)
+    return __rdtsc();
+#endif
+  clock_gettime( CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Work out how long an e_ticks tick is
+ *  Without an invariant time stamp counter ticks stay nanoseconds.
+ */
+void e_ticks_init() {
+#if defined(__x86_64__)
+  struct timespec t0, t1;
+  uint64_t c0, c1;
+  uint64_t ns;
+  unsigned int eax, ebx, ecx, edx;
+
+  //
+  // CPUID 0x80000007 EDX bit 8: the counter ticks at a constant rate
+  //
+  __asm__ volatile( "cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000007), "c"(0));
+  if( !(edx & (1 << 8)))
+    return;
+
+  clock_gettime( CLOCK_MONOTONIC, &t0);
+  c0 = __rdtsc();
+  usleep( 20000);
+  clock_gettime( CLOCK_MONOTONIC, &t1);
+  c1 = __rdtsc();
+
+  ns = (t1.tv_sec - t0.tv_sec) * 1000000000ULL + t1.tv_nsec - t0.tv_nsec;
+  if( c1 > c0 && ns > 0) {
+    e_tick_mult = ((unsigned __int128) ns << 32) / (c1 - c0);
+    e_ticks_tsc = 1;
+  }
+#endif
+}
+
+/** This thread's statistics
+ *  Made and published the first time the thread counts something.
+ */
+e_stats_t *e_stats_mine() {
+  static e_stats_t lost;	// for threads we have no room for: counted but never read
+  e_stats_t *st;
+  int k;
+
+  if( e_stats_own != NULL)
+    return e_stats_own;
+
+  st = calloc( 1, sizeof( *st));
+  k  = __atomic_fetch_add( &e_stats_n, 1, __ATOMIC_RELAXED);
+  if( st == NULL || k >= E_STATS_THREADS) {
+    fprintf( stderr, "No room for this thread's statistics (e_stats_mine)\n");
+    free( st);
+    e_stats_own = &lost;
+    return e_stats_own;
+  }
+  __atomic_store_n( &e_stats[k], st, __ATOMIC_RELEASE);
+  e_stats_own = st;
+  return e_stats_own;
+}
+
+/** Count an event in a histogram
+ *  Only the thread that owns the histogram (e_stats_mine) counts in it so
+ *  no locked instructions are needed; readers may be an event behind.
+ *
+ * \param h The histogram
+ * \param v How big the event was
+ */
+void e_hist_note( e_hist_t *h, unsigned long v) {
+  int k;
+
+  k = v == 0 ? 0 : 63 - __builtin_clzl( v);
+  if( k >= E_HIST_BUCKETS)
+    k = E_HIST_BUCKETS - 1;
+  __atomic_store_n( &h->n[k], h->n[k] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n( &h->sum, h->sum + v, __ATOMIC_RELAXED);
+}
+
+/** Count the nanoseconds since an e_ticks reading in a histogram
+ *
+ * \param h  The histogram
+ * \param t0 The reading from when the event started
+ */
+void e_hist_time( e_hist_t *h, uint64_t t0) {
+  e_hist_note( h, ((unsigned __int128)(e_ticks() - t0) * e_tick_mult) >> 32);
+}
+
+/** Which prepared statement is this?
+ *  Returns its index in prepared_statements or -1 for a statement we did
+ *  not prepare (or keep no statistics for).
+ *
+ * \param ps The statement's name
+ */
+int e_ps_find( char *ps) {
+  int len;
+  int i;
+
+  len = strlen( ps);
+  for( i=0; i<E_PS_MAX && i<sizeof(prepared_statements)/sizeof(prepared_statements[0]); i++) {
+    // "prepare name ..."
+    if( strncmp( prepared_statements[i] + 8, ps, len) == 0 && prepared_statements[i][8 + len] == ' ')
+      return i;
+  }
+  return -1;
+}
+
 /** Connect to our database server
  */
 void pg_conn() {
@@ -172,9 +986,10 @@ void pg_conn() {
   }
 
 
-  if( connection_init) {
+  if( connection_init && e_shard == NULL) {
     //
     // Listen for notify, etc.
+    // (Only the main loop: shards would throw away everyone's channels)
     //
     pgr = PQexec( q, "select e.init()");
     if( PQresultStatus( pgr) != PGRES_TUPLES_OK) {
@@ -182,8 +997,9 @@ void pg_conn() {
       exit( -1);
     }
     PQclear( pgr);
+  }
 
-
+  if( connection_init) {
     //
     // We use prepared statements except for e.init
     //
@@ -215,10 +1031,16 @@ void pg_conn() {
  */
 PGresult *e_execPrepared( char *ps, int nParams, const char **params, const int *paramLengths, const int *paramFormats, int resultFormat) {
   PGresult *pgr;
+  uint64_t t0;
+  int i;
 
   pg_conn();
 
+  i  = e_ps_find( ps);
+  t0 = e_ticks();
   pgr = PQexecPrepared( q, ps, nParams, params, paramLengths, paramFormats, resultFormat);
+  if( i != -1)
+    e_hist_time( e_stats_mine()->ps + i, t0);
   if( PQresultStatus( pgr) != PGRES_TUPLES_OK) {
     fprintf( stderr, "Statement execution failed: %s", PQerrorMessage( q));
     PQclear( pgr);
@@ -235,19 +1057,9 @@ PGresult *e_execPrepared( char *ps, int nParams, const char **params, const int
  */
 unsigned long long  swapd(double d) {
   unsigned long long a;
-  unsigned char *dst = (unsigned char *)&a;
-  unsigned char *src = (unsigned char *)&d;
 
-  dst[0] = src[7];
-  dst[1] = src[6];
-  dst[2] = src[5];
-  dst[3] = src[4];
-  dst[4] = src[3];
-  dst[5] = src[2];
-  dst[6] = src[1];
-  dst[7] = src[0];
-
-  return a;
+  memcpy( &a, &d, sizeof( a));
+  return __builtin_bswap64( a);
 }
 
 /** The inverse of swapd
@@ -256,21 +1068,194 @@ unsigned long long  swapd(double d) {
  */
 double unswapd( long long a) {
   double d;
-  unsigned char *dst = (unsigned char *)&d;
-  unsigned char *src = (unsigned char *)&a;
-
-  dst[0] = src[7];
-  dst[1] = src[6];
-  dst[2] = src[5];
-  dst[3] = src[4];
-  dst[4] = src[3];
-  dst[5] = src[2];
-  dst[6] = src[1];
-  dst[7] = src[0];
 
+  a = __builtin_bswap64( a);
+  memcpy( &d, &a, sizeof( d));
   return d;
 }
 
+//
+// Bulk byte swapping for array payloads.
+//
+// Each kernel swaps n 2, 4 or 8 byte elements from src to dst; src and
+// dst may be the same.  The scalar kernels always work.  On x86_64
+// e_swap_init switches to SSE2 kernels, or AVX2 kernels when the cpu has
+// them.  Neither needs special compiler flags: SSE2 is part of x86_64
+// and the AVX2 kernels are compiled with a target attribute.
+//
+
+static void e_swap16_scalar( void *dst, const void *src, int n) {
+  uint16_t v;
+  int i;
+
+  for( i=0; i<n; i++) {
+    memcpy( &v, (const char *)src + 2*i, sizeof( v));
+    v = __builtin_bswap16( v);
+    memcpy( (char *)dst + 2*i, &v, sizeof( v));
+  }
+}
+
+static void e_swap32_scalar( void *dst, const void *src, int n) {
+  uint32_t v;
+  int i;
+
+  for( i=0; i<n; i++) {
+    memcpy( &v, (const char *)src + 4*i, sizeof( v));
+    v = __builtin_bswap32( v);
+    memcpy( (char *)dst + 4*i, &v, sizeof( v));
+  }
+}
+
+static void e_swap64_scalar( void *dst, const void *src, int n) {
+  uint64_t v;
+  int i;
+
+  for( i=0; i<n; i++) {
+    memcpy( &v, (const char *)src + 8*i, sizeof( v));
+    v = __builtin_bswap64( v);
+    memcpy( (char *)dst + 8*i, &v, sizeof( v));
+  }
+}
+
+#if defined(__x86_64__)
+//
+// SSE2 has no byte shuffle: swap the bytes in each 16 bit word with
+// shifts after shuffling the words around for the wider types.
+//
+static inline __m128i e_swap_words_sse2( __m128i v) {
+  return _mm_or_si128( _mm_slli_epi16( v, 8), _mm_srli_epi16( v, 8));
+}
+
+static void e_swap16_sse2( void *dst, const void *src, int n) {
+  __m128i v;
+  int i;
+
+  for( i=0; i+8<=n; i+=8) {
+    v = _mm_loadu_si128( (const __m128i *)((const char *)src + 2*i));
+    _mm_storeu_si128( (__m128i *)((char *)dst + 2*i), e_swap_words_sse2( v));
+  }
+  e_swap16_scalar( (char *)dst + 2*i, (const char *)src + 2*i, n - i);
+}
+
+static void e_swap32_sse2( void *dst, const void *src, int n) {
+  __m128i v;
+  int i;
+
+  for( i=0; i+4<=n; i+=4) {
+    v = _mm_loadu_si128( (const __m128i *)((const char *)src + 4*i));
+    v = _mm_shufflehi_epi16( _mm_shufflelo_epi16( v, 0xb1), 0xb1);
+    _mm_storeu_si128( (__m128i *)((char *)dst + 4*i), e_swap_words_sse2( v));
+  }
+  e_swap32_scalar( (char *)dst + 4*i, (const char *)src + 4*i, n - i);
+}
+
+static void e_swap64_sse2( void *dst, const void *src, int n) {
+  __m128i v;
+  int i;
+
+  for( i=0; i+2<=n; i+=2) {
+    v = _mm_loadu_si128( (const __m128i *)((const char *)src + 8*i));
+    v = _mm_shufflehi_epi16( _mm_shufflelo_epi16( v, 0x1b), 0x1b);
+    _mm_storeu_si128( (__m128i *)((char *)dst + 8*i), e_swap_words_sse2( v));
+  }
+  e_swap64_scalar( (char *)dst + 8*i, (const char *)src + 8*i, n - i);
+}
+
+/** Swap 32 bytes at a time with a byte shuffle
+ *  Returns the number of elements done; the caller finishes the rest.
+ *
+ * \param dst  Where the swapped elements go
+ * \param src  The elements to swap
+ * \param n    Number of elements
+ * \param size Size of each element: 2, 4 or 8
+ */
+__attribute__((target("avx2")))
+static int e_swap_avx2( void *dst, const void *src, int n, int size) {
+  char m[32];
+  __m256i mask;
+  __m256i v;
+  int i;
+
+  for( i=0; i<32; i++)
+    m[i] = (i/size)*size + size - 1 - i%size;
+  mask = _mm256_loadu_si256( (const __m256i *)m);
+
+  for( i=0; i+32<=n*size; i+=32) {
+    v = _mm256_loadu_si256( (const __m256i *)((const char *)src + i));
+    _mm256_storeu_si256( (__m256i *)((char *)dst + i), _mm256_shuffle_epi8( v, mask));
+  }
+  return i / size;
+}
+
+static void e_swap16_avx2( void *dst, const void *src, int n) {
+  int i;
+
+  i = e_swap_avx2( dst, src, n, 2);
+  e_swap16_scalar( (char *)dst + 2*i, (const char *)src + 2*i, n - i);
+}
+
+static void e_swap32_avx2( void *dst, const void *src, int n) {
+  int i;
+
+  i = e_swap_avx2( dst, src, n, 4);
+  e_swap32_scalar( (char *)dst + 4*i, (const char *)src + 4*i, n - i);
+}
+
+static void e_swap64_avx2( void *dst, const void *src, int n) {
+  int i;
+
+  i = e_swap_avx2( dst, src, n, 8);
+  e_swap64_scalar( (char *)dst + 8*i, (const char *)src + 8*i, n - i);
+}
+#endif
+
+void (*e_swap16)( void *dst, const void *src, int n) = e_swap16_scalar;	//!< swap an array of shorts
+void (*e_swap32)( void *dst, const void *src, int n) = e_swap32_scalar;	//!< swap an array of floats or longs
+void (*e_swap64)( void *dst, const void *src, int n) = e_swap64_scalar;	//!< swap an array of doubles
+char *e_swap_kernels = "scalar";					//!< which kernels we picked
+
+/** Pick the fastest byte swap kernels this cpu runs
+ */
+void e_swap_init() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if( __builtin_cpu_supports( "avx2")) {
+    e_swap16 = e_swap16_avx2;
+    e_swap32 = e_swap32_avx2;
+    e_swap64 = e_swap64_avx2;
+    e_swap_kernels = "avx2";
+  } else if( __builtin_cpu_supports( "sse2")) {
+    e_swap16 = e_swap16_sse2;
+    e_swap32 = e_swap32_sse2;
+    e_swap64 = e_swap64_sse2;
+    e_swap_kernels = "sse2";
+  }
+#endif
+}
+
+/** Scratch space for converting arrays
+ *  Grows as needed and is kept for the next array.  Returns NULL when we
+ *  are out of memory.
+ *
+ * \param size Bytes needed
+ */
+char *e_swap_scratch( size_t size) {
+  static __thread char *scratch = NULL;
+  static __thread size_t scratch_size = 0;
+  char *tmp;
+
+  if( size > scratch_size) {
+    tmp = realloc( scratch, size);
+    if( tmp == NULL) {
+      fprintf( stderr, "Out of memory for %lu bytes of scratch (e_swap_scratch)\n", (unsigned long)size);
+      return NULL;
+    }
+    scratch      = tmp;
+    scratch_size = size;
+  }
+  return scratch;
+}
+
 /** see if this is an extended header
  * not used for every command type
  *
@@ -278,7 +1263,7 @@ double unswapd( long long a) {
  */
 int get_header_type( char  *buf) {
   // return 1 if extended header, 0 if normal header
-  if( *(buf+2)==0xff && *(buf+3)==0xff && *(buf+6)==0 && *(buf+7)==0) {
+  if( (unsigned char)buf[2]==0xff && (unsigned char)buf[3]==0xff && buf[6]==0 && buf[7]==0) {
     return 1;
   }
   return 0;
@@ -333,13 +1318,13 @@ void create_extended_message_header( e_extended_message_header_t *emh, uint16_t
   emh->marker2 = 0;
   emh->p1      = htonl( p1);
   emh->p2      = htonl( p2);
-  emh->plsize  = htons( plsize);
-  emh->dcount  = htons( dcount);
+  emh->plsize  = htonl( plsize);
+  emh->dcount  = htonl( dcount);
 }
 
 
 /** Creates a message using either the normal message header or the extended message header, as appropriate.
- *  Calloc's room for the entire payload and returns a pointer to start of the payload memory.
+ *  Reserves room for the entire message in the output arena of r->out and returns a pointer to start of the payload memory.
  *
  * Returns pointer to the payload data
  *
@@ -366,11 +1351,12 @@ void *create_message( e_response_t *r, uint16_t cmd, uint32_t pllength, uint16_t
 
   //  fprintf( stderr, "create_message   plsize: %d, dcount: %d\n", plsize, dcount);
 
-  if( plsize > 0x4000) {
+  if( plsize > 0x4000 || dcount >= 0xffff) {
     r->bufsize = sizeof( e_extended_message_header_t) + plsize;
-    r->buf = calloc( r->bufsize, 1);
+    r->buf = e_out_reserve( r->out, r->bufsize);
     if( r->buf == NULL) {
       fprintf( stderr, "Out of memory (create_message)\n");
+      r->bufsize = 0;
       return NULL;
     }
 
@@ -380,9 +1366,10 @@ void *create_message( e_response_t *r, uint16_t cmd, uint32_t pllength, uint16_t
   } else {
 
     r->bufsize = sizeof( e_message_header_t) + plsize;
-    r->buf = calloc( r->bufsize, 1);
+    r->buf = e_out_reserve( r->out, r->bufsize);
     if( r->buf == NULL) {
       fprintf( stderr, "Out of memory (create_message)\n");
+      r->bufsize = 0;
       return NULL;
     }
     
@@ -396,483 +1383,776 @@ void *create_message( e_response_t *r, uint16_t cmd, uint32_t pllength, uint16_t
 }
 
 
-/** Set up a dbr structure
- *  Basically fills in a structure by "hand"
+//
+// DBR encoders and decoders
+//
+// Everything below is generated per dbr type from E_DBR_TABLE (e.h).
+// The structure and value kinds are constants in each generated function
+// so the compiler throws away the branches that do not apply.
+//
+
+/** Put one graphic or control limit in the packet
+ *  Returns the size of the limit.
  *
- * \param pp           Pointer to the space reserved for this structure
- * \param dtype        The type of the structure
- * \param eepoch       Our timestamp
- * \param highlimit    High limit value
- * \param lowlimit     Low limit value
- * \param highlimithit Indicates the high limit has been reached
- * \param lowlimithit  Indicates the low limit has been reached
- * \param prec         The precision of the value contained in this packet
+ * \param p    Where the limit goes
+ * \param kind The value kind
+ * \param v    The limit
  */
-void mk_dbr_struct( void *pp, int dtype, uint32_t eepoch, uint32_t ensec, char *highlimit, char *lowlimit, int highlimithit, int lowlimithit, int prec) {
-  struct timeval tv;
-  struct timezone tz;
-  uint16_t *statusp;
-  uint16_t *severityp;
-  uint32_t *secPastEpochp;
-  uint32_t *nsecp;
-  
-
-  //
-  // base items have no structure in set
-  //
-  if( dtype/7 == 0)
-    return;
+static inline int e_dbr_limit( char *p, int kind, double v) {
+  int16_t short_value;
+  int32_t int_value;
+  float   float_value;
+  long long long_long_value;
 
-  //  fprintf( stderr, "highlimit %s   lowlimit %s  highlimithit %d  lowlimit hit %d  prec %d\n", highlimit, lowlimit, highlimithit, lowlimithit, prec);
+  switch( kind) {
+  case E_DBR_KIND_short:
+    short_value = htons( (int16_t) v);
+    memcpy( p, &short_value, sizeof( short_value));
+    return sizeof( short_value);
 
+  case E_DBR_KIND_float:
+    float_value = v;
+    memcpy( &int_value, &float_value, sizeof( int_value));
+    int_value = htonl( int_value);
+    memcpy( p, &int_value, sizeof( int_value));
+    return sizeof( int_value);
 
-  //
-  // everyone else gets these:
-  //
-  statusp    = pp;
-  *statusp   = htons(lowlimithit + 2 * highlimithit);
-  severityp  = pp+2;
-  *severityp = htons(lowlimithit + 2 * highlimithit);
+  case E_DBR_KIND_char:
+    *p = (char) v;
+    return 1;
 
-  //
-  // STS structure is now done
-  //
-  if( dtype/7 == 1)
-    return;
+  case E_DBR_KIND_long:
+    int_value = htonl( (int32_t) v);
+    memcpy( p, &int_value, sizeof( int_value));
+    return sizeof( int_value);
 
-  //
-  // Time stamp structure
-  //
-  if( dtype/7 == 2) {
-    secPastEpochp  = pp+4;
-    nsecp          = pp+8;
-    if( eepoch == 0) {
-      gettimeofday( &tv, &tz);
-      *secPastEpochp = htonl(tv.tv_sec - 631152000);
-      *nsecp         = htonl(tv.tv_usec * 1000);
-    } else {
-      *secPastEpochp = htonl( eepoch);
-      *nsecp         = htonl( ensec);
-    }
-    return;
+  case E_DBR_KIND_double:
+    long_long_value = swapd( v);
+    memcpy( p, &long_long_value, sizeof( long_long_value));
+    return sizeof( long_long_value);
   }
+  return 0;
+}
 
-  //
-  // Graphic structure
-  //
-  if( dtype/7 == 3) {
-    switch( dtype % 7) {
-    case 0:	// string stuff (Really?)  Ignore
-      break;
-    case 1:	// Integer
-      {
-	char *units_p;
-	int *lower_disp_limit_p;
-	int *upper_alarm_limit_p;
-	int *upper_warning_limit_p;
-	int *lower_warning_limit_p;
-	int *lower_alarm_limit_p;
-	int *upper_disp_limit_p;
-	
-	units_p               = pp +  4;
-	upper_disp_limit_p    = pp + 12;  *upper_disp_limit_p = htons(atoi( highlimit));
-	lower_disp_limit_p    = pp + 14;  *lower_disp_limit_p = htons(atoi( lowlimit));
-	upper_alarm_limit_p   = pp + 16;  *upper_alarm_limit_p   = htons(atoi( highlimit));
-	upper_warning_limit_p = pp + 18;  *upper_warning_limit_p = htons(atoi( highlimit));
-	lower_warning_limit_p = pp + 20;  *lower_warning_limit_p = htons(atoi( lowlimit));
-	lower_alarm_limit_p   = pp + 22;  *lower_alarm_limit_p   = htons(atoi( lowlimit));
-      }
-      break;
-
-    case 2:	// Float (32 bit)
-      {
-	char *units_p;
-	float ftmp;
-	int32_t itmp;
-	int16_t *prec_p;
-	int32_t *upper_disp_limit_p;
-        int32_t *lower_disp_limit_p;
-	int32_t *upper_alarm_limit_p;
-	int32_t *upper_warning_limit_p;
-	int32_t *lower_warning_limit_p;
-	int32_t *lower_alarm_limit_p;
-
-	
-
-	prec_p                = pp +  4;   *prec_p = htons( prec);
-	units_p               = pp +  8;
-
-	upper_disp_limit_p    = pp + 16;
-	ftmp                  = atof( highlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*upper_disp_limit_p = htonl( itmp);
+/** Plain types have no structure
+ */
+static inline void e_dbr_plain( void *pp, e_dbr_meta_t *m, int kind) {
+}
 
-	lower_disp_limit_p    = pp + 20;
-	ftmp                  = atof( lowlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*lower_disp_limit_p = htonl( itmp);
+/** Status and severity: everyone but the plain types starts with these
+ */
+static inline void e_dbr_sts( void *pp, e_dbr_meta_t *m, int kind) {
+  uint16_t status;
 
-	upper_alarm_limit_p   = pp + 24;
-	ftmp                  = atof( highlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*upper_alarm_limit_p   = htonl( itmp);
+  status = htons( m->lowlimithit + 2 * m->highlimithit);
+  memcpy( pp, &status, sizeof( status));		// status
+  memcpy( (char *)pp + 2, &status, sizeof( status));	// severity
+}
 
-	upper_warning_limit_p = pp + 28;
-	ftmp                  = atof( highlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*upper_warning_limit_p = htonl( itmp);
+/** Status, severity and time stamp
+ */
+static inline void e_dbr_time( void *pp, e_dbr_meta_t *m, int kind) {
+  struct timeval tv;
+  uint32_t stamp[2];
 
-	lower_warning_limit_p = pp + 32;
-	ftmp                  = atof( lowlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*lower_warning_limit_p = htonl( itmp);
+  e_dbr_sts( pp, m, kind);
+  if( m->eepoch == 0) {
+    gettimeofday( &tv, NULL);
+    stamp[0] = htonl( tv.tv_sec - 631152000);
+    stamp[1] = htonl( tv.tv_usec * 1000);
+  } else {
+    stamp[0] = htonl( m->eepoch);
+    stamp[1] = htonl( m->ensec);
+  }
+  memcpy( (char *)pp + 4, stamp, sizeof( stamp));
+}
 
-	lower_alarm_limit_p   = pp + 36;
-	ftmp                  = atof( lowlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*lower_alarm_limit_p   = htonl( itmp);
-      }
-      break;
+/** Graphic and control structures
+ *  Status and severity, precision for the floating point kinds, units
+ *  (left empty) and then the limits: display, alarm, warning and, for
+ *  control types, control.  We only know a high and a low limit so they
+ *  stand in for all of them.
+ *
+ * \param pp   The structure
+ * \param m    What goes in it
+ * \param kind The value kind
+ * \param ctrl 1 for control types
+ */
+static inline void e_dbr_limits( void *pp, e_dbr_meta_t *m, int kind, int ctrl) {
+  char *p;
+  uint16_t prec;
+
+  e_dbr_sts( pp, m, kind);
+
+  switch( kind) {
+  case E_DBR_KIND_float:
+  case E_DBR_KIND_double:
+    prec = htons( m->prec);
+    memcpy( (char *)pp + 4, &prec, sizeof( prec));
+    p = (char *)pp + 16;		// after precision, padding and units
+    break;
 
-    case 3:	// Enum
-      break;
+  case E_DBR_KIND_short:
+  case E_DBR_KIND_char:
+  case E_DBR_KIND_long:
+    p = (char *)pp + 12;		// after units
+    break;
 
-    case 4:	// Char
-      {
-	char *units_p;
-	char *upper_disp_limit_p;
-        char *lower_disp_limit_p;
-	char *upper_alarm_limit_p;
-	char *upper_warning_limit_p;
-	char *lower_warning_limit_p;
-	char *lower_alarm_limit_p;
-	
-	units_p               = pp +  4;
-	upper_disp_limit_p    = pp + 12;  *upper_disp_limit_p = atoi( highlimit);
-	lower_disp_limit_p    = pp + 13;  *lower_disp_limit_p = atoi( lowlimit);
-	upper_alarm_limit_p   = pp + 14;  *upper_alarm_limit_p   = atoi( highlimit);
-	upper_warning_limit_p = pp + 15;  *upper_warning_limit_p = atoi( highlimit);
-	lower_warning_limit_p = pp + 16;  *lower_warning_limit_p = atoi( lowlimit);
-	lower_alarm_limit_p   = pp + 17;  *lower_alarm_limit_p   = atoi( lowlimit);
-      }
-      break;
+  default:
+    return;	// strings and enums: nothing we know about
+  }
 
-    case 5:	// Int (32 bit)
-      {
-	char *units_p;
-	int32_t *upper_disp_limit_p;
-        int32_t *lower_disp_limit_p;
-	int32_t *upper_alarm_limit_p;
-	int32_t *upper_warning_limit_p;
-	int32_t *lower_warning_limit_p;
-	int32_t *lower_alarm_limit_p;
-	
-	units_p               = pp +  4;
-	upper_disp_limit_p    = pp + 12;  *upper_disp_limit_p = htonl(atoi( highlimit));
-	lower_disp_limit_p    = pp + 16;  *lower_disp_limit_p = htonl(atoi( lowlimit));
-	upper_alarm_limit_p   = pp + 20;  *upper_alarm_limit_p   = htonl(atoi( highlimit));
-	upper_warning_limit_p = pp + 24;  *upper_warning_limit_p = htonl(atoi( highlimit));
-	lower_warning_limit_p = pp + 28;  *lower_warning_limit_p = htonl(atoi( lowlimit));
-	lower_alarm_limit_p   = pp + 32;  *lower_alarm_limit_p   = htonl(atoi( lowlimit));
-      }
-      break;
-      
-    case 6:	// Double (64 bit)
-      {
-	
-	uint16_t *prec_p;
-	char *units_p;
-	double dtmp;
-	long long *upper_disp_limit_p;
-	long long *lower_disp_limit_p;
-	long long *upper_alarm_limit_p;
-	long long *upper_warning_limit_p;
-	long long *lower_warning_limit_p;
-	long long *lower_alarm_limit_p;
-	
-	prec_p                = pp +  4;   *prec_p = htons( prec);
-	units_p               = pp +  8;
+  p += e_dbr_limit( p, kind, m->highlimit);	// upper display
+  p += e_dbr_limit( p, kind, m->lowlimit);	// lower display
+  p += e_dbr_limit( p, kind, m->highlimit);	// upper alarm
+  p += e_dbr_limit( p, kind, m->highlimit);	// upper warning
+  p += e_dbr_limit( p, kind, m->lowlimit);	// lower warning
+  p += e_dbr_limit( p, kind, m->lowlimit);	// lower alarm
+  if( ctrl) {
+    p += e_dbr_limit( p, kind, m->highlimit);	// upper control
+    p += e_dbr_limit( p, kind, m->lowlimit);	// lower control
+  }
+}
 
-	upper_disp_limit_p    = pp + 16;
-	dtmp = atof( highlimit);
-	*upper_disp_limit_p   = swapd( dtmp);
+static inline void e_dbr_gr( void *pp, e_dbr_meta_t *m, int kind) {
+  e_dbr_limits( pp, m, kind, 0);
+}
 
-	lower_disp_limit_p    = pp + 24;
-	dtmp = atof( lowlimit);
-	*lower_disp_limit_p   = swapd( dtmp);
+static inline void e_dbr_ctrl( void *pp, e_dbr_meta_t *m, int kind) {
+  e_dbr_limits( pp, m, kind, 1);
+}
 
-	upper_alarm_limit_p   = pp + 32;
-	dtmp = atof( highlimit);
-	*upper_alarm_limit_p   = swapd( dtmp);
+/** Put a value we have as text in the packet
+ *
+ * \param pp     Where the value goes
+ * \param kind   The value kind
+ * \param svalue The value
+ */
+static inline void e_dbr_pack( void *pp, int kind, char *svalue) {
+  switch( kind) {
+  case E_DBR_KIND_string:
+  case E_DBR_KIND_char:
+    //
+    // Chars are long strings (channel names ending in $)
+    //
+    // IF CA clients die when we give them full sized strings the
+    // this will need to be changed to
+    // strncpy( pp, svalue, MAX_STRING_SIZE-1);
+    // Implicit null termination 'cause e_out_reserve zeroes the message
+    //
+    strcpy( pp, svalue);
+    break;
 
-	upper_warning_limit_p = pp + 40;
-	dtmp = atof( highlimit);
-	*upper_warning_limit_p   = swapd( dtmp);
+  case E_DBR_KIND_enum:
+  case E_DBR_KIND_short:
+    e_dbr_limit( pp, E_DBR_KIND_short, atoi( svalue));
+    break;
 
-	lower_warning_limit_p = pp + 48;
-	dtmp = atof( lowlimit);
-	*lower_warning_limit_p   = swapd( dtmp);
+  case E_DBR_KIND_long:
+    e_dbr_limit( pp, E_DBR_KIND_long, atoi( svalue));
+    break;
 
-	lower_alarm_limit_p   = pp + 56;
-	dtmp = atof( lowlimit);
-	*lower_alarm_limit_p   = swapd( dtmp);
-      }
-    }
+  case E_DBR_KIND_float:
+  case E_DBR_KIND_double:
+    e_dbr_limit( pp, kind, atof( svalue));
+    break;
   }
+}
 
-  //
-  // Control structure
-  //
-  if( dtype/7 == 4) {
-    switch( dtype % 7) {
-    case 0:	// string stuff (Really?)  Ignore
-      break;
-    case 1:	// Integer
-      {
-	char *units_p;
-	int *lower_disp_limit_p;
-	int *upper_alarm_limit_p;
-	int *upper_warning_limit_p;
-	int *lower_warning_limit_p;
-	int *lower_alarm_limit_p;
-	int *upper_disp_limit_p;
-	int *upper_control_limit_p;
-	int *lower_control_limit_p;
-	
-	units_p               = pp +  4;
-	upper_disp_limit_p    = pp + 12;  *upper_disp_limit_p = htons(atoi( highlimit));
-	lower_disp_limit_p    = pp + 14;  *lower_disp_limit_p = htons(atoi( lowlimit));
-	upper_alarm_limit_p   = pp + 16;  *upper_alarm_limit_p   = htons(atoi( highlimit));
-	upper_warning_limit_p = pp + 18;  *upper_warning_limit_p = htons(atoi( highlimit));
-	lower_warning_limit_p = pp + 20;  *lower_warning_limit_p = htons(atoi( lowlimit));
-	lower_alarm_limit_p   = pp + 22;  *lower_alarm_limit_p   = htons(atoi( lowlimit));
-	upper_control_limit_p = pp + 24;  *upper_control_limit_p = htons(atoi( highlimit));
-	lower_control_limit_p = pp + 26;  *lower_control_limit_p = htons(atoi( lowlimit));
-      }
-      break;
-
-    case 2:	// Float (32 bit)
-      {
-	char *units_p;
-	float ftmp;
-	int32_t itmp;
-	int16_t *prec_p;
-	int32_t *upper_disp_limit_p;
-        int32_t *lower_disp_limit_p;
-	int32_t *upper_alarm_limit_p;
-	int32_t *upper_warning_limit_p;
-	int32_t *lower_warning_limit_p;
-	int32_t *lower_alarm_limit_p;
-	int32_t *upper_control_limit_p;
-	int32_t *lower_control_limit_p;
-	
-
-	prec_p                = pp +  4;   *prec_p = htons( prec);
-	units_p               = pp +  8;
+/** Put a value we have as a double in the packet (array elements)
+ *
+ * \param pp   Where the value goes
+ * \param kind The value kind
+ * \param d    The value
+ */
+static inline void e_dbr_packd( void *pp, int kind, double d) {
+  switch( kind) {
+  case E_DBR_KIND_string:
+    snprintf( pp, MAX_STRING_SIZE, "%g", d);
+    break;
 
-	upper_disp_limit_p    = pp + 16;
-	ftmp                  = atof( highlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*upper_disp_limit_p = htonl( itmp);
+  case E_DBR_KIND_enum:
+    e_dbr_limit( pp, E_DBR_KIND_short, d);
+    break;
 
-	lower_disp_limit_p    = pp + 20;
-	ftmp                  = atof( lowlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*lower_disp_limit_p = htonl( itmp);
+  default:
+    e_dbr_limit( pp, kind, d);
+    break;
+  }
+}
 
-	upper_alarm_limit_p   = pp + 24;
-	ftmp                  = atof( highlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*upper_alarm_limit_p   = htonl( itmp);
+/** Turn a value from a client into text
+ *  Returns the number of bytes of the payload used, or -1 when the value
+ *  runs past the end of the payload.
+ *
+ * \param pp    The value
+ * \param avail Bytes left in the payload
+ * \param kind  The value kind
+ * \param s     Where the text goes
+ * \param ssize Room in s
+ */
+static inline int e_dbr_unpack( void *pp, int avail, int kind, char *s, int ssize) {
+  int16_t short_value;
+  int32_t int_value;
+  float float_value;
+  long long long_long_value;
+  int n;
+
+  switch( kind) {
+  case E_DBR_KIND_string:
+    n = strnlen( pp, avail);
+    if( n == avail)
+      return -1;
+    snprintf( s, ssize, "%s", (char *)pp);
+    return n + 1;
+
+  case E_DBR_KIND_short:
+    if( avail < 2)
+      return -1;
+    memcpy( &short_value, pp, sizeof( short_value));
+    snprintf( s, ssize, "%d", (int16_t) ntohs( short_value));
+    return 2;
+
+  case E_DBR_KIND_float:
+    if( avail < 4)
+      return -1;
+    memcpy( &int_value, pp, sizeof( int_value));
+    int_value = ntohl( int_value);
+    memcpy( &float_value, &int_value, sizeof( float_value));
+    snprintf( s, ssize, "%f", float_value);
+    return 4;
+
+  case E_DBR_KIND_enum:
+    if( avail < 2)
+      return -1;
+    memcpy( &short_value, pp, sizeof( short_value));
+    snprintf( s, ssize, "%u", (uint16_t) ntohs( short_value));
+    return 2;
+
+  case E_DBR_KIND_char:
+    if( avail < 1)
+      return -1;
+    snprintf( s, ssize, "%u", *(unsigned char *)pp);
+    return 1;
 
-	upper_warning_limit_p = pp + 28;
-	ftmp                  = atof( highlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*upper_warning_limit_p = htonl( itmp);
+  case E_DBR_KIND_long:
+    if( avail < 4)
+      return -1;
+    memcpy( &int_value, pp, sizeof( int_value));
+    snprintf( s, ssize, "%d", (int32_t) ntohl( int_value));
+    return 4;
+
+  case E_DBR_KIND_double:
+    if( avail < 8)
+      return -1;
+    memcpy( &long_long_value, pp, sizeof( long_long_value));
+    snprintf( s, ssize, "%f", unswapd( long_long_value));
+    return 8;
+  }
+  return -1;
+}
 
-	lower_warning_limit_p = pp + 32;
-	ftmp                  = atof( lowlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*lower_warning_limit_p = htonl( itmp);
+//
+// One structure encoder, value encoder, array element encoder and value
+// decoder per dbr type
+//
+#define E_DBR_FUNCS( dt, name, ss, vs, kind, cat)		\
+  static void e_dbr_struct_##name( void *pp, e_dbr_meta_t *m) { e_dbr_##cat( pp, m, E_DBR_KIND_##kind); } \
+  static void e_dbr_pack_##name( void *pp, char *svalue) { e_dbr_pack( pp, E_DBR_KIND_##kind, svalue); } \
+  static void e_dbr_packd_##name( void *pp, double d) { e_dbr_packd( pp, E_DBR_KIND_##kind, d); } \
+  static int e_dbr_unpack_##name( void *pp, int avail, char *s, int ssize) { return e_dbr_unpack( pp, avail, E_DBR_KIND_##kind, s, ssize); }
+E_DBR_TABLE( E_DBR_FUNCS)
+#undef E_DBR_FUNCS
+
+/** The dbr types, indexed by dtype
+ */
+e_dbr_t e_dbrs[] = {
+#define E_DBR_ENTRY( dt, name, ss, vs, kind, cat)		\
+  { #name, ss, vs, e_dbr_struct_##name, e_dbr_pack_##name, e_dbr_packd_##name, e_dbr_unpack_##name},
+  E_DBR_TABLE( E_DBR_ENTRY)
+#undef E_DBR_ENTRY
+};
 
-	lower_alarm_limit_p   = pp + 36;
-	ftmp                  = atof( lowlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*lower_alarm_limit_p   = htonl( itmp);
+/** Make sure e.dbrs agrees with E_DBR_TABLE
+ *  Complains about every difference: the two should change together.
+ */
+void e_dbr_check() {
+  PGresult *pgr;
+  int i;
+  int dtype;
+  int n;
 
-	upper_control_limit_p    = pp + 40;
-	ftmp                  = atof( highlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*upper_control_limit_p = htonl( itmp);
+  pgr = e_execPrepared( "get_dbrs", 0, NULL, NULL, NULL, 0);
+  if( pgr == NULL)
+    return;
 
-	lower_control_limit_p    = pp + 44;
-	ftmp                  = atof( lowlimit);  	memcpy( &itmp, &ftmp, sizeof( itmp));
-	*lower_control_limit_p = htonl( itmp);
+  n = 0;
+  for( i=0; i<PQntuples( pgr); i++) {
+    dtype = atoi( PQgetvalue( pgr, i, 0));
+    if( dtype < 0 || dtype >= E_DBR_N)
+      continue;
+    n++;
+    if( strcmp( PQgetvalue( pgr, i, 1), e_dbrs[dtype].dbr_name) != 0
+	|| atoi( PQgetvalue( pgr, i, 2)) != e_dbrs[dtype].dbr_struct_size
+	|| atoi( PQgetvalue( pgr, i, 3)) != e_dbrs[dtype].dbr_type_size) {
+      fprintf( stderr, "e.dbrs has %s (%s, %s) for dbr type %d but we have %s (%d, %d) (e_dbr_check)\n",
+	       PQgetvalue( pgr, i, 1), PQgetvalue( pgr, i, 2), PQgetvalue( pgr, i, 3), dtype,
+	       e_dbrs[dtype].dbr_name, e_dbrs[dtype].dbr_struct_size, e_dbrs[dtype].dbr_type_size);
+    }
+  }
+  if( n != E_DBR_N)
+    fprintf( stderr, "e.dbrs has %d of our %d dbr types (e_dbr_check)\n", n, E_DBR_N);
+  PQclear( pgr);
+}
 
-      }
-      break;
+/** Set up a dbr structure
+ *
+ * \param pp    Pointer to the space reserved for this structure
+ * \param dtype The type of the structure
+ * \param m     What goes in it
+ */
+void mk_dbr_struct( void *pp, int dtype, e_dbr_meta_t *m) {
+  if( dtype < 0 || dtype >= E_DBR_N) {
+    fprintf( stderr, "Unknown dbr type %d (mk_dbr_struct)\n", dtype);
+    return;
+  }
+  e_dbrs[dtype].mk_struct( pp, m);
+}
 
-    case 3:	// Enum
-      break;
+/** Fill in dbr metadata from the text the database gave us
+ *
+ * \param m            The metadata
+ * \param eepoch       Our timestamp (0 for now)
+ * \param ensec        And its nanoseconds
+ * \param highlimit    High limit value
+ * \param lowlimit     Low limit value
+ * \param highlimithit Indicates the high limit has been reached
+ * \param lowlimithit  Indicates the low limit has been reached
+ * \param prec         The precision of the value contained in this packet
+ */
+void e_dbr_meta( e_dbr_meta_t *m, uint32_t eepoch, uint32_t ensec, char *highlimit, char *lowlimit, int highlimithit, int lowlimithit, int prec) {
+  m->eepoch       = eepoch;
+  m->ensec        = ensec;
+  m->highlimit    = atof( highlimit);
+  m->lowlimit     = atof( lowlimit);
+  m->highlimithit = highlimithit;
+  m->lowlimithit  = lowlimithit;
+  m->prec         = prec;
+}
 
-    case 4:	// Char
-      {
-	char *units_p;
-	char *upper_disp_limit_p;
-        char *lower_disp_limit_p;
-	char *upper_alarm_limit_p;
-	char *upper_warning_limit_p;
-	char *lower_warning_limit_p;
-	char *lower_alarm_limit_p;
-	char *upper_control_limit_p;
-        char *lower_control_limit_p;
-	
-	units_p               = pp +  4;
-	upper_disp_limit_p    = pp + 12;  *upper_disp_limit_p = atoi( highlimit);
-	lower_disp_limit_p    = pp + 13;  *lower_disp_limit_p = atoi( lowlimit);
-	upper_alarm_limit_p   = pp + 14;  *upper_alarm_limit_p   = atoi( highlimit);
-	upper_warning_limit_p = pp + 15;  *upper_warning_limit_p = atoi( highlimit);
-	lower_warning_limit_p = pp + 16;  *lower_warning_limit_p = atoi( lowlimit);
-	lower_alarm_limit_p   = pp + 17;  *lower_alarm_limit_p   = atoi( lowlimit);
-	upper_control_limit_p = pp + 18;  *upper_control_limit_p = atoi( highlimit);
-	lower_control_limit_p = pp + 19;  *lower_control_limit_p = atoi( lowlimit);
-      }
-      break;
+/** put the datavalue in the packet
+ *
+ * \param pp     Our packet
+ * \param dtype  The data type
+ * \param svalue The value to store in the packet
+ */
+void pack_dbr_data( void *pp, int dtype, char *svalue) {
+  if( dtype < 0 || dtype >= E_DBR_N) {
+    fprintf( stderr, "Unknown dbr type %d (pack_dbr_data)\n", dtype);
+    return;
+  }
+  e_dbrs[dtype].pack( pp, svalue);
+}
 
-    case 5:	// Int (32 bit)
-      {
-	char *units_p;
-	int32_t *upper_disp_limit_p;
-        int32_t *lower_disp_limit_p;
-	int32_t *upper_alarm_limit_p;
-	int32_t *upper_warning_limit_p;
-	int32_t *lower_warning_limit_p;
-	int32_t *lower_alarm_limit_p;
-	int32_t *upper_control_limit_p;
-        int32_t *lower_control_limit_p;
-	
-	units_p               = pp +  4;
-	upper_disp_limit_p    = pp + 12;  *upper_disp_limit_p = htonl(atoi( highlimit));
-	lower_disp_limit_p    = pp + 16;  *lower_disp_limit_p = htonl(atoi( lowlimit));
-	upper_alarm_limit_p   = pp + 20;  *upper_alarm_limit_p   = htonl(atoi( highlimit));
-	upper_warning_limit_p = pp + 24;  *upper_warning_limit_p = htonl(atoi( highlimit));
-	lower_warning_limit_p = pp + 28;  *lower_warning_limit_p = htonl(atoi( lowlimit));
-	lower_alarm_limit_p   = pp + 32;  *lower_alarm_limit_p   = htonl(atoi( lowlimit));
-	upper_control_limit_p = pp + 36;  *upper_control_limit_p = htonl(atoi( highlimit));
-	lower_control_limit_p = pp + 40;  *lower_control_limit_p = htonl(atoi( lowlimit));
-      }
-      break;
-      
-    case 6:	// Double (64 bit)
-      {
-	
-	uint16_t *prec_p;
-	char *units_p;
-	double dtmp;
-	long long *upper_disp_limit_p;
-	long long *lower_disp_limit_p;
-	long long *upper_alarm_limit_p;
-	long long *upper_warning_limit_p;
-	long long *lower_warning_limit_p;
-	long long *lower_alarm_limit_p;
-	long long *upper_control_limit_p;
-	long long *lower_control_limit_p;
-	
-	prec_p                = pp +  4;   *prec_p = htons( prec);
-	units_p               = pp +  8;
+/** Find the elements of an array value from the database
+ *  The vals column is a float8[] in binary: number of dimensions, a null
+ *  flag, the element type and then a size and lower bound for each
+ *  dimension.  Each element is a 4 byte length (-1 for null) followed by
+ *  a big endian double.  Multi dimensional arrays are sent flattened.
+ *  Returns the number of elements or -1 when this is not an array.
+ *
+ * \param vals  The binary array
+ * \param len   Its length
+ * \param first Returns where the first element starts
+ */
+int e_array_elements( char *vals, int len, char **first) {
+  int32_t ndim;
+  int32_t dim;
+  char *p;
+  int i;
+  int n;
 
-	upper_disp_limit_p    = pp + 16;
-	dtmp = atof( highlimit);
-	*upper_disp_limit_p   = swapd( dtmp);
+  if( vals == NULL || len < 12)
+    return -1;
 
-	lower_disp_limit_p    = pp + 24;
-	dtmp = atof( lowlimit);
-	*lower_disp_limit_p   = swapd( dtmp);
+  memcpy( &ndim, vals, sizeof( ndim));
+  ndim = ntohl( ndim);
+  if( ndim < 0 || len < 12 + 8*ndim)
+    return -1;
 
-	upper_alarm_limit_p   = pp + 32;
-	dtmp = atof( highlimit);
-	*upper_alarm_limit_p   = swapd( dtmp);
+  n = ndim == 0 ? 0 : 1;
+  for( i=0; i<ndim; i++) {
+    memcpy( &dim, vals + 12 + 8*i, sizeof( dim));
+    n *= ntohl( dim);
+  }
 
-	upper_warning_limit_p = pp + 40;
-	dtmp = atof( highlimit);
-	*upper_warning_limit_p   = swapd( dtmp);
+  *first = vals + 12 + 8*ndim;
+  if( n < 0 || *first + 4*(long)n > vals + len)
+    return -1;
 
-	lower_warning_limit_p = pp + 48;
-	dtmp = atof( lowlimit);
-	*lower_warning_limit_p   = swapd( dtmp);
+  //
+  // A length and a double each, unless some are null: then walk them
+  //
+  if( *first + 12*(long)n <= vals + len)
+    return n;
+  p = *first;
+  for( i=0; i<n; i++) {
+    if( p + 4 > vals + len)
+      return -1;
+    memcpy( &dim, p, sizeof( dim));
+    dim = ntohl( dim);
+    p += 4;
+    if( dim == sizeof( double))
+      p += sizeof( double);
+    else if( dim != -1)
+      return -1;
+  }
+  if( p > vals + len)
+    return -1;
+  return n;
+}
 
-	lower_alarm_limit_p   = pp + 56;
-	dtmp = atof( lowlimit);
-	*lower_alarm_limit_p   = swapd( dtmp);
+/** How many array elements to reply with
+ *  What the client asked for, or everything we have when they asked for
+ *  0, but never more than fits in a message.
+ *
+ * \param struct_size Size of the dbr structure
+ * \param data_size   Size of each element
+ * \param asked       Elements the client asked for
+ * \param nvals       Elements we have
+ */
+uint32_t e_array_count( int struct_size, int data_size, uint32_t asked, int nvals) {
+  uint32_t n;
+  uint32_t most;
 
-	upper_control_limit_p    = pp + 64;
-	dtmp = atof( highlimit);
-	*upper_control_limit_p   = swapd( dtmp);
+  most = (E_MSG_MAX - struct_size) / data_size;
+  n    = asked == 0 ? nvals : asked;
+  return n > most ? most : n;
+}
 
-	lower_control_limit_p    = pp + 72;
-	dtmp = atof( lowlimit);
-	*lower_control_limit_p   = swapd( dtmp);
+/** Pull the doubles out of a binary float8[]
+ *  Drops the length word in front of each element.  The doubles stay in
+ *  network byte order and null elements become zero.
+ *
+ * \param dst   Where the doubles go
+ * \param first The first element from e_array_elements
+ * \param n     Number of elements
+ */
+void e_array_gather( void *dst, char *first, int n) {
+  char *p;
+  int32_t len;
+  int i;
 
-      }
+  p = first;
+  for( i=0; i<n; i++) {
+    memcpy( &len, p, sizeof( len));
+    len = ntohl( len);
+    p += sizeof( len);
+    if( len == sizeof( double)) {
+      memcpy( (char *)dst + sizeof( double)*i, p, sizeof( double));
+      p += sizeof( double);
+    } else {
+      //
+      // null element
+      //
+      memset( (char *)dst + sizeof( double)*i, 0, sizeof( double));
     }
   }
 }
 
-/** put the datavalue in the packet
+/** Put array elements in the packet
+ *  Converts straight from the database result into the output arena.
+ *  Doubles are already in network byte order and are just copied.
+ *  Shorts, enums, floats and longs are converted in bulk: gather the doubles,
+ *  swap them to host order, convert and swap the result back.
  *
- * \param pp     Our packet
- * \param dtype  The data type
- * \param svalue The value to store in the packet
+ * \param pp        Our packet
+ * \param dtype     The data type
+ * \param data_size Size of each element in the packet
+ * \param first     The first element from e_array_elements
+ * \param n         Number of elements to pack
  */
-void pack_dbr_data( void *pp, int dtype, char *svalue) {
-  int16_t short_value;
-  int32_t int_value, int_value2;
-  float   float_value;
-  double  double_value;
-  long long long_long_value;
+void e_pack_dbr_array( void *pp, int dtype, int data_size, char *first, int n) {
+  char *p;
+  char *dst;
+  char *scratch;
+  double *dv;
+  int32_t len;
+  int i;
+  long long bits;
 
   switch( dtype % 7) {
-  case 0:	// string
-    strcpy( pp, svalue);
-    //
-    // IF CA clients die when we give them full sized strings the
-    // this will need to be changed to
-    // strncpy( pp, svalue, MAX_STRING_SIZE-1);
-    // Implicit null termination 'cause we used calloc
-    //
-    break;
+  case E_DBR_KIND_double:
+    e_array_gather( pp, first, n);
+    return;
 
-  case 1:	// short
-    short_value = htons( atoi( svalue));
-    memcpy( pp, &short_value, sizeof( short_value));
-    break;
+  case E_DBR_KIND_short:
+  case E_DBR_KIND_enum:
+  case E_DBR_KIND_float:
+  case E_DBR_KIND_long:
+    scratch = e_swap_scratch( (size_t)n * (sizeof( double) + data_size));
+    if( scratch == NULL)
+      break;
+    dv = (double *)scratch;
+    e_array_gather( dv, first, n);
+    e_swap64( dv, dv, n);
 
-  case 2:	// float
-    float_value = atof( svalue);
-    memcpy( &int_value, &float_value, sizeof( int_value));
-    int_value2 = htonl( int_value);
-    memcpy( pp, &int_value2, sizeof( int_value2));
-    break;
+    dst = scratch + (size_t)n * sizeof( double);
+    switch( dtype % 7) {
+    case E_DBR_KIND_short:
+    case E_DBR_KIND_enum:
+      for( i=0; i<n; i++)
+	((int16_t *)dst)[i] = dv[i];
+      e_swap16( pp, dst, n);
+      break;
 
-  case 3:	// enum
-    short_value = htons( atoi( svalue));
-    memcpy( pp, &short_value, sizeof( short_value));
-    break;
+    case E_DBR_KIND_float:
+      for( i=0; i<n; i++)
+	((float *)dst)[i] = dv[i];
+      e_swap32( pp, dst, n);
+      break;
 
-  case 4:	// char
-    //
-    // No byte swapping cause it's just one byte
-    //
-    strcpy( pp, svalue);
-    break;
+    case E_DBR_KIND_long:
+      for( i=0; i<n; i++)
+	((int32_t *)dst)[i] = dv[i];
+      e_swap32( pp, dst, n);
+      break;
+    }
+    return;
+  }
 
-  case 5:	// int
-    int_value = htonl( atoi( svalue));
-    memcpy( pp, &int_value, sizeof( int_value));
-    break;
+  //
+  // One at a time for everyone else
+  //
+  p = first;
+  for( i=0; i<n; i++) {
+    memcpy( &len, p, sizeof( len));
+    len = ntohl( len);
+    p += sizeof( len);
+    if( len == sizeof( bits)) {
+      memcpy( &bits, p, sizeof( bits));
+      p += sizeof( bits);
+    } else {
+      //
+      // null element: leave it zero
+      //
+      continue;
+    }
+
+    dst = (char *)pp + data_size*i;
+    e_dbrs[dtype].packd( dst, unswapd( bits));
+  }
+}
+
+/** Turn an array from a client write into a postgres array literal
+ *  Returns a string to free or NULL if the payload is short.
+ *
+ * \param payload The dbr data
+ * \param dtype   The dbr type
+ * \param n       Number of elements
+ * \param plsize  Size of the payload
+ */
+char *e_array_literal( char *payload, int dtype, uint32_t n, uint32_t plsize) {
+  static const int data_sizes[7] = { MAX_STRING_SIZE, 2, 4, 2, 1, 4, 8};
+  //
+  // Widest element as text, with its comma: an escaped quoted string,
+  // -32768, -1.23456789e-38 (%.9g), 65535, 255, -2147483648 and
+  // -1.2345678901234567e-308 (%.17g)
+  //
+  static const int text_sizes[7] = { 2*MAX_STRING_SIZE + 3, 7, 16, 7, 4, 12, 25};
+  char *rtn;
+  char *sp;
+  char *ep;
+  uint32_t i;
+  int j;
+  int16_t short_value;
+  int32_t int_value;
+  float float_value;
+  double double_value;
+  char *dp;
+
+  if( dtype < 0 || dtype >= E_DBR_N)
+    return NULL;
+
+  payload += e_dbrs[dtype].dbr_struct_size;
+  if( e_dbrs[dtype].dbr_struct_size + (uint64_t)n * data_sizes[dtype % 7] > plsize) {
+    fprintf( stderr, "Array of %u elements does not fit in a %u byte payload (e_array_literal)\n", n, plsize);
+    return NULL;
+  }
 
-  case 6:	// double
-    double_value = atof( svalue);
-    long_long_value = swapd( double_value);
-    memcpy( pp, &long_long_value, sizeof( long_long_value));
+  //
+  // Swap the numbers to host order in bulk before formatting them
+  //
+  switch( dtype % 7) {
+  case E_DBR_KIND_short:
+  case E_DBR_KIND_enum:
+  case E_DBR_KIND_float:
+  case E_DBR_KIND_long:
+  case E_DBR_KIND_double:
+    dp = e_swap_scratch( (size_t)n * data_sizes[dtype % 7]);
+    if( dp == NULL)
+      return NULL;
+    if( data_sizes[dtype % 7] == 2)
+      e_swap16( dp, payload, n);
+    else if( data_sizes[dtype % 7] == 4)
+      e_swap32( dp, payload, n);
+    else
+      e_swap64( dp, payload, n);
+    payload = dp;
     break;
   }
+
+  rtn = malloc( (size_t)n * text_sizes[dtype % 7] + 3);
+  if( rtn == NULL) {
+    fprintf( stderr, "Out of memory for %u element array (e_array_literal)\n", n);
+    return NULL;
+  }
+
+  sp = rtn;
+  *sp++ = '{';
+  for( i=0; i<n; i++) {
+    if( i > 0)
+      *sp++ = ',';
+    dp = payload + i * data_sizes[dtype % 7];
+    switch( dtype % 7) {
+    case 0:	// string
+      *sp++ = '"';
+      ep = memchr( dp, 0, MAX_STRING_SIZE);
+      for( j=0; dp + j < (ep == NULL ? dp + MAX_STRING_SIZE : ep); j++) {
+	if( dp[j] == '"' || dp[j] == '\\')
+	  *sp++ = '\\';
+	*sp++ = dp[j];
+      }
+      *sp++ = '"';
+      break;
+
+    case 1:	// short
+      memcpy( &short_value, dp, sizeof( short_value));
+      sp += sprintf( sp, "%d", short_value);
+      break;
+
+    case 2:	// float
+      memcpy( &float_value, dp, sizeof( float_value));
+      sp += sprintf( sp, "%.9g", float_value);
+      break;
+
+    case 3:	// enum
+      memcpy( &short_value, dp, sizeof( short_value));
+      sp += sprintf( sp, "%u", (uint16_t) short_value);
+      break;
+
+    case 4:	// char
+      sp += sprintf( sp, "%u", *(unsigned char *)dp);
+      break;
+
+    case 5:	// int
+      memcpy( &int_value, dp, sizeof( int_value));
+      sp += sprintf( sp, "%d", int_value);
+      break;
+
+    case 6:	// double
+      memcpy( &double_value, dp, sizeof( double_value));
+      sp += sprintf( sp, "%.17g", double_value);
+      break;
+    }
+  }
+  *sp++ = '}';
+  *sp   = 0;
+  return rtn;
+}
+
+/** Read a channel's metadata from a create_channels or get_values row
+ *  Returns 0, leaving chan alone, when the row does not have it (get_values
+ *  found our cached copy is still good).
+ *
+ * \param pgr  The result (binary)
+ * \param row  Which row
+ * \param chan Where the metadata goes
+ */
+int e_chan_row( PGresult *pgr, int row, e_chan_t *chan) {
+  int metaseq_col;
+  int max_rate_col;
+
+  metaseq_col = PQfnumber( pgr, "metaseq");
+  if( metaseq_col == -1 || PQgetisnull( pgr, row, metaseq_col) || PQgetisnull( pgr, row, PQfnumber( pgr, "high_limit")))
+    return 0;
+
+  e_dbr_meta( &chan->m, 0, 0,
+	      PQgetvalue( pgr, row, PQfnumber( pgr, "high_limit")),
+	      PQgetvalue( pgr, row, PQfnumber( pgr, "low_limit")),
+	      ntohl( *(uint32_t *)PQgetvalue( pgr, row, PQfnumber( pgr, "high_limit_hit"))),
+	      ntohl( *(uint32_t *)PQgetvalue( pgr, row, PQfnumber( pgr, "low_limit_hit"))),
+	      ntohl( *(uint32_t *)PQgetvalue( pgr, row, PQfnumber( pgr, "prec"))));
+
+  max_rate_col = PQfnumber( pgr, "max_rate");
+  chan->has_max_rate = max_rate_col != -1 && !PQgetisnull( pgr, row, max_rate_col);
+  chan->max_rate     = chan->has_max_rate ? unswapd( *(long long *)PQgetvalue( pgr, row, max_rate_col)) : 0;
+  chan->metaseq      = ntohl( *(uint32_t *)PQgetvalue( pgr, row, metaseq_col));
+  return 1;
+}
+
+/** Ask get_values about a channel
+ *  Passes the metaseq we have cached so the database can leave out
+ *  metadata we already know.
+ *
+ * \param b   The circuit
+ * \param sid Our channel identifier
+ */
+PGresult *e_get_values( e_socks_buffer_t *b, uint32_t sid) {
+  void *params[2];
+  int param_lengths[2];
+  int param_formats[2];
+  e_chan_t *chan;
+  uint32_t nsid;
+  uint32_t nseq;
+
+  chan = e_chan_find( b, sid);
+  nsid = htonl( sid);
+  nseq = htonl( chan == NULL ? -1 : chan->metaseq);
+
+  params[0] = &nsid;	param_lengths[0] = sizeof( nsid);	param_formats[0] = 1;
+  params[1] = &nseq;	param_lengths[1] = sizeof( nseq);	param_formats[1] = 1;
+  return e_execPrepared( "get_values", 2, (const char **)params, param_lengths, param_formats, 1);
 }
 
+/** The dbr metadata and maximum update rate that go with a get_values result
+ *  Fresh metadata in the result replaces what the circuit has cached.
+ *
+ * \param b        The circuit
+ * \param sid      Our channel identifier
+ * \param pgr      Result from e_get_values
+ * \param m        Returns the limits, limit hits and precision
+ * \param max_rate Returns the most updates per second (our default unless the channel has its own)
+ */
+void e_chan_values( e_socks_buffer_t *b, uint32_t sid, PGresult *pgr, e_dbr_meta_t *m, double *max_rate) {
+  e_chan_t *chan;
+  e_chan_t fresh;
+
+  memset( &fresh, 0, sizeof( fresh));
+  chan = e_chan_find( b, sid);
+  if( PQntuples( pgr) > 0 && e_chan_row( pgr, 0, &fresh)) {
+    if( chan != NULL) {
+      chan->metaseq      = fresh.metaseq;
+      chan->m            = fresh.m;
+      chan->has_max_rate = fresh.has_max_rate;
+      chan->max_rate     = fresh.max_rate;
+    }
+    chan = &fresh;
+  } else if( chan == NULL) {
+    chan = &fresh;
+  }
+
+  *m        = chan->m;
+  *max_rate = chan->has_max_rate ? chan->max_rate : e_max_rate;
+}
 
 /**
  * \param pgr      result from get_values query
+ * \param meta     limits, limit hits and precision (e_chan_values)
  * \param dbr_type the request return type
  * \param count    the requested count.  If count==0, use the actual return count
  */
-void format_dbr( PGresult *pgr, e_response_t *r, int cmd, int dtype, uint32_t dcount, uint32_t p1, uint32_t p2) {
+void format_dbr( PGresult *pgr, e_dbr_meta_t *meta, e_response_t *r, int cmd, int dtype, uint32_t dcount, uint32_t p1, uint32_t p2) {
   int
     i,				// loop over query results
     n,				// number of query rows to expect
@@ -882,21 +2162,22 @@ void format_dbr( PGresult *pgr, e_response_t *r, int cmd, int dtype, uint32_t dc
     eepoch,			// second portion of time stamp
     ensec;			// nano second portion of time stamp
   char *svalue;			// string returned as the value from the query
-  char *highlimit;		// our high limit 
-  char *lowlimit;		// our low limit 
   void *payload;		// pointer to the packet payload area
-  int highlimithit;		// high limit hit
-  int lowlimithit;		// low limit hit
-  int prec;			// precision for printing
-  int highlimithit_col;		// high limit hit
-  int lowlimithit_col;		// low limit hit
-  int prec_col;			// precision for printing
+  int vals_col;			// array value, if we have one
+  int nvals;			// number of array elements (-1 when we are a scalar)
+  char *first;			// first array element
+  e_dbr_meta_t m;		// what goes in the dbr structure
+
+  if( dtype < 0 || dtype >= E_DBR_N) {
+    fprintf( stderr, "Unknown dbr type %d (format_dbr)\n", dtype);
+    return;
+  }
 
   //
   // Figure the space required
   //
-  struct_size = dbr_sizes[dtype].dbr_struct_size;
-  data_size   = dbr_sizes[dtype].dbr_type_size;
+  struct_size = e_dbrs[dtype].dbr_struct_size;
+  data_size   = e_dbrs[dtype].dbr_type_size;
 
   //
   // pick off time stamps
@@ -906,18 +2187,39 @@ void format_dbr( PGresult *pgr, e_response_t *r, int cmd, int dtype, uint32_t dc
   eepoch = ntohl( *(uint32_t *)PQgetvalue( pgr, 0, PQfnumber( pgr, "eepoch")));
   ensec  = ntohl( *(uint32_t *)PQgetvalue( pgr, 0, PQfnumber( pgr, "ensec")));
 
-  highlimit    = PQgetvalue( pgr, 0, PQfnumber( pgr, "high_limit"));
-  lowlimit     = PQgetvalue( pgr, 0, PQfnumber( pgr, "low_limit"));
+  svalue       = PQgetvalue( pgr, 0, 0);
 
-  highlimithit_col = PQfnumber( pgr, "high_limit_hit");
-  lowlimithit_col  = PQfnumber( pgr, "low_limit_hit");
-  prec_col         = PQfnumber( pgr, "prec");
+  //
+  // The limits and precision come from the channel's metadata cache
+  //
+  m        = *meta;
+  m.eepoch = eepoch;
+  m.ensec  = ensec;
 
-  highlimithit = highlimithit_col != -1 ? ntohl( *(uint32_t *)PQgetvalue( pgr, 0, highlimithit_col))  : 0;
-  lowlimithit  = lowlimithit_col  != -1 ? ntohl( *(uint32_t *)PQgetvalue( pgr, 0, lowlimithit_col))   : 0;
-  prec         = prec_col         != -1 ? ntohl( *(uint32_t *)PQgetvalue( pgr, 0, prec_col)) : 0;
-  svalue       = PQgetvalue( pgr, 0, 0);
+  //
+  // Arrays come back as a binary float8[] that we unpack straight into the reply
+  //
+  vals_col = PQfnumber( pgr, "vals");
+  nvals    = -1;
+  if( vals_col != -1 && !PQgetisnull( pgr, 0, vals_col))
+    nvals = e_array_elements( PQgetvalue( pgr, 0, vals_col), PQgetlength( pgr, 0, vals_col), &first);
+
+  if( nvals >= 0) {
+    if( dtype % 7 == 0)
+      data_size = MAX_STRING_SIZE;
+
+    //
+    // Asking for more than we have gets the rest zero filled
+    //
+    return_dcount = e_array_count( struct_size, data_size, dcount, nvals);
+    payload = create_message( r, cmd, struct_size + data_size * return_dcount, dtype, return_dcount, p1, p2);
+    if( payload == NULL)
+      return;
 
+    mk_dbr_struct( payload, dtype, &m);
+    e_pack_dbr_array( payload + struct_size, dtype, data_size, first, return_dcount < nvals ? return_dcount : nvals);
+    return;
+  }
 
   // Propagate the evil epics fixed length string
   //
@@ -954,13 +2256,14 @@ void format_dbr( PGresult *pgr, e_response_t *r, int cmd, int dtype, uint32_t dc
   // create a message
   //
   payload = create_message( r, cmd, struct_size + data_size * return_dcount, dtype, return_dcount, p1, p2);
-
+  if( payload == NULL)
+    return;
 
   //
   // this is where we'd fill in the structure stuff.  leave it zero for now.
-  // (you did use calloc, not malloc, right?)
+  // (e_out_reserve zeroed it for us)
   //
-  mk_dbr_struct( payload, dtype, eepoch, ensec, highlimit, lowlimit, highlimithit, lowlimithit, prec);
+  mk_dbr_struct( payload, dtype, &m);
 
   payload += struct_size;
 
@@ -1004,6 +2307,7 @@ void read_extended_message_header( e_socks_buffer_t *inbuf, e_extended_message_h
   struct e_message_header mh;
 
   if( get_header_type( inbuf->rbp)) {
+    memcpy( h, inbuf->rbp, sizeof( e_extended_message_header_t));
     h->cmd    = ntohs( h->cmd);
     h->dtype  = ntohs( h->dtype);
     h->p1     = ntohl( h->p1);
@@ -1030,1046 +2334,3854 @@ void read_extended_message_header( e_socks_buffer_t *inbuf, e_extended_message_h
 
 
 
-/** Exchange client and server protocol version numbers
+/** Hash a channel name for the name index
  *
- *          cmd: 0
- * payload size: 0
- *     priority: Virtual circuit priority
- *      version: The version number
- *     reserved: "must be zero" is specified but it appears to be a counter
- *     reserved: "must be zero"
+ * \param name The channel name
+ */
+unsigned int e_name_hash( const char *name) {
+  unsigned int h;
+
+  // FNV-1a
+  for( h = 2166136261u; *name; name++) {
+    h ^= (unsigned char) *name;
+    h *= 16777619u;
+  }
+  return h & (E_NAME_BUCKETS - 1);
+}
+
+/** Look up a channel name in the index
+ *  Safe to call from any thread.
  *
- * tcp and udp
+ * Returns 1 if the name exists, 0 if it does not, -1 if we don't know (ask the database)
  *
- * \param inbuf  The buffer received
- * \param r
+ * \param name The channel name
  */
-void cmd_ca_proto_version( e_socks_buffer_t *inbuf, e_response_t *r) {
-  // 
-  // Docs specify that this command does not request a response but our
-  // implementation will perceive that it does (?)
-  //
-  // for protocol 4.11 (ours) "Server will send response immediately after establishing a virtual circuit"
-  // but the example given does not include such a response.
-  //
-  // Docs also specify that field p1 "Must be 0." but it looks to contain a counter.
-  //
-  e_extended_message_header_t emh;
+int e_name_lookup( const char *name) {
+  e_name_t *n;
+  int rtn;
 
-  read_extended_message_header( inbuf, &emh);
+  rtn = -1;
+  pthread_rwlock_rdlock( &e_names_lock);
+  for( n = e_names[e_name_hash( name)]; n != NULL; n = n->next) {
+    if( strcmp( n->name, name) == 0) {
+      if( n->expires > time( NULL))
+	rtn = n->found;
+      break;
+    }
+  }
+  pthread_rwlock_unlock( &e_names_lock);
+  return rtn;
 }
 
+/** Record what the database told us about a channel name
+ *  Main loop only.
+ *
+ * \param name  The channel name
+ * \param found 1 if it exists
+ */
+void e_name_learn( const char *name, int found) {
+  e_name_t *n;
+  unsigned int h;
+
+  h = e_name_hash( name);
+  pthread_rwlock_wrlock( &e_names_lock);
+  for( n = e_names[h]; n != NULL; n = n->next) {
+    if( strcmp( n->name, name) == 0)
+      break;
+  }
+  if( n == NULL) {
+    n = calloc( sizeof( *n), 1);
+    if( n == NULL || (n->name = strdup( name)) == NULL) {
+      fprintf( stderr, "Out of memory for name index (e_name_learn)\n");
+      free( n);
+      pthread_rwlock_unlock( &e_names_lock);
+      return;
+    }
+    n->next = e_names[h];
+    e_names[h] = n;
+  }
+  n->found   = found;
+  n->expires = time( NULL) + (found ? E_NAME_POS_TTL : E_NAME_NEG_TTL);
+  pthread_rwlock_unlock( &e_names_lock);
+}
 
-
-/** Creates a subscription on a channel
+/** Add a rule to the client filter
+ *  Returns 0 on success or -1 when the rule makes no sense or there are
+ *  too many.
  *
- *            cmd:  1
- *   payload size: 16
- *      data type: desired dbr type
- *     data count: desired number of elements (>=0)
- *            SID: Our channel number
- * subscriptionID: ID client uses to identify this subscription
+ * \param spec  Network as address/bits (bits default to 32)
+ * \param allow 1 to let matching clients in, 0 to turn them away
+ */
+int e_cidr_add( char *spec, int allow) {
+  char addr[INET_ADDRSTRLEN];
+  struct in_addr in;
+  char *slash;
+  int bits;
+
+  if( e_cidrs_n == E_CIDR_MAX) {
+    fprintf( stderr, "Only %d client filter rules, please (e_cidr_add)\n", E_CIDR_MAX);
+    return -1;
+  }
+
+  bits  = 32;
+  slash = strchr( spec, '/');
+  if( slash != NULL) {
+    bits = atoi( slash + 1);
+    if( bits < 0 || bits > 32 || slash - spec >= sizeof( addr))
+      return -1;
+    memcpy( addr, spec, slash - spec);
+    addr[slash - spec] = 0;
+  } else {
+    if( strlen( spec) >= sizeof( addr))
+      return -1;
+    strcpy( addr, spec);
+  }
+  if( inet_pton( AF_INET, addr, &in) != 1)
+    return -1;
+
+  e_cidrs[e_cidrs_n].mask  = bits == 0 ? 0 : 0xffffffff << (32 - bits);
+  e_cidrs[e_cidrs_n].addr  = ntohl( in.s_addr) & e_cidrs[e_cidrs_n].mask;
+  e_cidrs[e_cidrs_n].allow = allow;
+  e_cidrs_n++;
+  if( allow)
+    e_cidrs_allows++;
+  return 0;
+}
+
+/** May this client search for and create our channels?
+ *  Asked before we do any database work for them.
  *
- * tcp
+ * \param peer The client
+ */
+int e_client_allowed( struct sockaddr_in *peer) {
+  uint32_t a;
+  int i;
+
+  a = ntohl( peer->sin_addr.s_addr);
+  for( i=0; i<e_cidrs_n; i++) {
+    if( (a & e_cidrs[i].mask) == e_cidrs[i].addr)
+      return e_cidrs[i].allow;
+  }
+  return e_cidrs_allows == 0;
+}
+
+/** Which of our metric channels is this?
+ *  Returns its index in e_metrics or -1 when the name is not one of ours.
  *
- * \param inbuf The received buffer
- * \param r     Our response
+ * \param name The channel name
  */
-void cmd_ca_proto_event_add( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
-  uint32_t mask, nmask, nsid, ncount, nsubid, nsock, ndtype;
-  void *payload;
-  uint16_t *tmp;
-  void *params[6];
-  int param_lengths[6];
-  int param_formats[6];
-  PGresult *pgr;
+int e_metric_find( char *name) {
+  int len;
+  int k;
 
-  read_extended_message_header( inbuf, &emh);
+  if( e_metric_prefix == NULL)
+    return -1;
 
-  payload = inbuf->rbp + 12;	// skip 3 obsolete 32 bit float values
-  tmp = payload;
-  inbuf->rbp += emh.plsize;
+  len = strlen( e_metric_prefix);
+  if( strncmp( name, e_metric_prefix, len) != 0)
+    return -1;
 
-  nsid   = htonl( emh.p1);
-  nsubid = htonl( emh.p2);
-  mask   = ntohs( *tmp);
-  nmask  = htonl( mask);
-  ncount = htonl( emh.dcount);
-  nsock  = htonl( inbuf->sock);
-  ndtype = htonl( emh.dtype);
+  for( k=0; k<e_metrics_n; k++) {
+    if( strcmp( name + len, e_metrics[k].name) == 0)
+      return k;
+  }
+  return -1;
+}
 
-  params[0] = &nsid;	param_lengths[0] = sizeof( nsid);    param_formats[0] = 1;
-  params[1] = &nsubid;	param_lengths[1] = sizeof( nsubid);  param_formats[1] = 1;
-  params[2] = &nmask;	param_lengths[2] = sizeof( nmask);   param_formats[2] = 1;
-  params[3] = &ncount;	param_lengths[3] = sizeof( ncount);  param_formats[3] = 1;
-  params[4] = &nsock;	param_lengths[4] = sizeof( nsock);   param_formats[4] = 1;
-  params[5] = &ndtype;	param_lengths[5] = sizeof( ndtype);  param_formats[5] = 1;
+/** Number of elements in a metric
+ *
+ * \param k Index in e_metrics
+ */
+int e_metric_count( int k) {
+  return e_metrics[k].kind == E_METRIC_HIST ? E_HIST_BUCKETS : 1;
+}
 
-  pgr = e_execPrepared( "create_monitor", 6, (const char **)params, param_lengths, param_formats, 0);
-  if( pgr == NULL)
-    return;
-  PQclear( pgr);
+/** A metric's current value
+ *  Returns the number of elements.
+ *
+ * \param k Index in e_metrics
+ * \param v Returns the elements (room for E_HIST_BUCKETS)
+ */
+int e_metric_values( int k, double *v) {
+  e_stats_t *st;
+  e_hist_t *h;
+  unsigned long n[E_HIST_BUCKETS];
+  unsigned long sum;
+  int nst;
+  int i;
+  int j;
 
-  params[0] = &nsid;	param_lengths[0] = sizeof( nsid);    param_formats[0] = 1;
-  pgr = e_execPrepared( "get_values", 1, (const char **)params, param_lengths, param_formats, 1);
-  if( pgr == NULL)
-    return;
+  switch( e_metrics[k].kind) {
+  case E_METRIC_ULONG:
+    v[0] = __atomic_load_n( (unsigned long *)e_metrics[k].p, __ATOMIC_RELAXED);
+    return 1;
+
+  case E_METRIC_INT:
+    v[0] = __atomic_load_n( (int *)e_metrics[k].p, __ATOMIC_RELAXED);
+    return 1;
+  }
 
-  // Response
   //
-  //             cmd: 1
-  //    payload size: response size
-  //       data type: same as the request
-  //      data count: same as request
-  //     status code: ECA_NORMAL (1) on success
-  // Subscription ID: same as request
+  // Histograms are the sum of every thread's
   //
-  format_dbr( pgr, r, 1, emh.dtype, emh.dcount, 1, emh.p2);
+  memset( n, 0, sizeof( n));
+  sum = 0;
+  nst = __atomic_load_n( &e_stats_n, __ATOMIC_RELAXED);
+  for( j=0; j<nst && j<E_STATS_THREADS; j++) {
+    st = __atomic_load_n( &e_stats[j], __ATOMIC_ACQUIRE);
+    if( st == NULL)
+      continue;
+    h = (e_hist_t *)((char *)st + e_metrics[k].off);
+    sum += __atomic_load_n( &h->sum, __ATOMIC_RELAXED);
+    for( i=0; i<E_HIST_BUCKETS; i++)
+      n[i] += __atomic_load_n( &h->n[i], __ATOMIC_RELAXED);
+  }
 
-  PQclear( pgr);
+  switch( e_metrics[k].kind) {
+  case E_METRIC_COUNT:
+    v[0] = 0;
+    for( i=0; i<E_HIST_BUCKETS; i++)
+      v[0] += n[i];
+    return 1;
 
-  //  printf( "Event add\n");
+  case E_METRIC_SUM:
+    v[0] = sum;
+    return 1;
+
+  case E_METRIC_HIST:
+    for( i=0; i<E_HIST_BUCKETS; i++)
+      v[i] = n[i];
+    return E_HIST_BUCKETS;
+  }
+  return 0;
 }
 
-/** Clears event subscription
- *
- *            cmd: 2
- *   payload size: 0
- *      data type: Same value sent in the subscribe request (do we check this?)
- *     data count: Same value sent in the subscribe request (Again, do we check this?)
- *            SID: Our channel number
- * SubscriptionID: The client's subscriptino ID
+/** A metric as a binary float8[], the way get_values sends arrays
+ *  So the usual packing code can turn it into any dbr type.  Returns its
+ *  length.
  *
- * tcp
+ * \param k Index in e_metrics
+ * \param a Where the array goes (E_METRIC_ARRAY bytes)
  */
-void cmd_ca_proto_event_cancel( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
-  uint32_t nsid, nsubid;
+int e_metric_array( int k, char *a) {
+  double v[E_HIST_BUCKETS];
+  uint32_t w[5];
+  int32_t len;
+  unsigned long long bits;
+  char *p;
+  int n;
+  int i;
 
-  void *params[2];
-  int param_lengths[2];
-  int param_formats[2];
-  PGresult *pgr;
-  
-  read_extended_message_header( inbuf, &emh);
-
-
-  inbuf->rbp += emh.plsize;
-
-  nsid   = htonl( emh.p1);
-  nsubid = htonl( emh.p2);
-
-  params[0] = &nsid;	param_lengths[0] = sizeof( nsid);    param_formats[0] = 1;
-  params[1] = &nsubid;	param_lengths[1] = sizeof( nsubid);  param_formats[1] = 1;
-
-  pgr = e_execPrepared( "cancel_monitor", 2, (const char **)params, param_lengths, param_formats, 0);
-  if( pgr == NULL)
-    return;
-  PQclear( pgr);
-
-  //  printf( "Event cancel\n");
+  n = e_metric_values( k, v);
+  w[0] = htonl( 1);	// dimensions
+  w[1] = htonl( 0);	// no nulls
+  w[2] = htonl( 701);	// float8
+  w[3] = htonl( n);	// elements
+  w[4] = htonl( 1);	// lower bound
+  memcpy( a, w, sizeof( w));
 
+  p   = a + sizeof( w);
+  len = htonl( sizeof( bits));
+  for( i=0; i<n; i++) {
+    memcpy( p, &len, sizeof( len));
+    p += sizeof( len);
+    bits = swapd( v[i]);
+    memcpy( p, &bits, sizeof( bits));
+    p += sizeof( bits);
+  }
+  return p - a;
 }
 
-/** (depreceitated, unsupported here) Read the value of a chennel
- * cmd 3
- * tcp
- * Deprecated
- * Not supported here
+/** Reply with a metric's value
+ *  The metric channel version of format_dbr.
+ *
+ * \param r      Our response
+ * \param k      Index in e_metrics
+ * \param cmd    The command we are answering
+ * \param dtype  The dbr type they asked for
+ * \param dcount The count they asked for (0 for all of them)
+ * \param p1     Goes in the header
+ * \param p2     So does this
  */
-void cmd_ca_proto_read( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
-
-  read_extended_message_header( inbuf, &emh);
-  //  printf( "Proto Read\n");
+void e_metric_reply( e_response_t *r, int k, int cmd, int dtype, uint32_t dcount, uint32_t p1, uint32_t p2) {
+  char a[E_METRIC_ARRAY];
+  char *first;
+  int nvals;
+  int struct_size;
+  int data_size;
+  uint32_t return_dcount;
+  void *payload;
+  e_dbr_meta_t m;
 
-  inbuf->rbp += emh.plsize;
-}
+  if( dtype >= E_DBR_N) {
+    fprintf( stderr, "Unknown dbr type %d (e_metric_reply)\n", dtype);
+    return;
+  }
 
-/** Write a new channel value
- *
- *          cmd: 4
- * payload size: size of dbr formatted data
- *    data type: dbr type of the data
- *   data count: number of elemets
- *          SID: server channel identifier
- *         IOID: client's identifer of this request
- *
- * tcp
- */
-void cmd_ca_proto_write( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
-  char *payload;
-  void *params[3];
-  int param_lengths[3];
-  int param_formats[3];
-  uint32_t struct_size;
-  uint32_t data_size, s_size;
-  char *sp;
-  PGresult *pgr;
-  uint32_t dbr_type;
-  uint32_t ioid, sid, nsid;
-  char s[128];
+  nvals = e_array_elements( a, e_metric_array( k, a), &first);
+  if( nvals < 0)
+    return;
 
-  read_extended_message_header( inbuf, &emh);
-  sid = emh.p1;
-  nsid = htonl(sid);
-  ioid = emh.p2;
-  emh.dcount = 1;	// hold the arrays
+  struct_size = e_dbrs[dtype].dbr_struct_size;
+  data_size   = dtype % 7 == 0 ? MAX_STRING_SIZE : e_dbrs[dtype].dbr_type_size;
 
-  //
-  // Discover our data size (shouldn't we just create an array at initiallizaion or compile time?...)
-  //
-  dbr_type = htonl(emh.dtype);
-  struct_size = dbr_sizes[emh.dtype].dbr_struct_size;
-  data_size   = dbr_sizes[emh.dtype].dbr_type_size;
+  return_dcount = e_array_count( struct_size, data_size, dcount, nvals);
+  payload = create_message( r, cmd, struct_size + data_size * return_dcount, dtype, return_dcount, p1, p2);
+  if( payload == NULL)
+    return;
 
   //
-  // TO DO:
-  // add proper array support by implementing the postgresql/libpq array structures
+  // No limits or precision and a time stamp of now
   //
-  payload = inbuf->rbp;
-  switch( emh.dtype % 7) {
-  case 0:
-    sp = payload;
-    s_size = strlen( sp)+1;
-    printf( "Proto Write:  String %s\n", sp);
-    if( payload + s_size > inbuf->wbp) {
-      fprintf( stderr, "Bad string detected (cmd_ca_proto_write)\n");
-      inbuf->rbp = inbuf->wbp;
-      return;
-    }
-    payload += s_size + 1;
-    params[0] = &nsid;	        param_lengths[0] = sizeof(nsid);	param_formats[0] = 1;
-    params[1] = sp;		param_lengths[1] = 0;			param_formats[1] = 0;
-    pgr = e_execPrepared( "set_str_value", 2, (const char **)params, param_lengths, param_formats, 0);
-    maybe_check_monitors = 1;
-    if( pgr == NULL)
-      return;
-    PQclear( pgr);
-    break;
-
-  case 1:	// int (16 bit)
-    snprintf( s, sizeof( s)-1, "%d", ntohs(*(int16_t *)payload));
-    s[sizeof(s)-1] = 0;
-    printf( "Proto Write:  16 bit int %s\n", s);
-    payload += 2;
-    params[0] = &nsid;		param_lengths[0] = sizeof( nsid);	param_formats[0] = 1;
-    params[1] = s;		param_lengths[1] = 0;			param_formats[1] = 0;
-    pgr = e_execPrepared( "set_str_value", 2, (const char **)params, param_lengths, param_formats, 0);
-    maybe_check_monitors = 1;
-    if( pgr == NULL)
-      return;
-    PQclear( pgr);
-    break;
-
-  case 2:	// float (32 bit)
-    {
-      uint32_t tmp;
-      tmp = ntohs( *(uint32_t *)payload);
-      snprintf( s, sizeof( s)-1, "%f", *(float *)&tmp);
-      s[sizeof(s)-1] = 0;
-      printf( "Proto Write:  32 bit float %s\n", s);
-      payload += 4;
-      params[0] = &nsid;		param_lengths[0] = sizeof( nsid);	param_formats[0] = 1;
-      params[1] = s;		param_lengths[1] = 0;			param_formats[1] = 0;
-      pgr = e_execPrepared( "set_str_value", 2, (const char **)params, param_lengths, param_formats, 0);
-      maybe_check_monitors = 1;
-      if( pgr == NULL)
-	return;
-      PQclear( pgr);
-    }
-    break;
-
-  case 3:	// enum (16 bit unsigned int)
-    snprintf( s, sizeof( s)-1, "%u", ntohs(*(uint16_t *)payload));
-    s[sizeof(s)-1] = 0;
-    printf( "Proto Write:  enum: %s\n", s);
-    payload += 2;
-    params[0] = &nsid;		param_lengths[0] = sizeof( nsid);	param_formats[0] = 1;
-    params[1] = s;		param_lengths[1] = 0;			param_formats[1] = 0;
-    pgr = e_execPrepared( "set_str_value", 2, (const char **)params, param_lengths, param_formats, 0);
-    maybe_check_monitors = 1;
-    if( pgr == NULL)
-      return;
-    PQclear( pgr);
-    break;
-
-  case 4:	// enum (8 bit unsigned int)
-    snprintf( s, sizeof( s)-1, "%u", *(unsigned char *)payload);
-    s[sizeof(s)-1] = 0;
-    printf( "Proto Write:  8 bit int %s\n", s);
-    payload += 1;
-    params[0] = &nsid;		param_lengths[0] = sizeof( nsid);	param_formats[0] = 1;
-    params[1] = s;		param_lengths[1] = 0;			param_formats[1] = 0;
-    pgr = e_execPrepared( "set_str_value", 2, (const char **)params, param_lengths, param_formats, 0);
-    maybe_check_monitors = 1;
-    if( pgr == NULL)
-      return;
-    PQclear( pgr);
-    break;
-
-  case 5:	// enum (32 bit signed int)
-    snprintf( s, sizeof( s)-1, "%d", ntohl( *(int32_t *)payload));
-    s[sizeof(s)-1] = 0;
-    printf( "Proto Write:  32 bit int %s\n", s);
-    payload += 4;
-    params[0] = &nsid;		param_lengths[0] = sizeof( nsid);	param_formats[0] = 1;
-    params[1] = s;		param_lengths[1] = 0;			param_formats[1] = 0;
-    pgr = e_execPrepared( "set_str_value", 2, (const char **)params, param_lengths, param_formats, 0);
-    maybe_check_monitors = 1;
-    if( pgr == NULL)
-      return;
-    PQclear( pgr);
-    break;
-
-  case 6:	// double (64 bit)
-    snprintf( s, sizeof( s)-1, "%f", unswapd( *(long long *)payload));
-    s[sizeof(s)-1] = 0;
-    printf( "Proto Write:  64 bit double %s\n", s);
-    payload += 8;
-    params[0] = &nsid;		param_lengths[0] = sizeof( nsid);	param_formats[0] = 1;
-    params[1] = s;		param_lengths[1] = 0;			param_formats[1] = 0;
-    pgr = e_execPrepared( "set_str_value", 2, (const char **)params, param_lengths, param_formats, 0);
-    maybe_check_monitors = 1;
-    if( pgr == NULL)
-      return;
-    PQclear( pgr);
-    break;
-  }
-    
-   
-
-  inbuf->rbp += emh.plsize;
-}
-
-/** Obsolete function unsupported here
- * cmd 5
- * tcp
- * obsolete
- * Not supported here
- */
-void cmd_ca_proto_snapshot( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
-
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
+  memset( &m, 0, sizeof( m));
+  mk_dbr_struct( payload, dtype, &m);
+  e_pack_dbr_array( payload + struct_size, dtype, data_size, first, return_dcount < nvals ? return_dcount : nvals);
 }
 
-/** Searches for a given channel name
- *
- *          cmd: 6
- * payload size: padded size of channel name
- *        reply: 10 = don't reply on failed search, 5 = should reply on failed search
- *      version: minor protocol version number
- *          CID: client id number
- * (docs specify that CID should be repeated in parameter 2, I'm not sure this is true)
+/** Does a channel exist?
+ *  Asks the name index first and the database when the index does not know.
+ *  Main loop only (we use the database connection).  Callers have already
+ *  checked the client with e_client_allowed.
  *
- * tcp and udp
+ * \param peer    Who is asking
+ * \param version Their minor protocol version
+ * \param name    The channel name
  */
-void cmd_ca_proto_search( e_socks_buffer_t *inbuf, e_response_t *r) {
-  int reply;
-  int version, versionn;
-  int cid;
-  char *pl;
+int e_channel_search( struct sockaddr_in *peer, int version, char *name) {
+  int versionn;
   int foundIt;
   char *brvp;  // pointer to the boolean returned value
-
-  e_extended_message_header_t emh;
   char* params[3];
   int   paramLengths[3];
   int   paramFormats[3];
   PGresult *pgr;
 
-  read_extended_message_header( inbuf, &emh);
-  pl = inbuf->rbp;
-  pl[emh.plsize-1] = 0;
-  inbuf->rbp += emh.plsize;
-
-  reply   = emh.dtype;
-  version = emh.dcount;
-  versionn = htonl( version);
-  cid     = emh.p1;
-
-  //fprintf( stderr, "Search: plsize = %d, version = %d, reply = %d, cid = %d, PV = '%s'\n", emh.plsize, version, reply, cid, pl);
+  //
+  // Our metric channels are not in the database
+  //
+  if( e_metric_find( name) != -1)
+    return 1;
 
-  if( strcmp( "thisIsTheEnd", pl) == 0) {
-    exit( 0);
+  foundIt = e_name_lookup( name);
+  if( foundIt != -1) {
+    __atomic_add_fetch( &e_search_hits, 1, __ATOMIC_RELAXED);
+    return foundIt;
   }
+  __atomic_add_fetch( &e_search_misses, 1, __ATOMIC_RELAXED);
 
-  params[0] = inet_ntoa( r->peer.sin_addr);	paramLengths[0] = 0;                   paramFormats[0] = 0;
+  versionn = htonl( version);
+  params[0] = inet_ntoa( peer->sin_addr);	paramLengths[0] = 0;                   paramFormats[0] = 0;
   params[1] = (char *)&versionn;                paramLengths[1] = sizeof( versionn);   paramFormats[1] = 1;
-  params[2] = pl;                               paramLengths[2] = 0;                   paramFormats[2] = 0;
+  params[2] = name;                             paramLengths[2] = 0;                   paramFormats[2] = 0;
 
   foundIt = 0;
   pgr = e_execPrepared( "channel_search", 3, (const char **)params, paramLengths, paramFormats, 1);
   if( pgr == NULL)
-    return;
+    return 0;
 
   if( PQgetisnull( pgr, 0, 0) == 0) {
     // only look at a non-null reply
     if( PQgetlength( pgr, 0, 0) != 1) {
-      fprintf( stderr, "Warning: channel_search returned a value of length %d instead of 1 as expected (cmd_ca_proto_search)\n", PQgetlength( pgr, 0, 0));
+      fprintf( stderr, "Warning: channel_search returned a value of length %d instead of 1 as expected (e_channel_search)\n", PQgetlength( pgr, 0, 0));
     } else {
       brvp = (char *)PQgetvalue( pgr, 0, 0);
       if( *brvp != 0) {
-	fprintf( stderr, "Found channel %s\n", pl);
+	fprintf( stderr, "Found channel %s\n", name);
 	foundIt = 1;
       }
     }
   }
   PQclear( pgr);
 
-  if( foundIt) {
-    uint16_t server_protocol_version = 11, *spvp;
-
-    // Response
-    //
-    //          cmd: 6
-    // payload size: 8
-    //  port number: our port number (5064)
-    //   data count: 0
-    //          SID: 0xffffffff
-    //          CID: same as the request
-    //
-    spvp = create_message( r, 6, 8, 5064, 0, 0xffffffff, cid);
-    *spvp = htons(server_protocol_version);
-  }
-
-
-  if( !foundIt && reply == 10) {
-    // Docs specify that reply==10 only on a TCP request and that the reply
-    // should come back over UDP.  We'll just send the reply back over the same socket
-    // it came in on and assume that either the documentation or the protocol are wacky
-    //
-    r->bufsize = sizeof( e_message_header_t);
-    r->buf     = calloc( r->bufsize, 1);
-    if( r->buf == NULL) {
-      fprintf( stderr, "Out of memory (cmd_ca_proto_search)\n");
-      return;
-    }
-    // Response
-    //
-    //          cmd: 14
-    // payload size:  0
-    //   reply flag:  DO_REPLY (aka 10)
-    //      version:  same as request
-    //          CID:  same as request
-    //          CID:  same as request
-    //
-    create_message( r, 14, 0, 10, version, cid, cid);
+  if( strlen( name) < E_NAME_MAX) {
+    e_name_learn( name, foundIt);
   }
+  return foundIt;
 }
 
-
-/** Documented only as being obsolete
- * cmd 7
- * tcp
- * obsolete
- * Not supported here
- */
-void cmd_ca_proto_build( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
-
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-}
-
-/** Disable server from sending subscription updates to this circuit
+/** Exchange client and server protocol version numbers
  *
- *          cmd: 8
+ *          cmd: 0
  * payload size: 0
- *        dtype: 0
- *       length: 0
- *           p1: 0
- *           p2: 0
+ *     priority: Virtual circuit priority
+ *      version: The version number
+ *     reserved: "must be zero" is specified but it appears to be a counter
+ *     reserved: "must be zero"
  *
- * tcp
+ * tcp and udp
+ *
+ * \param inbuf  The buffer received
+ * \param r
  */
-void cmd_ca_proto_events_off( e_socks_buffer_t *inbuf, e_response_t *r) {
+void cmd_ca_proto_version( e_socks_buffer_t *inbuf, e_response_t *r) {
+  // 
+  // Docs specify that this command does not request a response but our
+  // implementation will perceive that it does (?)
+  //
+  // for protocol 4.11 (ours) "Server will send response immediately after establishing a virtual circuit"
+  // but the example given does not include such a response.
+  //
+  // Docs also specify that field p1 "Must be 0." but it looks to contain a counter.
+  //
+  // The priority (data type field) says how urgently this circuit should
+  // be served: 0 (default) to E_PRIO_MAX.  Only virtual circuits have one.
   //
   e_extended_message_header_t emh;
 
   read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  inbuf->events_on = 0;
+
+  if( !inbuf->udp) {
+    inbuf->priority   = emh.dtype > E_PRIO_MAX ? E_PRIO_MAX : emh.dtype;
+    inbuf->prio_class = inbuf->priority * E_PRIO_CLASSES / (E_PRIO_MAX + 1);
+  }
 }
 
 
-/** Enable server sending subscriptions updates to this circuit
- *
- *          cmd: 9
- * payload size: 0
- *        dtype: 0
- *       length: 0
- *           p1: 0
- *           p2: 0
+
+/** make up the reply packet
+ *  The reply has already been serialized into the output arena of outbuf:
+ *  everything from rstart to the end of the arena.
+ *  Virtual circuits just send the arena as a byte stream; datagram
+ *  sockets need to remember where each packet goes.  Replies to the
+ *  peer we are already sending to are packed into its datagram until it
+ *  is E_UDP_MTU long.
  *
- * tcp
+ * \param outbuf     the buffer whose arena holds the reply
+ * \param rstart     offset in the arena where the reply starts
+ * \param fromaddrp  Our from address
+ * \param fromlen    Length of our from address
  */
-void cmd_ca_proto_events_on( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
+void mk_reply( e_socks_buffer_t *outbuf, int rstart, struct sockaddr_in *fromaddrp, int fromlen) {
+  e_reply_queue_t *our_reply;
+  e_reply_queue_t *last_reply;		// points to the last reply in the queue
+  int rsize;
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  inbuf->events_on = 1;
-  //  printf( "Events on\n");
+  if( !outbuf->udp || outbuf->otail <= rstart) {
+    return;
+  }
+  rsize = outbuf->otail - rstart;
+
+  last_reply = outbuf->reply_qtail;
+  if( last_reply != NULL
+      && !(outbuf->oinflight && last_reply == outbuf->reply_q)
+      && last_reply->reply_offset + last_reply->reply_size == rstart
+      && last_reply->reply_size + rsize <= E_UDP_MTU
+      && last_reply->fromlen == fromlen
+      && (fromlen == 0 || (last_reply->fromaddr.sin_addr.s_addr == fromaddrp->sin_addr.s_addr && last_reply->fromaddr.sin_port == fromaddrp->sin_port))) {
+    //
+    // Same peer, room left: ride along
+    //
+    last_reply->reply_size += rsize;
+    return;
+  }
+
+  if( outbuf->reply_free != NULL) {
+    our_reply = outbuf->reply_free;
+    outbuf->reply_free = our_reply->next;
+  } else {
+    our_reply = calloc( sizeof( *our_reply), 1);
+    if( our_reply == NULL) {
+      fprintf( stderr, "Out of memory for our_reply (mk_reply)\n");
+      exit( -1);
+    }
+    __atomic_add_fetch( &e_out_allocs, 1, __ATOMIC_RELAXED);
+  }
+  our_reply->next         = NULL;
+  our_reply->reply_size   = rsize;
+  our_reply->reply_offset = rstart;
+
+  our_reply->fromlen      = fromlen;
+  if( fromlen > 0) {
+    our_reply->fromaddr   = *fromaddrp;
+  }
+
+  //
+  // Add reply to the end of the queue
+  // We'd support packet priorities here, I suppose
+  //
+  if( outbuf->reply_q == NULL)
+    outbuf->reply_q = our_reply;
+  else
+    last_reply->next = our_reply;
+  outbuf->reply_qtail = our_reply;
+  outbuf->reply_qlen++;
+  if( outbuf->reply_qlen > e_udp_qmax)
+    e_udp_qmax = outbuf->reply_qlen;
 }
 
-/** Deprecated and un documented
+/** Encode a monitor update into a socket buffer's output arena
  *
- * cmd 10
- * tcp
- * Deprecated
- * Not implemented here
+ * \param b      The socket buffer
+ * \param subid  Subscription id
+ * \param dtype  The dbr type they asked for
+ * \param cnt    The element count they asked for
+ * \param eepoch Epics time stamp seconds
+ * \param ensec  Epics time stamp nanoseconds
+ * \param svalue The value as text
+ * \param vals   The value as a binary float8[] or NULL for scalars
+ * \param vlen   Length of vals
+ * \param alarm  Alarm state: 1 for the high limit hit, 2 for low (e.alarm_state)
  */
-void cmd_ca_proto_read_sync( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
+void e_monitor_pack( e_socks_buffer_t *b, uint32_t subid, uint32_t dtype, uint32_t cnt, uint32_t eepoch, uint32_t ensec, char *svalue, char *vals, int vlen, int alarm) {
+  e_response_t ert;
+  int struct_size;
+  int data_size;
+  void *payload;
+  int nvals;	// array elements we have (-1 for scalars)
+  char *first;	// the first of them
+  e_dbr_meta_t m;	// what goes in the dbr structure
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  //  printf( "Read Sync\n");
+  if( dtype >= E_DBR_N) {
+    fprintf( stderr, "Unknown dbr type %d (e_monitor_pack)\n", dtype);
+    return;
+  }
+
+  struct_size = e_dbrs[dtype].dbr_struct_size;
+  data_size   = e_dbrs[dtype].dbr_type_size;
+
+  nvals = e_array_elements( vals, vlen, &first);
+  if( nvals >= 0) {
+    if( dtype % 7 == 0)
+      data_size = MAX_STRING_SIZE;
+    cnt = e_array_count( struct_size, data_size, cnt, nvals);
+  } else {
+    // Propagate the evil epics fixed length string
+    //
+    if( dtype % 7 == 0) {
+      if( cnt == 1) {
+	data_size = strlen( svalue) + 1;
+      } else {
+	data_size = MAX_STRING_SIZE;
+      }
+    }
+    cnt = 1;
+  }
+    
+  //    fprintf( stderr, "e_monitor_pack    sock: %d   dtype: %d   cnt: %d   svalue: '%s' struct_size: %d  data_size: %d\n",
+  //                                        b->sock,   dtype,      cnt,      svalue,      struct_size,     data_size);
+
+  //
+  // create the message
+  // 
+  //              cmd:  1
+  //     payload size: size of the dbr data
+  //        data type: same as request
+  //      data length: same as the request (all of them when they asked for 0)
+  //      status code: ECA_NORMAL (1) on success
+  //  subscription id: as the client requested
+  //
+  ert.out = b;
+  payload = create_message( &ert, 1, struct_size + cnt*data_size, dtype, cnt, 1, subid);
+  if( payload == NULL) {
+    fprintf( stderr, "out of memory for buffer %d (e_monitor_pack)\n", b->sock);
+    return;
+  }
+    
+  //
+  // Status and time stamp: graphic and control metadata comes from each
+  // subscriber's template (e_monitor_put)
+  //
+  memset( &m, 0, sizeof( m));
+  m.eepoch       = eepoch;
+  m.ensec        = ensec;
+  m.highlimithit = (alarm & 1) != 0;
+  m.lowlimithit  = (alarm & 2) != 0;
+  mk_dbr_struct( payload, dtype, &m);
+
+  payload += struct_size;
+
+  if( nvals >= 0)
+    e_pack_dbr_array( payload, dtype, data_size, first, cnt < nvals ? cnt : nvals);
+  else
+    pack_dbr_data( payload, dtype, svalue);
+
+  //    fprintf( stderr, "e_monitor_pack hex_dump:\n");
+  //    hex_dump( ert.bufsize, ert.buf);
 }
 
-/** Sends error message and code
- *
- * cmd: 11
- * payload size: Size of the request header that triggered the error plus size of the error message.
- *     reserved: "must be zero"
- *     reserved: "must be zero"
- *          CID: Client's id for the failed channel
- *  Status code: an ECA code
- *
- * tcp
+/** Encode a monitor update once for everyone who wants it this way
+ *  The subscription id is left 0: e_monitor_put fills it in for each
+ *  subscriber.  Returns the encoding with one reference or NULL when we
+ *  are out of memory.
  *
- * UNIMPLIMENTED
+ * \param dtype  The dbr type they asked for
+ * \param cnt    The element count they asked for
+ * \param eepoch Epics time stamp seconds
+ * \param ensec  Epics time stamp nanoseconds
+ * \param svalue The value as text
+ * \param vals   The value as a binary float8[] or NULL for scalars
+ * \param vlen   Length of vals
+ * \param alarm  Alarm state (e.alarm_state)
  */
-void cmd_ca_proto_error( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
+e_enc_t *e_enc_new( uint32_t dtype, uint32_t cnt, uint32_t eepoch, uint32_t ensec, char *svalue, char *vals, int vlen, int alarm) {
+  static __thread e_socks_buffer_t scratch;	// encodings are built in here (its arena only grows)
+  e_enc_t *enc;
+  int n;
+
+  scratch.ohead = 0;
+  scratch.otail = 0;
+  e_monitor_pack( &scratch, 0, dtype, cnt, eepoch, ensec, svalue, vals, vlen, alarm);
+  n = scratch.otail;
+  if( n == 0)
+    return NULL;
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  //  printf( "Proto Error\n");
+  enc = malloc( sizeof( *enc) + n);
+  if( enc == NULL) {
+    fprintf( stderr, "Out of memory for a %d byte monitor update (e_enc_new)\n", n);
+    return NULL;
+  }
+  __atomic_add_fetch( &e_out_allocs, 1, __ATOMIC_RELAXED);
+  enc->refs = 1;
+  enc->meta = NULL;
+  enc->size = n;
+  memcpy( enc->msg, scratch.obuf, n);
+  return enc;
 }
 
-/** Clears the channel (shuts it down)
+/** Encode a reply with no payload
+ *  For write_notify replies sent from the main loop.  The ioid goes in
+ *  when the reply is queued, just like a subscription id.
  *
- *           cmd: 12
- *  payload size: 0
- *     data type: 0
- *   data length: 0
- *           SID: Server's channel identifier
- *           CID: Client's channel identifier
+ * \param cmd    The command
+ * \param dtype  The dbr type
+ * \param dcount The count
+ * \param p1     The first parameter
+ */
+e_enc_t *e_enc_message( uint16_t cmd, uint16_t dtype, uint32_t dcount, uint32_t p1) {
+  static __thread e_socks_buffer_t scratch;	// replies are built in here (its arena only grows)
+  e_response_t er;
+  e_enc_t *enc;
+  int n;
+
+  scratch.ohead = 0;
+  scratch.otail = 0;
+  er.out = &scratch;
+  if( create_message( &er, cmd, 0, dtype, dcount, p1, 0) == NULL)
+    return NULL;
+  n = scratch.otail;
+
+  enc = malloc( sizeof( *enc) + n);
+  if( enc == NULL) {
+    fprintf( stderr, "Out of memory for a %d byte reply (e_enc_message)\n", n);
+    return NULL;
+  }
+  __atomic_add_fetch( &e_out_allocs, 1, __ATOMIC_RELAXED);
+  enc->refs = 1;
+  enc->meta = NULL;
+  enc->size = n;
+  memcpy( enc->msg, scratch.obuf, n);
+  return enc;
+}
+
+/** Build a subscription's template
+ *  Graphic and control updates carry the channel's limits and precision
+ *  after the status and severity.  They do not change from one update to
+ *  the next so we work them out at event_add, from the channel's
+ *  metadata, and again only when that changes (e_sub_refresh).
  *
- * tcp
+ * \param sub   The subscription
+ * \param dtype The dbr type they asked for
+ * \param meta  The channel's metadata (e_chan_values)
  */
-void cmd_ca_proto_clear_channel( e_socks_buffer_t *inbuf, e_response_t *r) {
-  uint32_t sid, cid, sidn, cidn;
-  e_extended_message_header_t emh;
-  char* params[3];
-  int param_lengths[3];
-  int param_formats[3];
-  PGresult *pgr;
+void e_sub_template( e_sub_t *sub, int dtype, e_dbr_meta_t *meta) {
+  int struct_size;
+  char *dbr;
+  e_dbr_meta_t m;
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  sid = emh.p1;
-  sidn = htonl( sid);
-  cid = emh.p2;
-  cidn = htonl( cid);
-  //  printf( "Clear channel sid: %d, cid: %d\n", sid, cid);
+  free( sub->tmpl);
+  sub->tmpl      = NULL;
+  sub->tmpl_size = 0;
 
-  params[0] = inet_ntoa( r->peer.sin_addr); param_lengths[0] = 0;                param_formats[0] = 0;
-  params[1] = (char *)&sidn;                 param_lengths[1] = sizeof(sidn);     param_formats[1] = 1;
-  params[2] = (char *)&cidn;                 param_lengths[2] = sizeof(cidn);     param_formats[2] = 1;
-  
-  pgr = e_execPrepared( "clear_channel", 3, (const char **)params, param_lengths, param_formats, 0);
-  if( pgr != NULL)
-    PQclear( pgr);
+  if( dtype < 21 || dtype > 34)
+    return;
+
+  struct_size = e_dbrs[dtype].dbr_struct_size;
+  dbr = calloc( struct_size, 1);
+  if( dbr == NULL) {
+    fprintf( stderr, "Out of memory for subscription template (e_sub_template)\n");
+    return;
+  }
 
   //
-  // The client does nothing with this message: it's just noise.
+  // Status and severity come from each update's alarm state, not from here
   //
-  // Response
+  m = *meta;
+  m.highlimithit = 0;
+  m.lowlimithit  = 0;
+  mk_dbr_struct( dbr, dtype, &m);
+
   //
-  //          cmd: 12
-  // payload size: 0
-  //    data type: 0
-  //  data length: 0
-  //          SID: server id (as sent to us)
-  //          CID: client id (as sent to us)
+  // Keep everything after status and severity
   //
-  create_message( r, 12, 0, 0, 0, sid, cid);
-  inbuf->active--;
+  memmove( dbr, dbr + 4, struct_size - 4);
+  sub->tmpl       = dbr;
+  sub->tmpl_size  = struct_size - 4;
+  sub->tmpl_dtype = dtype;
 }
 
-/** Beacon sent by server when it becomes available
- *
- *             cmd: 13
- *    payload size:  0
- *     Server port:  TCP at which to find the server
- *        reserved:  0
- *       Beacon ID:  sequential beacon id
- *         Address:  may contain the IP address of the server or may be zero
+/** Bring a subscription up to date with its channel's metadata
+ *  Called when an update comes with newer metadata than the subscription
+ *  was set up with: check_monitors read it once for everyone, so the
+ *  template, the update rate and the circuit's cache come from it
+ *  without asking the database again.
  *
- * udp
+ * \param sub  The subscription
+ * \param meta The metadata the update goes with
  */
-void cmd_ca_proto_rsrv_is_up( e_socks_buffer_t *inbuf, e_response_t *r) {
-  uint32_t beaconid, nbeaconid;
+void e_sub_refresh( e_sub_t *sub, e_chan_t *meta) {
+  e_chan_t *chan;
+
+  chan = e_chan_find( sub->b, sub->sid);
+  if( chan != NULL) {
+    chan->metaseq      = meta->metaseq;
+    chan->m            = meta->m;
+    chan->has_max_rate = meta->has_max_rate;
+    chan->max_rate     = meta->max_rate;
+  }
 
-  struct in_addr addr;
-  e_extended_message_header_t emh;
-  void *params[2];
-  int param_lengths[2];
-  int param_formats[2];
-  PGresult *pgr;
+  if( sub->tmpl != NULL)
+    e_sub_template( sub, sub->tmpl_dtype, &meta->m);
+  e_sub_rate( sub, meta->has_max_rate ? meta->max_rate : e_max_rate);
+  sub->metaseq = meta->metaseq;
+}
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  beaconid = emh.p1;
+/** Queue an encoded monitor update to a subscriber
+ *  A copy into their output arena with their subscription id patched in
+ *  and, for graphic and control types, the metadata from their template.
+ *
+ * \param b     The subscriber's socket buffer
+ * \param sub   Their subscription (NULL if we do not know it)
+ * \param subid Their subscription id
+ * \param enc   The encoded update
+ */
+void e_monitor_put( e_socks_buffer_t *b, e_sub_t *sub, uint32_t subid, e_enc_t *enc) {
+  char *m;
+  uint32_t nsubid;
+  uint16_t dtype;
+  int hsize;
+
+  m = e_out_reserve( b, enc->size);
+  if( m == NULL) {
+    fprintf( stderr, "out of memory for buffer %d (e_monitor_put)\n", b->sock);
+    return;
+  }
+  memcpy( m, enc->msg, enc->size);
 
-  if( emh.p2 == 0) {
-    addr = r->peer.sin_addr;
-  } else {
-    addr.s_addr     = htonl(emh.p2);
+  //
+  // p2 is at the same place in the normal and extended headers
+  //
+  nsubid = htonl( subid);
+  memcpy( m + offsetof( e_message_header_t, p2), &nsubid, sizeof( nsubid));
+
+  if( sub != NULL && sub->tmpl != NULL) {
+    memcpy( &dtype, m + offsetof( e_message_header_t, dtype), sizeof( dtype));
+    hsize = get_header_type( m) ? sizeof( e_extended_message_header_t) : sizeof( e_message_header_t);
+    if( ntohs( dtype) == sub->tmpl_dtype && hsize + 4 + sub->tmpl_size <= enc->size)
+      memcpy( m + hsize + 4, sub->tmpl, sub->tmpl_size);
   }
 
-  nbeaconid = htonl( beaconid);
+  __atomic_add_fetch( &e_io_updates, 1, __ATOMIC_RELAXED);
+  if( b->otail - b->ohead > b->outq_max)
+    b->outq_max = b->otail - b->ohead;
+}
 
-  params[0] = inet_ntoa( addr); param_lengths[0] = 0;                  param_formats[0] = 0;
-  params[1] = &nbeaconid;       param_lengths[1] = sizeof( nbeaconid); param_formats[1] = 1;
-  pgr = e_execPrepared( "beacon_update", 2, (const char **)params, param_lengths, param_formats, 0);
-  if( pgr != NULL)
-    PQclear( pgr);
+/** Send a subscription's held update, if it has one
+ *
+ * \param sub The subscription
+ */
+void e_sub_flush( e_sub_t *sub) {
+  e_enc_t *enc;
 
-  // printf( "Beacon from %s with id %d\n", inet_ntoa( addr), beaconid);
-}
+  if( sub->held == NULL)
+    return;
 
+  enc = sub->held;
+  sub->held      = NULL;
+  sub->last_sent = e_wheel_now();
+  e_monitor_put( sub->b, sub, sub->subid, enc);
+  e_enc_unref( enc);
+}
 
-/** Indicates the requested channel does not exist
- *  Currently unimplement as this is a response command and onlly
- *  implemented in the client.
- *
- *            cmd: 14
- * payload length:  0
- *     reply flag: 10  (AKA DO_REPLY)
- *        version: same as request
- *            CID: same as request
- *            CID: same as request
- * tcp and udp
+/** A rate limited subscription may send again
  *
- * This command should be implemented when we support operations as a client.
- * As a server, this is possibly sent in response to a failed ca_proto_search request.
+ * \param t The subscription's timer
  */
-void cmd_ca_proto_not_found( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
+void e_sub_timer( e_timer_t *t) {
+  e_sub_t *sub;
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  //  printf( "Not Found\n");
+  sub = (e_sub_t *) t;
+  if( sub->b->events_on)
+    e_sub_flush( sub);
 }
 
-
-/** Read the value of a channel
+/** Send every update a circuit has been holding
+ *  After the client turns events back on.
  *
- *          cmd: 15
- * payload size:  0
- *    data type: dbr type
- *   data count: >= 0
- *          SID: server's channel identifier
- *          CID: client's channel identifier
+ * \param b The circuit
+ */
+void e_subs_flush( e_socks_buffer_t *b) {
+  e_sub_t *sub;
+  int i;
+
+  if( b->subs == NULL)
+    return;
+
+  for( i=0; i<E_SUB_BUCKETS; i++) {
+    for( sub = b->subs[i]; sub != NULL; sub = sub->next) {
+      e_timer_cancel( &sub->timer);
+      e_sub_flush( sub);
+    }
+  }
+}
+
+/** Keep an update for later, replacing any we were already keeping
  *
- * tcp
+ * \param sub The subscription
+ * \param enc The encoded update
  */
-void cmd_ca_proto_read_notify( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
-  uint32_t sid, nsid;
-  uint32_t ioid;
-  void *params[1];
-  int   param_lengths[1];
-  int   param_formats[1];
-  PGresult *pgr;
+void e_sub_hold( e_sub_t *sub, e_enc_t *enc) {
+  if( sub->held != NULL) {
+    __atomic_add_fetch( &e_updates_held, 1, __ATOMIC_RELAXED);
+    e_enc_unref( sub->held);
+  }
+  sub->held = e_enc_ref( enc);
+}
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  sid  = emh.p1;
-  ioid = emh.p2;
+/** Send a monitor update to a subscriber, or hold it if they are getting them too fast
+ *  Only the latest held update is kept and it goes out, with its own
+ *  time stamp, as soon as the subscription's rate allows.  While the
+ *  client has events off everything is held until it turns them back on,
+ *  so a stalled client costs us at most one update per subscription.
+ *  Main loop or the shard that owns the subscriber.
+ *
+ * \param b     The subscriber's socket buffer
+ * \param subid Their subscription id
+ * \param enc   The encoded update (we take our own reference if we keep it)
+ */
+void e_monitor_send( e_socks_buffer_t *b, uint32_t subid, e_enc_t *enc) {
+  e_sub_t *sub;
+  uint64_t now;
 
-  //  fprintf( stderr, "Read Notify for sid=%d  ioid=%d   dtype=%d\n", sid, ioid, emh.dtype);
+  sub = e_sub_find( b, subid);
+  if( sub != NULL && sub->metric_sid == 0 && enc->meta != NULL && enc->meta->metaseq != sub->metaseq)
+    e_sub_refresh( sub, enc->meta);
 
-  nsid = htonl(sid);
-  params[0] = &nsid;		param_lengths[0] = sizeof( nsid);	param_formats[0] = 1;
-  //
-  pgr = e_execPrepared( "get_values", 1, (const char **)params, param_lengths, param_formats, 1);
-  if( pgr == NULL)
+  if( sub != NULL && !b->events_on) {
+    e_sub_hold( sub, enc);
     return;
+  }
 
-  //
-  // Docs say p1 is sid but really it is the error code
-  // dbr error code for AOK is 1
-  //
-  //           cmd: 15
+  if( sub != NULL && sub->min_ticks > 0) {
+    now = e_wheel_now();
+    if( now < sub->last_sent + sub->min_ticks) {
+      e_sub_hold( sub, enc);
+      sub->timer.cb = e_sub_timer;
+      if( !sub->timer.pending)
+	e_timer_add( &sub->timer, (sub->last_sent + sub->min_ticks - now) * E_WHEEL_TICK_MS);
+      return;
+    }
+    //
+    // This one is newer than anything we were holding
+    //
+    e_enc_unref( sub->held);
+    sub->held      = NULL;
+    sub->last_sent = now;
+    e_timer_cancel( &sub->timer);
+  }
+
+  e_monitor_put( b, sub, subid, enc);
+}
+
+/** Send subscribers to metric channels their updates
+ *  Each thread has its own timer for the circuits it serves; it stops
+ *  once nobody is subscribed.
+ *
+ * \param t This thread's e_metric_timer
+ */
+void e_metric_tick( e_timer_t *t) {
+  char a[E_METRIC_ARRAY];
+  e_sub_t *sub;
+  e_enc_t *enc;
+  int alen;
+  int subs;	// metric subscriptions we found
+  int i;
+  int k;
+
+  subs = 0;
+  for( k=0; k<n_e_socks; k++) {
+    if( e_sock_bufs[k].subs == NULL)
+      continue;
+    for( i=0; i<E_SUB_BUCKETS; i++) {
+      for( sub = e_sock_bufs[k].subs[i]; sub != NULL; sub = sub->next) {
+	if( sub->metric_sid == 0)
+	  continue;
+	subs++;
+	alen = e_metric_array( sub->metric_sid - E_METRIC_SID, a);
+	enc  = e_enc_new( sub->metric_dtype, sub->metric_count, 0, 0, "", a, alen, 0);
+	if( enc == NULL)
+	  continue;
+	e_monitor_send( e_sock_bufs + k, sub->subid, enc);
+	e_enc_unref( enc);
+      }
+    }
+  }
+
+  if( subs > 0)
+    e_timer_add( t, E_METRIC_MS);
+}
+
+/** Subscribe to a metric channel
+ *  Answered right away with the current value, then every E_METRIC_MS by
+ *  e_metric_tick.
+ *
+ * \param inbuf The circuit
+ * \param r     Our response
+ * \param emh   The event_add request
+ */
+void e_metric_event_add( e_socks_buffer_t *inbuf, e_response_t *r, e_extended_message_header_t *emh) {
+  e_sub_t *sub;
+  e_dbr_meta_t m;
+
+  e_metric_reply( r, emh->p1 - E_METRIC_SID, 1, emh->dtype, emh->dcount, 1, emh->p2);
+  if( inbuf->udp || emh->dtype >= E_DBR_N)
+    return;
+
+  sub = e_sub_add( inbuf, emh->p2, e_max_rate);
+  if( sub == NULL)
+    return;
+  memset( &m, 0, sizeof( m));
+  e_sub_template( sub, emh->dtype, &m);
+  sub->sid          = emh->p1;
+  sub->metaseq      = -1;	// ours never change
+  sub->metric_sid   = emh->p1;
+  sub->metric_dtype = emh->dtype;
+  sub->metric_count = emh->dcount;
+
+  if( e_metric_timer == NULL)
+    e_metric_timer = e_timer_new( e_metric_tick, 0);
+  if( e_metric_timer != NULL && !e_metric_timer->pending)
+    e_timer_add( e_metric_timer, E_METRIC_MS);
+}
+
+/** Creates a subscription on a channel
+ *
+ *            cmd:  1
+ *   payload size: 16
+ *      data type: desired dbr type
+ *     data count: desired number of elements (>=0)
+ *            SID: Our channel number
+ * subscriptionID: ID client uses to identify this subscription
+ *
+ * tcp
+ *
+ * \param inbuf The received buffer
+ * \param r     Our response
+ */
+void cmd_ca_proto_event_add( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+  uint32_t mask, nmask, nsid, ncount, nsubid, nsock, ndtype;
+  void *payload;
+  uint16_t *tmp;
+  double max_rate;	// most updates per second for this subscription
+  e_dbr_meta_t m;	// the channel's limits and precision
+  e_sub_t *sub;		// our record of the subscription
+  e_chan_t *chan;	// and of the channel
+  void *params[6];
+  int param_lengths[6];
+  int param_formats[6];
+  PGresult *pgr;
+
+  read_extended_message_header( inbuf, &emh);
+
+  payload = inbuf->rbp + 12;	// skip 3 obsolete 32 bit float values
+  tmp = payload;
+  inbuf->rbp += emh.plsize;
+
+  nsid   = htonl( emh.p1);
+  nsubid = htonl( emh.p2);
+  mask   = ntohs( *tmp);
+  nmask  = htonl( mask);
+  ncount = htonl( emh.dcount);
+  nsock  = htonl( inbuf->sock);
+  ndtype = htonl( emh.dtype);
+
+  if( emh.dtype >= E_DBR_N) {
+    //
+    // ECA_BADTYPE: the dbr tables stop at E_DBR_N
+    //
+    fprintf( stderr, "Unknown dbr type %d (cmd_ca_proto_event_add)\n", emh.dtype);
+    create_message( r, 1, 0, emh.dtype, 0, 114, emh.p2);
+    return;
+  }
+
+  if( emh.p1 >= E_METRIC_SID) {
+    e_metric_event_add( inbuf, r, &emh);
+    return;
+  }
+
+  params[0] = &nsid;	param_lengths[0] = sizeof( nsid);    param_formats[0] = 1;
+  params[1] = &nsubid;	param_lengths[1] = sizeof( nsubid);  param_formats[1] = 1;
+  params[2] = &nmask;	param_lengths[2] = sizeof( nmask);   param_formats[2] = 1;
+  params[3] = &ncount;	param_lengths[3] = sizeof( ncount);  param_formats[3] = 1;
+  params[4] = &nsock;	param_lengths[4] = sizeof( nsock);   param_formats[4] = 1;
+  params[5] = &ndtype;	param_lengths[5] = sizeof( ndtype);  param_formats[5] = 1;
+
+  pgr = e_execPrepared( "create_monitor", 6, (const char **)params, param_lengths, param_formats, 0);
+  if( pgr == NULL)
+    return;
+  PQclear( pgr);
+
+  pgr = e_get_values( inbuf, emh.p1);
+  if( pgr == NULL)
+    return;
+
+  //
+  // The channel's .MAXRATE kv beats our default
+  //
+  e_chan_values( inbuf, emh.p1, pgr, &m, &max_rate);
+
+  // Response
+  //
+  //             cmd: 1
+  //    payload size: response size
+  //       data type: same as the request
+  //      data count: same as request
+  //     status code: ECA_NORMAL (1) on success
+  // Subscription ID: same as request
+  //
+  format_dbr( pgr, &m, r, 1, emh.dtype, emh.dcount, 1, emh.p2);
+
+  if( !inbuf->udp) {
+    sub = e_sub_add( inbuf, emh.p2, max_rate);
+    if( sub != NULL) {
+      chan = e_chan_find( inbuf, emh.p1);
+      sub->sid          = emh.p1;
+      sub->metaseq      = chan == NULL ? -1 : chan->metaseq;
+      e_sub_template( sub, emh.dtype, &m);
+    }
+  }
+
+  PQclear( pgr);
+
+  //  printf( "Event add\n");
+}
+
+/** Clears event subscription
+ *
+ *            cmd: 2
+ *   payload size: 0
+ *      data type: Same value sent in the subscribe request (do we check this?)
+ *     data count: Same value sent in the subscribe request (Again, do we check this?)
+ *            SID: Our channel number
+ * SubscriptionID: The client's subscriptino ID
+ *
+ * tcp
+ */
+void cmd_ca_proto_event_cancel( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+  uint32_t nsid, nsubid;
+
+  void *params[2];
+  int param_lengths[2];
+  int param_formats[2];
+  PGresult *pgr;
+  
+  read_extended_message_header( inbuf, &emh);
+
+
+  inbuf->rbp += emh.plsize;
+
+  nsid   = htonl( emh.p1);
+  nsubid = htonl( emh.p2);
+
+  params[0] = &nsid;	param_lengths[0] = sizeof( nsid);    param_formats[0] = 1;
+  params[1] = &nsubid;	param_lengths[1] = sizeof( nsubid);  param_formats[1] = 1;
+
+  e_sub_remove( inbuf, emh.p2);
+  if( emh.p1 >= E_METRIC_SID)
+    return;
+
+  pgr = e_execPrepared( "cancel_monitor", 2, (const char **)params, param_lengths, param_formats, 0);
+  if( pgr == NULL)
+    return;
+  PQclear( pgr);
+
+  //  printf( "Event cancel\n");
+
+}
+
+/** (depreceitated, unsupported here) Read the value of a chennel
+ * cmd 3
+ * tcp
+ * Deprecated
+ * Not supported here
+ */
+void cmd_ca_proto_read( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  //  printf( "Proto Read\n");
+
+  inbuf->rbp += emh.plsize;
+}
+
+/** Write a new channel value
+ *
+ *          cmd: 4
+ * payload size: size of dbr formatted data
+ *    data type: dbr type of the data
+ *   data count: number of elemets
+ *          SID: server channel identifier
+ *         IOID: client's identifer of this request
+ *
+ * tcp
+ */
+void cmd_ca_proto_write( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+  char *payload;
+  void *params[3];
+  int param_lengths[3];
+  int param_formats[3];
+  char *sp;
+  PGresult *pgr;
+  uint32_t ioid, sid, nsid;
+  char s[128];
+
+  read_extended_message_header( inbuf, &emh);
+  sid = emh.p1;
+  nsid = htonl(sid);
+  ioid = emh.p2;
+
+  //
+  // Metric channels are read only
+  //
+  if( sid >= E_METRIC_SID) {
+    inbuf->rbp += emh.plsize;
+    return;
+  }
+
+  if( emh.dtype >= E_DBR_N) {
+    fprintf( stderr, "Unknown dbr type %d (cmd_ca_proto_write)\n", emh.dtype);
+    inbuf->rbp += emh.plsize;
+    return;
+  }
+
+  //
+  // Arrays are stored as postgres array literals.
+  // Char arrays are long strings (channel names ending in $) and stay below.
+  //
+  if( emh.dcount > 1 && emh.dtype % 7 != 4) {
+    sp = e_array_literal( inbuf->rbp, emh.dtype, emh.dcount, emh.plsize);
+    if( sp != NULL) {
+      params[0] = &nsid;	param_lengths[0] = sizeof( nsid);	param_formats[0] = 1;
+      params[1] = sp;		param_lengths[1] = 0;			param_formats[1] = 0;
+      pgr = e_execPrepared( "set_str_value", 2, (const char **)params, param_lengths, param_formats, 0);
+      maybe_check_monitors = 1;
+      free( sp);
+      if( pgr != NULL)
+	PQclear( pgr);
+    }
+    inbuf->rbp += emh.plsize;
+    return;
+  }
+  emh.dcount = 1;
+
+  //
+  // The dbr table decodes the value into text for set_str_value.
+  // Strings are passed straight from the payload so long ones are not truncated.
+  //
+  payload = inbuf->rbp;
+  if( e_dbrs[emh.dtype].unpack( payload, inbuf->wbp - payload, s, sizeof( s)) < 0) {
+    fprintf( stderr, "Bad %s detected (cmd_ca_proto_write)\n", e_dbrs[emh.dtype].dbr_name);
+    inbuf->rbp = inbuf->wbp;
+    return;
+  }
+  sp = emh.dtype % 7 == 0 ? payload : s;
+  printf( "Proto Write:  %s %s\n", e_dbrs[emh.dtype].dbr_name, sp);
+
+  params[0] = &nsid;		param_lengths[0] = sizeof( nsid);	param_formats[0] = 1;
+  params[1] = sp;		param_lengths[1] = 0;			param_formats[1] = 0;
+  pgr = e_execPrepared( "set_str_value", 2, (const char **)params, param_lengths, param_formats, 0);
+  maybe_check_monitors = 1;
+  if( pgr == NULL)
+    return;
+  PQclear( pgr);
+
+  inbuf->rbp += emh.plsize;
+}
+
+/** Obsolete function unsupported here
+ * cmd 5
+ * tcp
+ * obsolete
+ * Not supported here
+ */
+void cmd_ca_proto_snapshot( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+}
+
+/** Searches for a given channel name
+ *
+ *          cmd: 6
+ * payload size: padded size of channel name
+ *        reply: 10 = don't reply on failed search, 5 = should reply on failed search
+ *      version: minor protocol version number
+ *          CID: client id number
+ * (docs specify that CID should be repeated in parameter 2, I'm not sure this is true)
+ *
+ * tcp and udp
+ */
+void cmd_ca_proto_search( e_socks_buffer_t *inbuf, e_response_t *r) {
+  int reply;
+  int version;
+  int cid;
+  char *pl;
+  int foundIt;
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  pl = inbuf->rbp;
+  pl[emh.plsize-1] = 0;
+  inbuf->rbp += emh.plsize;
+
+  reply   = emh.dtype;
+  version = emh.dcount;
+  cid     = emh.p1;
+
+  //fprintf( stderr, "Search: plsize = %d, version = %d, reply = %d, cid = %d, PV = '%s'\n", emh.plsize, version, reply, cid, pl);
+
+  if( strcmp( "thisIsTheEnd", pl) == 0) {
+    exit( 0);
+  }
+
+  if( !e_client_allowed( &r->peer)) {
+    __atomic_add_fetch( &e_search_rejects, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  foundIt = e_channel_search( &r->peer, version, pl);
+
+  if( foundIt) {
+    uint16_t server_protocol_version = 11, *spvp;
+
+    // Response
+    //
+    //          cmd: 6
+    // payload size: 8
+    //  port number: our port number (5064)
+    //   data count: 0
+    //          SID: 0xffffffff
+    //          CID: same as the request
+    //
+    spvp = create_message( r, 6, 8, 5064, 0, 0xffffffff, cid);
+    if( spvp != NULL)
+      *spvp = htons(server_protocol_version);
+  }
+
+
+  if( !foundIt && reply == 10) {
+    // Docs specify that reply==10 only on a TCP request and that the reply
+    // should come back over UDP.  We'll just send the reply back over the same socket
+    // it came in on and assume that either the documentation or the protocol are wacky
+    //
+    // Response
+    //
+    //          cmd: 14
+    // payload size:  0
+    //   reply flag:  DO_REPLY (aka 10)
+    //      version:  same as request
+    //          CID:  same as request
+    //          CID:  same as request
+    //
+    create_message( r, 14, 0, 10, version, cid, cid);
+  }
+}
+
+
+/** Documented only as being obsolete
+ * cmd 7
+ * tcp
+ * obsolete
+ * Not supported here
+ */
+void cmd_ca_proto_build( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+}
+
+/** Disable server from sending subscription updates to this circuit
+ *
+ *          cmd: 8
+ * payload size: 0
+ *        dtype: 0
+ *       length: 0
+ *           p1: 0
+ *           p2: 0
+ *
+ * tcp
+ */
+void cmd_ca_proto_events_off( e_socks_buffer_t *inbuf, e_response_t *r) {
+  //
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  inbuf->events_on = 0;
+}
+
+
+/** Enable server sending subscriptions updates to this circuit
+ *
+ *          cmd: 9
+ * payload size: 0
+ *        dtype: 0
+ *       length: 0
+ *           p1: 0
+ *           p2: 0
+ *
+ * tcp
+ */
+void cmd_ca_proto_events_on( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  inbuf->events_on = 1;
+
+  //
+  // Everything we held while they were off goes out now
+  //
+  e_subs_flush( inbuf);
+  //  printf( "Events on\n");
+}
+
+/** Deprecated and un documented
+ *
+ * cmd 10
+ * tcp
+ * Deprecated
+ * Not implemented here
+ */
+void cmd_ca_proto_read_sync( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  //  printf( "Read Sync\n");
+}
+
+/** Sends error message and code
+ *
+ * cmd: 11
+ * payload size: Size of the request header that triggered the error plus size of the error message.
+ *     reserved: "must be zero"
+ *     reserved: "must be zero"
+ *          CID: Client's id for the failed channel
+ *  Status code: an ECA code
+ *
+ * tcp
+ *
+ * UNIMPLIMENTED
+ */
+void cmd_ca_proto_error( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  //  printf( "Proto Error\n");
+}
+
+/** Clears the channel (shuts it down)
+ *
+ *           cmd: 12
+ *  payload size: 0
+ *     data type: 0
+ *   data length: 0
+ *           SID: Server's channel identifier
+ *           CID: Client's channel identifier
+ *
+ * tcp
+ */
+void cmd_ca_proto_clear_channel( e_socks_buffer_t *inbuf, e_response_t *r) {
+  uint32_t sid, cid, sidn, cidn;
+  e_extended_message_header_t emh;
+  char* params[3];
+  int param_lengths[3];
+  int param_formats[3];
+  PGresult *pgr;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  sid = emh.p1;
+  sidn = htonl( sid);
+  cid = emh.p2;
+  cidn = htonl( cid);
+  //  printf( "Clear channel sid: %d, cid: %d\n", sid, cid);
+
+  params[0] = inet_ntoa( r->peer.sin_addr); param_lengths[0] = 0;                param_formats[0] = 0;
+  params[1] = (char *)&sidn;                 param_lengths[1] = sizeof(sidn);     param_formats[1] = 1;
+  params[2] = (char *)&cidn;                 param_lengths[2] = sizeof(cidn);     param_formats[2] = 1;
+  
+  if( sid < E_METRIC_SID) {
+    pgr = e_execPrepared( "clear_channel", 3, (const char **)params, param_lengths, param_formats, 0);
+    if( pgr != NULL)
+      PQclear( pgr);
+    e_chan_remove( inbuf, sid);
+  }
+
+  //
+  // The client does nothing with this message: it's just noise.
+  //
+  // Response
+  //
+  //          cmd: 12
+  // payload size: 0
+  //    data type: 0
+  //  data length: 0
+  //          SID: server id (as sent to us)
+  //          CID: client id (as sent to us)
+  //
+  create_message( r, 12, 0, 0, 0, sid, cid);
+  inbuf->active--;
+}
+
+/** Beacon sent by server when it becomes available
+ *
+ *             cmd: 13
+ *    payload size:  0
+ *     Server port:  TCP at which to find the server
+ *        reserved:  0
+ *       Beacon ID:  sequential beacon id
+ *         Address:  may contain the IP address of the server or may be zero
+ *
+ * udp
+ */
+void cmd_ca_proto_rsrv_is_up( e_socks_buffer_t *inbuf, e_response_t *r) {
+  uint32_t beaconid, nbeaconid;
+
+  struct in_addr addr;
+  e_extended_message_header_t emh;
+  void *params[2];
+  int param_lengths[2];
+  int param_formats[2];
+  PGresult *pgr;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  beaconid = emh.p1;
+
+  if( emh.p2 == 0) {
+    addr = r->peer.sin_addr;
+  } else {
+    addr.s_addr     = htonl(emh.p2);
+  }
+
+  nbeaconid = htonl( beaconid);
+
+  params[0] = inet_ntoa( addr); param_lengths[0] = 0;                  param_formats[0] = 0;
+  params[1] = &nbeaconid;       param_lengths[1] = sizeof( nbeaconid); param_formats[1] = 1;
+  pgr = e_execPrepared( "beacon_update", 2, (const char **)params, param_lengths, param_formats, 0);
+  if( pgr != NULL)
+    PQclear( pgr);
+
+  // printf( "Beacon from %s with id %d\n", inet_ntoa( addr), beaconid);
+}
+
+
+/** Indicates the requested channel does not exist
+ *  Currently unimplement as this is a response command and onlly
+ *  implemented in the client.
+ *
+ *            cmd: 14
+ * payload length:  0
+ *     reply flag: 10  (AKA DO_REPLY)
+ *        version: same as request
+ *            CID: same as request
+ *            CID: same as request
+ * tcp and udp
+ *
+ * This command should be implemented when we support operations as a client.
+ * As a server, this is possibly sent in response to a failed ca_proto_search request.
+ */
+void cmd_ca_proto_not_found( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  //  printf( "Not Found\n");
+}
+
+
+/** Read the value of a channel
+ *
+ *          cmd: 15
+ * payload size:  0
+ *    data type: dbr type
+ *   data count: >= 0
+ *          SID: server's channel identifier
+ *          CID: client's channel identifier
+ *
+ * tcp
+ */
+void cmd_ca_proto_read_notify( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+  uint32_t sid;
+  uint32_t ioid;
+  double max_rate;
+  e_dbr_meta_t m;
+  PGresult *pgr;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  sid  = emh.p1;
+  ioid = emh.p2;
+
+  //  fprintf( stderr, "Read Notify for sid=%d  ioid=%d   dtype=%d\n", sid, ioid, emh.dtype);
+
+  if( emh.dtype >= E_DBR_N) {
+    //
+    // ECA_BADTYPE: the dbr tables stop at E_DBR_N
+    //
+    fprintf( stderr, "Unknown dbr type %d (cmd_ca_proto_read_notify)\n", emh.dtype);
+    create_message( r, 15, 0, emh.dtype, 0, 114, ioid);
+    return;
+  }
+
+  if( sid >= E_METRIC_SID) {
+    e_metric_reply( r, sid - E_METRIC_SID, 15, emh.dtype, emh.dcount, 1, ioid);
+    return;
+  }
+
+  pgr = e_get_values( inbuf, sid);
+  if( pgr == NULL)
+    return;
+  e_chan_values( inbuf, sid, pgr, &m, &max_rate);
+
+  //
+  // Docs say p1 is sid but really it is the error code
+  // dbr error code for AOK is 1
+  //
+  //           cmd: 15
   //  payload size: size of our payload
   //     data type: type of payload (hint: same as request)
   //   data length: number of elements (should be same as request)
   //    error code: 1 for AOK
   //          ioid: Id from client
   //
-  format_dbr( pgr, r, 15, emh.dtype, emh.dcount, 1, ioid);
+  format_dbr( pgr, &m, r, 15, emh.dtype, emh.dcount, 1, ioid);
+
+  PQclear( pgr);
+  
+
+  //  fprintf( stderr, "read_notify result:\n");
+  //  hex_dump( r->bufsize, r->buf);
+}
+
+/** Obsolete and undocumented
+ *
+ * cmd 16
+ * tcp
+ * Obsolete
+ * Not implemented here
+ */
+void cmd_ca_proto_read_build( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  //  printf( "Read Build\n");
+}
+
+/** Confirms successful repeater client registration
+ *
+ *           cmd: 17
+ *  payload size:  0
+ *     data type:  0
+ *   data length:  0
+ *   parameter 1:  0
+ *   parameter 2:  server ip address
+ *
+ * udp
+ * TODO
+ * Implement when we start operating as a repeater
+ */
+void cmd_ca_repeater_confirm( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  //  printf( "Repeater Confirm\n");
+}
+
+/** How long is the message starting here?
+ *  Returns the header plus payload size, or 0 when not even the header
+ *  has arrived yet.
+ *
+ * \param p   Start of the message
+ * \param end End of the data we have
+ */
+uint32_t e_msg_size( char *p, char *end) {
+  if( p + sizeof( e_message_header_t) > end)
+    return 0;
+
+  if( get_header_type( p)) {
+    if( p + sizeof( e_extended_message_header_t) > end)
+      return 0;
+    return sizeof( e_extended_message_header_t) + ntohl( ((e_extended_message_header_t *) p)->plsize);
+  }
+  return sizeof( e_message_header_t) + ntohs( ((e_message_header_t *) p)->plsize);
+}
+
+/** Is the next message in the buffer a complete create_chan?
+ *
+ * \param inbuf The buffer received
+ */
+int e_next_is_create( e_socks_buffer_t *inbuf) {
+  uint32_t size;
+
+  if( inbuf->rbp + sizeof( e_message_header_t) > inbuf->wbp || get_command( inbuf->rbp) != 18)
+    return 0;
+
+  size = e_msg_size( inbuf->rbp, inbuf->wbp);
+  return size > sizeof( e_message_header_t) && inbuf->rbp + size <= inbuf->wbp;
+}
+
+/** Monotonic nanoseconds for the capture
+ */
+uint64_t e_cap_now() {
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Start capturing our traffic
+ *  Returns -1 if we could not.
+ *
+ * \param path The file to capture to (overwritten)
+ */
+int e_cap_open( char *path) {
+  e_cap_file_t hdr;
+  struct timespec ts;
+
+  e_cap_file = fopen( path, "w");
+  if( e_cap_file == NULL) {
+    fprintf( stderr, "Could not open capture file %s: %s (e_cap_open)\n", path, strerror( errno));
+    return -1;
+  }
+  setvbuf( e_cap_file, NULL, _IOFBF, E_CAP_BUFSIZE);
+
+  clock_gettime( CLOCK_REALTIME, &ts);
+  hdr.magic    = E_CAP_MAGIC;
+  hdr.version  = E_CAP_VERSION;
+  hdr.epoch_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  e_cap_t0     = e_cap_now();
+  if( fwrite( &hdr, sizeof( hdr), 1, e_cap_file) != 1) {
+    fprintf( stderr, "Could not write capture file %s (e_cap_open)\n", path);
+    fclose( e_cap_file);
+    e_cap_file = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/** Capture something
+ *  Costs nothing but the test when we are not capturing.
+ *
+ * \param kind E_CAP_OPEN ...
+ * \param conn Circuit number (0 for datagrams and NOTIFYs)
+ * \param peer Who it is from (NULL for the database)
+ * \param data What they sent
+ * \param len  Its length
+ */
+void e_cap_note( int kind, uint32_t conn, struct sockaddr_in *peer, void *data, uint32_t len) {
+  e_cap_rec_t rec;
+
+  if( e_cap_file == NULL)
+    return;
+
+  rec.t    = e_cap_now() - e_cap_t0;
+  rec.conn = conn;
+  rec.addr = peer == NULL ? 0 : peer->sin_addr.s_addr;
+  rec.port = peer == NULL ? 0 : peer->sin_port;
+  rec.kind = kind;
+  rec.len  = len;
+
+  pthread_mutex_lock( &e_cap_lock);
+  fwrite( &rec, sizeof( rec), 1, e_cap_file);
+  if( len > 0)
+    fwrite( data, len, 1, e_cap_file);
+  e_cap_records++;
+  e_cap_bytes += sizeof( rec) + len;
+  pthread_mutex_unlock( &e_cap_lock);
+}
+
+/** Capture a NOTIFY: the channel name then the payload
+ *
+ * \param n The notification
+ */
+void e_cap_notify( PGnotify *n) {
+  char buf[512];	// ours are a word or two
+  char *p;
+  int rl, el;
+
+  if( e_cap_file == NULL)
+    return;
+
+  rl = strlen( n->relname) + 1;
+  el = strlen( n->extra) + 1;
+  p  = buf;
+  if( rl + el > sizeof( buf)) {
+    p = malloc( rl + el);
+    if( p == NULL) {
+      fprintf( stderr, "Out of memory for a %d byte NOTIFY, not capturing it (e_cap_notify)\n", rl + el);
+      return;
+    }
+  }
+  memcpy( p, n->relname, rl);
+  memcpy( p + rl, n->extra, el);
+  e_cap_note( E_CAP_NOTIFY, 0, NULL, p, rl + el);
+  if( p != buf)
+    free( p);
+}
+
+/** Push the capture out to its file
+ *  Driven by cap_timer so a capture cut short loses at most a second.
+ *
+ * \param t Our timer
+ */
+void cap_flush( e_timer_t *t) {
+  pthread_mutex_lock( &e_cap_lock);
+  fflush( e_cap_file);
+  pthread_mutex_unlock( &e_cap_lock);
+  e_timer_add( t, E_CAP_FLUSH_MS);
+}
+
+/** Tell the client their channel is ready
+ *
+ * \param inbuf    The circuit
+ * \param r        Our response
+ * \param cid      The client's channel identifier
+ * \param sid      Ours
+ * \param dbr_type The channel's native type
+ * \param dcount   And length
+ * \param access   Read (1) and write (2) access
+ */
+void e_create_reply( e_socks_buffer_t *inbuf, e_response_t *r, uint32_t cid, uint32_t sid, uint32_t dbr_type, uint32_t dcount, uint32_t access) {
+  e_message_header_t *h1, *h2, *h3;
+
+  r->bufsize = 3*sizeof( e_message_header_t);
+  r->buf     = e_out_reserve( r->out, r->bufsize);
+  if( r->buf == NULL) {
+    fprintf( stderr, "Out of memory (e_create_reply)\n");
+    return;
+  }
+
+  h1 = (e_message_header_t *)r->buf;
+  h2 = h1 + 1;
+  h3 = h2 + 1;
+  //
+  // Responses (3, count 'em, 3)
+  //
+  // the protocol reponse cmd 3, minor version 11
+  // access rights
+  // and
+  //           cmd: 18
+  //  payload size:  0
+  //     data type: native type
+  //    data count: native length
+  //           CID: as the client sent us
+  //           SID: our channel identifier
+  //
+  create_message_header( h1,  0, 0, 0, 11,   0,   0);		// protocol response: cmd:0  minor version: 11 (in data length field)
+  create_message_header( h2, 22, 0, 0,  0, cid, access);		// grant read (1) and write (2) access
+  create_message_header( h3, 18, 0, dbr_type,  dcount, cid, sid);	// channel create response
+
+  if( inbuf->cap_id != 0) {
+    uint32_t ids[2] = { cid, sid};
+
+    e_cap_note( E_CAP_SID, inbuf->cap_id, &inbuf->peer, ids, sizeof( ids));
+  }
+
+  if( inbuf->active == -1) {
+    inbuf->active = 1;
+  } else {
+    inbuf->active++;
+  }
+}
+
+/** Requests the creation of a channel
+ *
+ *            cmd: 18
+ *   payload size: padded length of the channel name
+ *       reserved: 0
+ *       reserved: 0
+ *            CID: client's channel identifier
+ * client version: minor protocol version of the client
+ *
+ * tcp
+ *
+ * Clients opening a screen send hundreds of these at once: we take this
+ * one and every complete create_chan right behind it in the buffer (up
+ * to E_CREATE_BURST) and resolve them with one call to
+ * e.create_channels.  The batch counts as one message against the
+ * circuit's budget.
+ */
+void cmd_ca_proto_create_chan( e_socks_buffer_t *inbuf, e_response_t *r) {
+  uint32_t cids[E_CREATE_BURST];
+  uint32_t versions[E_CREATE_BURST];
+  char *names[E_CREATE_BURST];
+  uint32_t cid;
+  uint32_t sid;
+  uint32_t dbr_type;
+  uint32_t dcount;
+  e_chan_t *chan;	// where we cache the channel's metadata
+  int n;		// number of creates we are doing
+  int i;
+  int len;		// room needed for the arrays
+  char *cidsa, *versionsa, *namesa;	// the arrays as postgres array literals
+  char *cp, *vp, *np, *sp;
+  
+  char* params[6];
+  int   paramLengths[6];
+  int   paramFormats[6];
+  PGresult *pgr;
+  e_extended_message_header_t emh;
+  int j;		// requests left for the database
+  int k;		// metric channel
+
+  n   = 0;
+  len = 0;
+  do {
+    read_extended_message_header( inbuf, &emh);
+    names[n] = inbuf->rbp;		// pointer to our string
+    if( emh.plsize > 0)
+      names[n][emh.plsize-1] = 0;	// ensure it is null terminated
+    else
+      names[n] = "";
+    inbuf->rbp += emh.plsize;
+    cids[n]     = emh.p1;
+    versions[n] = emh.p2;
+    len += 2*strlen( names[n]) + 3;	// quoted, every character escaped at worst, and a comma
+    n++;
+  } while( n < E_CREATE_BURST && e_next_is_create( inbuf));
+
+  //  fprintf( stderr, "Create Chan with %d names starting with '%s'\n", n, names[0]);
+  //
+  // Clients the filter turns away get a create failure for each request
+  // without us bothering the database
+  //
+  if( !e_client_allowed( &r->peer)) {
+    __atomic_add_fetch( &e_create_rejects, n, __ATOMIC_RELAXED);
+    for( i=0; i<n; i++)
+      create_message( r, 26, 0, 0, 0, cids[i], 0);
+    if( inbuf->active == -1)
+      inbuf->active = 0;
+    return;
+  }
+
+  //
+  // Our metric channels (read only doubles) are answered here and the
+  // rest go to the database
+  //
+  j = 0;
+  for( i=0; i<n; i++) {
+    k = e_metric_find( names[i]);
+    if( k != -1) {
+      e_create_reply( inbuf, r, cids[i], E_METRIC_SID + k, 6, e_metric_count( k), 1);
+      len -= 2*strlen( names[i]) + 3;
+      continue;
+    }
+    cids[j]     = cids[i];
+    versions[j] = versions[i];
+    names[j]    = names[i];
+    j++;
+  }
+  n = j;
+  if( n == 0)
+    return;
+
+  if( inbuf->host_name == NULL)
+    inbuf->host_name = strdup("");
+  if( inbuf->user_name == NULL)
+    inbuf->user_name = strdup("");
+
+  //
+  // Array literals: {1,2,3} and {"name1","name2"}
+  //
+  cidsa     = malloc( n*12 + 3);
+  versionsa = malloc( n*12 + 3);
+  namesa    = malloc( len + 3);
+  if( cidsa == NULL || versionsa == NULL || namesa == NULL) {
+    fprintf( stderr, "Out of memory (cmd_ca_proto_create_chan)\n");
+    free( cidsa);
+    free( versionsa);
+    free( namesa);
+    return;
+  }
+  cp = cidsa;
+  vp = versionsa;
+  np = namesa;
+  *cp++ = '{';
+  *vp++ = '{';
+  *np++ = '{';
+  for( i=0; i<n; i++) {
+    if( i > 0) {
+      *cp++ = ',';
+      *vp++ = ',';
+      *np++ = ',';
+    }
+    cp += sprintf( cp, "%d", (int32_t) cids[i]);
+    vp += sprintf( vp, "%d", (int32_t) versions[i]);
+    *np++ = '"';
+    for( sp = names[i]; *sp; sp++) {
+      if( *sp == '"' || *sp == '\\')
+	*np++ = '\\';
+      *np++ = *sp;
+    }
+    *np++ = '"';
+  }
+  strcpy( cp, "}");
+  strcpy( vp, "}");
+  strcpy( np, "}");
+
+  params[0] = inet_ntoa( r->peer.sin_addr); paramLengths[0] = 0;                paramFormats[0] = 0;
+  params[1] = inbuf->host_name;	             paramLengths[1] = 0;                paramFormats[1] = 0;
+  params[2] = inbuf->user_name;              paramLengths[2] = 0;                paramFormats[2] = 0;
+  params[3] = cidsa;                         paramLengths[3] = 0;                paramFormats[3] = 0;
+  params[4] = versionsa;                     paramLengths[4] = 0;                paramFormats[4] = 0;
+  params[5] = namesa;	                     paramLengths[5] = 0;                paramFormats[5] = 0;
+
+  pgr = e_execPrepared( "create_channels", 6, (const char **)params, paramLengths, paramFormats, 1);
+  free( cidsa);
+  free( versionsa);
+  free( namesa);
+  if( pgr == NULL)
+    return;
+
+  for( i=0; i<PQntuples( pgr); i++) {
+    cid = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "cid")));
+
+    if( PQgetisnull( pgr, i, PQfnumber( pgr, "sid")) != 1) {
+      //
+      // Success
+      //
+      sid      = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "sid")));
+      dbr_type = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "dbr_type")));
+      dcount   = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "dcount")));
+
+      //
+      // Cache the channel's metadata for reads and monitors
+      //
+      chan = e_chan_add( inbuf, sid);
+      if( chan != NULL)
+	e_chan_row( pgr, i, chan);
+
+      e_create_reply( inbuf, r, cid, sid, dbr_type, dcount, 3);
+    } else {
+      //
+      // Failed to create channel
+      //
+      //             cmd: 26
+      //  payload length: 0
+      //       data type: 0
+      //     data length: 0
+      //             CID: from client
+      //     parameter 2: 0
+      //
+      create_message( r, 26, 0, 0, 0, cid, 0);
+
+      if( inbuf->active == -1) {
+	//
+	// First attempt after the connection
+	// just let it die
+	//
+	inbuf->active = 0;
+      }
+    }
+  }
+
+  PQclear( pgr);
+}
+
+/** Writes the new channel value
+ *
+ *          cmd: 19
+ * payload size: size of the dbr formatted payload
+ *    data type: dbr type of the data
+ *   data count: number of elements
+ *          SID: server's id for this channel
+ *         IOID: client's id for this request
+ *
+ * Every request is answered, arrays included.  A command the database
+ * queues for the MD2 is only answered once it has finished, when its kv
+ * changes, or has timed out (-w): see check_puts.  Everything else is
+ * answered here, failures with the status saying why.
+ *
+ * tcp
+ */
+void cmd_ca_proto_write_notify( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+  void *params[7];
+  int param_lengths[7];
+  int param_formats[7];
+  PGresult *pgr;
+  uint32_t ioid, sid;
+  uint32_t nsid, nsock, nioid, ndtype, ncount, ntmo;
+  char *payload;
+  char *sp;		// the value as text
+  char *literal;	// array literal to free, if that is what sp is
+  char s[128];
+  int rtn_value;
+
+  read_extended_message_header( inbuf, &emh);
+  payload = inbuf->rbp;
+  inbuf->rbp += emh.plsize;
+
+  sid  = emh.p1;
+  ioid = emh.p2;
+  rtn_value = 160;	// ECA_PUTFAIL unless the database says otherwise
+
+  //
+  // The value as text, the same way cmd_ca_proto_write does it
+  //
+  sp      = NULL;
+  literal = NULL;
+  if( sid >= E_METRIC_SID) {
+    rtn_value = 376;	// ECA_NOWTACCESS: metric channels are read only
+  } else if( emh.dtype >= E_DBR_N) {
+    fprintf( stderr, "Unknown dbr type %d (cmd_ca_proto_write_notify)\n", emh.dtype);
+  } else if( emh.dcount > 1 && emh.dtype % 7 != 4) {
+    literal = e_array_literal( payload, emh.dtype, emh.dcount, emh.plsize);
+    sp = literal;
+  } else if( e_dbrs[emh.dtype].unpack( payload, emh.plsize, s, sizeof( s)) < 0) {
+    fprintf( stderr, "Bad %s detected (cmd_ca_proto_write_notify)\n", e_dbrs[emh.dtype].dbr_name);
+  } else {
+    sp = emh.dtype % 7 == 0 ? payload : s;
+  }
+
+  if( sp != NULL) {
+    printf( "Proto Write Notify:  %s %s\n", e_dbrs[emh.dtype].dbr_name, literal != NULL ? "array" : sp);
+
+    nsid   = htonl( sid);
+    nsock  = htonl( inbuf->sock);
+    nioid  = htonl( ioid);
+    ndtype = htonl( emh.dtype);
+    ncount = htonl( emh.dcount);
+    ntmo   = htonl( e_put_tmo);
+    params[0] = &nsid;		param_lengths[0] = sizeof( nsid);	param_formats[0] = 1;
+    params[1] = sp;		param_lengths[1] = 0;			param_formats[1] = 0;
+    params[2] = &nsock;		param_lengths[2] = sizeof( nsock);	param_formats[2] = 1;
+    params[3] = &nioid;		param_lengths[3] = sizeof( nioid);	param_formats[3] = 1;
+    params[4] = &ndtype;	param_lengths[4] = sizeof( ndtype);	param_formats[4] = 1;
+    params[5] = &ncount;	param_lengths[5] = sizeof( ncount);	param_formats[5] = 1;
+    params[6] = &ntmo;		param_lengths[6] = sizeof( ntmo);	param_formats[6] = 1;
+    pgr = e_execPrepared( "put_notify", 7, (const char **)params, param_lengths, param_formats, 1);
+    maybe_check_monitors = 1;
+    free( literal);
+    if( pgr != NULL) {
+      rtn_value = ntohl( *(uint32_t *)PQgetvalue( pgr, 0, PQfnumber( pgr, "rtn")));
+      PQclear( pgr);
+    }
+
+    //
+    // Queued for the MD2: check_puts replies when the command has finished
+    //
+    if( rtn_value == 0) {
+      __atomic_add_fetch( &e_puts_waiting, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  //
+  // Response
+  //
+  //           cmd: 19
+  //  payload size:  0
+  //     data type: same as request
+  //   data length: same as request
+  //   status code: ECA_NORMAL (1), ECA_PUTFAIL (160: bad type or payload,
+  //                short array, database failure) or ECA_NOWTACCESS (376)
+  //          IOID: from client
+  //
+  create_message( r, 19, 0, emh.dtype, emh.dcount, rtn_value, ioid);
+}
+
+/** Sends the local username to the server
+ *
+ *           cmd: 20
+ *  payload size: string length of the user name
+ *     data type: 0
+ *   data length: 0
+ *   parameter 1: 0
+ *   parameter 2: 0
+ *
+ * tcp
+ */
+void cmd_ca_proto_client_name( e_socks_buffer_t *inbuf, e_response_t *r) {
+  char *clientName;
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  clientName = inbuf->rbp;
+  clientName[emh.plsize - 1] = 0;
+  inbuf->rbp += emh.plsize;
+
+  if( inbuf->user_name != NULL) {
+    free( inbuf->user_name);
+  }
+  inbuf->user_name = strdup( clientName);
+
+  //  printf( "Client Name '%s'\n", clientName);
+  //
+  // no response
+  //
+}
+
+/** Sends the local host name to the server
+ *
+ *          cmd: 21
+ * payload size: string length of the hostname
+ *    data type: 0
+ *  data length: 0
+ *  parameter 1: 0
+ *  parameter 1: 0
+ *
+ * tcp
+ */
+void cmd_ca_proto_host_name( e_socks_buffer_t *inbuf, e_response_t *r) {
+  //
+  char *hostName;
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  hostName = inbuf->rbp;
+  hostName[emh.plsize - 1] = 0;
+  inbuf->rbp += emh.plsize;
+
+  if( inbuf->host_name != NULL) {
+    free( inbuf->host_name);
+  }
+  inbuf->host_name = strdup( hostName);
+
+  //  printf( "Host Name '%s'\n", hostName);
+  //
+  // no response
+  //
+}
+
+/** Response command: notify client of access rights
+ *  Only needed as a command in the client
+ *
+ *            cmd: 22
+ *   payload size:  0
+ *      data type:  0
+ * payload length:  0
+ *            CID:  client channel identifier
+ *  Access Rights: 0 = no rights, 1 = read only, 2 = write only (really?), 3 = read and write
+ *
+ * tcp
+ */
+void cmd_ca_proto_access_rights( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  //  printf( "Access Rights\n");
+}
+
+/** Connection verify
+ *
+ *          cmd: 23
+ * payload size:  0
+ *    data type:  0
+ *  data length:  0
+ *  parameter 1:  0
+ *  parameter 2:  0
+ *
+ * tcp and udp
+ */
+void cmd_ca_proto_echo( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  //  printf( "Echo\n");
+
+  // Response
+  //
+  //          cmd: 23
+  // payload size: 0
+  //    data type: 0
+  //   data count: 0
+  //  parameter 1: 0
+  //  parameter 2: 0
+  //
+  create_message( r, 23, 0, 0, 0, 0, 0);
+}
+
+/** Requests registration with the repeater
+ *  NOT IMPLEMENTED
+ *
+ * cmd: 24
+ * payload size: 0
+ *    data type: 0
+ *  data length: 0
+ *  parameter 1: 0
+ *  parameter 2: IP address of client
+ *
+ * udp
+ * TODO
+ */
+void cmd_ca_repeater_register( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  //  printf( "Repeater Register\n");
+}
+
+/** obsolete and undocumented
+ *
+ * cmd: 25
+ * tcp
+ * Obsolete
+ * Not implemented here
+ */
+void cmd_ca_proto_signal( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  //  printf( "Signal\n");
+}
+
+/** Response to a failed channel creation
+ *  Not implemented as it is only a command on the client side
+ *
+ *          cmd: 26
+ * payload size:  0
+ *    data type:  0
+ *  data length:  0
+ *          CID:  cient id as in the original request
+ *  parameter 2:  0
+ *
+ * tcp
+ * TODO: Implement when we need to act as a client.
+ */
+void cmd_ca_proto_create_ch_fail( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  //  printf( "Create ch fail\n");
+}
+
+/** Notifies client that server has disconnected the channel
+ *  This is a reponse command and unimplemented here
+ *
+ *          cmd: 27
+ * payload size:  0
+ *    data type:  0
+ *  data length:  0
+ *          CID:  The client channel identifier
+ *  parameter 2:  0
+ *
+ * tcp
+ * TODO: Implement when we need to act as a client
+ */
+void cmd_ca_proto_server_disconn( e_socks_buffer_t *inbuf, e_response_t *r) {
+  e_extended_message_header_t emh;
+
+  read_extended_message_header( inbuf, &emh);
+  inbuf->rbp += emh.plsize;
+  //  printf( "Server Disconnect\n");
+}
+
+
+
+/** Command array to access commands in an O(1) manner
+ */
+void (*cmds[])(e_socks_buffer_t *, e_response_t *) = {
+  cmd_ca_proto_version,		//  0
+  cmd_ca_proto_event_add,	//  1
+  cmd_ca_proto_event_cancel,	//  2
+  cmd_ca_proto_read,		//  3
+  cmd_ca_proto_write,		//  4
+  cmd_ca_proto_snapshot,	//  5
+  cmd_ca_proto_search,		//  6
+  cmd_ca_proto_build,		//  7
+  cmd_ca_proto_events_off,	//  8
+  cmd_ca_proto_events_on,	//  9
+  cmd_ca_proto_read_sync,	// 10
+  cmd_ca_proto_error,		// 11
+  cmd_ca_proto_clear_channel,	// 12
+  cmd_ca_proto_rsrv_is_up,	// 13
+  cmd_ca_proto_not_found,	// 14
+  cmd_ca_proto_read_notify,	// 15
+  cmd_ca_proto_read_build,	// 16
+  cmd_ca_repeater_confirm,	// 17
+  cmd_ca_proto_create_chan,	// 18
+  cmd_ca_proto_write_notify,	// 19
+  cmd_ca_proto_client_name,	// 20
+  cmd_ca_proto_host_name,	// 21
+  cmd_ca_proto_access_rights,	// 22
+  cmd_ca_proto_echo,		// 23
+  cmd_ca_repeater_register,	// 24
+  cmd_ca_proto_signal,		// 25
+  cmd_ca_proto_create_ch_fail,	// 26
+  cmd_ca_proto_server_disconn	// 27
+};
+_Static_assert( sizeof( cmds)/sizeof( cmds[0]) == E_CMDS, "E_CMDS must match cmds[]");
+
+
+
+/** Fix up buffer pointers
+ *
+ * Take all unread bytes in the buffer
+ * and move them to the front.
+ */
+void fixup_bps( e_socks_buffer_t *b) {
+  int nbytes;
+
+  if( b==NULL || b->buf==NULL) {
+    fprintf( stderr, "Bad buffer pointer (why?) (fixup_bps)\n");
+    return;
+  }
+  if( b->wbp < b->rbp) {
+    fprintf( stderr, "Read and write buffer out of sync? (fixup_bps)\n");
+    return;
+  }
+  nbytes = b->wbp - b->rbp;
+  memmove( b->buf, b->rbp, nbytes);
+  b->rbp = b->buf;
+  b->wbp = b->buf + nbytes;
+}
+
+/** Make room in a socket's input buffer for a message of n bytes
+ *  Waveform writes can be much bigger than the buffer we start with.
+ *  Returns 0 on success, -1 when the message is too big or we are out of memory.
+ *
+ * \param b The socket buffer
+ * \param n The size of the whole message
+ */
+int e_in_reserve( e_socks_buffer_t *b, uint32_t n) {
+  char *nb;
+  int nbytes;
+
+  if( n <= b->bufsize)
+    return 0;
+
+  if( n > E_MSG_MAX) {
+    fprintf( stderr, "Message of %u bytes on sock %d is too big (e_in_reserve)\n", n, b->sock);
+    return -1;
+  }
+
+  fixup_bps( b);
+  nbytes = b->wbp - b->rbp;
+  nb = realloc( b->buf, n);
+  if( nb == NULL) {
+    fprintf( stderr, "Out of memory for a %u byte message on sock %d (e_in_reserve)\n", n, b->sock);
+    return -1;
+  }
+  __atomic_add_fetch( &e_out_allocs, 1, __ATOMIC_RELAXED);
+  b->buf     = nb;
+  b->rbp     = nb;
+  b->wbp     = nb + nbytes;
+  b->bufsize = n;
+  return 0;
+}
+
+
+/** Retire the packet at the head of a datagram socket's reply queue
+ *
+ * \param outbuf The socket buffer
+ */
+void e_reply_done( e_socks_buffer_t *outbuf) {
+  e_reply_queue_t *done;
+
+  done = outbuf->reply_q;
+  outbuf->reply_q = done->next;
+  if( outbuf->reply_q == NULL)
+    outbuf->reply_qtail = NULL;
+  outbuf->reply_qlen--;
+  outbuf->ohead   = done->reply_offset + done->reply_size;
+  done->next = outbuf->reply_free;
+  outbuf->reply_free = done;
+}
+
+/** Note how many datagrams the kernel has dropped on a socket
+ *  SO_RXQ_OVFL hands us the running count with each datagram.
+ *
+ * \param b   The socket buffer
+ * \param msg The received message with its control data
+ */
+void e_udp_note_drops( e_socks_buffer_t *b, struct msghdr *msg) {
+  struct cmsghdr *cm;
+  uint32_t drops;
+
+  for( cm = CMSG_FIRSTHDR( msg); cm != NULL; cm = CMSG_NXTHDR( msg, cm)) {
+    if( cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+      memcpy( &drops, CMSG_DATA( cm), sizeof( drops));
+      b->rx_drops = drops;
+    }
+  }
+}
+
+/** Send a circuit to the back of the run queue
+ *  We stop reading from it until e_run_service gives it another turn.
+ *
+ * \param b The circuit
+ */
+void e_run_defer( e_socks_buffer_t *b) {
+  int c;
+
+  if( b->run_wait)
+    return;
+
+  c = b->prio_class;
+  if( e_run_qlen[c] >= sizeof( e_run_q[c])/sizeof( e_run_q[c][0])) {
+    // Can't happen: one entry per socket
+    fprintf( stderr, "Run queue full, dropping sock %d (e_run_defer)\n", b->sock);
+    b->active = 0;
+    return;
+  }
+  b->run_wait = 1;
+  b->turns_deferred++;
+  e_run_q[c][(e_run_qhead[c] + e_run_qlen[c]) % (sizeof( e_run_q[c])/sizeof( e_run_q[c][0]))] = b->sock;
+  e_run_qlen[c]++;
+  e_run_waiting++;
+  __atomic_add_fetch( &e_run_deferrals, 1, __ATOMIC_RELAXED);
+}
+
+/** Run every complete command sitting in a socket's input buffer
+ *  Whatever we say in response is serialized into the socket's output
+ *  arena and queued as a single reply.
+ *
+ * \param inbuf     Our input buffer
+ * \param sock      The socket the commands came in on
+ * \param fromaddrp Who sent them
+ */
+void ca_process( e_socks_buffer_t *inbuf, int sock, struct sockaddr_in *fromaddrp) {
+  e_response_t ert;			// our response
+  e_extended_message_header_t bad_cmd_header;	// used to skip commands we do not know how to handle
+  void *old_rbp;			// used to be sure we are still reading from the buffer
+  int cmd;				// our current command
+  uint32_t size;			// size of the current message
+  uint64_t t0;				// when the command started
+
+  inbuf->last_rx = e_wheel_now();
+  inbuf->msgs = 0;
+  inbuf->turns++;
+  if( inbuf->wbp - inbuf->rbp > inbuf->inq_max)
+    inbuf->inq_max = inbuf->wbp - inbuf->rbp;
+
+  //
+  // Everything we say in response to this read is serialized
+  // straight into our output arena starting here
+  //
+  if( inbuf->ohead == inbuf->otail && !inbuf->oinflight) {
+    inbuf->ohead = 0;
+    inbuf->otail = 0;
+  }
+  inbuf->ostart = inbuf->otail;
+
+  while( inbuf->rbp < inbuf->wbp) {
+
+    old_rbp = inbuf->rbp;
+
+    size = e_msg_size( inbuf->rbp, inbuf->wbp);
+    if( !inbuf->udp && (size == 0 || inbuf->rbp + size > inbuf->wbp)) {
+      //
+      // The rest of this message is still on its way:
+      // make sure it will fit and wait for it
+      //
+      if( e_in_reserve( inbuf, size) == -1) {
+	inbuf->active = 0;
+      }
+      break;
+    }
+
+    cmd = get_command( inbuf->rbp);
+    if( cmd <0 || cmd >= E_CMDS) {
+      //
+      // Bad command: either a protocol version problem or we have a messed up packet.
+      //
+      read_extended_message_header( inbuf, &bad_cmd_header);
+      inbuf->rbp += bad_cmd_header.plsize;
+      fprintf( stderr, "unsupported command %d with payload size %d\n", cmd, bad_cmd_header.plsize);
+      if( inbuf->rbp > inbuf->wbp) {
+	fprintf( stderr, "request to read more bytes than we have: likely we've screwed up the buffer, reseting\n");
+	inbuf->rbp = inbuf->buf;
+	inbuf->wbp = inbuf->buf;
+	break;
+      }
+    } else {
+      //
+      // Good command
+      //
+      if( !inbuf->udp && inbuf->msgs++ >= E_MSG_BUDGET) {
+	//
+	// Most commands go to the database: after a few let the
+	// other circuits have a turn.  Stopping here keeps the rest of
+	// the buffer in order.
+	//
+	e_run_defer( inbuf);
+	break;
+      }
+      ert.sock    = sock;
+      ert.peer    = *fromaddrp;
+      ert.bufsize = 0;
+      ert.buf     = NULL;
+      ert.out     = inbuf;
+      t0 = e_ticks();
+      cmds[cmd](inbuf, &ert);
+      e_hist_time( e_stats_mine()->cmd + cmd, t0);
+    }
+    if( inbuf->rbp == old_rbp) {
+      // nothing left we can read
+      break;
+    }
+  }
+
+  //	fprintf( stderr, "Making reply of %d bytes for socket %d\n", inbuf->otail - inbuf->ostart, sock);
+
+  mk_reply( inbuf, inbuf->ostart, fromaddrp, sizeof( *fromaddrp));
+  inbuf->ostart = -1;
+  if( inbuf->otail - inbuf->ohead > inbuf->outq_max)
+    inbuf->outq_max = inbuf->otail - inbuf->ohead;
+  e_hist_note( &e_stats_mine()->replyq, inbuf->otail - inbuf->ohead);
+}
+
+/** Another turn for a circuit that used up its budget
+ *
+ * \param sock The circuit
+ */
+void e_run_turn( int sock) {
+  e_socks_buffer_t *b;
+  int k;
+
+  for( k=0; k<n_e_socks; k++) {
+    if( e_sock_bufs[k].sock == sock && e_sock_bufs[k].run_wait) {
+      b = e_sock_bufs + k;
+      b->run_wait = 0;
+      if( b->active != 0) {
+	ca_process( b, b->sock, &b->peer);
+      }
+      return;
+    }
+  }
+  // Gone while it waited
+}
+
+/** Give circuits waiting in the run queue another turn
+ *  Circuits that use up their budget again go back to the end of their class's queue.
+ *  Called once per pass through the poll loop so network I/O keeps
+ *  flowing between turns.
+ *
+ *  Higher priority classes go first and get more turns per pass
+ *  (E_PRIO_TURNS doubling with each class) but every class gets some,
+ *  so an archiver at priority 0 still makes progress under a busy GUI.
+ */
+void e_run_service() {
+  int n, sock, c;
+
+  for( c = E_PRIO_CLASSES - 1; c >= 0; c--) {
+    n = E_PRIO_TURNS << c;
+    if( n > e_run_qlen[c])
+      n = e_run_qlen[c];
+    for( ; n > 0; n--) {
+      sock = e_run_q[c][e_run_qhead[c]];
+      e_run_qhead[c] = (e_run_qhead[c] + 1) % (sizeof( e_run_q[c])/sizeof( e_run_q[c][0]));
+      e_run_qlen[c]--;
+      e_run_waiting--;
+      e_run_turn( sock);
+    }
+  }
+}
+
+/** Is this datagram ours to answer?
+ *  Every socket in the SO_REUSEPORT search group gets its own copy of a
+ *  broadcast, so broadcasts are split between the main loop (id 0) and
+ *  the search workers by sender.  Unicast datagrams went to just one of
+ *  us already.
+ *
+ * \param b    The socket buffer (NULL for a search worker)
+ * \param msg  The received message with its control data
+ * \param from The sender
+ * \param id   Who we are: 0 for the main loop, 1 through e_search_workers for the workers
+ */
+int e_udp_ours( e_socks_buffer_t *b, struct msghdr *msg, struct sockaddr_in *from, int id) {
+  struct cmsghdr *cm;
+  struct in_pktinfo pi;
+
+  if( e_search_workers == 0 || (b != NULL && b != e_sock_bufs + search_index)) {
+    return 1;
+  }
+
+  for( cm = CMSG_FIRSTHDR( msg); cm != NULL; cm = CMSG_NXTHDR( msg, cm)) {
+    if( cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_PKTINFO) {
+      memcpy( &pi, CMSG_DATA( cm), sizeof( pi));
+      if( pi.ipi_addr.s_addr == pi.ipi_spec_dst.s_addr) {
+	// sent to us and only us
+	return 1;
+      }
+      break;
+    }
+  }
+  return (ntohl( from->sin_addr.s_addr) ^ ntohs( from->sin_port)) % (e_search_workers + 1) == id;
+}
+
+/** Send a batch of queued datagrams
+ *  One sendmmsg for up to E_UDP_BATCH packets.
+ *
+ * \param pfd   The pollfd structure for this socket
+ * \param inbuf Our socket buffer
+ */
+void ca_udp_send( struct pollfd *pfd, e_socks_buffer_t *inbuf) {
+  static struct mmsghdr msgs[E_UDP_BATCH];
+  static struct iovec iovs[E_UDP_BATCH];
+  e_reply_queue_t *next;
+  int n, i, sent_count;
+
+  memset( msgs, 0, sizeof( msgs));
+  for( n=0, next=inbuf->reply_q; n<E_UDP_BATCH && next != NULL; n++, next=next->next) {
+    iovs[n].iov_base = inbuf->obuf + next->reply_offset;
+    iovs[n].iov_len  = next->reply_size;
+    msgs[n].msg_hdr.msg_iov     = iovs + n;
+    msgs[n].msg_hdr.msg_iovlen  = 1;
+    msgs[n].msg_hdr.msg_name    = &next->fromaddr;
+    msgs[n].msg_hdr.msg_namelen = next->fromlen;
+  }
+
+  sent_count = sendmmsg( pfd->fd, msgs, n, 0);
+  __atomic_add_fetch( &e_io_syscalls, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch( &e_udp_tx_calls, 1, __ATOMIC_RELAXED);
+  if( sent_count == -1) {
+    if( errno == EAGAIN)
+      return;
+    next = inbuf->reply_q;
+    fprintf( stderr, "fromlen: %d     fromaddr: %s\n", next->fromlen, inet_ntoa( next->fromaddr.sin_addr));
+    perror( "ca_udp_send");
+    if( pfd->fd == beacons) {
+      hex_dump( next->reply_size, inbuf->obuf + next->reply_offset);
+    } else {
+      inbuf->active = 0;
+    }
+    //
+    // Datagrams go out whole or not at all
+    //
+    e_reply_done( inbuf);
+    return;
+  }
+
+  __atomic_add_fetch( &e_udp_tx_dgrams, sent_count, __ATOMIC_RELAXED);
+  for( i=0; i<sent_count; i++) {
+    e_reply_done( inbuf);
+  }
+}
+
+/** Read a batch of datagrams and run each one
+ *  One recvmmsg for up to E_UDP_BATCH datagrams, each processed with its own sender.
+ *
+ * \param pfd   The pollfd structure for this socket
+ * \param inbuf Our socket buffer
+ */
+void ca_udp_recv( struct pollfd *pfd, e_socks_buffer_t *inbuf) {
+  static char dgrams[E_UDP_BATCH][E_UDP_DGRAM];
+  static char cmsgs[E_UDP_BATCH][E_UDP_CMSG_SPACE];
+  static struct sockaddr_in froms[E_UDP_BATCH];
+  static struct mmsghdr msgs[E_UDP_BATCH];
+  static struct iovec iovs[E_UDP_BATCH];
+  int i, n;
+
+  for( i=0; i<E_UDP_BATCH; i++) {
+    iovs[i].iov_base = dgrams[i];
+    iovs[i].iov_len  = E_UDP_DGRAM;
+    msgs[i].msg_hdr.msg_iov        = iovs + i;
+    msgs[i].msg_hdr.msg_iovlen     = 1;
+    msgs[i].msg_hdr.msg_name       = froms + i;
+    msgs[i].msg_hdr.msg_namelen    = sizeof( froms[i]);
+    msgs[i].msg_hdr.msg_control    = cmsgs[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof( cmsgs[i]);
+    msgs[i].msg_hdr.msg_flags      = 0;
+  }
+
+  n = recvmmsg( pfd->fd, msgs, E_UDP_BATCH, MSG_DONTWAIT, NULL);
+  __atomic_add_fetch( &e_io_syscalls, 1, __ATOMIC_RELAXED);
+  if( n <= 0) {
+    // we assume the UDP listening socket is not going to close on its own
+    return;
+  }
+  __atomic_add_fetch( &e_udp_rx_calls, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch( &e_udp_rx_dgrams, n, __ATOMIC_RELAXED);
+
+  for( i=0; i<n; i++) {
+    e_udp_note_drops( inbuf, &msgs[i].msg_hdr);
+    if( !e_udp_ours( inbuf, &msgs[i].msg_hdr, froms + i, 0)) {
+      continue;
+    }
+    e_cap_note( E_CAP_UDP, 0, froms + i, dgrams[i], msgs[i].msg_len);
+
+    //
+    // Each datagram stands on its own: run it straight out of the batch
+    //
+    inbuf->rbp = dgrams[i];
+    inbuf->wbp = dgrams[i] + msgs[i].msg_len;
+    ca_process( inbuf, pfd->fd, froms + i);
+  }
+  inbuf->rbp = inbuf->buf;
+  inbuf->wbp = inbuf->buf;
+}
+
+/** Socket options shared by our datagram sockets
+ *  Receive buffer size (when asked for) and drop counting.
+ *
+ * \param sock The socket
+ */
+void e_udp_sockopts( int sock) {
+  int opt_param;
+
+  if( e_udp_rcvbuf > 0) {
+    opt_param = e_udp_rcvbuf;
+    if( setsockopt( sock, SOL_SOCKET, SO_RCVBUF, &opt_param, sizeof( opt_param)) == -1) {
+      perror( "udp RCVBUF");
+    }
+  }
+  opt_param = 1;
+  if( setsockopt( sock, SOL_SOCKET, SO_RXQ_OVFL, &opt_param, sizeof( opt_param)) == -1) {
+    perror( "udp RXQ_OVFL");
+  }
+}
+
+/** Queue a search for the main loop to take to the database
+ *  Called by the search workers.
+ *
+ * \param peer    Who asked
+ * \param cid     Their channel id
+ * \param version Their minor protocol version
+ * \param reply   Their reply flag
+ * \param name    The channel name
+ */
+void e_search_enqueue( struct sockaddr_in *peer, uint32_t cid, int version, int reply, char *name) {
+  e_search_req_t *sr;
+  uint64_t one = 1;
+  int kick;
+
+  pthread_mutex_lock( &e_search_lock);
+  if( e_search_qlen >= E_SEARCH_QUEUE_MAX) {
+    e_search_overflows++;
+    pthread_mutex_unlock( &e_search_lock);
+    return;
+  }
+  if( e_search_free != NULL) {
+    sr = e_search_free;
+    e_search_free = sr->next;
+  } else {
+    sr = malloc( sizeof( *sr));
+    if( sr == NULL) {
+      pthread_mutex_unlock( &e_search_lock);
+      fprintf( stderr, "Out of memory for search request (e_search_enqueue)\n");
+      return;
+    }
+  }
+  sr->next    = NULL;
+  sr->peer    = *peer;
+  sr->cid     = cid;
+  sr->version = version;
+  sr->reply   = reply;
+  strncpy( sr->name, name, sizeof( sr->name) - 1);
+  sr->name[sizeof( sr->name) - 1] = 0;
+
+  if( e_search_qtail == NULL)
+    e_search_q = sr;
+  else
+    e_search_qtail->next = sr;
+  e_search_qtail = sr;
+  kick = e_search_qlen++ == 0;
+  pthread_mutex_unlock( &e_search_lock);
+
+  if( kick && write( e_search_efd, &one, sizeof( one)) == -1) {
+    perror( "search eventfd write (e_search_enqueue)");
+  }
+}
+
+/** Answer the searches the workers could not
+ *  Main loop: called when the search eventfd is readable.
+ */
+void e_search_service() {
+  e_search_req_t *sr, *list, *last;
+  e_response_t ert;
+  uint64_t count;
+  int foundIt;
+  uint16_t *spvp;
+
+  if( read( e_search_efd, &count, sizeof( count)) == -1 && errno != EAGAIN) {
+    perror( "search eventfd read (e_search_service)");
+  }
+
+  pthread_mutex_lock( &e_search_lock);
+  list = e_search_q;
+  e_search_q = NULL;
+  e_search_qtail = NULL;
+  e_search_qlen = 0;
+  pthread_mutex_unlock( &e_search_lock);
+
+  last = NULL;
+  for( sr = list; sr != NULL; sr = sr->next) {
+    last = sr;
+    foundIt = e_channel_search( &sr->peer, sr->version, sr->name);
+
+    ert.out  = e_sock_bufs + search_index;
+    ert.sock = ert.out->sock;
+    ert.peer = sr->peer;
+    ert.out->ostart = ert.out->otail;
+    if( foundIt) {
+      // Same response as cmd_ca_proto_search
+      spvp = create_message( &ert, 6, 8, 5064, 0, 0xffffffff, sr->cid);
+      if( spvp != NULL)
+	*spvp = htons( 11);
+    } else if( sr->reply == 10) {
+      create_message( &ert, 14, 0, 10, sr->version, sr->cid, sr->cid);
+    }
+    mk_reply( ert.out, ert.out->ostart, &sr->peer, sizeof( sr->peer));
+    ert.out->ostart = -1;
+  }
+
+  if( last != NULL) {
+    pthread_mutex_lock( &e_search_lock);
+    last->next = e_search_free;
+    e_search_free = list;
+    pthread_mutex_unlock( &e_search_lock);
+  }
+}
+
+/** Make a udp socket in our SO_REUSEPORT search group
+ *  Returns the bound socket or -1.
+ */
+int e_search_socket() {
+  struct sockaddr_in addr;
+  int sock;
+  int opt_param;
+
+  sock = socket( PF_INET, SOCK_DGRAM, 0);
+  if( sock == -1) {
+    perror( "search worker socket");
+    return -1;
+  }
+  opt_param = 1;
+  setsockopt( sock, SOL_SOCKET, SO_REUSEADDR, &opt_param, sizeof( opt_param));
+  opt_param = 1;
+  setsockopt( sock, SOL_SOCKET, SO_REUSEPORT, &opt_param, sizeof( opt_param));
+  opt_param = 1;
+  setsockopt( sock, SOL_SOCKET, SO_BROADCAST, &opt_param, sizeof( opt_param));
+  opt_param = 1;
+  setsockopt( sock, IPPROTO_IP, IP_PKTINFO, &opt_param, sizeof( opt_param));
+  e_udp_sockopts( sock);
+
+  memset( &addr, 0, sizeof( addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port   = htons(5064);
+  addr.sin_addr.s_addr = INADDR_ANY;
+  if( bind( sock, (struct sockaddr *) &addr, sizeof( addr)) == -1) {
+    perror( "search worker bind");
+    close( sock);
+    return -1;
+  }
+  return sock;
+}
+
+/** Search worker thread
+ *  Answers searches from the name index on its own socket in the
+ *  SO_REUSEPORT group and hands the rest to the main loop.  Never touches
+ *  the database or the socket array.
+ *
+ * \param arg Our worker id (1 through e_search_workers)
+ */
+void *e_search_worker( void *arg) {
+  struct mmsghdr *msgs, *outs;
+  struct iovec *iovs, *oiovs;
+  struct sockaddr_in *froms;
+  char (*dgrams)[E_UDP_DGRAM];
+  char (*replies)[E_UDP_MTU];
+  char (*cmsgs)[E_UDP_CMSG_SPACE];
+  e_socks_buffer_t tb;
+  e_extended_message_header_t emh;
+  e_message_header_t *mh;
+  char *name;
+  int id, sock, n, nout, i, rlen, found;
+
+  id   = (intptr_t) arg;
+  sock = e_search_socket();
+  if( sock == -1) {
+    fprintf( stderr, "search worker %d giving up\n", id);
+    return NULL;
+  }
+
+  msgs    = calloc( E_UDP_BATCH, sizeof( *msgs));
+  outs    = calloc( E_UDP_BATCH, sizeof( *outs));
+  iovs    = calloc( E_UDP_BATCH, sizeof( *iovs));
+  oiovs   = calloc( E_UDP_BATCH, sizeof( *oiovs));
+  froms   = calloc( E_UDP_BATCH, sizeof( *froms));
+  dgrams  = calloc( E_UDP_BATCH, sizeof( *dgrams));
+  replies = calloc( E_UDP_BATCH, sizeof( *replies));
+  cmsgs   = calloc( E_UDP_BATCH, sizeof( *cmsgs));
+  if( !msgs || !outs || !iovs || !oiovs || !froms || !dgrams || !replies || !cmsgs) {
+    fprintf( stderr, "Out of memory for search worker %d\n", id);
+    return NULL;
+  }
+
+  while( 1) {
+    for( i=0; i<E_UDP_BATCH; i++) {
+      iovs[i].iov_base = dgrams[i];
+      iovs[i].iov_len  = E_UDP_DGRAM;
+      msgs[i].msg_hdr.msg_iov        = iovs + i;
+      msgs[i].msg_hdr.msg_iovlen     = 1;
+      msgs[i].msg_hdr.msg_name       = froms + i;
+      msgs[i].msg_hdr.msg_namelen    = sizeof( froms[i]);
+      msgs[i].msg_hdr.msg_control    = cmsgs[i];
+      msgs[i].msg_hdr.msg_controllen = sizeof( cmsgs[i]);
+      msgs[i].msg_hdr.msg_flags      = 0;
+    }
+
+    n = recvmmsg( sock, msgs, E_UDP_BATCH, MSG_WAITFORONE, NULL);
+    if( n <= 0) {
+      if( n == -1 && errno != EINTR)
+	perror( "search worker recvmmsg");
+      continue;
+    }
+    __atomic_add_fetch( &e_udp_rx_calls, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch( &e_udp_rx_dgrams, n, __ATOMIC_RELAXED);
+
+    nout = 0;
+    for( i=0; i<n; i++) {
+      if( !e_udp_ours( NULL, &msgs[i].msg_hdr, froms + i, id))
+	continue;
+      e_cap_note( E_CAP_UDP, 0, froms + i, dgrams[i], msgs[i].msg_len);
+
+      tb.rbp = dgrams[i];
+      tb.wbp = dgrams[i] + msgs[i].msg_len;
+      rlen = 0;
+      while( tb.rbp + sizeof( e_message_header_t) <= tb.wbp) {
+	read_extended_message_header( &tb, &emh);
+	if( tb.rbp + emh.plsize > tb.wbp)
+	  break;
+	if( emh.cmd == 6 && emh.plsize > 0) {
+	  name = tb.rbp;
+	  name[emh.plsize-1] = 0;
+
+	  if( strcmp( "thisIsTheEnd", name) == 0) {
+	    exit( 0);
+	  }
+
+	  if( !e_client_allowed( froms + i)) {
+	    __atomic_add_fetch( &e_search_rejects, 1, __ATOMIC_RELAXED);
+	    tb.rbp += emh.plsize;
+	    continue;
+	  }
+
+	  found = e_name_lookup( name);
+	  if( found == -1) {
+	    // counted as a hit or miss by e_channel_search
+	    e_search_enqueue( froms + i, emh.p1, emh.dcount, emh.dtype, name);
+	  } else {
+	    __atomic_add_fetch( &e_search_hits, 1, __ATOMIC_RELAXED);
+	    if( found && rlen + 24 <= E_UDP_MTU) {
+	      // Same response as cmd_ca_proto_search
+	      mh = (e_message_header_t *) (replies[nout] + rlen);
+	      create_message_header( mh, 6, 8, 5064, 0, 0xffffffff, emh.p1);
+	      memset( mh + 1, 0, 8);
+	      *(uint16_t *)(mh + 1) = htons( 11);
+	      rlen += 24;
+	    } else if( !found && emh.dtype == 10 && rlen + 16 <= E_UDP_MTU) {
+	      mh = (e_message_header_t *) (replies[nout] + rlen);
+	      create_message_header( mh, 14, 0, 10, emh.dcount, emh.p1, emh.p1);
+	      rlen += 16;
+	    }
+	  }
+	}
+	tb.rbp += emh.plsize;
+      }
+
+      if( rlen > 0) {
+	oiovs[nout].iov_base = replies[nout];
+	oiovs[nout].iov_len  = rlen;
+	memset( &outs[nout], 0, sizeof( outs[nout]));
+	outs[nout].msg_hdr.msg_iov     = oiovs + nout;
+	outs[nout].msg_hdr.msg_iovlen  = 1;
+	outs[nout].msg_hdr.msg_name    = froms + i;
+	outs[nout].msg_hdr.msg_namelen = sizeof( froms[i]);
+	nout++;
+      }
+    }
+
+    if( nout > 0) {
+      if( sendmmsg( sock, outs, nout, 0) == -1) {
+	perror( "search worker sendmmsg");
+      } else {
+	__atomic_add_fetch( &e_udp_tx_calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch( &e_udp_tx_dgrams, nout, __ATOMIC_RELAXED);
+      }
+    }
+  }
+  return NULL;
+}
+
+/** Start the search workers
+ *  Returns the eventfd the main loop polls for searches that need the database.
+ */
+int e_search_start() {
+  pthread_t tid;
+  intptr_t id;
+
+  e_search_efd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if( e_search_efd == -1) {
+    perror( "search eventfd");
+    exit( -1);
+  }
+
+  for( id=1; id<=e_search_workers; id++) {
+    if( pthread_create( &tid, NULL, e_search_worker, (void *) id) != 0) {
+      fprintf( stderr, "Could not start search worker %d\n", (int) id);
+      exit( -1);
+    }
+    pthread_detach( tid);
+  }
+  return e_search_efd;
+}
+
+/** Channel Access packet service routine
+ *
+ * \param pfd   The pollfd structure for this socket
+ * \param inbuf Our input buffer
+ */
+void ca_service( struct pollfd *pfd, e_socks_buffer_t *inbuf) {
+  struct sockaddr_in fromaddr;		// client's address
+  unsigned int fromlen;			// used and ignored to store length of client address
+  int nread;				// number of bytes read
+  
+
+  if( pfd->revents & (POLLERR | POLLHUP | POLLNVAL)) {
+    //
+    // close the socket and ignore it ever more
+    //
+    inbuf->active = 0;
+    return;
+  }
+
+
+  if( pfd->revents & POLLOUT) {
+    // Service outgoing packets before incoming ones
+    //
+    int sent_count;
+
+    //    fprintf( stderr, "Here I am in ca_service POLLOUT\n");
+
+    if( inbuf->udp && inbuf->reply_q != NULL) {
+      ca_udp_send( pfd, inbuf);
+
+    } else if( !inbuf->udp && inbuf->ohead < inbuf->otail) {
+      //
+      // Send as much of the stream as the socket will take.
+      // Possibly we are sending a big array or something.
+      //
+      sent_count = send( pfd->fd, inbuf->obuf + inbuf->ohead, inbuf->otail - inbuf->ohead, MSG_NOSIGNAL);
+      __atomic_add_fetch( &e_io_syscalls, 1, __ATOMIC_RELAXED);
+      if( sent_count == -1) {
+	perror( "ca_service");
+	inbuf->active = 0;
+	return;
+      }
+
+      if( sent_count == 0) {
+	fprintf( stderr, "(ca_service) possible bad connect, cutting out\n");
+	inbuf->active = 0;
+	return;
+      }
+
+      inbuf->ohead += sent_count;
+      if( inbuf->ohead == inbuf->otail) {
+	inbuf->ohead = 0;
+	inbuf->otail = 0;
+      }
+    }
+  }
+
+  if( (pfd->revents & POLLIN) && inbuf->udp) {
+    ca_udp_recv( pfd, inbuf);
+
+  } else if( pfd->revents & POLLIN) {
+
+    fixup_bps( inbuf);
+
+    fromlen = sizeof( fromaddr);
+    nread = recvfrom( pfd->fd, inbuf->wbp, inbuf->bufsize - (inbuf->wbp - inbuf->rbp), 0, (struct sockaddr *) &fromaddr, &fromlen);
+    __atomic_add_fetch( &e_io_syscalls, 1, __ATOMIC_RELAXED);
+    if( nread == 0) {
+      //
+      // The client hung up: forget the circuit now rather than
+      // letting poll tell us about it forever
+      //
+      inbuf->active = 0;
+      return;
+    }
+    if( nread == -1) {
+      // we should stick some error handling code here
+      //
+      return;
+    }
+    e_cap_note( E_CAP_TCP, inbuf->cap_id, &inbuf->peer, inbuf->wbp, nread);
+    inbuf->wbp += nread;
+
+    //    printf( "From %s port %d read %d bytes\n", inet_ntoa( fromaddr.sin_addr), ntohs(fromaddr.sin_port), nread);
+
+    //
+    // recvfrom does not tell us who is on the other end of a virtual circuit
+    //
+    ca_process( inbuf, pfd->fd, &inbuf->peer);
+  }
+  //  printf( "\n");
+}
+
+
+/** Give a provided buffer back to the kernel
+ *
+ * \param bid The buffer id from the completion
+ */
+void e_uring_buf_return( int bid) {
+  struct io_uring_buf *b;
+
+  b = &ur.br->bufs[ur.br_tail & (E_URING_NBUFS - 1)];
+  b->addr = (unsigned long) (ur.bufs + bid * E_URING_BUFSIZE);
+  b->len  = E_URING_BUFSIZE;
+  b->bid  = bid;
+  ur.br_tail++;
+  __atomic_store_n( &ur.br->tail, ur.br_tail, __ATOMIC_RELEASE);
+}
+
+/** Set up our io_uring
+ *  Maps the submission and completion rings and registers a ring of
+ *  provided buffers that multishot receives pick from.
+ *
+ * Returns the ring file descriptor (so we can poll it) or -1 on failure.
+ */
+int e_uring_init() {
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size;
+  int i;
+
+  memset( &p, 0, sizeof( p));
+  ur.fd = syscall( __NR_io_uring_setup, E_URING_ENTRIES, &p);
+  if( ur.fd < 0) {
+    perror( "io_uring_setup (e_uring_init)");
+    return -1;
+  }
+  if( !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    fprintf( stderr, "kernel io_uring is too old for us (e_uring_init)\n");
+    close( ur.fd);
+    return -1;
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof( unsigned);
+  cq_size = p.cq_off.cqes  + p.cq_entries * sizeof( struct io_uring_cqe);
+  if( cq_size > sq_size)
+    sq_size = cq_size;
+
+  sq_ptr = mmap( NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQ_RING);
+  if( sq_ptr == MAP_FAILED) {
+    perror( "io_uring ring mmap (e_uring_init)");
+    close( ur.fd);
+    return -1;
+  }
+  cq_ptr = sq_ptr;
+
+  ur.sqes = mmap( NULL, p.sq_entries * sizeof( struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQES);
+  if( ur.sqes == MAP_FAILED) {
+    perror( "io_uring sqe mmap (e_uring_init)");
+    close( ur.fd);
+    return -1;
+  }
+
+  ur.sq_head    = sq_ptr + p.sq_off.head;
+  ur.sq_tail    = sq_ptr + p.sq_off.tail;
+  ur.sq_mask    = sq_ptr + p.sq_off.ring_mask;
+  ur.sq_array   = sq_ptr + p.sq_off.array;
+  ur.sq_entries = p.sq_entries;
+  ur.to_submit  = 0;
+  ur.cq_head    = cq_ptr + p.cq_off.head;
+  ur.cq_tail    = cq_ptr + p.cq_off.tail;
+  ur.cq_mask    = cq_ptr + p.cq_off.ring_mask;
+  ur.cqes       = cq_ptr + p.cq_off.cqes;
+
+  //
+  // Provided buffers: the kernel picks one for each chunk it receives
+  // and hands it back to us in the completion.
+  //
+  ur.br = mmap( NULL, E_URING_NBUFS * sizeof( struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ur.bufs = malloc( E_URING_NBUFS * E_URING_BUFSIZE);
+  if( ur.br == MAP_FAILED || ur.bufs == NULL) {
+    fprintf( stderr, "Out of memory for provided buffers (e_uring_init)\n");
+    close( ur.fd);
+    return -1;
+  }
 
-  PQclear( pgr);
-  
+  memset( &reg, 0, sizeof( reg));
+  reg.ring_addr    = (unsigned long) ur.br;
+  reg.ring_entries = E_URING_NBUFS;
+  reg.bgid         = 0;
+  if( syscall( __NR_io_uring_register, ur.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    perror( "io_uring provided buffer registration (e_uring_init)");
+    close( ur.fd);
+    return -1;
+  }
 
-  //  fprintf( stderr, "read_notify result:\n");
-  //  hex_dump( r->bufsize, r->buf);
+  ur.br_tail = 0;
+  for( i=0; i<E_URING_NBUFS; i++) {
+    e_uring_buf_return( i);
+  }
+
+  return ur.fd;
 }
 
-/** Obsolete and undocumented
+/** Hand everything queued so far to the kernel
  *
- * cmd 16
- * tcp
- * Obsolete
- * Not implemented here
+ * \param min_complete Wait for this many completions (0 to just submit)
  */
-void cmd_ca_proto_read_build( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
+void e_uring_submit( int min_complete) {
+  int err;
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  //  printf( "Read Build\n");
+  if( ur.to_submit == 0 && min_complete == 0)
+    return;
+
+  err = syscall( __NR_io_uring_enter, ur.fd, ur.to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  __atomic_add_fetch( &e_io_syscalls, 1, __ATOMIC_RELAXED);
+  if( err < 0) {
+    if( errno != EINTR)
+      perror( "io_uring_enter (e_uring_submit)");
+    return;
+  }
+  ur.to_submit -= err;
 }
 
-/** Confirms successful repeater client registration
- *
- *           cmd: 17
- *  payload size:  0
- *     data type:  0
- *   data length:  0
- *   parameter 1:  0
- *   parameter 2:  server ip address
+/** Get the next free submission queue entry
+ *  Submits what we have when the queue is full.
  *
- * udp
- * TODO
- * Implement when we start operating as a repeater
+ * \param b  The socket this operation is for
+ * \param op What we are doing (goes into the user data with the socket and its generation)
  */
-void cmd_ca_repeater_confirm( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
+struct io_uring_sqe *e_uring_sqe( e_socks_buffer_t *b, int op) {
+  struct io_uring_sqe *sqe;
+  unsigned tail, idx;
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  //  printf( "Repeater Confirm\n");
+  tail = *ur.sq_tail;
+  if( tail - __atomic_load_n( ur.sq_head, __ATOMIC_ACQUIRE) >= ur.sq_entries) {
+    e_uring_submit( 0);
+  }
+
+  idx = tail & *ur.sq_mask;
+  sqe = &ur.sqes[idx];
+  memset( sqe, 0, sizeof( *sqe));
+  sqe->fd = b->sock;
+  sqe->user_data = ((uint64_t) op << 56) | ((uint64_t) b->ugen << 24) | (b->sock & 0xffffff);
+
+  ur.sq_array[idx] = idx;
+  __atomic_store_n( ur.sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ur.to_submit++;
+  return sqe;
 }
 
-/** Requests the creation of a channel
- *
- *            cmd: 18
- *   payload size: padded length of the channel name
- *       reserved: 0
- *       reserved: 0
- *            CID: client's channel identifier
- * client version: minor protocol version of the client
+/** Arm a multishot receive on a socket
+ *  From now on the socket is served by the ring, not by poll.
  *
- * tcp
+ * \param b The socket buffer
  */
-void cmd_ca_proto_create_chan( e_socks_buffer_t *inbuf, e_response_t *r) {
-  uint32_t cid, cidn;
-  uint32_t version, versionn;
-  uint32_t sid, *sidp;
-  uint32_t dbr_type, *dbr_typep;
-  uint32_t dcount;
-  
-  char* params[6];
-  int   paramLengths[6];
-  int   paramFormats[6];
-  PGresult *pgr;
-  char *payload;
-  e_extended_message_header_t emh;
-  e_message_header_t *h1, *h2, *h3;
+void e_uring_recv( e_socks_buffer_t *b) {
+  static struct msghdr msg;		// the kernel copies this when the request is prepped
+  struct io_uring_sqe *sqe;
 
-  read_extended_message_header( inbuf, &emh);
-  payload = inbuf->rbp;		// pointer to our string
-  payload[emh.plsize-1] = 0;	// ensure it is null terminated
-  inbuf->rbp += emh.plsize;
-  cid = emh.p1;
-  version = emh.p2;
+  if( !b->uring) {
+    b->uring = 1;
+    b->ugen  = ++e_uring_gen;
+  }
 
-  //  fprintf( stderr, "Create Chan with name '%s'\n", payload);
-  if( inbuf->host_name == NULL)
-    inbuf->host_name = strdup("");
-  if( inbuf->user_name == NULL)
-    inbuf->user_name = strdup("");
-  cidn = htonl( cid);
-  versionn = htonl( version);
+  sqe = e_uring_sqe( b, E_URING_OP_RECV);
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  if( b->udp) {
+    //
+    // We need the sender's address, which the kernel puts at the
+    // front of each provided buffer ahead of the datagram
+    //
+    msg.msg_namelen    = sizeof( struct sockaddr_in);
+    msg.msg_controllen = E_UDP_CMSG_SPACE;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->addr   = (unsigned long) &msg;
+    sqe->len    = 1;
+  } else {
+    sqe->opcode = IORING_OP_RECV;
+  }
+  b->urecv = E_URECV_ARMED;
+  b->uops++;
+}
 
-  params[0] = inet_ntoa( r->peer.sin_addr); paramLengths[0] = 0;                paramFormats[0] = 0;
-  params[1] = inbuf->host_name;	             paramLengths[1] = 0;                paramFormats[1] = 0;
-  params[2] = inbuf->user_name;              paramLengths[2] = 0;                paramFormats[2] = 0;
-  params[3] = (char *)&cidn;                 paramLengths[3] = sizeof(cidn);     paramFormats[3] = 1;
-  params[4] = (char *)&versionn;             paramLengths[4] = sizeof(versionn); paramFormats[4] = 1;
-  params[5] = payload;	                     paramLengths[5] = 0;                paramFormats[5] = 0;
+/** Stop a circuit's multishot receive
+ *  The ring would otherwise keep reading from a circuit waiting in the
+ *  run queue, which poll does not do.  e_socks_prepare arms it again
+ *  once the circuit has had its turn.
+ *
+ * \param b The socket buffer
+ */
+void e_uring_recv_cancel( e_socks_buffer_t *b) {
+  struct io_uring_sqe *sqe;
+
+  sqe = e_uring_sqe( b, E_URING_OP_CANCEL);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr   = ((uint64_t) E_URING_OP_RECV << 56) | ((uint64_t) b->ugen << 24) | (b->sock & 0xffffff);
+  b->urecv = E_URECV_CANCELING;
+}
 
+/** Queue a send of whatever is waiting in a socket's output arena
+ *  One send at a time per socket so the arena only has to hold still
+ *  for that one.
+ *
+ * \param b The socket buffer
+ */
+void e_uring_send( e_socks_buffer_t *b) {
+  struct io_uring_sqe *sqe;
 
-  pgr = e_execPrepared( "create_channel", 6, (const char **)params, paramLengths, paramFormats, 1);
-  if( pgr == NULL)
+  if( b->oinflight || !e_out_pending( b))
     return;
 
-  if( PQntuples( pgr) > 0 && PQgetisnull( pgr, 0, 0) != 1) {
-    //
-    // Success
-    //
-    sidp = (uint32_t *)PQgetvalue( pgr, 0, PQfnumber( pgr, "sid"));
-    sid = ntohl( *sidp);
+  sqe = e_uring_sqe( b, E_URING_OP_SEND);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  if( b->udp) {
+    sqe->addr     = (unsigned long) (b->obuf + b->reply_q->reply_offset);
+    sqe->len      = b->reply_q->reply_size;
+    sqe->addr2    = (unsigned long) &b->reply_q->fromaddr;
+    sqe->addr_len = b->reply_q->fromlen;
+  } else {
+    sqe->addr = (unsigned long) (b->obuf + b->ohead);
+    sqe->len  = b->otail - b->ohead;
+  }
+  b->oinflight = 1;
+  b->uops++;
+}
 
-    dbr_typep = (uint32_t *)PQgetvalue( pgr, 0, PQfnumber( pgr, "dbr_type"));
-    dbr_type  = ntohl( *dbr_typep);
+/** Take in data the kernel received for us
+ *
+ * \param b    The socket buffer
+ * \param data What arrived
+ * \param n    How much arrived
+ * \param from Who sent it
+ */
+void e_uring_input( e_socks_buffer_t *b, char *data, int n, struct sockaddr_in *from) {
+  int room;
+  char *nb;
 
-    dcount = ntohl( *(uint32_t *)PQgetvalue( pgr, 0, PQfnumber( pgr, "dcount")));
+  while( n > 0) {
+    fixup_bps( b);
 
-    r->bufsize = 3*sizeof( e_message_header_t);
-    r->buf     = calloc( r->bufsize, 1);
-    if( r->buf == NULL) {
-      fprintf( stderr, "Out of memory (cmd_ca_proto_create_chan)\n");
-    } else {
-      h1 = (e_message_header_t *)r->buf;
-      h2 = h1 + 1;
-      h3 = h2 + 1;
-      //
-      // Responses (3, count 'em, 3)
+    if( b->run_wait) {
       //
-      // the protocol reponse cmd 3, minor version 11
-      // access rights (read and write)
-      // and
-      //           cmd: 18
-      //  payload size:  0
-      //     data type: native type
-      //    data count: native length
-      //           CID: as the client sent us
-      //           SID: our channel identifier
+      // What the ring read before e_socks_prepare stopped it: hold on
+      // to it, e_run_service will process it.  Only a little should
+      // come, so a flood means something is wrong.
       //
-      create_message_header( h1,  0, 0, 0, 11,   0,   0);		// protocol response: cmd:0  minor version: 11 (in data length field)
-      create_message_header( h2, 22, 0, 0,  0, cid,   3);		// grant read (1) and write (2) access
-      create_message_header( h3, 18, 0, dbr_type,  dcount, cid, sid);	// channel create response
-
-      if( inbuf->active == -1) {
-	inbuf->active = 1;
-      } else {
-	inbuf->active++;
+      if( b->wbp - (char *)b->buf + n > b->bufsize) {
+	room = b->wbp - (char *)b->buf;
+	if( room + n > E_MSG_MAX) {
+	  fprintf( stderr, "Too much input on sock %d while it waits its turn, cutting out (e_uring_input)\n", b->sock);
+	  b->active = 0;
+	  return;
+	}
+	nb = realloc( b->buf, room + n);
+	if( nb == NULL) {
+	  fprintf( stderr, "Out of memory for input on sock %d, cutting out (e_uring_input)\n", b->sock);
+	  b->active = 0;
+	  return;
+	}
+	__atomic_add_fetch( &e_out_allocs, 1, __ATOMIC_RELAXED);
+	b->buf = nb;
+	b->rbp = nb;
+	b->wbp = nb + room;
+	b->bufsize = room + n;
       }
+      memcpy( b->wbp, data, n);
+      b->wbp += n;
+      return;
     }
-  } else {
+
+    room = b->bufsize - (b->wbp - b->rbp);
+    if( room <= 0) {
+      fprintf( stderr, "Input buffer full on sock %d, cutting out (e_uring_input)\n", b->sock);
+      b->active = 0;
+      return;
+    }
+    if( room > n)
+      room = n;
+    memcpy( b->wbp, data, room);
+    b->wbp += room;
+    data   += room;
+    n      -= room;
+    ca_process( b, b->sock, from);
+  }
+}
+
+/** Deal with one completion
+ *
+ * \param cqe The completion
+ */
+void e_uring_complete( struct io_uring_cqe *cqe) {
+  e_socks_buffer_t *b;
+  struct io_uring_recvmsg_out *rmo;
+  struct sockaddr_in from;
+  struct msghdr mh;
+  char *data;
+  int op, sock, bid, k, n;
+  uint32_t gen;
+
+  op   = cqe->user_data >> 56;
+  gen  = (cqe->user_data >> 24) & 0xffffffff;
+  sock = cqe->user_data & 0xffffff;
+  bid  = (cqe->flags & IORING_CQE_F_BUFFER) ? (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+
+  if( op == E_URING_OP_CANCEL) {
+    return;
+  }
+
+  b = NULL;
+  for( k=0; k<n_e_socks; k++) {
+    if( e_sock_bufs[k].sock == sock && e_sock_bufs[k].uring && e_sock_bufs[k].ugen == gen) {
+      b = e_sock_bufs + k;
+      break;
+    }
+  }
+
+  if( b == NULL) {
     //
-    // Failed to create channel
+    // Leftovers for a socket we've already closed
+    //
+    if( bid >= 0)
+      e_uring_buf_return( bid);
+    return;
+  }
+
+  if( op == E_URING_OP_SEND) {
+    b->uops--;
+    b->oinflight = 0;
+    if( b->ostale != NULL) {
+      free( b->ostale);
+      b->ostale = NULL;
+    }
+    if( b->udp) {
+      __atomic_add_fetch( &e_udp_tx_dgrams, 1, __ATOMIC_RELAXED);
+      if( cqe->res < 0) {
+	fprintf( stderr, "send to %s failed: %s (e_uring_complete)\n", inet_ntoa( b->reply_q->fromaddr.sin_addr), strerror( -cqe->res));
+      }
+      e_reply_done( b);
+      return;
+    }
+    if( cqe->res <= 0) {
+      if( cqe->res < 0)
+	fprintf( stderr, "send on sock %d failed: %s (e_uring_complete)\n", b->sock, strerror( -cqe->res));
+      b->active = 0;
+      return;
+    }
+    b->ohead += cqe->res;
+    if( b->ohead == b->otail) {
+      b->ohead = 0;
+      b->otail = 0;
+    }
+    return;
+  }
+
+  //
+  // Receive
+  //
+  if( !(cqe->flags & IORING_CQE_F_MORE)) {
     //
-    //             cmd: 26
-    //  payload length: 0
-    //       data type: 0
-    //     data length: 0
-    //             CID: from client
-    //     parameter 2: 0
+    // Multishot is done: we either get to rearm it or this socket is finished.
+    // Circuits waiting their turn get theirs back from e_socks_prepare.
     //
-    create_message( r, 26, 0, 0, 0, cid, 0);
+    b->uops--;
+    b->urecv = E_URECV_OFF;
+    if( b->active != 0 && b->run_wait && !b->udp) {
+      // waiting for its turn
+    } else if( b->active != 0 && (b->udp || cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED)) {
+      e_uring_recv( b);
+    } else if( !b->udp) {
+      b->active = 0;
+    }
+  }
 
-    if( inbuf->active == -1) {
+  if( bid < 0) {
+    return;
+  }
+
+  if( cqe->res > 0 && b->active != 0) {
+    data = ur.bufs + bid * E_URING_BUFSIZE;
+    if( b->udp) {
       //
-      // First attempt after the connection
-      // just let it die
+      // Provided buffer layout: header, sender address, control data, datagram
       //
-      inbuf->active = 0;
+      rmo = (struct io_uring_recvmsg_out *) data;
+      n = E_URING_BUFSIZE - sizeof( *rmo) - sizeof( struct sockaddr_in) - E_UDP_CMSG_SPACE;
+      if( rmo->payloadlen < n)
+	n = rmo->payloadlen;
+      memset( &from, 0, sizeof( from));
+      memcpy( &from, data + sizeof( *rmo), rmo->namelen < sizeof( from) ? rmo->namelen : sizeof( from));
+      memset( &mh, 0, sizeof( mh));
+      mh.msg_control    = data + sizeof( *rmo) + sizeof( struct sockaddr_in);
+      mh.msg_controllen = rmo->controllen;
+      e_udp_note_drops( b, &mh);
+      __atomic_add_fetch( &e_udp_rx_dgrams, 1, __ATOMIC_RELAXED);
+      if( e_udp_ours( b, &mh, &from, 0)) {
+	data += sizeof( *rmo) + sizeof( struct sockaddr_in) + E_UDP_CMSG_SPACE;
+	e_cap_note( E_CAP_UDP, 0, &from, data, n);
+	e_uring_input( b, data, n, &from);
+      }
+    } else {
+      e_cap_note( E_CAP_TCP, b->cap_id, &b->peer, data, cqe->res);
+      e_uring_input( b, data, cqe->res, &b->peer);
     }
   }
+  e_uring_buf_return( bid);
+}
 
-  PQclear( pgr);
+/** Reap everything the ring has finished
+ *  Called when poll says the ring is readable.
+ */
+void e_uring_service() {
+  struct io_uring_cqe *cqe;
+  unsigned head;
+
+  head = *ur.cq_head;
+  while( head != __atomic_load_n( ur.cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &ur.cqes[head & *ur.cq_mask];
+    head++;
+    //
+    // Let the kernel have the slot before we run commands that may submit more work
+    //
+    e_uring_complete( cqe);
+    __atomic_store_n( ur.cq_head, head, __ATOMIC_RELEASE);
+  }
 }
 
-/** Writes the new channel value
- *
- *          cmd: 19
- * payload size: size of the dbr formatted payload
- *    data type: dbr type of the data
- *   data count: number of elements
- *          SID: server's id for this channel
- *         IOID: client's id for this request
+/** Stop all io_uring activity on a socket before it is closed
+ *  Waits for the kernel to let go of the socket's buffers.
  *
- * tcp
+ * \param b The socket buffer
  */
-void cmd_ca_proto_write_notify( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
-  void *params[3];
-  int param_lengths[3];
-  int param_formats[3];
-  uint32_t struct_size;
-  uint32_t data_size;
-  PGresult *pgr;
-  uint32_t dbr_type;
-  uint32_t ioid, sid, nsid;
-  int rtn;
-  char *sp;
-  int s_size;
-  int rtn_value;
+void e_uring_quiesce( e_socks_buffer_t *b) {
+  struct io_uring_sqe *sqe;
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  
-  sid = emh.p1;
-  ioid = emh.p2;
-  emh.dcount = 1;	// hold the arrays
-  //
-  // Discover our data size (shouldn't we just create an array at initiallizaion or compile time?...)
-  //
-  dbr_type = htonl(emh.dtype);
-  struct_size = dbr_sizes[emh.dtype].dbr_struct_size;
-  data_size   = dbr_sizes[emh.dtype].dbr_type_size;
+  if( !b->uring)
+    return;
 
-  rtn = 160;	// default ca put fail
-  printf( "Proto Write Notify\n");
+  sqe = e_uring_sqe( b, E_URING_OP_CANCEL);
+  sqe->opcode       = IORING_OP_ASYNC_CANCEL;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
 
+  while( b->uops > 0) {
+    e_uring_submit( 1);
+    e_uring_service();
+  }
+  b->uring = 0;
+}
 
-  //
-  // TO DO:
-  // add proper array support by implementing the postgresql/libpq array structures
-  //
-  switch( emh.dtype) {
-  case 0:
-    sp = inbuf->rbp;
-    s_size = strlen( sp);
-    if( inbuf->rbp + s_size > inbuf->wbp) {
-      fprintf( stderr, "Bad string detected (cmd_ca_proto_write_notify)\n");
-      inbuf->rbp = inbuf->wbp;
-      return;
-    }
-    inbuf->rbp += s_size;
-    params[0] = &nsid;	param_lengths[0] = sizeof(nsid);	param_formats[0] = 1;
-    params[1] = sp;		param_lengths[1] = 0;			param_formats[1] = 0;
-    pgr = e_execPrepared( "set_str_value", 2, (const char **)params, param_lengths, param_formats, 1);
-    maybe_check_monitors = 1;
-    if( pgr == NULL)
-      return;
-    rtn_value = ntohl( *(uint32_t *)PQgetvalue( pgr, 0, PQfnumber( pgr, "rtn")));
-    PQclear( pgr);
+/** Datagram traffic summary
+ *  Receive batches, send batches, kernel drops and the deepest reply queue.
+ */
+void e_udp_report() {
+  uint32_t drops;
+  int i;
+
+  drops = 0;
+  for( i=0; i<n_e_socks; i++) {
+    if( e_sock_bufs[i].udp)
+      drops += e_sock_bufs[i].rx_drops;
   }
-  nsid = htonl(sid);
-  //
-  // Response
-  //
-  //           cmd: 19
-  //  payload size:  0
-  //     data type: same as request
-  //   data length: same as request
-  //   status code: ECA_NORMAL (1)  or ECA_PUTFAIL (160)
-  //          IOID: from client
-  //
-  create_message( r, 19, 0, emh.dtype, emh.dcount, rtn_value, ioid);
+  fprintf( stderr, "udp: %lu datagrams in %lu reads, %lu datagrams in %lu writes, %u dropped by the kernel, reply queue depth max %d\n",
+	   e_udp_rx_dgrams, e_udp_rx_calls, e_udp_tx_dgrams, e_udp_tx_calls, drops, e_udp_qmax);
+  fprintf( stderr, "search: %d workers, %lu answered from the name index, %lu from the database, %lu dropped waiting\n",
+	   e_search_workers, e_search_hits, e_search_misses, e_search_overflows);
+  fprintf( stderr, "circuits: %lu accepted (at most %lu in one wakeup), %lu turns cut short by the message budget\n",
+	   e_accepts, e_accept_bursts_max, e_run_deferrals);
 }
 
-/** Sends the local username to the server
+/** How a virtual circuit's queues have looked
+ *  Printed when the circuit closes and at exit.
  *
- *           cmd: 20
- *  payload size: string length of the user name
- *     data type: 0
- *   data length: 0
- *   parameter 1: 0
- *   parameter 2: 0
+ * \param b The circuit
+ */
+void e_circuit_report( e_socks_buffer_t *b) {
+  fprintf( stderr, "circuit %d (%s priority %d): %lu turns, %lu cut short by the budget, input queue max %d bytes (%d now), output queue max %d bytes (%d now)\n",
+	   b->sock, inet_ntoa( b->peer.sin_addr), b->priority, b->turns, b->turns_deferred,
+	   b->inq_max, (int)(b->wbp - b->rbp), b->outq_max, b->otail - b->ohead);
+}
+
+/** Tell the world how many system calls moving CA traffic cost us
+ *  Registered with atexit so a run can be compared between the poll and io_uring paths.
+ */
+void e_io_report() {
+  int i;
+
+  fprintf( stderr, "%s: %lu syscalls for %lu monitor updates (%.3f per update)\n",
+	   e_use_uring ? "io_uring" : "poll", e_io_syscalls, e_io_updates,
+	   e_io_updates ? (double) e_io_syscalls / e_io_updates : 0.0);
+  e_udp_report();
+  for( i=0; i<n_e_socks; i++) {
+    if( !e_sock_bufs[i].udp && e_sock_bufs[i].turns > 0)
+      e_circuit_report( e_sock_bufs + i);
+  }
+}
+
+
+/** Publish a metric
  *
- * tcp
+ * \param name What to call it (after the prefix)
+ * \param kind E_METRIC_ULONG ...
+ * \param p    The counter (NULL for a histogram)
+ * \param off  The histogram's place in e_stats_t
  */
-void cmd_ca_proto_client_name( e_socks_buffer_t *inbuf, e_response_t *r) {
-  char *clientName;
-  e_extended_message_header_t emh;
+void e_metric_add( char *name, int kind, void *p, size_t off) {
+  if( e_metrics_n == E_METRIC_MAX || strlen( name) >= E_METRIC_NAME) {
+    fprintf( stderr, "No room for metric %s (e_metric_add)\n", name);
+    return;
+  }
+  strcpy( e_metrics[e_metrics_n].name, name);
+  e_metrics[e_metrics_n].kind = kind;
+  e_metrics[e_metrics_n].p    = p;
+  e_metrics[e_metrics_n].off  = off;
+  e_metrics_n++;
+}
 
-  read_extended_message_header( inbuf, &emh);
-  clientName = inbuf->rbp;
-  clientName[emh.plsize - 1] = 0;
-  inbuf->rbp += emh.plsize;
+/** Publish a histogram
+ *  As name:count, name:sum and name:hist (the buckets).
+ *
+ * \param name What to call it (after the prefix)
+ * \param off  Its place in e_stats_t
+ */
+void e_metric_add_hist( char *name, size_t off) {
+  char s[E_METRIC_NAME];
+
+  snprintf( s, sizeof( s), "%s:count", name);
+  e_metric_add( s, E_METRIC_COUNT, NULL, off);
+  snprintf( s, sizeof( s), "%s:sum", name);
+  e_metric_add( s, E_METRIC_SUM, NULL, off);
+  snprintf( s, sizeof( s), "%s:hist", name);
+  e_metric_add( s, E_METRIC_HIST, NULL, off);
+}
 
-  if( inbuf->user_name != NULL) {
-    free( inbuf->user_name);
+/** Set up the metrics table
+ *  Start up, before anyone can ask for a metric.
+ */
+void e_metrics_init() {
+  char s[E_METRIC_NAME];
+  char *sp;
+  int i;
+
+  e_ticks_init();
+
+  for( i=0; i<sizeof( e_cmd_names)/sizeof( e_cmd_names[0]); i++) {
+    snprintf( s, sizeof( s), "cmd:%s", e_cmd_names[i]);
+    e_metric_add_hist( s, offsetof( e_stats_t, cmd) + i*sizeof( e_hist_t));
   }
-  inbuf->user_name = strdup( clientName);
 
-  //  printf( "Client Name '%s'\n", clientName);
-  //
-  // no response
-  //
+  for( i=0; i<E_PS_MAX && i<sizeof(prepared_statements)/sizeof(prepared_statements[0]); i++) {
+    // "prepare name ..."
+    snprintf( s, sizeof( s), "ps:%s", prepared_statements[i] + 8);
+    sp = strchr( s, ' ');
+    if( sp != NULL)
+      *sp = 0;
+    e_metric_add_hist( s, offsetof( e_stats_t, ps) + i*sizeof( e_hist_t));
+  }
+
+  e_metric_add_hist( "loop",            offsetof( e_stats_t, loop));
+  e_metric_add_hist( "replyq",          offsetof( e_stats_t, replyq));
+  e_metric_add_hist( "monitors:batch",  offsetof( e_stats_t, batch));
+  e_metric_add_hist( "monitors:fanout", offsetof( e_stats_t, fanout));
+
+  e_metric_add( "updates_held",      E_METRIC_ULONG, &e_updates_held, 0);
+  e_metric_add( "enc_shared",        E_METRIC_ULONG, &e_enc_shared, 0);
+  e_metric_add( "accepts",           E_METRIC_ULONG, &e_accepts, 0);
+  e_metric_add( "accept_bursts_max", E_METRIC_ULONG, &e_accept_bursts_max, 0);
+  e_metric_add( "run_deferrals",     E_METRIC_ULONG, &e_run_deferrals, 0);
+  e_metric_add( "out_allocs",        E_METRIC_ULONG, &e_out_allocs, 0);
+  e_metric_add( "io_syscalls",       E_METRIC_ULONG, &e_io_syscalls, 0);
+  e_metric_add( "io_updates",        E_METRIC_ULONG, &e_io_updates, 0);
+  e_metric_add( "udp_rx_dgrams",     E_METRIC_ULONG, &e_udp_rx_dgrams, 0);
+  e_metric_add( "udp_rx_calls",      E_METRIC_ULONG, &e_udp_rx_calls, 0);
+  e_metric_add( "udp_tx_dgrams",     E_METRIC_ULONG, &e_udp_tx_dgrams, 0);
+  e_metric_add( "udp_tx_calls",      E_METRIC_ULONG, &e_udp_tx_calls, 0);
+  e_metric_add( "udp_qmax",          E_METRIC_INT,   &e_udp_qmax, 0);
+  e_metric_add( "search_hits",       E_METRIC_ULONG, &e_search_hits, 0);
+  e_metric_add( "search_misses",     E_METRIC_ULONG, &e_search_misses, 0);
+  e_metric_add( "search_overflows",  E_METRIC_ULONG, &e_search_overflows, 0);
+  e_metric_add( "search_rejects",    E_METRIC_ULONG, &e_search_rejects, 0);
+  e_metric_add( "create_rejects",    E_METRIC_ULONG, &e_create_rejects, 0);
+  e_metric_add( "puts_waiting",      E_METRIC_INT,   &e_puts_waiting, 0);
+  e_metric_add( "cap_records",       E_METRIC_ULONG, &e_cap_records, 0);
+  e_metric_add( "cap_bytes",         E_METRIC_ULONG, &e_cap_bytes, 0);
+}
+
+/** Listen for people who want the metrics text dump
+ *  Returns the listening socket or -1.
+ *
+ * \param path Where the unix socket goes (anything already there is removed)
+ */
+int e_metrics_listen( char *path) {
+  struct sockaddr_un addr;
+  int sock;
+  int flags;
+
+  if( strlen( path) >= sizeof( addr.sun_path)) {
+    fprintf( stderr, "Metrics socket path %s is too long (e_metrics_listen)\n", path);
+    return -1;
+  }
+
+  sock = socket( AF_UNIX, SOCK_STREAM, 0);
+  if( sock == -1) {
+    perror( "metrics socket (e_metrics_listen)");
+    return -1;
+  }
+  flags = fcntl( sock, F_GETFL, 0);
+  fcntl( sock, F_SETFL, flags | O_NONBLOCK);
+
+  memset( &addr, 0, sizeof( addr));
+  addr.sun_family = AF_UNIX;
+  strcpy( addr.sun_path, path);
+  unlink( path);
+
+  if( bind( sock, (struct sockaddr *) &addr, sizeof( addr)) == -1 || listen( sock, 8) == -1) {
+    perror( "metrics bind/listen (e_metrics_listen)");
+    close( sock);
+    return -1;
+  }
+  return sock;
 }
 
-/** Sends the local host name to the server
- *
- *          cmd: 21
- * payload size: string length of the hostname
- *    data type: 0
- *  data length: 0
- *  parameter 1: 0
- *  parameter 1: 0
+/** Write every metric to a stream
+ *  One line each: the name followed by its value (the buckets for a histogram).
  *
- * tcp
+ * \param f Where to
  */
-void cmd_ca_proto_host_name( e_socks_buffer_t *inbuf, e_response_t *r) {
-  //
-  char *hostName;
-  e_extended_message_header_t emh;
+void e_metrics_print( FILE *f) {
+  double v[E_HIST_BUCKETS];
+  int n;
+  int i;
+  int k;
+
+  for( k=0; k<e_metrics_n; k++) {
+    n = e_metric_values( k, v);
+    fprintf( f, "%s", e_metrics[k].name);
+    for( i=0; i<n; i++)
+      fprintf( f, " %.0f", v[i]);
+    fprintf( f, "\n");
+  }
+}
 
-  read_extended_message_header( inbuf, &emh);
-  hostName = inbuf->rbp;
-  hostName[emh.plsize - 1] = 0;
-  inbuf->rbp += emh.plsize;
+/** Someone wants the metrics text dump
+ *  They get it all at once and we hang up.  Main loop only, so we never
+ *  wait for them: a reader that does not keep up is dropped.
+ */
+void e_metrics_dump() {
+  FILE *f;
+  char *text;
+  size_t size;
+  ssize_t n;
+  size_t done;
+  int sndbuf;
+  int sock;
+
+  sock = accept4( e_metric_fd, NULL, NULL, SOCK_NONBLOCK);
+  if( sock == -1) {
+    if( errno != EAGAIN && errno != EWOULDBLOCK)
+      perror( "accept (e_metrics_dump)");
+    return;
+  }
 
-  if( inbuf->host_name != NULL) {
-    free( inbuf->host_name);
+  text = NULL;
+  size = 0;
+  f = open_memstream( &text, &size);
+  if( f == NULL) {
+    fprintf( stderr, "Out of memory for the metrics dump (e_metrics_dump)\n");
+    close( sock);
+    return;
   }
-  inbuf->host_name = strdup( hostName);
+  e_metrics_print( f);
+  fclose( f);
 
-  //  printf( "Host Name '%s'\n", hostName);
   //
-  // no response
+  // Room for the whole dump so a reader that is there gets it in one go
   //
-}
-
-/** Response command: notify client of access rights
- *  Only needed as a command in the client
- *
- *            cmd: 22
- *   payload size:  0
- *      data type:  0
- * payload length:  0
- *            CID:  client channel identifier
- *  Access Rights: 0 = no rights, 1 = read only, 2 = write only (really?), 3 = read and write
- *
- * tcp
- */
-void cmd_ca_proto_access_rights( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
+  sndbuf = size;
+  setsockopt( sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof( sndbuf));
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  //  printf( "Access Rights\n");
+  for( done=0; done < size; done += n) {
+    n = write( sock, text + done, size - done);
+    if( n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      fprintf( stderr, "Metrics reader is not keeping up, dropping it after %zu of %zu bytes (e_metrics_dump)\n", done, size);
+      break;
+    }
+    if( n <= 0) {
+      perror( "write (e_metrics_dump)");
+      break;
+    }
+  }
+  free( text);
+  close( sock);
 }
 
-/** Connection verify
- *
- *          cmd: 23
- * payload size:  0
- *    data type:  0
- *  data length:  0
- *  parameter 1:  0
- *  parameter 2:  0
+
+/** A virtual circuit has been quiet for a while
+ *  First we ask it to echo; if that goes unanswered we hang up.
  *
- * tcp and udp
+ * \param t The circuit's idle timer (arg is the socket)
  */
-void cmd_ca_proto_echo( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
+void circuit_idle( e_timer_t *t) {
+  e_socks_buffer_t *b;
+  e_response_t ert;
+  uint64_t quiet;
+  int k;
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  //  printf( "Echo\n");
+  b = NULL;
+  for( k=0; k<n_e_socks; k++) {
+    if( e_sock_bufs[k].sock == t->arg && e_sock_bufs[k].idle_timer == t) {
+      b = e_sock_bufs + k;
+      break;
+    }
+  }
+  if( b == NULL || b->active == 0)
+    return;
 
-  r->bufsize = sizeof( e_message_header_t);
-  r->buf = calloc( r->bufsize, 1);
-  if( r->buf == NULL) {
-    fprintf( stderr, "Out of memory (cmd_ca_proto_echo)\n");
+  quiet = (e_wheel_now() - b->last_rx) * E_WHEEL_TICK_MS;
+  if( quiet < E_CIRCUIT_IDLE_MS) {
+    //
+    // We've heard from them since we set the timer (or sent our echo)
+    //
+    b->echo_pending = 0;
+    e_timer_add( t, E_CIRCUIT_IDLE_MS - quiet);
     return;
   }
-  // Response
+
+  if( b->echo_pending) {
+    fprintf( stderr, "No echo from %s on sock %d, cutting out (circuit_idle)\n", inet_ntoa( b->peer.sin_addr), b->sock);
+    b->active = 0;
+    return;
+  }
+
+  //
+  // Anybody there?
   //
   //          cmd: 23
   // payload size: 0
@@ -2078,362 +6190,419 @@ void cmd_ca_proto_echo( e_socks_buffer_t *inbuf, e_response_t *r) {
   //  parameter 1: 0
   //  parameter 2: 0
   //
-  create_message( r, 23, 0, 0, 0, 0, 0);
+  ert.out = b;
+  create_message( &ert, 23, 0, 0, 0, 0, 0);
+  b->echo_pending = 1;
+  e_timer_add( t, E_ECHO_TMO_MS);
 }
 
-/** Requests registration with the repeater
- *  NOT IMPLEMENTED
- *
- * cmd: 24
- * payload size: 0
- *    data type: 0
- *  data length: 0
- *  parameter 1: 0
- *  parameter 2: IP address of client
+/** Route a monitor update to the shard that owns the subscriber
+ *  Main loop only.  Updates collect on the shard's pending list until
+ *  e_shard_post hands them over.
  *
- * udp
- * TODO
+ * \param sh    The shard
+ * \param sock  The subscriber
+ * \param subid Their subscription id (or the ioid of a write_notify reply)
+ * \param enc   The encoded update (the shard gets its own reference)
+ * \param put   1 for a write_notify reply
  */
-void cmd_ca_repeater_register( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
-
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  //  printf( "Repeater Register\n");
-}
+void e_shard_route( e_shard_t *sh, int sock, uint32_t subid, e_enc_t *enc, int put) {
+  e_update_t *u;
 
-/** obsolete and undocumented
- *
- * cmd: 25
- * tcp
- * Obsolete
- * Not implemented here
- */
-void cmd_ca_proto_signal( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
+  if( e_update_free != NULL) {
+    u = e_update_free;
+    e_update_free = u->next;
+  } else {
+    u = calloc( 1, sizeof( *u));
+    if( u == NULL) {
+      fprintf( stderr, "Out of memory for monitor update (e_shard_route)\n");
+      return;
+    }
+    __atomic_add_fetch( &e_out_allocs, 1, __ATOMIC_RELAXED);
+  }
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  //  printf( "Signal\n");
+  u->next  = NULL;
+  u->sock  = sock;
+  u->subid = subid;
+  u->enc   = e_enc_ref( enc);
+  u->put   = put;
+
+  if( sh->pending_tail == NULL)
+    sh->pending = u;
+  else
+    sh->pending_tail->next = u;
+  sh->pending_tail = u;
 }
 
-/** Response to a failed channel creation
- *  Not implemented as it is only a command on the client side
- *
- *          cmd: 26
- * payload size:  0
- *    data type:  0
- *  data length:  0
- *          CID:  cient id as in the original request
- *  parameter 2:  0
+/** Hand a shard the updates routed to it and wake it up
+ *  Main loop only.  Also takes back the updates the shard has finished with.
  *
- * tcp
- * TODO: Implement when we need to act as a client.
+ * \param sh The shard
  */
-void cmd_ca_proto_create_ch_fail( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
+void e_shard_post( e_shard_t *sh) {
+  e_update_t *done;
+  uint64_t one = 1;
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  //  printf( "Create ch fail\n");
-}
+  if( sh->pending == NULL)
+    return;
 
-/** Notifies client that server has disconnected the channel
- *  This is a reponse command and unimplemented here
- *
- *          cmd: 27
- * payload size:  0
- *    data type:  0
- *  data length:  0
- *          CID:  The client channel identifier
- *  parameter 2:  0
- *
- * tcp
- * TODO: Implement when we need to act as a client
- */
-void cmd_ca_proto_server_disconn( e_socks_buffer_t *inbuf, e_response_t *r) {
-  e_extended_message_header_t emh;
+  pthread_mutex_lock( &sh->lock);
+  if( sh->updates_tail == NULL)
+    sh->updates = sh->pending;
+  else
+    sh->updates_tail->next = sh->pending;
+  sh->updates_tail = sh->pending_tail;
+  done = sh->done;
+  sh->done = NULL;
+  pthread_mutex_unlock( &sh->lock);
+
+  sh->pending = NULL;
+  sh->pending_tail = NULL;
+
+  while( done != NULL) {
+    e_update_t *u;
+    u = done;
+    done = u->next;
+    u->next = e_update_free;
+    e_update_free = u;
+  }
 
-  read_extended_message_header( inbuf, &emh);
-  inbuf->rbp += emh.plsize;
-  //  printf( "Server Disconnect\n");
+  if( write( sh->efd, &one, sizeof( one)) == -1) {
+    perror( "shard eventfd write (e_shard_post)");
+  }
 }
 
-
-
-/** Command array to access commands in an O(1) manner
- */
-void (*cmds[])(e_socks_buffer_t *, e_response_t *) = {
-  cmd_ca_proto_version,		//  0
-  cmd_ca_proto_event_add,	//  1
-  cmd_ca_proto_event_cancel,	//  2
-  cmd_ca_proto_read,		//  3
-  cmd_ca_proto_write,		//  4
-  cmd_ca_proto_snapshot,	//  5
-  cmd_ca_proto_search,		//  6
-  cmd_ca_proto_build,		//  7
-  cmd_ca_proto_events_off,	//  8
-  cmd_ca_proto_events_on,	//  9
-  cmd_ca_proto_read_sync,	// 10
-  cmd_ca_proto_error,		// 11
-  cmd_ca_proto_clear_channel,	// 12
-  cmd_ca_proto_rsrv_is_up,	// 13
-  cmd_ca_proto_not_found,	// 14
-  cmd_ca_proto_read_notify,	// 15
-  cmd_ca_proto_read_build,	// 16
-  cmd_ca_repeater_confirm,	// 17
-  cmd_ca_proto_create_chan,	// 18
-  cmd_ca_proto_write_notify,	// 19
-  cmd_ca_proto_client_name,	// 20
-  cmd_ca_proto_host_name,	// 21
-  cmd_ca_proto_access_rights,	// 22
-  cmd_ca_proto_echo,		// 23
-  cmd_ca_repeater_register,	// 24
-  cmd_ca_proto_signal,		// 25
-  cmd_ca_proto_create_ch_fail,	// 26
-  cmd_ca_proto_server_disconn	// 27
-};
-
-
-
-/** Fix up buffer pointers
+/** Start serving a virtual circuit from this thread's poll loop
  *
- * Take all unread bytes in the buffer
- * and move them to the front.
+ * \param sock The circuit
+ * \param peer Who is on the other end
  */
-void fixup_bps( e_socks_buffer_t *b) {
-  int nbytes;
+void e_circuit_adopt( int sock, struct sockaddr_in *peer) {
+  int i;
 
-  if( b==NULL || b->buf==NULL) {
-    fprintf( stderr, "Bad buffer pointer (why?) (fixup_bps)\n");
+  if( n_e_socks >= n_e_socks_max) {
+    fprintf( stderr, "Too many sockets, hanging up on %d (e_circuit_adopt)\n", sock);
+    if( e_shard != NULL) {
+      __atomic_store_n( &e_fd_shard[sock], 0, __ATOMIC_RELEASE);
+      __atomic_sub_fetch( &e_shard->circuits, 1, __ATOMIC_RELAXED);
+    }
+    close( sock);
     return;
   }
-  if( b->wbp < b->rbp) {
-    fprintf( stderr, "Read and write buffer out of sync? (fixup_bps)\n");
-    return;
+
+  i = e_socks_buf_init( sock);
+  e_sock_bufs[i].peer = *peer;
+  e_sock_bufs[i].prio_class = 0;	// until CA_PROTO_VERSION says otherwise
+  e_sock_bufs[i].idle_timer = e_timer_new( circuit_idle, sock);
+  if( e_sock_bufs[i].idle_timer != NULL) {
+    e_timer_add( e_sock_bufs[i].idle_timer, E_CIRCUIT_IDLE_MS);
+  }
+  if( e_cap_file != NULL) {
+    e_sock_bufs[i].cap_id = __atomic_add_fetch( &e_cap_conns, 1, __ATOMIC_RELAXED);
+    e_cap_note( E_CAP_OPEN, e_sock_bufs[i].cap_id, peer, NULL, 0);
+  }
+  if( e_use_uring && e_shard == NULL) {
+    e_uring_recv( e_sock_bufs + i);
   }
-  nbytes = b->wbp - b->rbp;
-  memmove( b->buf, b->rbp, nbytes);
-  b->rbp = b->buf;
-  b->wbp = b->buf + nbytes;
 }
 
-/** make up the reply packet
+/** Give a newly accepted virtual circuit to the least loaded shard
+ *  Main loop only.
  *
- * \param inbuf      the buffer this is a reponse to
- * \param rsize      size of the reply packet
- * \param reply      The reply packet
- * \param fromaddrp  Our from address
- * \param fromlen    Length of our from address
+ * \param sock The circuit
+ * \param peer Who is on the other end
  */
-void mk_reply( e_socks_buffer_t *inbuf, int rsize, char *reply, struct sockaddr_in *fromaddrp, int fromlen) {
-  e_reply_queue_t *our_reply;
-  e_reply_queue_t *last_reply;		// points to the last reply in the queue
+void e_shard_handoff( int sock, struct sockaddr_in *peer) {
+  e_shard_t *sh;
+  e_handoff_t *h;
+  uint64_t one = 1;
+  int k;
+
+  if( sock >= E_FD_MAX) {
+    fprintf( stderr, "Socket %d is too big to hand to a shard (e_shard_handoff)\n", sock);
+    close( sock);
+    return;
+  }
 
-  our_reply = calloc( sizeof( *our_reply), 1);
-  if( our_reply == NULL) {
-    fprintf( stderr, "Out of memory for our_reply (mk_reply)\n");
-    exit( -1);
+  sh = e_shards;
+  for( k=1; k<e_shards_n; k++) {
+    if( __atomic_load_n( &e_shards[k].circuits, __ATOMIC_RELAXED) < __atomic_load_n( &sh->circuits, __ATOMIC_RELAXED))
+      sh = e_shards + k;
   }
-  our_reply->next         = NULL;
-  our_reply->reply_size   = rsize;
-  our_reply->reply_packet = reply;
 
-  our_reply->fromlen      = fromlen;
-  if( fromlen > 0) {
-    our_reply->fromaddr   = *fromaddrp;
+  h = malloc( sizeof( *h));
+  if( h == NULL) {
+    fprintf( stderr, "Out of memory for circuit handoff (e_shard_handoff)\n");
+    close( sock);
+    return;
   }
+  h->sock = sock;
+  h->peer = *peer;
 
-  //
-  // Add reply to the end of the queue
-  // We'd support packet priorities here, I suppose
-  //
-  if( inbuf->reply_q == NULL)
-    inbuf->reply_q = our_reply;
-  else {
-    for( last_reply=inbuf->reply_q; last_reply->next != NULL; last_reply=last_reply->next);
-    last_reply->next = our_reply;
+  __atomic_store_n( &e_fd_shard[sock], sh->id, __ATOMIC_RELEASE);
+  __atomic_add_fetch( &sh->circuits, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock( &sh->lock);
+  h->next = sh->handoffs;
+  sh->handoffs = h;
+  pthread_mutex_unlock( &sh->lock);
+
+  if( write( sh->efd, &one, sizeof( one)) == -1) {
+    perror( "shard eventfd write (e_shard_handoff)");
   }
 }
 
-/** Channel Access packet service routine
- *
- * \param pfd   The pollfd structure for this socket
- * \param inbuf Our input buffer
+/** Adopt new circuits and send the monitor updates the main loop routed to us
+ *  Shard only: called when our eventfd is readable.
  */
-void ca_service( struct pollfd *pfd, e_socks_buffer_t *inbuf) {
-  static struct sockaddr_in fromaddr;	// client's address
-  static unsigned int fromlen;		// used and ignored to store length of client address
-  static e_response_t ert[1024];	// our responses
-  e_extended_message_header_t bad_cmd_header;	// used to skip commands we do not know how to handle
-  void *old_rbp;			// used to be sure we are still reading from the buffer
-  int nert;				// number of responses
-  int i;				// loop over responses
-  int rsize;				// size of reply packet
-  void *reply;				// our reply
-  void *rp;				// pointer to next location to write into reply
-  int cmd;				// our current command
-  int nread;				// number of bytes read
-  
+void e_shard_service() {
+  e_handoff_t *h, *handoffs;
+  e_update_t *u, *updates, *last;
+  uint64_t count;
+  int k;
+
+  if( read( e_shard->efd, &count, sizeof( count)) == -1 && errno != EAGAIN) {
+    perror( "shard eventfd read (e_shard_service)");
+  }
 
-  if( pfd->revents & (POLLERR | POLLHUP | POLLNVAL)) {
-    //
-    // close the socket and ignore it ever more
-    //
-    inbuf->active = 0;
-    return;
+  pthread_mutex_lock( &e_shard->lock);
+  handoffs = e_shard->handoffs;
+  e_shard->handoffs = NULL;
+  updates = e_shard->updates;
+  e_shard->updates = NULL;
+  e_shard->updates_tail = NULL;
+  pthread_mutex_unlock( &e_shard->lock);
+
+  while( handoffs != NULL) {
+    h = handoffs;
+    handoffs = h->next;
+    e_circuit_adopt( h->sock, &h->peer);
+    free( h);
+  }
+
+  //
+  // An update for a circuit we have closed since it was routed finds no socket
+  //
+  last = NULL;
+  for( u = updates; u != NULL; u = u->next) {
+    last = u;
+    for( k=0; k<n_e_socks; k++) {
+      if( e_sock_bufs[k].sock == u->sock) {
+	if( u->put)
+	  e_monitor_put( e_sock_bufs + k, NULL, u->subid, u->enc);
+	else
+	  e_monitor_send( e_sock_bufs + k, u->subid, u->enc);
+	break;
+      }
+    }
+    e_enc_unref( u->enc);
+    u->enc = NULL;
   }
 
+  if( last != NULL) {
+    pthread_mutex_lock( &e_shard->lock);
+    last->next = e_shard->done;
+    e_shard->done = updates;
+    pthread_mutex_unlock( &e_shard->lock);
+  }
+}
 
-  if( pfd->revents & POLLOUT) {
-    // Service outgoing packets before incoming ones
-    //
-    int sent_count;
-    e_reply_queue_t *next;
+/** Ask the main loop to check the monitors
+ *  Shard only: a write we made might have changed a value someone watches.
+ */
+void e_monitor_kick() {
+  uint64_t one = 1;
 
-    //    fprintf( stderr, "Here I am in ca_service POLLOUT\n");
+  if( write( e_monitor_efd, &one, sizeof( one)) == -1) {
+    perror( "monitor eventfd write (e_monitor_kick)");
+  }
+}
 
-    if( inbuf->reply_q != NULL) {
-      next = inbuf->reply_q;
+/** Close the sockets that have gone inactive and decide what to poll for
+ *  Runs at the top of every pass through the main loop and the shard loops.
+ */
+void e_socks_prepare() {
+  int i;
 
-      if( next->fromlen != 0) {
-	sent_count = sendto( pfd->fd, next->reply_packet, next->reply_size, 0, (const struct sockaddr *)&next->fromaddr, next->fromlen);
-      } else {
-	sent_count = send( pfd->fd, next->reply_packet, next->reply_size, 0);
-      }
-      if( sent_count == -1) {
-	fprintf( stderr, "fromlen: %d     fromaddr: %s\n", next->fromlen, inet_ntoa( next->fromaddr.sin_addr));
-	perror( "ca_service");
-	if( pfd->fd == beacons) {
-	  hex_dump( next->reply_size, next->reply_packet);
-	} else {
-	  inbuf->active = 0;
+  for( i=1; i<n_e_socks; i++) {
+    // Socket at index 0 is our database connection
+    // that we are not messing with here
+    //
+    //
+    // root out all the inactive sockets
+    // and check for outgoing packets
+    //
+    if( e_sock_bufs[i].active == 0) {
+      void *params[1];  int param_lengths[1], param_formats[1];
+      int nsock;
+      PGresult *pgr;
+
+      nsock = htonl( e_sock_bufs[i].sock);
+      params[0] = &nsock;	param_lengths[0] = sizeof( nsock);    param_formats[0] = 1;
+
+      pgr = e_execPrepared( "remove_monitor", 1, (const char **)params, param_lengths, param_formats, 0);
+      if( pgr != NULL)
+	PQclear( pgr);
+
+      if( __atomic_load_n( &e_puts_waiting, __ATOMIC_RELAXED) > 0) {
+	pgr = e_execPrepared( "remove_puts", 1, (const char **)params, param_lengths, param_formats, 0);
+	if( pgr != NULL) {
+	  __atomic_sub_fetch( &e_puts_waiting, atoi( PQgetvalue( pgr, 0, 0)), __ATOMIC_RELAXED);
+	  PQclear( pgr);
 	}
-	inbuf->reply_q = next->next;
-	free( next->reply_packet);
-	free( next);
-	return;
       }
 
-      if( sent_count == 0) {
-	fprintf( stderr, "(ca_service) possible bad connect, cutting out\n");
-	inbuf->active = 0;
-	return;
+      if( e_sock_bufs[i].turns > 0)
+	e_circuit_report( e_sock_bufs + i);
+      if( e_sock_bufs[i].cap_id != 0)
+	e_cap_note( E_CAP_CLOSE, e_sock_bufs[i].cap_id, &e_sock_bufs[i].peer, NULL, 0);
+      e_uring_quiesce( e_sock_bufs + i);
+      if( e_shard != NULL) {
+	// before the close: the main loop may reuse the number as soon as we let go of it
+	__atomic_store_n( &e_fd_shard[e_socks[i].fd], 0, __ATOMIC_RELEASE);
+	__atomic_sub_fetch( &e_shard->circuits, 1, __ATOMIC_RELAXED);
       }
-
-      if( sent_count == next->reply_size) {
-	//
-	// Done with this packet
-	//
-	inbuf->reply_q = next->next;
-	free( next->reply_packet);
-	free( next);
-      } else {
-	//
-	// Still more to send
-	// Possibly we are sending a big array or something.
-	//
-	memcpy( next->reply_packet, next->reply_packet + sent_count, next->reply_size - sent_count);
-	next->reply_size -= sent_count;
+      close( e_socks[i].fd);
+      e_socks_buf_free( e_sock_bufs + i);
+      n_e_socks--;
+      if( i == n_e_socks) {
+	// no need to do any more work to remove this socket
+	break;
+      }
+      while( e_sock_bufs[n_e_socks].active == 0 && n_e_socks > i) {
+	// find the last active socket
+	n_e_socks--;
+      }
+      if( n_e_socks > i) {
+	// move it into the current position
+	e_sock_bufs[i] = e_sock_bufs[n_e_socks];
+	e_socks[i]     = e_socks[n_e_socks];
+      }
+    }
+    //
+    // see if it wants to send something
+    //
+    if( e_sock_bufs[i].uring) {
+      //
+      // The ring does our I/O: poll would only get in its way.  Like
+      // poll, it does not read from circuits waiting in the run queue.
+      //
+      if( !e_sock_bufs[i].udp && e_sock_bufs[i].run_wait && e_sock_bufs[i].urecv == E_URECV_ARMED)
+	e_uring_recv_cancel( e_sock_bufs + i);
+      else if( !e_sock_bufs[i].udp && !e_sock_bufs[i].run_wait && e_sock_bufs[i].urecv == E_URECV_OFF && e_sock_bufs[i].active)
+	e_uring_recv( e_sock_bufs + i);
+      e_uring_send( e_sock_bufs + i);
+      e_socks[i].events = 0;
+    } else {
+      //
+      // Circuits waiting in the run queue already have more to do than they can
+      //
+      e_socks[i].events = e_sock_bufs[i].run_wait ? 0 : POLLIN;
+      if( e_out_pending( e_sock_bufs + i)) {
+	//	fprintf( stderr, "Setting POLLOUT for socket %d\n", e_sock_bufs[i].sock);
+	e_socks[i].events |= POLLOUT;
       }
     }
   }
+}
 
-  if( pfd->revents & POLLIN) {
+/** Circuit shard thread
+ *  The same loop as main's, less the listener, datagrams and beacons, on
+ *  our own database connection and timer wheel.
+ *
+ * \param arg Our shard
+ */
+void *e_shard_run( void *arg) {
+  int timer_fd;
+  uint64_t t0;
+  int nfds;
+  int i;
+  int c;
 
-    fixup_bps( inbuf);
+  e_shard = arg;
 
-    fromlen = sizeof( fromaddr);
-    nread = recvfrom( pfd->fd, inbuf->wbp, inbuf->bufsize - (inbuf->wbp - inbuf->rbp), 0, (struct sockaddr *) &fromaddr, &fromlen);
-    if( nread == -1 || nread == 0) {
-      // we should stick some error handling code here
-      // for now we assume the UDP listening socket is not going to close on its own
-      //
-      return;
-    }
-    inbuf->wbp += nread;
+  //
+  // Our database connection lands at index 0 just like main's
+  //
+  pg_conn();
 
-    //    printf( "From %s port %d read %d bytes\n", inet_ntoa( fromaddr.sin_addr), ntohs(fromaddr.sin_port), nread);
+  timer_fd = e_wheel_init();
+  e_socks_buf_init( timer_fd);
+  e_socks_buf_init( e_shard->efd);
 
-    nert = 0;
-    while( inbuf->rbp < inbuf->wbp) {
+  while( 1) {
+    e_socks_prepare();
+    e_wheel_arm();
 
-      old_rbp = inbuf->rbp;
-      cmd = get_command( inbuf->rbp);
-      if( cmd <0 || cmd > 27) {
-	//
-	// Bad command: either a protocol version problem or we have a messed up packet.
-	//
-	read_extended_message_header( inbuf, &bad_cmd_header);
-	inbuf->rbp += bad_cmd_header.plsize;
-	fprintf( stderr, "unsupported command %d with payload size %d\n", cmd, bad_cmd_header.plsize);
-	if( inbuf->rbp > inbuf->wbp) {
-	  fprintf( stderr, "request to read more bytes than we have: likely we've screwed up the buffer, reseting\n");
-	  inbuf->rbp = inbuf->buf;
-	  inbuf->wbp = inbuf->buf;
-	  return;
-	}
-      } else {
-	//
-	// Good command
-	//
-	ert[nert].sock    = pfd->fd;
-	ert[nert].peer    = fromaddr;
-	ert[nert].bufsize = 0;
-	ert[nert].buf     = NULL;
-	cmds[cmd](inbuf, (ert+nert));
-
-	if( ert[nert].bufsize >= 0) {
-	  // save responses for the end
-	  nert++;
-	  if( nert > (sizeof( ert) / sizeof( ert[0]))) {
-	    //
-	    // Really, this should not happen in real life.
-	    //
-	    break;
+    nfds = poll( e_socks, n_e_socks, e_run_waiting > 0 ? 0 : -1);
+    __atomic_add_fetch( &e_io_syscalls, 1, __ATOMIC_RELAXED);
+    t0 = e_ticks();
+
+    //
+    // Highest priority class first (see main)
+    //
+    for( c = E_PRIO_CLASSES - 1; nfds>0 && c >= 0; c--) {
+      for( i=0; nfds>0 && i<n_e_socks; i++) {
+	if( e_socks[i].revents && e_sock_bufs[i].prio_class == c) {
+	  nfds--;
+	
+	  if( e_socks[i].fd == timer_fd) {
+	    e_wheel_service();
+	  } else if( e_socks[i].fd == e_shard->efd) {
+	    e_shard_service();
+	  } else if( e_socks[i].fd == PQsocket(q)) {
+	    // Nobody LISTENs on a shard's connection but keep it drained anyway
+	    PQconsumeInput( q);
+	    while( PQnotifies( q) != NULL);
+	  } else {
+	    ca_service( e_socks+i, e_sock_bufs+i);
 	  }
+	  e_socks[i].revents = 0;
 	}
       }
-      if( inbuf->rbp == old_rbp) {
-	// nothing left we can read
-	break;
-      }
-    
-      // make up reply packet
-      // First get its size
-      rsize = 0;
-      for( i=0; i<nert; i++) {
-	rsize += ert[i].bufsize;
-      }
+    }
+    e_run_service();
+    if( maybe_check_monitors) {
+      maybe_check_monitors = 0;
+      e_monitor_kick();
+    }
+    e_hist_time( &e_stats_mine()->loop, t0);
+  }
+  return NULL;
+}
 
-      if( rsize>0) {
-	reply = calloc( rsize, 1);
-	if( reply == NULL) {
-	  fprintf( stderr, "Out of memory for reply (ca_service)\n");
-	  exit( -1);
-	}
-	rp = reply;
-	for( i=0; i<nert; i++) {
-	  if( ert[i].bufsize && ert[i].buf != NULL) {
-	    memcpy( rp, ert[i].buf, ert[i].bufsize);
-	    rp += ert[i].bufsize;
-	    free( ert[i].buf);
-	    ert[i].buf = NULL;
-	    ert[i].bufsize = 0;
-	  }
-	}
-      
-	//	fprintf( stderr, "Making reply of %d bytes for socket %d\n", rsize, pfd->fd);
+/** Start the circuit shards
+ *  Returns the eventfd the main loop polls for shards asking it to check monitors.
+ */
+int e_shards_start() {
+  e_shard_t *sh;
+  int k;
 
-	mk_reply( inbuf, rsize, reply, &fromaddr, sizeof( fromaddr));
-      }
+  e_monitor_efd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if( e_monitor_efd == -1) {
+    perror( "monitor eventfd");
+    exit( -1);
+  }
 
+  for( k=0; k<e_shards_n; k++) {
+    sh = e_shards + k;
+    memset( sh, 0, sizeof( *sh));
+    sh->id  = k + 1;
+    sh->efd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if( sh->efd == -1) {
+      perror( "shard eventfd");
+      exit( -1);
+    }
+    pthread_mutex_init( &sh->lock, NULL);
+    if( pthread_create( &sh->tid, NULL, e_shard_run, sh) != 0) {
+      fprintf( stderr, "Could not start circuit shard %d\n", sh->id);
+      exit( -1);
     }
+    pthread_detach( sh->tid);
   }
-  //  printf( "\n");
+  return e_monitor_efd;
 }
 
-
 /** Virtual circuit listener server
  *
  * \param pfd   pollfd object for this socket
@@ -2443,43 +6612,73 @@ void vclistener_service( struct pollfd *pfd, e_socks_buffer_t *inbuf) {
   static struct sockaddr_in fromaddr;	// client's address
   static int fromlen;			// used and ignored to store length of client address
   int newsock;
+  unsigned long n;			// circuits accepted this time around
   
-  fromlen = sizeof( fromaddr);
-  newsock = accept( pfd->fd, (struct sockaddr *)&fromaddr, (unsigned int *)&fromlen);
+  //
+  // After a restart every client reconnects at once: empty the
+  // accept queue now rather than one circuit per trip through poll
+  //
+  for( n=0; n<E_ACCEPT_BURST; n++) {
+    fromlen = sizeof( fromaddr);
+    newsock = accept( pfd->fd, (struct sockaddr *)&fromaddr, (unsigned int *)&fromlen);
+    if( newsock < 0) {
+      if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+	perror( "accept (vclistener_service)");
+      break;
+    }
 
-  fprintf( stderr, "accepted socket %d from %s (vclistener_service)\n", newsock, inet_ntoa( fromaddr.sin_addr));
+    fprintf( stderr, "accepted socket %d from %s (vclistener_service)\n", newsock, inet_ntoa( fromaddr.sin_addr));
 
-  if( newsock < 0) {
-    return;
-  }
-  if( n_e_socks < n_e_socks_max) {
-    e_socks_buf_init( newsock);
+    if( e_shards_n > 0) {
+      e_shard_handoff( newsock, &fromaddr);
+    } else {
+      e_circuit_adopt( newsock, &fromaddr);
+    }
   }
+  e_accepts += n;
+  if( n > e_accept_bursts_max)
+    e_accept_bursts_max = n;
 }
 
 /** Get list of kvs that have changed
+ *  Main loop only: updates for circuits owned by a shard are routed to it.
+ *  e.check_monitors has already applied each subscription's mask and the
+ *  channel's deadbands so everything we get here goes out.
  */
 void check_monitors() {
-  static e_response_t ert;
   PGresult *pgr;
-  uint32_t sid, subid, sock, dtype, cnt, eepoch, ensec;
+  uint32_t sid, subid, sock, dtype, cnt, eepoch, ensec, kv, kvseq, alarm;
+  int metaseq;	// the channel's metadata (-1 when the database does not say)
+  int metaseq_col;	// which column it is in
+  e_chan_t *meta;	// the metadata itself, read once per encoding
   char *svalue;
-  int struct_size;
-  int data_size;
-  int i, j;  // i loop over monitors, j loop over value arrays (not yet supported)
+  char *vals;	// array value (NULL for scalars)
+  int vlen;	// its length
+  int vals_col;	// which column it is in
+  int i;	// loop over monitors
   int k;	// loop over sock_bufs
-  void *payload;
+  e_enc_t *enc;	// the current encoding
+  uint32_t enc_kv, enc_kvseq, enc_dtype, enc_cnt;	// what it is an encoding of
+  int enc_metaseq;	// and the metadata it goes with
+  int copies;	// subscribers it has gone to
+  int owner;	// the shard serving the circuit (0 for us)
   
-  j = 0;
-
   pgr = e_execPrepared( "check_monitors", 0, NULL, NULL, NULL, 1);
   if( pgr == NULL)
     return;
+  e_hist_note( &e_stats_mine()->batch, PQntuples( pgr));
 
+  //
+  // Rows come sorted by kv, dbr type and count so everyone who wants the
+  // same update gets a copy of one encoding
+  //
+  enc = NULL;
+  enc_kv = enc_kvseq = enc_dtype = enc_cnt = 0;
+  enc_metaseq = -1;
+  copies = 0;
+  vals_col = PQfnumber( pgr, "vals");
+  metaseq_col = PQfnumber( pgr, "metaseq");
   for( i=0; i<PQntuples( pgr); i++) {
-    //
-    // Only handle scalers for now.  Arrays require a call to get_values.
-    //
     sid   = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "sid")));
     subid = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "subid")));
     sock  = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "sock")));
@@ -2487,115 +6686,183 @@ void check_monitors() {
     cnt   = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "cnt")));
     eepoch= ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "eepoch")));
     ensec = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "ensec")));
+    kv    = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "kv")));
+    kvseq = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "kvseq")));
+    alarm = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "alarm")));
     svalue = PQgetvalue( pgr, i, PQfnumber( pgr, "val"));
-
-
-    struct_size = dbr_sizes[dtype].dbr_struct_size;
-    data_size   = dbr_sizes[dtype].dbr_type_size;
-
-    // Propagate the evil epics fixed length string
-    //
-    if( dtype % 7 == 0) {
-      if( cnt == 1) {
-	data_size = strlen( svalue) + 1;
-      } else {
-	data_size = MAX_STRING_SIZE;
+    metaseq = -1;
+    if( metaseq_col != -1 && !PQgetisnull( pgr, i, metaseq_col))
+      metaseq = ntohl( *(uint32_t *)PQgetvalue( pgr, i, metaseq_col));
+
+    if( enc != NULL && (kv != enc_kv || kvseq != enc_kvseq || dtype != enc_dtype || cnt != enc_cnt || metaseq != enc_metaseq)) {
+      e_hist_note( &e_stats_mine()->fanout, copies);
+      e_enc_unref( enc);
+      enc = NULL;
+    }
+    if( enc == NULL) {
+      vals   = NULL;
+      vlen   = 0;
+      if( vals_col != -1 && !PQgetisnull( pgr, i, vals_col)) {
+	vals = PQgetvalue( pgr, i, vals_col);
+	vlen = PQgetlength( pgr, i, vals_col);
       }
+      enc = e_enc_new( dtype, cnt, eepoch, ensec, svalue, vals, vlen, alarm);
+      if( enc == NULL)
+	continue;
+      //
+      // Subscribers set up with older metadata catch up from this copy
+      //
+      meta = metaseq == -1 ? NULL : calloc( 1, sizeof( *meta));
+      if( meta != NULL && !e_chan_row( pgr, i, meta)) {
+	free( meta);
+	meta = NULL;
+      }
+      enc->meta   = meta;
+      enc_metaseq = metaseq;
+      enc_kv    = kv;
+      enc_kvseq = kvseq;
+      enc_dtype = dtype;
+      enc_cnt   = cnt;
+      copies    = 0;
+    } else {
+      e_enc_shared++;
     }
+    copies++;
 
-    // Today we only support monitors on scalers
     //
-    cnt = 1;
-    
-    ert.bufsize = struct_size + 1*data_size;
-    ert.buf     = calloc( ert.bufsize, 1);
-    if( ert.buf == NULL) {
-      fprintf( stderr, "out of memory for buffer %d (check_monitors)\n", sock);
+    // The shard may be closing the circuit as we look: if it has
+    // gone by the time the update gets there the shard drops it
+    //
+    owner = sock < E_FD_MAX ? __atomic_load_n( &e_fd_shard[sock], __ATOMIC_ACQUIRE) : 0;
+    if( owner != 0) {
+      e_shard_route( e_shards + owner - 1, sock, subid, enc, 0);
       continue;
     }
-    
-    //    fprintf( stderr, "check_monitors    sock: %d   dtype: %d   cnt: %d   svalue: '%s' struct_size: %d  data_size: %d bufsize: %d\n",
-    //                                        sock,      dtype,      cnt,      svalue,      struct_size,     data_size,    ert.bufsize);
 
-    //
-    // create a message
-    // 
-    //              cmd:  1
-    //     payload size: size of the dbr data
-    //        data type: same as request
-    //      data length: shold be the same as the request (1 for now until we support arrays)
-    //      status code: ECA_NORMAL (1) on success
-    //  subscription id: as the client requested
-    //
-    payload = create_message( &ert, 1, struct_size + 1*data_size, dtype, 1, 1, subid);
-    
-    // struct filling would go here if we did it
+    for( k=0; k<n_e_socks; k++) {
+      if( e_sock_bufs[k].sock == sock) {
+	break;
+      }
+    }
+    if( k == n_e_socks) {
+      //
+      // Socket is gone, nobody to tell
+      //
+      continue;
+    }
+
+    e_monitor_send( e_sock_bufs + k, subid, enc);
+  }
+  if( enc != NULL)
+    e_hist_note( &e_stats_mine()->fanout, copies);
+  e_enc_unref( enc);
+ 
+  PQclear( pgr);
 
-    mk_dbr_struct( payload, dtype, eepoch, ensec, "0", "0", 0, 0, 0);
+  for( k=0; k<e_shards_n; k++) {
+    e_shard_post( e_shards + k);
+  }
+}
 
-    payload += struct_size;
+/** Reply to the write_notify commands that have finished or given up
+ *  e.check_puts hands back each queued command once: ECA_NORMAL when its
+ *  kv has changed and ECA_TIMEOUT when it has waited too long.  Main loop
+ *  only.
+ */
+void check_puts() {
+  PGresult *pgr;
+  uint32_t sock, ioid, dtype, cnt, status;
+  e_enc_t *enc;
+  int i;	// loop over finished commands
+  int k;	// loop over sock_bufs and shards
+  int owner;	// the shard serving the circuit (0 for us)
 
-    pack_dbr_data( payload, dtype, svalue);
+  if( __atomic_load_n( &e_puts_waiting, __ATOMIC_RELAXED) <= 0)
+    return;
 
-    //    fprintf( stderr, "check_monitors hex_dump:\n");
-    //    hex_dump( ert.bufsize, ert.buf);
+  pgr = e_execPrepared( "check_puts", 0, NULL, NULL, NULL, 1);
+  if( pgr == NULL)
+    return;
+
+  for( i=0; i<PQntuples( pgr); i++) {
+    sock   = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "sock")));
+    ioid   = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "ioid")));
+    dtype  = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "dtype")));
+    cnt    = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "cnt")));
+    status = ntohl( *(uint32_t *)PQgetvalue( pgr, i, PQfnumber( pgr, "status")));
+    __atomic_sub_fetch( &e_puts_waiting, 1, __ATOMIC_RELAXED);
+
+    //
+    // Response
+    //
+    //           cmd: 19
+    //  payload size:  0
+    //     data type: same as request
+    //   data length: same as request
+    //   status code: ECA_NORMAL (1) or ECA_TIMEOUT (80)
+    //          IOID: from client
+    //
+    enc = e_enc_message( 19, dtype, cnt, status);
+    if( enc == NULL)
+      continue;
 
-    if( ert.buf != NULL && ert.bufsize > 0) {
-      for( k=0; k<n_e_socks_max; k++) {
+    owner = sock < E_FD_MAX ? __atomic_load_n( &e_fd_shard[sock], __ATOMIC_ACQUIRE) : 0;
+    if( owner != 0) {
+      e_shard_route( e_shards + owner - 1, sock, ioid, enc, 1);
+    } else {
+      for( k=0; k<n_e_socks; k++) {
 	if( e_sock_bufs[k].sock == sock) {
+	  e_monitor_put( e_sock_bufs + k, NULL, ioid, enc);
 	  break;
 	}
       }
-      if( k<n_e_socks_max) {
-	mk_reply( e_sock_bufs+k, ert.bufsize, ert.buf, NULL, 0);
-      }
     }
+    e_enc_unref( enc);
   }
- 
   PQclear( pgr);
+
+  for( k=0; k<e_shards_n; k++) {
+    e_shard_post( e_shards + k);
+  }
+}
+
+/** Look for finished write_notify commands
+ *  Catches the ones whose kv changed without a NOTIFY and the ones that
+ *  timed out.
+ *
+ * \param t Our timer
+ */
+void put_sweep( e_timer_t *t) {
+  check_puts();
+  e_timer_add( t, E_PUT_POLL_MS);
 }
 
 
 /** Send out our broadcast beacon
- *  Set up as a signal handler for a timer
+ *  Driven by the beacon timer: the interval backs off from 200 ms to 8 seconds.
  *
- * \param sig  The timer signal (SIGALRM).
+ * \param t  The beacon timer
 */
-void broadcast_beacon( int sig) {
+void broadcast_beacon( e_timer_t *t) {
   static int beaconid = 1;
-  static struct itimerval timer_interval;
-  int change_timer;
   e_response_t ert;
   uint32_t tmp;
 
   //
   // fix up the timer
   //
-  change_timer = 0;
-  getitimer( ITIMER_REAL, &timer_interval);
-  if( timer_interval.it_interval.tv_sec == 0) {
-    if( timer_interval.it_interval.tv_usec < 500000) {
-      timer_interval.it_interval.tv_usec *= 2;
-      change_timer = 1;
+  if( beacon_interval_ms < 1000) {
+    if( beacon_interval_ms < 500) {
+      beacon_interval_ms *= 2;
     } else {
-      timer_interval.it_interval.tv_sec  = 1;
-      timer_interval.it_interval.tv_usec = 0;
-      change_timer = 1;
+      beacon_interval_ms = 1000;
     }
   } else {
-    if( timer_interval.it_interval.tv_sec < 8) {
-      timer_interval.it_interval.tv_sec *= 2;
-      change_timer = 1;
-    }
-  }
-  
-  if( change_timer) {
-    timer_interval.it_value.tv_sec  =  timer_interval.it_interval.tv_sec;
-    timer_interval.it_value.tv_usec = timer_interval.it_interval.tv_usec;
-    if( setitimer( ITIMER_REAL, &timer_interval, NULL) == -1) {
-      perror( "timer initialization");
+    if( beacon_interval_ms < 8000) {
+      beacon_interval_ms *= 2;
     }
   }
+  e_timer_add( t, beacon_interval_ms);
 
   //
   // We've already converted the address to network byte order
@@ -2613,30 +6880,130 @@ void broadcast_beacon( int sig) {
   //     Beacon ID: sequential number
   //    perhaps ip: 0 or our ip address
   //
+  ert.out = e_sock_bufs + beacon_index;
+  ert.out->ostart = ert.out->otail;
   create_message( &ert, 13, 0, 5064, 0, beaconid++, tmp);
-  mk_reply( e_sock_bufs + beacon_index, ert.bufsize, ert.buf, &broadcastaddr, sizeof( broadcastaddr));
+  mk_reply( ert.out, ert.out->ostart, &broadcastaddr, sizeof( broadcastaddr));
+  ert.out->ostart = -1;
 
 }
 
 
+#ifndef E_NO_MAIN
 /** our main routine (of course)
+ *  Left out (E_NO_MAIN) when our tools include us for the protocol code.
  */
 int main( int argc, char **argv) {
   static int sock;			// our main socket
   static int vclistener;		// our tcp listener
   static struct sockaddr_in addr;	// our address
-  static struct sigaction alarm_action; // sets up alarm signal function
-  static struct itimerval timer_interval;
-  static sigset_t emptyset, blockset;		// signal masks
   int err;				// error return from bind
   int i;				// loop for poll response and sockets
   int nfds;				// number of active file descriptors from poll
   int flags;				// used to set non-blocking io for vclistener
   int opt_param;			// setsockot parameter
+  int sock_index;			// where a socket landed in e_socks
+  int uring_fd = -1;			// our io_uring, if we are using one
+  int timer_fd;				// drives our timer wheel
+  int search_fd = -1;			// search workers ask for the database through this
+  int monitor_fd = -1;			// circuit shards ask us to check monitors through this
+  uint64_t count;			// eventfd counter
+  uint64_t t0;				// when this time around the loop started
+  int c;				// command line option, then priority class
+  PGnotify *notify;			// a NOTIFY from the database
+
+  while( (c = getopt( argc, argv, "ur:s:c:b:m:a:d:w:p:x:C:")) != -1) {
+    switch( c) {
+    case 'u':
+      // socket I/O through io_uring instead of poll
+      e_use_uring = 1;
+      break;
+    case 'r':
+      // receive buffer size for the udp sockets
+      e_udp_rcvbuf = atoi( optarg);
+      break;
+    case 's':
+      // search worker threads sharing our udp port
+      e_search_workers = atoi( optarg);
+      if( e_search_workers < 0 || e_search_workers > E_SEARCH_WORKERS_MAX) {
+	fprintf( stderr, "Between 0 and %d search workers, please\n", E_SEARCH_WORKERS_MAX);
+	exit( -1);
+      }
+      break;
+    case 'c':
+      // circuit shard threads
+      e_shards_n = atoi( optarg);
+      if( e_shards_n < 0 || e_shards_n > E_SHARDS_MAX) {
+	fprintf( stderr, "Between 0 and %d circuit shards, please\n", E_SHARDS_MAX);
+	exit( -1);
+      }
+      break;
+    case 'b':
+      // virtual circuit listen backlog (the kernel caps it at somaxconn)
+      e_listen_backlog = atoi( optarg);
+      break;
+    case 'm':
+      // default most monitor updates per second per subscription
+      e_max_rate = atof( optarg);
+      break;
+    case 'w':
+      // seconds a write_notify queued for the MD2 waits for its kv to change
+      e_put_tmo = atoi( optarg);
+      break;
+    case 'p':
+      // serve our metrics as read only channels named with this prefix
+      e_metric_prefix = optarg;
+      break;
+    case 'x':
+      // and as a text dump on this unix socket
+      e_metric_path = optarg;
+      break;
+    case 'C':
+      // capture our traffic to this file for ca-replay
+      if( e_cap_open( optarg) == -1)
+	exit( -1);
+      break;
+    case 'a':
+    case 'd':
+      // let clients on this network in (a) or turn them away (d)
+      if( e_cidr_add( optarg, c == 'a') == -1) {
+	fprintf( stderr, "Bad network '%s': use address/bits\n", optarg);
+	exit( -1);
+      }
+      break;
+    default:
+      fprintf( stderr, "Usage: %s [-u] [-r udp_rcvbuf_bytes] [-s search_workers] [-c circuit_shards] [-b listen_backlog] [-m max_updates_per_sec] [-a allow_net/bits]... [-d deny_net/bits]... [-w write_notify_timeout_secs] [-p metric_channel_prefix] [-x metrics_socket_path] [-C capture_file]\n", argv[0]);
+      exit( -1);
+    }
+  }
+
+  //
+  // Without any rules we serve the beamline network as we always have
+  //
+  if( e_cidrs_n == 0)
+    e_cidr_add( "10.1.0.0/16", 1);
+
   //
   // pgres
   //
   pg_conn();
+  e_dbr_check();
+  e_swap_init();
+  e_metrics_init();
+
+  if( e_use_uring) {
+    uring_fd = e_uring_init();
+    if( uring_fd == -1) {
+      fprintf( stderr, "Could not set up io_uring, falling back to poll\n");
+      e_use_uring = 0;
+    } else {
+      //
+      // Poll the ring along with the libpq and listener sockets
+      //
+      e_socks_buf_init( uring_fd);
+    }
+  }
+  atexit( e_io_report);
 
   //
   // UDP comms
@@ -2655,6 +7022,17 @@ int main( int argc, char **argv) {
   setsockopt ( sock, SOL_SOCKET, SO_REUSEADDR, &opt_param, sizeof( opt_param));
   opt_param = 1;
   setsockopt ( sock, SOL_SOCKET, SO_BROADCAST, &opt_param, sizeof( opt_param));
+  if( e_search_workers > 0) {
+    //
+    // The workers bind the same port: the kernel spreads unicast
+    // searches across us and e_udp_ours splits up the broadcasts
+    //
+    opt_param = 1;
+    setsockopt ( sock, SOL_SOCKET, SO_REUSEPORT, &opt_param, sizeof( opt_param));
+    opt_param = 1;
+    setsockopt ( sock, IPPROTO_IP, IP_PKTINFO, &opt_param, sizeof( opt_param));
+  }
+  e_udp_sockopts( sock);
 
   err = bind( sock, (struct sockaddr *) &addr, sizeof(struct sockaddr_in));
   if( err == -1) {
@@ -2662,7 +7040,11 @@ int main( int argc, char **argv) {
     exit( -1);
   }
 
-  e_socks_buf_init( sock);
+  sock_index = e_socks_buf_init( sock);
+  search_index = sock_index;
+  if( e_use_uring) {
+    e_uring_recv( e_sock_bufs + sock_index);
+  }
 
   beacons = socket( PF_INET, SOCK_DGRAM, 0);
   if( sock == -1) {
@@ -2682,6 +7064,7 @@ int main( int argc, char **argv) {
   if( setsockopt ( beacons, SOL_SOCKET, SO_BROADCAST, &opt_param, sizeof( opt_param)) == -1) {
     perror( "beacons BROADCAST");
   }
+  e_udp_sockopts( beacons);
 
   err = bind( beacons, (struct sockaddr *) &addr, sizeof(struct sockaddr_in));
   if( err == -1) {
@@ -2698,6 +7081,9 @@ int main( int argc, char **argv) {
   inet_aton( "10.1.0.19", &(ouraddr.sin_addr));
 
   beacon_index = e_socks_buf_init( beacons);
+  if( e_use_uring) {
+    e_uring_recv( e_sock_bufs + beacon_index);
+  }
 
   //
   // TCP Virtual Circuits
@@ -2728,7 +7114,7 @@ int main( int argc, char **argv) {
     exit( -1);
   }
 
-  err = listen( vclistener, 4);
+  err = listen( vclistener, e_listen_backlog);
   if( err == -1) {
     fprintf( stderr, "Could not listen with the virtual circuit listener socket\n");
     exit( -1);
@@ -2737,115 +7123,131 @@ int main( int argc, char **argv) {
   e_socks_buf_init( vclistener);
 
   //
-  // block sigalrm
+  // Timers (beacons, circuit timeouts) run from the poll loop
   //
-  sigemptyset( &blockset);
-  sigaddset( &blockset, SIGALRM);
-  sigprocmask( SIG_BLOCK, &blockset, NULL);
+  timer_fd = e_wheel_init();
+  e_socks_buf_init( timer_fd);
 
   //
-  // broadcast the beacon when the alarm comes in
+  // First beacon goes out in 5 seconds, then we back off from there
   //
-  alarm_action.sa_handler = broadcast_beacon;
-  sigemptyset( &alarm_action.sa_mask);
-  alarm_action.sa_flags   = 0;
-  sigaction( SIGALRM, &alarm_action, NULL);
+  beacon_timer.cb = broadcast_beacon;
+  e_timer_add( &beacon_timer, 5000);
 
   //
-  // set up periodic alarms
+  // Queued write_notify commands that finish without a NOTIFY or not at all
   //
-  timer_interval.it_interval.tv_sec  = 0;
-  timer_interval.it_interval.tv_usec = 200000;
-  timer_interval.it_value.tv_sec     = 5;
-  timer_interval.it_value.tv_usec    = 0;
+  put_timer.cb = put_sweep;
+  e_timer_add( &put_timer, E_PUT_POLL_MS);
 
-  if( setitimer( ITIMER_REAL, &timer_interval, NULL) == -1) {
-    perror( "timer initialization");
+  //
+  // Traffic capture goes out to its file every second
+  //
+  if( e_cap_file != NULL) {
+    cap_timer.cb = cap_flush;
+    e_timer_add( &cap_timer, E_CAP_FLUSH_MS);
   }
 
+  //
+  // Metrics text dump
+  //
+  if( e_metric_path != NULL) {
+    e_metric_fd = e_metrics_listen( e_metric_path);
+    if( e_metric_fd == -1)
+      exit( -1);
+    e_socks_buf_init( e_metric_fd);
+  }
 
-  while( 1) {
-    for( i=1; i<n_e_socks; i++) {
-      // Socket at index 0 is our database connection
-      // that we are not messing with here
-      //
-      //
-      // root out all the inactive sockets
-      // and check for outgoing packets
-      //
-      if( e_sock_bufs[i].active == 0) {
-	void *params[1];  int param_lengths[1], param_formats[1];
-	int nsock;
-	PGresult *pgr;
-
-	nsock = htonl( e_sock_bufs[i].sock);
-	params[0] = &nsock;	param_lengths[0] = sizeof( nsock);    param_formats[0] = 1;
+  //
+  // Search workers answer what they can from the name index
+  //
+  if( e_search_workers > 0) {
+    search_fd = e_search_start();
+    e_socks_buf_init( search_fd);
+  }
 
-	pgr = e_execPrepared( "remove_monitor", 1, (const char **)params, param_lengths, param_formats, 0);
-	if( pgr != NULL)
-	  PQclear( pgr);
+  //
+  // Circuit shards serve the virtual circuits we accept
+  //
+  if( e_shards_n > 0) {
+    monitor_fd = e_shards_start();
+    e_socks_buf_init( monitor_fd);
+  }
 
-	close( e_socks[i].fd);
-	n_e_socks--;
-	if( i == n_e_socks) {
-	  // no need to do any more work to remove this socket
-	  break;
-	}
-	while( e_sock_bufs[n_e_socks].active == 0 && n_e_socks > i) {
-	  // find the last active socket
-	  n_e_socks--;
-	}
-	if( n_e_socks > i) {
-	  // move it into the current position
-	  e_sock_bufs[i] = e_sock_bufs[n_e_socks];
-	  e_socks[i]     = e_socks[n_e_socks];
-	}
-      }
-      //
-      // see if it wants to send something
-      //
-      if( e_sock_bufs[i].reply_q != NULL) {
-	//	fprintf( stderr, "Setting POLLOUT for socket %d\n", e_sock_bufs[i].sock);
-	e_socks[i].events = POLLIN | POLLOUT;
-      } else {
-	e_socks[i].events = POLLIN;
-      }
-    }
+  while( 1) {
+    e_socks_prepare();
     
+    if( e_use_uring) {
+      e_uring_submit( 0);
+    }
+    e_wheel_arm();
+
     //
-    // unblock alarm signal and wait for file descriptors
+    // wait for file descriptors
+    // (but don't sleep while circuits are waiting for another turn)
     //
-    sigemptyset( &emptyset);
-    nfds = ppoll( e_socks, n_e_socks, NULL, &emptyset);
- 
+    nfds = poll( e_socks, n_e_socks, e_run_waiting > 0 ? 0 : -1);
+    __atomic_add_fetch( &e_io_syscalls, 1, __ATOMIC_RELAXED);
+    t0 = e_ticks();
 
     //
     // Check for active descriptors
     //
-    for( i=0; nfds>0 && i<n_e_socks_max; i++) {
-      if( e_socks[i].revents) {
-	nfds--;
+    // Our own sockets (listener, database, timers...) are in the top
+    // class; virtual circuits are served (input and output) in order of
+    // the priority their clients asked for.  Every ready socket is served
+    // each time around: the classes only decide who waits for whom.
+    //
+    for( c = E_PRIO_CLASSES - 1; nfds>0 && c >= 0; c--) {
+      for( i=0; nfds>0 && i<n_e_socks; i++) {
+	if( e_socks[i].revents && e_sock_bufs[i].prio_class == c) {
+	  nfds--;
 	
-	if( e_socks[i].fd == vclistener) {
-	  vclistener_service( e_socks+i, e_sock_bufs+i);
-	} else if( e_socks[i].fd == PQsocket(q)) {
-	  //
-	  // The only thing that would come over the pg socket
-	  // would be a notify about a monitor update.
-	  //
-	  PQconsumeInput( q);
-	  while( PQnotifies( q) != NULL);
-	  check_monitors();
-	} else {
-	  ca_service( e_socks+i, e_sock_bufs+i);
+	  if( e_socks[i].fd == vclistener) {
+	    vclistener_service( e_socks+i, e_sock_bufs+i);
+	  } else if( e_socks[i].fd == uring_fd) {
+	    e_uring_service();
+	  } else if( e_socks[i].fd == timer_fd) {
+	    e_wheel_service();
+	  } else if( e_socks[i].fd == search_fd) {
+	    e_search_service();
+	  } else if( e_socks[i].fd == e_metric_fd) {
+	    e_metrics_dump();
+	  } else if( e_socks[i].fd == monitor_fd) {
+	    if( read( monitor_fd, &count, sizeof( count)) == -1 && errno != EAGAIN) {
+	      perror( "monitor eventfd read");
+	    }
+	    check_monitors();
+	    check_puts();
+	  } else if( e_socks[i].fd == PQsocket(q)) {
+	    //
+	    // The only thing that would come over the pg socket
+	    // would be a notify about a monitor update (or the kv
+	    // a queued write_notify is waiting on).
+	    //
+	    PQconsumeInput( q);
+	    while( (notify = PQnotifies( q)) != NULL) {
+	      if( e_cap_file != NULL)
+		e_cap_notify( notify);
+	      PQfreemem( notify);
+	    }
+	    check_monitors();
+	    check_puts();
+	  } else {
+	    ca_service( e_socks+i, e_sock_bufs+i);
+	  }
+	  e_socks[i].revents = 0;
 	}
       }
     }
+    e_run_service();
     if( maybe_check_monitors) {
       maybe_check_monitors = 0;
       check_monitors();
+      check_puts();
     }
+    e_hist_time( &e_stats_mine()->loop, t0);
   }
   return 0;
 }
-
+#endif
@@ -7,13 +7,24 @@
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <stddef.h>
 #include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <libpq-fe.h>
 #include <sys/time.h>
 #include <errno.h>
-#include <signal.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 // For some reason epics uses fixed length strings
 // Sort of: epics strings are defined as a struct { unsigned length; char *pString}
@@ -45,23 +56,65 @@ typedef struct e_extended_message_header {
   uint32_t dcount;
 } e_extended_message_header_t;
 
+// timer
+//
+// Lives in the timer wheel until it fires or is cancelled.
+//
+typedef struct e_timer_struct {
+  struct e_timer_struct *next;	// next timer in our wheel slot
+  struct e_timer_struct *prev;	// previous timer in our wheel slot
+  uint64_t expires;		// wheel tick at which we fire
+  int pending;			// 1 while we are in the wheel
+  void (*cb)( struct e_timer_struct *);	// what to do when we fire
+  int arg;			// for the callback: usually the socket this timer belongs to
+} e_timer_t;
+
+#define E_WHEEL_TICK_MS  10	// timer resolution
+#define E_WHEEL_BITS      6	// each level has 64 slots
+#define E_WHEEL_SLOTS    (1 << E_WHEEL_BITS)
+#define E_WHEEL_LEVELS    4	// 64^4 ticks is a bit over 6 days
+
+#define E_UDP_BATCH   32	// datagrams moved per recvmmsg/sendmmsg
+#define E_UDP_DGRAM 4096	// largest datagram we take in
+#define E_UDP_MTU   1472	// replies to the same peer are packed into datagrams up to this size
+#define E_UDP_CMSG_SPACE (CMSG_SPACE( sizeof( uint32_t)) + CMSG_SPACE( sizeof( struct in_pktinfo)))	// drop count and destination address
+
+#define E_CIRCUIT_IDLE_MS 60000	// probe a virtual circuit with an echo when it has been quiet this long
+#define E_ECHO_TMO_MS      5000	// and give up on it when the echo goes unanswered this long
+#define E_PUT_TMO_S          60	// default seconds a queued write_notify waits for its kv to change (-w)
+#define E_PUT_POLL_MS       250	// how often we look for finished write_notify commands while some are waiting
+
+#define E_LISTEN_BACKLOG   1024	// default virtual circuit listen backlog (-b)
+#define E_ACCEPT_BURST      256	// most circuits accepted per listener wakeup
+#define E_PRIO_MAX           99	// highest circuit priority a client may ask for (CA_PROTO_VERSION)
+#define E_PRIO_CLASSES        4	// circuit priorities are scheduled in this many classes
+#define E_PRIO_TURNS          4	// run queue turns per pass for the lowest class: each class up gets twice as many
+#define E_MSG_BUDGET         16	// messages a circuit may process per turn before it yields to the other circuits
+#define E_MSG_MAX    (16 << 20)	// biggest message we accept (a 1M element double waveform and change)
+#define E_CREATE_BURST       64	// most channels created in one database call
+#define E_CMDS               28	// commands in cmds[] (CA_PROTO_VERSION through CA_PROTO_SERVER_DISCONN)
+
 // response packet
 //
 typedef struct e_response_struct {
   struct sockaddr_in peer;	// our peer
   int sock;			// our socket
   int bufsize;			// number of bytes used in buf
-  char *buf;			// our buffer, free when done
+  char *buf;			// our message, serialized in place in the output arena (do not free)
+  struct e_socks_buffer_struct *out;	// the circuit whose output arena receives our message
 } e_response_t;
 
 // reply queue
 //
+// Only datagram sockets queue replies: a stream socket just sends
+// whatever is in its output arena.
+//
 typedef struct e_reply_queue_struct {
   struct e_reply_queue_struct *next;
   struct sockaddr_in fromaddr;	// our from address to send reply to udp socket
   int fromlen;			// length of from address
   int reply_size;		// number of bytes in reply
-  char *reply_packet;		// calloc'ed reply packet
+  int reply_offset;		// where the reply starts in the output arena
 } e_reply_queue_t;
 
 //
@@ -71,19 +124,385 @@ typedef struct e_socks_buffer_struct {
   char *host_name;	// read from host name command
   char *user_name;	// read from user name command
   int sock;		// our socket
+  struct sockaddr_in peer;	// who is on the other end of a virtual circuit
   void *buf;		// input buffer
   int active;		// -1 when connection made; otherwise a count of active PV's served, 0 to close tcp connection
   int events_on;	// 1 means send subscription updates, 0 means drop them in the bit bucket
   int bufsize;		// size of the buffer
   char *rbp;		// pointer to the next position in the buffer to read from
   char *wbp;		// pointer to the next position in the buffer to write to
-  e_reply_queue_t *reply_q;	// packets ready to send
+  int udp;		// 1 for datagram sockets, 0 for virtual circuits
+  char *obuf;		// output arena: replies are serialized directly in here
+  int obufsize;		// size of the output arena
+  int ohead;		// offset of the next byte in the arena to send
+  int otail;		// offset of the next free byte in the arena
+  int ostart;		// where the reply being built starts (-1 when none): moves with the arena when e_out_reserve compacts it
+  e_reply_queue_t *reply_q;	// packets ready to send (datagram sockets only)
+  e_reply_queue_t *reply_qtail;	// last packet in reply_q
+  int reply_qlen;	// number of packets in reply_q
+  e_reply_queue_t *reply_free;	// recycled reply queue entries
+  uint32_t rx_drops;	// datagrams the kernel dropped for want of receive buffer space (SO_RXQ_OVFL)
+  int uring;		// 1 when our reads and writes go through the io_uring backend instead of poll
+  uint32_t ugen;	// generation tag so completions for a recycled fd are not mistaken for ours
+  int uops;		// io_uring operations we have in flight
+  int urecv;		// our multishot receive: E_URECV_OFF, E_URECV_ARMED or E_URECV_CANCELING
+  int oinflight;	// 1 while the kernel may be reading from our output arena
+  char *ostale;		// old arena kept alive for an in flight send after the arena had to grow
+  uint64_t last_rx;	// wheel tick when we last heard from our peer
+  int echo_pending;	// 1 when we have sent an echo to see if our peer is still there
+  e_timer_t *idle_timer;	// idle and echo timeout for virtual circuits
+  int msgs;			// messages processed in this turn through ca_process
+  int run_wait;			// 1 while we wait our turn in the run queue (input is not read)
+  unsigned long turns;		// turns we have had in ca_process
+  unsigned long turns_deferred;	// turns that ended with our budget used up
+  int inq_max;			// most input bytes we have had waiting to be processed
+  int outq_max;			// most output bytes we have had waiting to be sent
+  int priority;			// circuit priority from CA_PROTO_VERSION (0 through E_PRIO_MAX)
+  int prio_class;		// which scheduling class that puts us in (higher goes first)
+  struct e_sub_struct **subs;	// our subscriptions hashed by subscription id (E_SUB_BUCKETS, allocated with the first one)
+  struct e_chan_struct **chans;	// metadata of the channels we created hashed by sid (E_CHAN_BUCKETS, allocated with the first one)
+  uint32_t cap_id;		// our circuit number in the traffic capture (0 when not capturing)
 } e_socks_buffer_t;
 
-typedef struct e_dbr_size_struct {
+#define E_SUB_BUCKETS 64	// subscription hash buckets per circuit (power of 2)
+#define E_CHAN_BUCKETS 64	// channel metadata hash buckets per circuit (power of 2)
+
+// encoded monitor update
+//
+// Built once for everyone monitoring the same kv with the same dbr type
+// and count, then copied to each subscriber with their subscription id
+// patched in.  Immutable once built; the last user frees it.
+//
+typedef struct e_enc_struct {
+  int refs;			// users (atomic: shards share encodings with the main loop)
+  int size;			// bytes in msg
+  struct e_chan_struct *meta;	// the channel metadata it goes with (ours, NULL for none: subscriptions are left alone)
+  char msg[];			// the whole message with a subscription id of 0
+} e_enc_t;
+
+// subscription
+//
+// What the circuit's own thread knows about a monitor it serves.  While
+// updates are being held back (maximum update rate) only the latest one
+// is kept, with its original time stamp.
+//
+typedef struct e_sub_struct {
+  e_timer_t timer;		// fires when we may send again (first, so the timer callback can find us)
+  struct e_sub_struct *next;	// next subscription in our bucket
+  e_socks_buffer_t *b;		// our circuit
+  uint32_t subid;		// the client's subscription id
+  uint32_t sid;			// the channel
+  uint64_t min_ticks;		// wheel ticks between updates (0 for no limit)
+  uint64_t last_sent;		// wheel tick we last sent an update at
+  e_enc_t *held;		// the update waiting to be sent (we hold a reference) or NULL
+  char *tmpl;			// graphic and control types: the dbr structure after status and severity, or NULL
+  int tmpl_size;		// bytes in tmpl
+  uint32_t tmpl_dtype;		// the dbr type tmpl was built for
+  int metaseq;			// the channel metadata tmpl and min_ticks go with (-1 for unknown)
+  uint32_t metric_sid;		// one of our own metric channels (E_METRIC_SID and up) or 0 for the database's
+  uint16_t metric_dtype;	// the dbr type they asked for (metric channels only)
+  uint32_t metric_count;	// and the element count
+} e_sub_t;
+
+// dbr value kinds (dtype % 7)
+//
+enum {
+  E_DBR_KIND_string = 0,
+  E_DBR_KIND_short,
+  E_DBR_KIND_float,
+  E_DBR_KIND_enum,
+  E_DBR_KIND_char,
+  E_DBR_KIND_long,
+  E_DBR_KIND_double
+};
+
+// The dbr types
+//
+// Keep in order and in step with e.dbrs in e.sql (dtype, dname, dplsize,
+// ddsize): e_dbr_check compares the two at start up.  The encoders and
+// decoders for each type are generated from this table.
+//
+//   X( dtype, name, structure size, value size, value kind, structure kind)
+//
+#define E_DBR_TABLE(X) \
+  X(  0, string,        0, 0, string, plain) \
+  X(  1, short,         0, 2, short,  plain) \
+  X(  2, float,         0, 4, float,  plain) \
+  X(  3, enum,          0, 2, enum,   plain) \
+  X(  4, char,          0, 1, char,   plain) \
+  X(  5, long,          0, 4, long,   plain) \
+  X(  6, double,        0, 8, double, plain) \
+  X(  7, sts_string,    4, 0, string, sts) \
+  X(  8, sts_short,     4, 2, short,  sts) \
+  X(  9, sts_float,     4, 4, float,  sts) \
+  X( 10, sts_enum,      4, 2, enum,   sts) \
+  X( 11, sts_char,      5, 1, char,   sts) \
+  X( 12, sts_long,      4, 4, long,   sts) \
+  X( 13, sts_double,    8, 8, double, sts) \
+  X( 14, time_string,  12, 0, string, time) \
+  X( 15, time_short,   14, 2, short,  time) \
+  X( 16, time_float,   12, 4, float,  time) \
+  X( 17, time_enum,    14, 2, enum,   time) \
+  X( 18, time_char,    15, 1, char,   time) \
+  X( 19, time_long,    12, 4, long,   time) \
+  X( 20, time_double,  16, 8, double, time) \
+  X( 21, gr_string,     0, 0, string, gr) \
+  X( 22, gr_short,     24, 2, short,  gr) \
+  X( 23, gr_float,     40, 4, float,  gr) \
+  X( 24, gr_enum,     422, 2, enum,   gr) \
+  X( 25, gr_char,      19, 1, char,   gr) \
+  X( 26, gr_long,      36, 4, long,   gr) \
+  X( 27, gr_double,    64, 8, double, gr) \
+  X( 28, crtl_string,   0, 0, string, ctrl) \
+  X( 29, crtl_short,   28, 2, short,  ctrl) \
+  X( 30, crtl_float,   48, 4, float,  ctrl) \
+  X( 31, crtl_enum,   422, 2, enum,   ctrl) \
+  X( 32, crtl_char,    21, 1, char,   ctrl) \
+  X( 33, crtl_long,    44, 4, long,   ctrl) \
+  X( 34, crtl_double,  80, 8, double, ctrl)
+
+#define E_DBR_N 35	// dbr types we serve (e.dbrs also lists 35 through 38, which we do not)
+
+// What goes in a dbr structure, parsed once per message rather than once per field
+//
+typedef struct e_dbr_meta_struct {
+  uint32_t eepoch;		// time stamp seconds (0 for now)
+  uint32_t ensec;		// and nanoseconds
+  int highlimithit;		// high limit has been reached
+  int lowlimithit;		// low limit has been reached
+  int prec;			// display precision
+  double highlimit;		// stands in for every upper limit
+  double lowlimit;		// and every lower one
+} e_dbr_meta_t;
+
+// channel metadata cache
+//
+// Limits, limit hits, precision and maximum update rate come from a
+// channel's companion kvs and rarely change.  Each circuit keeps them for
+// the channels it created: e.create_channels sends them and get_values
+// only sends them again when metaseq, the newest kvseq among the
+// companions, has moved on.
+//
+typedef struct e_chan_struct {
+  struct e_chan_struct *next;	// next channel in our bucket
+  uint32_t sid;			// our channel identifier
+  int metaseq;			// companion kvseq the metadata goes with (-1 for none yet)
+  e_dbr_meta_t m;		// limits, limit hits and precision (no time stamp)
+  int has_max_rate;		// 1 when the channel has its own .MAXRATE
+  double max_rate;		// and what it is
+} e_chan_t;
+
+typedef struct e_dbr_struct {
   char *dbr_name;
   int  dbr_struct_size;
   int  dbr_type_size;
-} e_dbr_size_t;
+  void (*mk_struct)( void *pp, e_dbr_meta_t *m);	// fill in the structure before the value
+  void (*pack)( void *pp, char *svalue);		// put a value we have as text in the packet
+  void (*packd)( void *pp, double d);			// put an array element in the packet
+  int (*unpack)( void *pp, int avail, char *s, int ssize);	// turn a value from a client into text
+} e_dbr_t;
+
+
+
+//
+// io_uring backend (selected with -u)
+// We talk to the kernel directly: no liburing needed.
+//
+#define E_URING_ENTRIES  256		// submission queue size
+#define E_URING_NBUFS    256		// number of provided receive buffers (power of 2)
+#define E_URING_BUFSIZE  4096		// size of each provided receive buffer
+
+#define E_URING_OP_RECV   1
+#define E_URING_OP_SEND   2
+#define E_URING_OP_CANCEL 3
 
+#define E_URECV_OFF       0	// no receive: a circuit waiting for its turn is not read from
+#define E_URECV_ARMED     1
+#define E_URECV_CANCELING 2	// asked the kernel to stop it: data may still arrive until it says it has
+
+typedef struct e_uring_struct {
+  int fd;				// the ring, polled along with everyone else
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned to_submit;			// sqes queued since the last io_uring_enter
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *br;		// provided buffer ring for multishot receives
+  char *bufs;				// the provided buffers themselves
+  uint16_t br_tail;			// our copy of the buffer ring tail
+} e_uring_t;
+
+//
+// Client filter
+// Searches and create_chan requests from clients it turns away never reach
+// the database.  Rules are tried in the order given and the first match
+// wins.  A client no rule matches is turned away when there are any allow
+// rules and let in otherwise.  Set up at start up, read only after that.
+//
+#define E_CIDR_MAX 64			// most allow and deny rules (-a and -d)
+
+typedef struct e_cidr_struct {
+  uint32_t addr;			// network, host byte order
+  uint32_t mask;			// netmask, host byte order
+  int allow;				// 1 to let matching clients in, 0 to turn them away
+} e_cidr_t;
+
+//
+// Metrics
+// Each thread counts into its own e_stats_t with plain adds (a time stamp
+// counter read and two adds per event) and whoever asks sums them up: our
+// own read only channels under a prefix (-p) and a text dump on a unix
+// socket (-x).  Bucket k of a histogram counts events of 2^k up to
+// 2^(k+1) nanoseconds (or bytes, rows, copies); bucket 0 also takes the
+// zeros.
+//
+#define E_HIST_BUCKETS      32		// log2 buckets: the last takes everything over 2^31
+#define E_PS_MAX            32		// most prepared statements we keep statistics for
+#define E_STATS_THREADS    256		// most threads that keep statistics
+#define E_METRIC_MAX       256		// most metrics we publish
+#define E_METRIC_NAME       64		// longest metric name (less the prefix)
+#define E_METRIC_SID 0x7fff0000		// our metric channels have sids from here up (the database's are far below)
+#define E_METRIC_MS       1000		// how often subscribers to a metric channel get an update
+#define E_METRIC_ARRAY (20 + 12*E_HIST_BUCKETS)	// room for a metric as a binary float8[]
+
+typedef struct e_hist_struct {
+  unsigned long sum;			// total of everything counted
+  unsigned long n[E_HIST_BUCKETS];	// events by log2 of their size (the count is the sum of these)
+} e_hist_t;
+
+// One thread's statistics: only that thread writes them
+//
+typedef struct e_stats_struct {
+  e_hist_t cmd[E_CMDS];		// nanoseconds spent in each command in cmds[]
+  e_hist_t ps[E_PS_MAX];	// nanoseconds spent in each prepared statement
+  e_hist_t loop;		// busy nanoseconds per poll loop iteration
+  e_hist_t replyq;		// output bytes a circuit has waiting at the end of its turn
+  e_hist_t batch;		// rows in each check_monitors
+  e_hist_t fanout;		// subscribers sent a copy of each monitor encoding
+} e_stats_t;
+
+#define E_METRIC_ULONG 0	// an unsigned long counter
+#define E_METRIC_INT   1	// an int
+#define E_METRIC_COUNT 2	// events in a histogram
+#define E_METRIC_SUM   3	// their total
+#define E_METRIC_HIST  4	// the buckets (an array channel)
+
+typedef struct e_metric_struct {
+  char name[E_METRIC_NAME];	// channel name after the prefix, also the name in the text dump
+  int kind;			// E_METRIC_ULONG ...
+  void *p;			// the counter (E_METRIC_ULONG and E_METRIC_INT)
+  size_t off;			// the histogram: where it is in each thread's e_stats_t
+} e_metric_t;
+
+//
+// Traffic capture (-C file)
+// Everything our clients send us, as it arrives, and the NOTIFYs from
+// the database, so ca-replay can play a real workload back against
+// another build.  The file is an e_cap_file_t and then records, each an
+// e_cap_rec_t followed by len bytes: stream bytes as read from a circuit
+// (not whole messages), whole datagrams, a NOTIFY's channel name and
+// payload each with its terminating 0, or the cid and sid of a channel
+// we created (sids are ours to pick: replay maps them to the new ones).
+// Host byte order: replay on the same kind of machine.
+//
+#define E_CAP_MAGIC   0x50414345	// "ECAP" in the first four bytes on a little endian machine
+#define E_CAP_VERSION 2
+#define E_CAP_FLUSH_MS 1000		// how often the capture goes out to the file
+#define E_CAP_BUFSIZE (1 << 20)		// stdio buffer for the capture
+
+#define E_CAP_OPEN   1		// circuit accepted (no data)
+#define E_CAP_TCP    2		// bytes read from a circuit
+#define E_CAP_CLOSE  3		// circuit gone (no data)
+#define E_CAP_UDP    4		// a datagram
+#define E_CAP_NOTIFY 5		// a NOTIFY from the database
+#define E_CAP_SID    6		// we created a channel: the client's cid then our sid (two uint32_t)
+
+typedef struct e_cap_file_struct {
+  uint32_t magic;		// E_CAP_MAGIC
+  uint32_t version;		// E_CAP_VERSION
+  uint64_t epoch_ns;		// wall clock when the capture started
+} e_cap_file_t;
+
+typedef struct e_cap_rec_struct {
+  uint64_t t;			// nanoseconds since the capture started
+  uint32_t conn;		// circuit number (0 for datagrams and NOTIFYs)
+  uint32_t addr;		// peer address (network byte order)
+  uint16_t port;		// peer port (network byte order)
+  uint16_t kind;		// E_CAP_OPEN ...
+  uint32_t len;			// bytes that follow
+} e_cap_rec_t;
+
+//
+// Channel name index
+// Shared by the search workers (readers) and the main loop (writer)
+//
+#define E_NAME_BUCKETS     4096		// hash buckets in the name index (power of 2)
+#define E_NAME_MAX          256		// longest channel name we bother with
+#define E_NAME_POS_TTL      600		// seconds before we recheck a name we found
+#define E_NAME_NEG_TTL       30		// seconds before we recheck a name we did not find
+#define E_SEARCH_QUEUE_MAX 4096		// most searches waiting for the database
+#define E_SEARCH_WORKERS_MAX 64		// most search worker threads (-s)
+
+typedef struct e_name_struct {
+  struct e_name_struct *next;	// next name in our bucket
+  char *name;			// the channel name
+  int found;			// 1 when the name resolves to a kv
+  time_t expires;		// when we have to ask the database again
+} e_name_t;
+
+// A search the index could not answer, waiting for the main loop to ask the database
+//
+typedef struct e_search_req_struct {
+  struct e_search_req_struct *next;
+  struct sockaddr_in peer;	// who asked
+  uint32_t cid;			// their channel id
+  uint16_t version;		// their minor protocol version
+  uint16_t reply;		// 10 means they want to hear about failures
+  char name[E_NAME_MAX];	// what they asked for
+} e_search_req_t;
+
+//
+// Circuit shards
+// Each shard thread runs its own poll loop, database connection and timer
+// wheel for the virtual circuits the main loop hands it at accept.
+//
+#define E_SHARDS_MAX 64		// most circuit shard threads (-c)
+#define E_FD_MAX  65536		// sockets numbered this high or higher are not handed to shards
+
+// A monitor update routed from the main loop to the shard that owns the subscriber
+//
+typedef struct e_update_struct {
+  struct e_update_struct *next;
+  int sock;			// the subscriber
+  uint32_t subid;		// their subscription id (the ioid for a write_notify reply)
+  struct e_enc_struct *enc;	// the encoded update (we hold a reference)
+  int put;			// 1 for a write_notify reply: sent as is, no subscription to go through
+} e_update_t;
+
+// A newly accepted virtual circuit on its way to a shard
+//
+typedef struct e_handoff_struct {
+  struct e_handoff_struct *next;
+  int sock;			// the circuit
+  struct sockaddr_in peer;	// who is on the other end
+} e_handoff_t;
 
+typedef struct e_shard_struct {
+  int id;			// 1 through the number of shards
+  pthread_t tid;		// our thread
+  int efd;			// wakes the shard: new circuits or updates are waiting
+  int circuits;			// circuits we own (for least loaded assignment)
+  pthread_mutex_t lock;		// protects the lists below
+  e_handoff_t *handoffs;	// circuits to adopt
+  e_update_t *updates;		// monitor updates to send
+  e_update_t *updates_tail;	// last of them
+  e_update_t *done;		// updates sent, waiting for the main loop to reuse them
+  e_update_t *pending;		// main loop only: updates routed to us but not yet posted
+  e_update_t *pending_tail;	// last of them
+} e_shard_t;
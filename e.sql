@@ -8,6 +8,7 @@ CREATE OR REPLACE FUNCTION e.init() returns void as $$
   BEGIN
     DELETE FROM e.created_channels;
     DELETE FROM e.monitors;
+    DELETE FROM e.puts;
     LISTEN EPICS_MONITOR_UPDATE;
     LISTEN REDIS_KV_CONNECTOR;
   END;
@@ -64,10 +65,7 @@ CREATE OR REPLACE FUNCTION e.channel_search( theIp inet, thepversion int, theCha
       INSERT INTO e.channel_searches (csip, cspversion, cschanname) VALUES (theip, thepversion, thechan);
     END IF;
 
-    IF not (theip << '10.1.0.0/16'::inet) THEN
-      -- for now ignore requests from other than 10.1.0.0/16
-      return false;
-    END IF;
+    -- The server only asks for clients its filter lets in (10.1.0.0/16 unless told otherwise)
 
     SELECT INTO thekv e.channel_name_to_kv( theChan);
     IF FOUND and thekv is not null THEN
@@ -213,9 +211,39 @@ INSERT INTO e.dbrs (dtype, dname, dplsize, ddsize) VALUES ( 36, 'unknown_36',
 INSERT INTO e.dbrs (dtype, dname, dplsize, ddsize) VALUES ( 37, 'stack_string', 0, 0);
 INSERT INTO e.dbrs (dtype, dname, dplsize, ddsize) VALUES ( 38, 'class_name',   0, 0);
 
+CREATE OR REPLACE FUNCTION e.kv_number( thevalue text) returns float8 as $$
+  BEGIN
+    return thevalue::float8;
+  EXCEPTION WHEN others THEN
+    return NULL;
+  END;
+$$ LANGUAGE plpgsql IMMUTABLE;
+ALTER FUNCTION e.kv_number( text) OWNER TO lsadmin;
+
+--
+-- Array kvs (waveforms) are stored as postgres array literals, '{1,2,3}'.
+-- Returns the elements as doubles, or null when the value is not an array.
+--
+CREATE OR REPLACE FUNCTION e.kv_array( thevalue text) returns float8[] as $$
+  BEGIN
+    IF thevalue is null OR thevalue NOT LIKE '{%}' THEN
+      return NULL;
+    END IF;
+    return thevalue::float8[];
+  EXCEPTION WHEN others THEN
+    return NULL;
+  END;
+$$ LANGUAGE plpgsql IMMUTABLE;
+ALTER FUNCTION e.kv_array( text) OWNER TO lsadmin;
+
 drop type e.get_values_type cascade;
-CREATE TYPE e.get_values_type AS ( val text, eepoch int, ensec int, high_limit text, low_limit text, high_limit_hit int, low_limit_hit int, prec int);
-CREATE OR REPLACE FUNCTION e.get_values( sid int) returns setof e.get_values_type as $$
+CREATE TYPE e.get_values_type AS ( val text, eepoch int, ensec int, high_limit text, low_limit text, high_limit_hit int, low_limit_hit int, prec int, vals float8[], max_rate float8, metaseq int);
+CREATE OR REPLACE FUNCTION e.get_values( sid int, knownseq int default -1) returns setof e.get_values_type as $$
+  --
+  -- The limits, limit hits, precision and maximum rate (see e.get_meta) are
+  -- only filled in when metaseq differs from knownseq, the one the server
+  -- cached them with.  Otherwise they are null.
+  --
   DECLARE
     rtn e.get_values_type;
     theepoch numeric;
@@ -230,18 +258,19 @@ CREATE OR REPLACE FUNCTION e.get_values( sid int) returns setof e.get_values_typ
 
       rtn.eepoch := (floor(theepoch))::int;
       rtn.ensec  := (floor((theepoch - rtn.eepoch) * 1000000000))::int;
-      SELECT INTO rtn.high_limit     coalesce( kvvalue, '0') FROM e.created_channels LEFT JOIN px.kvs ON cchighlimitkv=kvkey WHERE ccsid=sid;
-      SELECT INTO rtn.low_limit      coalesce( kvvalue, '0') FROM e.created_channels LEFT JOIN px.kvs ON cclowlimitkv=kvkey  WHERE ccsid=sid;
-      SELECT INTO rtn.high_limit_hit (coalesce( kvvalue, '0'))::int FROM e.created_channels LEFT JOIN px.kvs ON cchighlimithitkv=kvkey WHERE ccsid=sid;
-      SELECT INTO rtn.low_limit_hit  (coalesce( kvvalue, '0'))::int FROM e.created_channels LEFT JOIN px.kvs ON cclowlimithitkv=kvkey  WHERE ccsid=sid;
-      SELECT INTO rtn.prec           (coalesce( kvvalue, '0'))::int FROM e.created_channels LEFT JOIN px.kvs ON ccpreckv=kvkey      WHERE ccsid=sid;
+      rtn.vals := e.kv_array( rtn.val);
+      rtn.metaseq := e.metaseq( sid);
+      IF rtn.metaseq != knownseq THEN
+        SELECT INTO rtn.high_limit, rtn.low_limit, rtn.high_limit_hit, rtn.low_limit_hit, rtn.prec, rtn.max_rate
+                    high_limit,     low_limit,     high_limit_hit,     low_limit_hit,     prec,     max_rate FROM e.get_meta( sid);
+      END IF;
 
       return next rtn;
     END LOOP;
     return;
   END;
 $$ LANGUAGE plpgsql SECURITY DEFINER;
-ALTER FUNCTION e.get_values( int) OWNER TO lsadmin;
+ALTER FUNCTION e.get_values( int, int) OWNER TO lsadmin;
 
 
 CREATE OR REPLACE FUNCTION e.set_str_value( sid int, thevalue text) returns int as $$
@@ -306,12 +335,41 @@ CREATE TABLE e.created_channels (
        cclowlimitkv int default null,
        cchighlimithitkv int default null,
        cclowlimithitkv int default null,
+       ccpreckv int default null,
+       ccmdelkv int default null,	-- monitor deadband (DBE_VALUE)
+       ccadelkv int default null,	-- archive deadband (DBE_LOG)
+       ccmaxratekv int default null,	-- most monitor updates per second
        ccsid int unique
 );
 ALTER TABLE e.created_channels OWNER TO lsadmin;
 CREATE INDEX cc_kv_index on e.created_channels (cckv);
 CREATE INDEX cc_sid_index on e.created_channels (ccsid);
 
+CREATE OR REPLACE FUNCTION e.metaseq( sid int) returns int as $$
+  --
+  -- The newest kvseq among a channel's companion kvs (limits, limit hits,
+  -- precision and maximum rate): when it moves the server refreshes its cache
+  --
+  SELECT (coalesce( max( kvseq), 0))::int FROM e.created_channels, px.kvs
+    WHERE ccsid=$1 AND kvkey IN ( cchighlimitkv, cclowlimitkv, cchighlimithitkv, cclowlimithitkv, ccpreckv, ccmaxratekv);
+$$ LANGUAGE SQL SECURITY DEFINER STABLE;
+ALTER FUNCTION e.metaseq( int) OWNER TO lsadmin;
+
+CREATE TYPE e.get_meta_type AS ( high_limit text, low_limit text, high_limit_hit int, low_limit_hit int, prec int, max_rate float8, metaseq int);
+CREATE OR REPLACE FUNCTION e.get_meta( sid int) returns e.get_meta_type as $$
+  SELECT coalesce( hl.kvvalue, '0'), coalesce( ll.kvvalue, '0'), (coalesce( hh.kvvalue, '0'))::int, (coalesce( lh.kvvalue, '0'))::int,
+         (coalesce( pr.kvvalue, '0'))::int, e.kv_number( mr.kvvalue), e.metaseq( $1)
+    FROM e.created_channels
+    LEFT JOIN px.kvs hl ON cchighlimitkv=hl.kvkey
+    LEFT JOIN px.kvs ll ON cclowlimitkv=ll.kvkey
+    LEFT JOIN px.kvs hh ON cchighlimithitkv=hh.kvkey
+    LEFT JOIN px.kvs lh ON cclowlimithitkv=lh.kvkey
+    LEFT JOIN px.kvs pr ON ccpreckv=pr.kvkey
+    LEFT JOIN px.kvs mr ON ccmaxratekv=mr.kvkey
+    WHERE ccsid=$1;
+$$ LANGUAGE SQL SECURITY DEFINER STABLE;
+ALTER FUNCTION e.get_meta( int) OWNER TO lsadmin;
+
 CREATE TYPE e.create_channel_type as ( sid int, dbr_type int, dcount int);
 CREATE OR REPLACE FUNCTION e.create_channel(theip inet, thehost text, theuser text, thecid int, thepversion int, thechan text) returns e.create_channel_type as $$
   DECLARE
@@ -322,6 +380,9 @@ CREATE OR REPLACE FUNCTION e.create_channel(theip inet, thehost text, theuser te
     thehighlimithitkv  int;
     thelowlimithitkv  int;
     thepreckv int;
+    themdelkv int;
+    theadelkv int;
+    themaxratekv int;
     forcechara boolean;
     channame text;
     rtn    e.create_channel_type;
@@ -365,16 +426,18 @@ CREATE OR REPLACE FUNCTION e.create_channel(theip inet, thehost text, theuser te
     SELECT INTO thehighlimithitkv e.channel_name_to_kv( channame || '.posLimitSet');
     SELECT INTO thelowlimithitkv  e.channel_name_to_kv( channame || '.negLimitSet');
     SELECT INTO thepreckv         e.channel_name_to_kv( channame || '.printPrecision');
+    SELECT INTO themdelkv         e.channel_name_to_kv( channame || '.MDEL');
+    SELECT INTO theadelkv         e.channel_name_to_kv( channame || '.ADEL');
+    SELECT INTO themaxratekv      e.channel_name_to_kv( channame || '.MAXRATE');
 
-    INSERT INTO e.created_channels (ccip,  cchost,  ccuser,  cccid,  ccpversion,  cckv,  ccsid,  cchighlimitkv,  cclowlimitkv,  cchighlimithitkv,  cclowlimithitkv, ccpreckv) VALUES
-                                   (theip, thehost, theuser, thecid, thepversion, thekv, thesid,thehighlimitkv, thelowlimitkv, thehighlimithitkv, thelowlimithitkv, thepreckv);
+    INSERT INTO e.created_channels (ccip,  cchost,  ccuser,  cccid,  ccpversion,  cckv,  ccsid,  cchighlimitkv,  cclowlimitkv,  cchighlimithitkv,  cclowlimithitkv, ccpreckv,  ccmdelkv,  ccadelkv,  ccmaxratekv) VALUES
+                                   (theip, thehost, theuser, thecid, thepversion, thekv, thesid,thehighlimitkv, thelowlimitkv, thehighlimithitkv, thelowlimithitkv, thepreckv, themdelkv, theadelkv, themaxratekv);
 
     IF forcechara THEN
       rtn.dbr_type := 4;
       rtn.dcount   := 256;
     ELSE
-      SELECT INTO rtn.dbr_type kvdbrtype FROM px.kvs WHERE kvkey=thekv;
-      rtn.dcount   = 1;   -- only support scalars for now
+      SELECT INTO rtn.dbr_type, rtn.dcount kvdbrtype, coalesce( array_length( e.kv_array( kvvalue), 1), 1) FROM px.kvs WHERE kvkey=thekv;
     END IF;
     rtn.sid      = thesid;
     return rtn;
@@ -382,6 +445,32 @@ CREATE OR REPLACE FUNCTION e.create_channel(theip inet, thehost text, theuser te
 $$ LANGUAGE plpgsql SECURITY DEFINER;
 ALTER FUNCTION e.create_channel( inet, text, text, int, int, text) OWNER TO lsadmin;
 
+CREATE TYPE e.create_channels_type as ( cid int, sid int, dbr_type int, dcount int, high_limit text, low_limit text, high_limit_hit int, low_limit_hit int, prec int, max_rate float8, metaseq int);
+CREATE OR REPLACE FUNCTION e.create_channels(theip inet, thehost text, theuser text, thecids int[], thepversions int[], thechans text[]) returns setof e.create_channels_type as $$
+  --
+  -- All the create_chan requests a client sent us in one go: one row per request in the
+  -- order given, sid is null for channels we could not create.  Each row also carries
+  -- the channel's metadata (e.get_meta) so the server can cache it from the start.
+  --
+  DECLARE
+    cc     e.create_channel_type;
+    rtn    e.create_channels_type;
+  BEGIN
+    FOR i IN 1 .. coalesce( array_upper( thechans, 1), 0) LOOP
+      SELECT INTO cc * FROM e.create_channel( theip, thehost, theuser, thecids[i], thepversions[i], thechans[i]);
+      rtn.cid      := thecids[i];
+      rtn.sid      := cc.sid;
+      rtn.dbr_type := cc.dbr_type;
+      rtn.dcount   := cc.dcount;
+      SELECT INTO rtn.high_limit, rtn.low_limit, rtn.high_limit_hit, rtn.low_limit_hit, rtn.prec, rtn.max_rate, rtn.metaseq
+                  high_limit,     low_limit,     high_limit_hit,     low_limit_hit,     prec,     max_rate,     metaseq FROM e.get_meta( cc.sid);
+      return next rtn;
+    END LOOP;
+    return;
+  END;
+$$ LANGUAGE plpgsql SECURITY DEFINER;
+ALTER FUNCTION e.create_channels( inet, text, text, int[], int[], text[]) OWNER TO lsadmin;
+
 CREATE OR REPLACE FUNCTION e.clear_channel( theip inet, thesid int, thecid int) returns void as $$
   DECLARE
   BEGIN
@@ -402,17 +491,65 @@ CREATE TABLE e.monitors (
        mmask int,			-- monitor mask received
        mdtype int,			-- the epics dbr type
        mcount int,			-- count of objects requested
-       mkvseq int not null default 0	-- last sent value of kvseq for this channel
+       mkvseq int not null default 0,	-- last sent value of kvseq for this channel
+       mlastval text,			-- value last past the monitor deadband (DBE_VALUE)
+       mlastlog text,			-- value last past the archive deadband (DBE_LOG)
+       mlastalarm int			-- alarm state last sent (DBE_ALARM)
 );
 ALTER TABLE e.monitors OWNER TO lsadmin;
 
+--
+-- Alarm state from the limit hit kvs: 1 for high, 2 for low
+--
+CREATE OR REPLACE FUNCTION e.alarm_state( thehighhit text, thelowhit text) returns int as $$
+  SELECT (coalesce( $1, '0') <> '0')::int + 2 * (coalesce( $2, '0') <> '0')::int;
+$$ LANGUAGE sql IMMUTABLE;
+ALTER FUNCTION e.alarm_state( text, text) OWNER TO lsadmin;
+
+--
+-- MDEL/ADEL style deadbands: true when the new value moved more than the
+-- deadband from the last one sent.  A deadband ending in % is relative to
+-- the last value, a negative one passes everything and no deadband means
+-- any change at all.  Values that are not numbers pass whenever they change.
+--
+CREATE OR REPLACE FUNCTION e.deadband_exceeded( newval text, lastval text, deadband text) returns boolean as $$
+  DECLARE
+    newv  float8;
+    lastv float8;
+    db    float8;
+  BEGIN
+    IF lastval is null THEN
+      return newval is not null;
+    END IF;
+    newv  := e.kv_number( newval);
+    lastv := e.kv_number( lastval);
+    IF newv is null or lastv is null THEN
+      return newval is distinct from lastval;
+    END IF;
+    IF right( deadband, 1) = '%' THEN
+      db := abs( lastv) * coalesce( e.kv_number( rtrim( deadband, '%')), 0) / 100.0;
+    ELSE
+      db := coalesce( e.kv_number( deadband), 0);
+    END IF;
+    IF db < 0 THEN
+      return True;
+    END IF;
+    return abs( newv - lastv) > db;
+  END;
+$$ LANGUAGE plpgsql IMMUTABLE;
+ALTER FUNCTION e.deadband_exceeded( text, text, text) OWNER TO lsadmin;
+
 CREATE OR REPLACE FUNCTION e.create_monitor( sid int, subid int, mask int, cnt int, sock int, dtype int) RETURNS setof e.get_values_type AS $$
   DECLARE
   BEGIN
-    INSERT INTO e.monitors (mcc,   msock, msubid, mmask, mcount, mdtype, mkvseq)
-                     SELECT cckey, sock,  subid,  mask,  cnt,    dtype,  kvseq
+    INSERT INTO e.monitors (mcc,   msock, msubid, mmask, mcount, mdtype, mkvseq,
+                            mlastval,  mlastlog,  mlastalarm)
+                     SELECT cckey, sock,  subid,  mask,  cnt,    dtype,  greatest( v.kvseq, coalesce( hh.kvseq, 0), coalesce( ll.kvseq, 0)),
+                            v.kvvalue, v.kvvalue, e.alarm_state( hh.kvvalue, ll.kvvalue)
                        FROM e.created_channels
-                       LEFT JOIN px.kvs on cckv=kvkey
+                       LEFT JOIN px.kvs v  on cckv=v.kvkey
+                       LEFT JOIN px.kvs hh on cchighlimithitkv=hh.kvkey
+                       LEFT JOIN px.kvs ll on cclowlimithitkv=ll.kvkey
                        WHERE ccsid=sid;
     RETURN QUERY SELECT * FROM  e.get_values( sid);
   END;
@@ -442,30 +579,135 @@ CREATE OR REPLACE FUNCTION e.remove_monitor( sock int) returns void as $$
 $$ LANGUAGE plpgsql SECURITY DEFINER;
 ALTER FUNCTION e.remove_monitor( int) OWNER TO lsadmin;
 
-CREATE TYPE e.check_monitor_type AS ( sid int, subid int, val text, sock int, dtype int, cnt int, eepoch int, ensec int);
+CREATE TYPE e.check_monitor_type AS ( sid int, subid int, val text, sock int, dtype int, cnt int, eepoch int, ensec int, vals float8[], kv int, kvseq int, alarm int,
+                                      high_limit text, low_limit text, high_limit_hit int, low_limit_hit int, prec int, max_rate float8, metaseq int);
 CREATE OR REPLACE FUNCTION e.check_monitors() returns setof e.check_monitor_type AS $$
+  --
+  -- Only changes the subscriber's mask asks for are returned:
+  --   1 (DBE_VALUE) the value moved past the channel's MDEL
+  --   2 (DBE_LOG)   the value moved past the channel's ADEL
+  --   4 (DBE_ALARM) a limit hit kv changed
+  -- A mask of 0 gets the CA default, DBE_VALUE | DBE_ALARM.
+  --
   DECLARE
     rtn e.check_monitor_type;
     newseq int;
     themkey int;
     theepoch numeric;
+    themask int;
+    thelastval text;
+    thelastlog text;
+    thelastalarm int;
+    thealarm int;
+    themdel text;
+    theadel text;
+    valuepast boolean;
+    logpast boolean;
+    sendit boolean;
   BEGIN
-    FOR           rtn.sid, rtn.subid, rtn.val, rtn.sock, rtn.dtype, rtn.cnt, theepoch,                               newseq, themkey
-        IN SELECT ccsid,   msubid,    kvvalue, msock,    mdtype,    mcount,  extract( epoch from (kvts-'1990-1-1 00:00:00-00'::timestamptz)),  kvseq,   mkey
+    FOR           rtn.sid, rtn.subid, rtn.val,   rtn.sock, rtn.dtype, rtn.cnt, theepoch, rtn.kv, rtn.kvseq,
+                  newseq,
+                  themkey, themask, thelastval, thelastlog, thelastalarm, thealarm, themdel, theadel
+        IN SELECT ccsid,   msubid,    v.kvvalue, msock,    mdtype,    mcount,  extract( epoch from (v.kvts-'1990-1-1 00:00:00-00'::timestamptz)), v.kvkey, v.kvseq,
+                  greatest( v.kvseq, coalesce( hh.kvseq, 0), coalesce( ll.kvseq, 0)),
+                  mkey,    mmask,   mlastval,   mlastlog,   mlastalarm,   e.alarm_state( hh.kvvalue, ll.kvvalue), md.kvvalue, ad.kvvalue
            FROM e.monitors
            LEFT JOIN e.created_channels ON mcc=cckey
-           LEFT JOIN px.kvs ON cckv=kvkey
-           WHERE kvseq > mkvseq LOOP
-      UPDATE e.monitors set mlastts=now(), mkvseq=newseq WHERE mkey=themkey;
-      rtn.eepoch := (floor(theepoch))::int;
-      rtn.ensec  := (floor((theepoch - rtn.eepoch) * 1000000000))::int;
-      return next rtn;
+           LEFT JOIN px.kvs v  ON cckv=v.kvkey
+           LEFT JOIN px.kvs hh ON cchighlimithitkv=hh.kvkey
+           LEFT JOIN px.kvs ll ON cclowlimithitkv=ll.kvkey
+           LEFT JOIN px.kvs md ON ccmdelkv=md.kvkey
+           LEFT JOIN px.kvs ad ON ccadelkv=ad.kvkey
+           WHERE greatest( v.kvseq, coalesce( hh.kvseq, 0), coalesce( ll.kvseq, 0)) > mkvseq
+           ORDER BY v.kvkey, mdtype, mcount LOOP
+
+      themask   := coalesce( nullif( themask, 0), 5);
+      valuepast := e.deadband_exceeded( rtn.val, thelastval, themdel);
+      logpast   := e.deadband_exceeded( rtn.val, thelastlog, theadel);
+      sendit    := (themask & 1 <> 0 and valuepast) or (themask & 2 <> 0 and logpast) or (themask & 4 <> 0 and thealarm is distinct from thelastalarm);
+
+      UPDATE e.monitors set mkvseq=newseq,
+                            mlastts    = CASE WHEN sendit    THEN now()   ELSE mlastts  END,
+                            mlastval   = CASE WHEN valuepast THEN rtn.val ELSE mlastval END,
+                            mlastlog   = CASE WHEN logpast   THEN rtn.val ELSE mlastlog END,
+                            mlastalarm = thealarm
+                        WHERE mkey=themkey;
+      IF sendit THEN
+        rtn.eepoch := (floor(theepoch))::int;
+        rtn.ensec  := (floor((theepoch - rtn.eepoch) * 1000000000))::int;
+        rtn.vals   := e.kv_array( rtn.val);
+        rtn.alarm  := thealarm;
+        --
+        -- The channel's metadata: the server refreshes its subscriptions when metaseq moves
+        --
+        SELECT INTO rtn.high_limit, rtn.low_limit, rtn.high_limit_hit, rtn.low_limit_hit, rtn.prec, rtn.max_rate, rtn.metaseq
+                    high_limit,     low_limit,     high_limit_hit,     low_limit_hit,     prec,     max_rate,     metaseq FROM e.get_meta( rtn.sid);
+        return next rtn;
+      END IF;
     END LOOP;
     return;
   END;
 $$ LANGUAGE plpgsql SECURITY DEFINER;
 ALTER FUNCTION e.check_monitors() OWNER TO lsadmin;
 
+CREATE TABLE e.puts (
+       pkey serial primary key,
+       pts timestamp with time zone not null default now(),	-- when the command was queued
+       pexpires timestamp with time zone not null,		-- when we give up on it
+       psock int not null,		-- the socket: means something only to the server
+       pioid int not null,		-- client's id for this write_notify
+       pdtype int not null,		-- the dbr type they wrote
+       pcount int not null,		-- and how many
+       pkv int not null,		-- the kv the command should change
+       pkvseq int not null		-- its kvseq when the command was queued
+);
+ALTER TABLE e.puts OWNER TO lsadmin;
+
+CREATE OR REPLACE FUNCTION e.put_notify( sid int, thevalue text, thesock int, theioid int, thedtype int, thecount int, thetimeout int) returns int as $$
+  --
+  -- write_notify: e.set_str_value, except that a command queued for the MD2
+  -- is only done when its kv changes.  Returns 0 when the reply has to wait
+  -- for e.check_puts, otherwise the status to reply with now.
+  --
+  DECLARE
+    thekvkey int;
+    thekvseq int;
+    theCmd text;
+    theStn int;
+  BEGIN
+    SELECT INTO thekvkey, thekvseq, theCmd, thestn  cckv, kvseq, kvmd2cmd, kvstn FROM e.created_channels left join px.kvs on cckv=kvkey WHERE ccsid=sid;
+    IF FOUND and theCmd is not NULL and thestn is not null THEN
+      PERFORM px.md2pushqueue( theStn, theCmd || ' ' || thevalue);
+      INSERT INTO e.puts (pexpires, psock, pioid, pdtype, pcount, pkv, pkvseq) VALUES
+                         (now() + thetimeout * interval '1 second', thesock, theioid, thedtype, thecount, thekvkey, thekvseq);
+      RETURN 0;
+    END IF;
+    RETURN e.set_str_value( sid, thevalue);
+  END;
+$$ LANGUAGE plpgsql SECURITY DEFINER;
+ALTER FUNCTION e.put_notify( int, text, int, int, int, int, int) OWNER TO lsadmin;
+
+CREATE TYPE e.check_puts_type AS ( sock int, ioid int, dtype int, cnt int, status int);
+CREATE OR REPLACE FUNCTION e.check_puts() returns setof e.check_puts_type AS $$
+  --
+  -- Queued write_notify commands that are finished, each returned once:
+  --    1 (ECA_NORMAL)  the kv has changed
+  --   80 (ECA_TIMEOUT) we waited too long (or the kv is gone)
+  --
+  DELETE FROM e.puts
+    WHERE pexpires < now() OR pkvseq != (SELECT kvseq FROM px.kvs WHERE kvkey=pkv)
+    RETURNING psock, pioid, pdtype, pcount, CASE WHEN pkvseq != (SELECT kvseq FROM px.kvs WHERE kvkey=pkv) THEN 1 ELSE 80 END;
+$$ LANGUAGE SQL SECURITY DEFINER;
+ALTER FUNCTION e.check_puts() OWNER TO lsadmin;
+
+CREATE OR REPLACE FUNCTION e.remove_puts( sock int) returns int as $$
+  --
+  -- Forget a closed socket's queued write_notify commands.  Returns how many there were.
+  --
+  WITH gone AS (DELETE FROM e.puts WHERE psock=$1 RETURNING 1) SELECT count(*)::int FROM gone;
+$$ LANGUAGE SQL SECURITY DEFINER;
+ALTER FUNCTION e.remove_puts( int) OWNER TO lsadmin;
+
 
 
 drop type e.getkvs_type cascade;